@@ -0,0 +1,188 @@
+#include "client.h"
+
+static PendingCommand *pending;
+static int pending_capacity;
+static int pending_head = 0;
+static int pending_count = 0;
+static bool input_done = false;
+static bool connection_broken = false;
+static int failures = 0;
+static pthread_mutex_t pending_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pending_not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pending_not_full = PTHREAD_COND_INITIALIZER;
+
+/**
+ * @brief Reply reader thread, matches replies to commands in the order they were sent.
+ *
+ * @param arg
+ * @return void*
+ */
+static void *reply_thread(void *arg) {
+    ReplyReader reader = { .sock = *(int *)arg, .start = 0, .end = 0 };
+
+    while (1) {
+        pthread_mutex_lock(&pending_mutex);
+        while (pending_count == 0 && !input_done) {
+            pthread_cond_wait(&pending_not_empty, &pending_mutex);
+        }
+        if (pending_count == 0) {
+            pthread_mutex_unlock(&pending_mutex);
+            break;
+        }
+        PendingCommand *cmd = &pending[pending_head];
+        pthread_mutex_unlock(&pending_mutex);
+
+        int result = read_reply(&reader, cmd);
+
+        pthread_mutex_lock(&pending_mutex);
+        if (result < 0) {
+            printf("Error while receiving server's msg\n");
+            failures += pending_count;
+            pending_count = 0;
+            connection_broken = true;
+            pthread_cond_broadcast(&pending_not_full);
+            pthread_mutex_unlock(&pending_mutex);
+            break;
+        }
+        if (result == 0) {
+            failures++;
+        }
+        pending_head = (pending_head + 1) % pending_capacity;
+        pending_count--;
+        pthread_cond_signal(&pending_not_full);
+        pthread_mutex_unlock(&pending_mutex);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Parses one batch line into a command, using the same arguments as the command line.
+ *
+ * @param line
+ * @param cmd
+ * @return true if the line is a valid command.
+ */
+static bool parse_batch_line(const char *line, PendingCommand *cmd) {
+    char name[16], first[2048], second[2048];
+    int args = sscanf(line, "%15s %2047s %2047s", name, first, second);
+    if (args < 2) {
+        return false;
+    }
+
+    if (strcmp(name, "GET") == 0) {
+        cmd->type = GET;
+        strcpy(cmd->remote_path, first);
+        strcpy(cmd->local_path, args == 3 ? second : first);
+    } else if (strcmp(name, "PUT") == 0) {
+        cmd->type = PUT;
+        strcpy(cmd->local_path, first);
+        strcpy(cmd->remote_path, args == 3 ? second : first);
+    } else if (args == 2 && strcmp(name, "INFO") == 0) {
+        cmd->type = INFO;
+        strcpy(cmd->remote_path, first);
+    } else if (args == 2 && strcmp(name, "MD") == 0) {
+        cmd->type = MD;
+        strcpy(cmd->remote_path, first);
+    } else if (args == 2 && strcmp(name, "RM") == 0) {
+        cmd->type = RM;
+        strcpy(cmd->remote_path, first);
+    } else if (args == 3 && (strcmp(name, "CP") == 0 || strcmp(name, "MV") == 0)) {
+        cmd->type = name[0] == 'C' ? CP : MV;
+        strcpy(cmd->remote_path, first);
+        strcpy(cmd->target_path, second);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Runs every command read from input over one pipelined connection.
+ *
+ * Commands are sent without waiting for their replies, up to pipeline_depth
+ * ahead, while a reader thread reports the replies in order.
+ *
+ * @param socket_desc
+ * @param input
+ * @param pipeline_depth
+ * @return int 0 if every command succeeded, -1 otherwise.
+ */
+int run_batch(int socket_desc, FILE *input, int pipeline_depth) {
+    pending_capacity = pipeline_depth;
+    pending = calloc(pending_capacity, sizeof(PendingCommand));
+    if (pending == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, reply_thread, &socket_desc) != 0) {
+        perror("pthread_create");
+        free(pending);
+        return -1;
+    }
+
+    char line[BUFFER_SIZE];
+    uint32_t next_request_id = 1;
+    while (fgets(line, sizeof(line), input) != NULL) {
+        PendingCommand cmd;
+        if (line[strspn(line, " \t\r\n")] == '\0') {
+            continue;
+        }
+        if (!parse_batch_line(line, &cmd)) {
+            printf("Invalid batch command: %s", line);
+            pthread_mutex_lock(&pending_mutex);
+            failures++;
+            pthread_mutex_unlock(&pending_mutex);
+            continue;
+        }
+
+        cmd.request_id = next_request_id++;
+
+        FILE *file = NULL;
+        if (cmd.type == PUT && (file = fopen(cmd.local_path, "rb")) == NULL) {
+            printf("Error reading file %s\n", cmd.local_path);
+            pthread_mutex_lock(&pending_mutex);
+            failures++;
+            pthread_mutex_unlock(&pending_mutex);
+            continue;
+        }
+
+        pthread_mutex_lock(&pending_mutex);
+        while (pending_count == pending_capacity && !connection_broken) {
+            pthread_cond_wait(&pending_not_full, &pending_mutex);
+        }
+        if (connection_broken) {
+            pthread_mutex_unlock(&pending_mutex);
+            if (file != NULL) {
+                fclose(file);
+            }
+            break;
+        }
+        pending[(pending_head + pending_count) % pending_capacity] = cmd;
+        pending_count++;
+        pthread_cond_signal(&pending_not_empty);
+        pthread_mutex_unlock(&pending_mutex);
+
+        bool sent = send_command(socket_desc, &cmd, file);
+        if (file != NULL) {
+            fclose(file);
+        }
+        if (!sent) {
+            printf("Unable to send message\n");
+            // The reader would otherwise wait for a reply that will never come
+            shutdown(socket_desc, SHUT_RDWR);
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&pending_mutex);
+    input_done = true;
+    pthread_cond_signal(&pending_not_empty);
+    pthread_mutex_unlock(&pending_mutex);
+
+    pthread_join(reader, NULL);
+    free(pending);
+
+    return failures == 0 ? 0 : -1;
+}
@@ -0,0 +1,57 @@
+#!/bin/bash
+
+# Runs fbench against a fresh server whose USB devices are tmpfs directories,
+# so results depend on the server and not on the disks behind it.
+#
+#   ./bench.sh [fbench options]
+#
+# DEVICES       number of devices (2)
+# PORT          port the server listens on (15600)
+# SERVER_EXTRA  extra server.conf lines, e.g. 'durability = "group"'
+# BENCH_ROOT    where the devices live (a new directory under /dev/shm)
+
+set -e
+
+client_dir=$(cd "$(dirname "$0")" && pwd)
+server_dir="$client_dir/../server"
+devices=${DEVICES:-2}
+port=${PORT:-15600}
+bench_root=${BENCH_ROOT:-$(mktemp -d /dev/shm/fbench.XXXXXX)}
+
+make -s -C "$server_dir" server
+make -s -C "$client_dir" fbench
+
+# One storage folder per device, and a server.conf pointing at them
+mkdir -p "$bench_root/server"
+{
+    echo "host = \"127.0.0.1\""
+    echo "port = $port"
+    echo "$SERVER_EXTRA"
+    echo "usb_devices = ("
+    for i in $(seq 1 "$devices"); do
+        mkdir -p "$bench_root/usb$i/data"
+        [ "$i" -gt 1 ] && echo "    ,"
+        echo "    { mount_point = \"$bench_root/usb$i\""
+        echo "      storage_folder = \"/data/\""
+        echo "      removable = false }"
+    done
+    echo ");"
+} > "$bench_root/server/server.conf"
+
+cp "$server_dir/server" "$bench_root/server/"
+(cd "$bench_root/server" && exec ./server > "$bench_root/server.log" 2>&1) &
+server_pid=$!
+trap 'kill $server_pid 2>/dev/null; wait $server_pid 2>/dev/null || true; rm -rf "$bench_root"' EXIT
+
+# Wait for the server to accept connections
+for _ in $(seq 50); do
+    (exec 3<>"/dev/tcp/127.0.0.1/$port") 2>/dev/null && break
+    sleep 0.1
+done
+
+# MD creates a directory on one device only, so the default working set directory is made on all of them
+for i in $(seq 1 "$devices"); do
+    mkdir -p "$bench_root/usb$i/data/fbench"
+done
+
+"$client_dir/fbench" --host 127.0.0.1 --port "$port" "$@"
@@ -2,6 +2,7 @@
 
 static char host[INET_ADDRSTRLEN] = {0};
 static int port;
+static int pipeline_depth = DEFAULT_PIPELINE_DEPTH;
 
 static CommandInfo commands[] = {
     {"GET", GET, 3},
@@ -11,6 +12,20 @@ static CommandInfo commands[] = {
     {"PUT", PUT, 3},
     {"PUT", PUT, 4},
     {"RM", RM, 3},
+    {"BATCH", BATCH, 2},
+    {"BATCH", BATCH, 3},
+    {"RGET", RGET, 3},
+    {"RGET", RGET, 4},
+    {"PGET", PGET, 5},
+    {"MPUT", MPUT, 4},
+    {"MPUT", MPUT, 5},
+    {"STAT", STAT, 2},
+    {"STAT", STAT, 3},
+    {"LS", LS, 3},
+    {"LS", LS, 4},
+    {"CP", CP, 4},
+    {"MV", MV, 4},
+    {"STATS", STATS, 2},
 };
 
 /**
@@ -25,6 +40,15 @@ void print_usage(const char *prog_name) {
     printf("%s MD <remote_folder_path>\n", prog_name);
     printf("%s PUT <local_file_path> optional[<remote_file_path>]\n", prog_name);
     printf("%s RM <remote_file_path>\n", prog_name);
+    printf("%s BATCH optional[<command_file>]   (one command per line, stdin by default)\n", prog_name);
+    printf("%s RGET <remote_file_path> optional[<local_file_path>]   (resumes a partial download)\n", prog_name);
+    printf("%s PGET <remote_file_path> <local_file_path> <parts>   (parallel ranged download)\n", prog_name);
+    printf("%s MPUT <local_file_path> <remote_file_path> optional[<connections>]   (resumable parallel upload)\n", prog_name);
+    printf("%s STAT optional[<path_list_file>]   (one remote path per line, stdin by default)\n", prog_name);
+    printf("%s LS <remote_folder_path> optional[-r]   (\"/\" lists the whole storage folder, -r recurses)\n", prog_name);
+    printf("%s CP <remote_source_path> <remote_target_path>   (copied on the server)\n", prog_name);
+    printf("%s MV <remote_source_path> <remote_target_path>\n", prog_name);
+    printf("%s STATS   (server latency histograms and device counters)\n", prog_name);
 }
 
 /**
@@ -64,8 +88,9 @@ bool parse_command_line(int argc, char *argv[], CommandType *cmd) {
  * @param config_file 
  * @param host 
  * @param port 
+ * @param pipeline_depth 
  */
-void load_configuration(const char *config_file, char *host, int *port) {
+void load_configuration(const char *config_file, char *host, int *port, int *pipeline_depth) {
     config_t cfg;
 
     config_init(&cfg);
@@ -86,37 +111,33 @@ void load_configuration(const char *config_file, char *host, int *port) {
     // Read port
     config_lookup_int(&cfg, "port", port);
 
+    // Read how many batch commands may be in flight at once
+    config_lookup_int(&cfg, "pipeline_depth", pipeline_depth);
+    if (*pipeline_depth <= 0) {
+        *pipeline_depth = DEFAULT_PIPELINE_DEPTH;
+    }
+
     config_destroy(&cfg);
 }
 
-int main(int argc, char *argv[]) {
-
-    load_configuration("client.conf", host, &port);
-    
-    CommandType cmd;
-
-    if (!parse_command_line(argc, argv, &cmd)) {
-        return -1;
-    }
-
-    int socket_desc;
+/**
+ * @brief Opens a TCP connection to the configured server.
+ * 
+ * @return int the socket, or -1 on failure.
+ */
+int connect_to_server(void) {
     struct sockaddr_in server_addr;
-    char server_message[BUFFER_SIZE], client_message[BUFFER_SIZE];
-
-    // Clean buffers:
-    memset(server_message, '\0', sizeof(server_message));
-    memset(client_message, '\0', sizeof(client_message));
 
     // Create socket:
-    socket_desc = socket(AF_INET, SOCK_STREAM, 0);
+    int socket_desc = socket(AF_INET, SOCK_STREAM, 0);
 
     if (socket_desc < 0) {
         printf("Unable to create socket\n");
-        close(socket_desc);
         return -1;
     }
 
     // Set port and IP the same as server-side:
+    memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_port = htons(port);
     server_addr.sin_addr.s_addr = inet_addr(host);
@@ -127,231 +148,122 @@ int main(int argc, char *argv[]) {
         close(socket_desc);
         return -1;
     }
+    return socket_desc;
+}
 
-    switch (cmd) {
-        case GET: {
-            // Prepare and send the command message:
-            snprintf(client_message, sizeof(client_message), "%s %s", argv[1], argv[2]);
-            if (send(socket_desc, client_message, strlen(client_message), 0) < 0) {
-                printf("Unable to send message\n");
-                close(socket_desc);
-                return -1;
-            }
-
-            // Receive the server's response (success or failure):
-            char status;
-            if (recv(socket_desc, &status, 1, 0) < 0) {
-                printf("Error while receiving server's msg\n");
-                close(socket_desc);
-                return -1;
-            }
-
-            if (status == 0) {
-                // Receive and print the error message from the server:
-                if (recv(socket_desc, server_message, sizeof(server_message), 0) < 0) {
-                    printf("Error while receiving server's error msg\n");
-                    close(socket_desc);
-                    return -1;
-                }
-                printf("%s\n", server_message);
-                close(socket_desc);
-                return -1;
-            }
+int main(int argc, char *argv[]) {
 
-            // Save the file data to a local file:
-            FILE *file = fopen(argv[argc - 1], "wb");
-            if (file == NULL) {
-                perror("fopen");
-                close(socket_desc);
-                return -1;
-            }
-            ssize_t recv_size;
-            while ((recv_size = recv(socket_desc, server_message, BUFFER_SIZE, 0)) > 0) {
-                fwrite(server_message, 1, recv_size, file);
-                memset(server_message, '\0', sizeof(server_message));
-            }
-            fclose(file);
-            printf("File saved successfully: %s\n", argv[argc - 1]);
-            break;
-        }
-        case INFO: {
-            // Prepare and send the command message:
-            snprintf(client_message, sizeof(client_message), "%s %s", argv[1], argv[2]);
-            if (send(socket_desc, client_message, strlen(client_message), 0) < 0) {
-                printf("Unable to send message\n");
-                close(socket_desc);
-                return -1;
-            }
+    load_configuration("client.conf", host, &port, &pipeline_depth);
+    
+    CommandType cmd;
 
-            // Receive the server's response (success or failure):
-            char status;
-            if (recv(socket_desc, &status, 1, 0) < 0) {
-                printf("Error while receiving server's msg\n");
-                close(socket_desc);
-                return -1;
-            }
+    if (!parse_command_line(argc, argv, &cmd)) {
+        return -1;
+    }
 
-            if (status == 0) {
-                // Receive and print the error message from the server:
-                if (recv(socket_desc, server_message, sizeof(server_message), 0) < 0) {
-                    printf("Error while receiving server's error msg\n");
-                    close(socket_desc);
-                    return -1;
-                }
-                printf("%s\n", server_message);
-                close(socket_desc);
-                return -1;
-            }
-            // Receive the file information from the server:
-            if (recv(socket_desc, server_message, sizeof(server_message), 0) < 0) {
-                printf("Error while receiving server's msg\n");
-                close(socket_desc);
-                return -1;
-            }
-            // Print the file information from the server:
-            printf("File information:\n%s\n", server_message);
-            break;
+    // Ranged downloads and multipart uploads open their own connections
+    if (cmd == RGET) {
+        return resume_get(argv[2], argv[argc - 1]);
+    }
+    if (cmd == PGET) {
+        int parts = atoi(argv[4]);
+        if (parts < 1 || parts > 64) {
+            printf("Parts must be between 1 and 64\n");
+            return -1;
         }
-        case MD: {
-            // Prepare and send the command message:
-            snprintf(client_message, sizeof(client_message), "%s %s", argv[1], argv[2]);
-            if (send(socket_desc, client_message, strlen(client_message), 0) < 0) {
-                printf("Unable to send message\n");
-                close(socket_desc);
-                return -1;
-            }
-
-            // Receive the server's response (success or failure):
-            char status;
-            if (recv(socket_desc, &status, 1, 0) < 0) {
-                printf("Error while receiving server's msg\n");
-                close(socket_desc);
-                return -1;
-            }
-
-            if (status == 0) {
-                // Receive and print the error message from the server:
-                if (recv(socket_desc, server_message, sizeof(server_message), 0) < 0) {
-                    printf("Error while receiving server's error msg\n");
-                    close(socket_desc);
-                    return -1;
-                }
-                printf("%s\n", server_message);
-                close(socket_desc);
-                return -1;
-            }
-            printf("Folder created successfully: %s\n", argv[2]);
-            break;
+        return parallel_get(argv[2], argv[3], parts);
+    }
+    if (cmd == MPUT) {
+        int connections = argc == 5 ? atoi(argv[4]) : DEFAULT_UPLOAD_CONNECTIONS;
+        if (connections < 1 || connections > 64) {
+            printf("Connections must be between 1 and 64\n");
+            return -1;
         }
-        case PUT: {
-            // Prepare and send the command message:
-            snprintf(client_message, sizeof(client_message), "%s %s", argv[1], argv[argc - 1]);
-            if (send(socket_desc, client_message, strlen(client_message), 0) < 0) {
-                printf("Unable to send message\n");
-                close(socket_desc);
-                return -1;
-            }
+        return multipart_put(argv[2], argv[3], connections);
+    }
 
-            // recv ack from client
-            char ack;
-            if (recv(socket_desc, &ack, 1, 0) < 0) {
-                printf("Error while receiving server's msg\n");
-                close(socket_desc);
-                return -1;
-            }
+    int socket_desc = connect_to_server();
+    if (socket_desc < 0) {
+        return -1;
+    }
 
-            if (ack != 1) {
-                printf("Server is not ready to receive file content\n");
-                close(socket_desc);
-                return -1;
-            }
+    PendingCommand request = { .type = cmd, .request_id = 1 };
+    FILE *file = NULL;
 
-            // Send local file
-            FILE *file = fopen(argv[2], "rb");
+    switch (cmd) {
+        case GET:
+            // The local path defaults to the remote one
+            snprintf(request.remote_path, sizeof(request.remote_path), "%s", argv[2]);
+            snprintf(request.local_path, sizeof(request.local_path), "%s", argv[argc - 1]);
+            break;
+        case PUT:
+            snprintf(request.local_path, sizeof(request.local_path), "%s", argv[2]);
+            snprintf(request.remote_path, sizeof(request.remote_path), "%s", argv[argc - 1]);
+            file = fopen(argv[2], "rb");
             if (file == NULL) {
                 printf("Error reading file %s\n", argv[2]);
                 close(socket_desc);
                 return -1;
             }
-
-            // Send file size
-            fseek(file, 0, SEEK_END);
-            long file_size = ftell(file);
-            fseek(file, 0, SEEK_SET);
-            long file_size_network = htonl(file_size);
-            if (send(socket_desc, &file_size_network, sizeof(file_size_network), 0) < 0) {
-                printf("Unable to send file size\n");
-                close(socket_desc);
-                return -1;
-            }
-
-            int read_size;
-            memset(client_message, '\0', sizeof(client_message));
-            while ((read_size = fread(client_message, 1, BUFFER_SIZE, file)) > 0) {
-                send(socket_desc, client_message, read_size, 0);
-                memset(client_message, '\0', sizeof(client_message));
-            }
-            fclose(file);
-
-            // Receive the server's response (success or failure):
-            char status;
-            if (recv(socket_desc, &status, 1, 0) < 0) {
-                printf("Error while receiving server's msg\n");
-                close(socket_desc);
-                return -1;
-            }
-
-            if (status == 0) {
-                // Receive and print the error message from the server:
-                if (recv(socket_desc, server_message, sizeof(server_message), 0) < 0) {
-                    printf("Error while receiving server's error msg\n");
-                    close(socket_desc);
-                    return -1;
-                }
-                printf("%s\n", server_message);
-                close(socket_desc);
-                return -1;
-            }
-
-            printf("File sent successfully: %s\n", argv[2]);
             break;
-        }
-
-        case RM: {
-             // Prepare and send the command message:
-            snprintf(client_message, sizeof(client_message), "%s %s", argv[1], argv[2]);
-            if (send(socket_desc, client_message, strlen(client_message), 0) < 0) {
-                printf("Unable to send message\n");
+        case INFO:
+        case MD:
+        case RM:
+            snprintf(request.remote_path, sizeof(request.remote_path), "%s", argv[2]);
+            break;
+        case CP:
+        case MV:
+            snprintf(request.remote_path, sizeof(request.remote_path), "%s", argv[2]);
+            snprintf(request.target_path, sizeof(request.target_path), "%s", argv[3]);
+            break;
+        case STATS:
+            break;
+        case BATCH:
+        case STAT: {
+            FILE *input = stdin;
+            if (argc == 3 && (input = fopen(argv[2], "r")) == NULL) {
+                perror("fopen");
                 close(socket_desc);
                 return -1;
             }
-
-            // Receive the server's response (success or failure):
-            char status;
-            if (recv(socket_desc, &status, 1, 0) < 0) {
-                printf("Error while receiving server's msg\n");
-                close(socket_desc);
-                return -1;
+            int result = cmd == BATCH ? run_batch(socket_desc, input, pipeline_depth) : run_stat(socket_desc, input);
+            if (input != stdin) {
+                fclose(input);
             }
-
-            if (status == 0) {
-                // Receive and print the error message from the server:
-                if (recv(socket_desc, server_message, sizeof(server_message), 0) < 0) {
-                    printf("Error while receiving server's error msg\n");
-                    close(socket_desc);
-                    return -1;
-                }
-                printf("%s\n", server_message);
+            close(socket_desc);
+            return result;
+        }
+        case LS: {
+            if (argc == 4 && strcmp(argv[3], "-r") != 0) {
+                print_usage(argv[0]);
                 close(socket_desc);
                 return -1;
             }
-            printf("File deleted successfully: %s\n", argv[2]);
-            break;
+            int result = list_directory(socket_desc, argv[2], argc == 4);
+            close(socket_desc);
+            return result;
         }
         default:
             break;
     }
+
+    // Send the request and wait for its reply:
+    bool sent = send_command(socket_desc, &request, file);
+    if (file != NULL) {
+        fclose(file);
+    }
+    if (!sent) {
+        printf("Unable to send message\n");
+        close(socket_desc);
+        return -1;
+    }
+
+    ReplyReader reader = { .sock = socket_desc, .start = 0, .end = 0 };
+    int result = read_reply(&reader, &request);
+    if (result < 0) {
+        printf("Error while receiving server's msg\n");
+    }
     close(socket_desc);
 
-    return 0;
+    return result == 1 ? 0 : -1;
 }
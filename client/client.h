@@ -9,8 +9,13 @@
 #include <sys/socket.h>
 #include <unistd.h>
 #include <libconfig.h>
+#include <pthread.h>
+#include "protocol.h"
+#include "crc32c.h"
 
 #define BUFFER_SIZE 4096
+#define DEFAULT_PIPELINE_DEPTH 16
+#define DEFAULT_UPLOAD_CONNECTIONS 4
 
 typedef enum {
     INVALID,
@@ -18,7 +23,16 @@ typedef enum {
     INFO,
     MD,
     PUT,
-    RM
+    RM,
+    BATCH,
+    RGET,
+    PGET,
+    MPUT,
+    STAT,
+    LS,
+    CP,
+    MV,
+    STATS
 } CommandType;
 
 typedef struct {
@@ -27,6 +41,27 @@ typedef struct {
     int arg_count;
 } CommandInfo;
 
+/**
+ * @brief A command sent to the server, waiting for its reply.
+ */
+typedef struct {
+    CommandType type;
+    uint32_t request_id;
+    char remote_path[2048];
+    char local_path[2048];
+    char target_path[2048]; // the destination of a CP or MV
+} PendingCommand;
+
+/**
+ * @brief Buffered reader over the server socket, replies arrive back-to-back.
+ */
+typedef struct {
+    int sock;
+    size_t start;
+    size_t end;
+    char data[BUFFER_SIZE];
+} ReplyReader;
+
 /**
  * @brief Prints the usage of the program.
  * 
@@ -51,7 +86,112 @@ bool parse_command_line(int argc, char *argv[], CommandType *cmd);
  * @param config_file 
  * @param host 
  * @param port 
+ * @param pipeline_depth 
+ */
+void load_configuration(const char *config_file, char *host, int *port, int *pipeline_depth);
+
+/**
+ * @brief Opens a TCP connection to the configured server.
+ * 
+ * @return int the socket, or -1 on failure.
+ */
+int connect_to_server(void);
+
+/**
+ * @brief Sends all of buf.
+ * 
+ * @param sock 
+ * @param buf 
+ * @param len 
+ * @return true on success, false if the connection failed.
+ */
+bool send_all(int sock, const void *buf, size_t len);
+
+/**
+ * @brief Reads exactly len bytes of the reply stream.
+ * 
+ * @param reader 
+ * @param buf 
+ * @param len 
+ * @return true on success, false if the connection failed.
+ */
+bool read_exact(ReplyReader *reader, void *buf, size_t len);
+
+/**
+ * @brief Sends the request frame for a command, and the file content for a PUT.
+ * 
+ * @param socket_desc 
+ * @param cmd 
+ * @param file for a PUT, the open local file
+ * @return true on success, false if the connection failed.
+ */
+bool send_command(int socket_desc, const PendingCommand *cmd, FILE *file);
+
+/**
+ * @brief Reads the reply to a command and reports it.
+ * 
+ * @param reader 
+ * @param cmd 
+ * @return int 1 if the command succeeded, 0 if it failed, -1 if the connection broke.
+ */
+int read_reply(ReplyReader *reader, const PendingCommand *cmd);
+
+/**
+ * @brief Runs every command read from input over one pipelined connection.
+ * 
+ * @param socket_desc 
+ * @param input 
+ * @param pipeline_depth max commands sent ahead of their replies
+ * @return int 0 if every command succeeded, -1 otherwise.
+ */
+int run_batch(int socket_desc, FILE *input, int pipeline_depth);
+
+/**
+ * @brief Downloads a file, continuing from the end of an existing partial local copy.
+ * 
+ * @param remote_path 
+ * @param local_path 
+ * @return int 0 on success, -1 on failure.
+ */
+int resume_get(const char *remote_path, const char *local_path);
+
+/**
+ * @brief Downloads a file as ranges fetched over parallel connections.
+ * 
+ * @param remote_path 
+ * @param local_path 
+ * @param parts number of ranges and connections
+ * @return int 0 on success, -1 on failure.
+ */
+int parallel_get(const char *remote_path, const char *local_path, int parts);
+
+/**
+ * @brief Uploads a file in chunks over parallel connections, resuming an earlier attempt.
+ * 
+ * @param local_path 
+ * @param remote_path 
+ * @param connections 
+ * @return int 0 on success, -1 on failure.
+ */
+int multipart_put(const char *local_path, const char *remote_path, int connections);
+
+/**
+ * @brief Prints the metadata of every remote path read from input, many paths per request.
+ * 
+ * @param socket_desc 
+ * @param input one remote path per line
+ * @return int 0 if every batch was answered, -1 otherwise.
+ */
+int run_stat(int socket_desc, FILE *input);
+
+/**
+ * @brief Lists a remote directory page by page, following the server's cursor.
+ * 
+ * @param socket_desc 
+ * @param remote_path 
+ * @param recursive also list everything below its subdirectories
+ * @return int 0 on success, -1 on failure.
  */
-void load_configuration(const char *config_file, char *host, int *port);
+int list_directory(int socket_desc, const char *remote_path, bool recursive);
 
 #endif // CLIENT_H
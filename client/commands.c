@@ -0,0 +1,279 @@
+#include "client.h"
+
+/**
+ * @brief Sends all of buf.
+ * 
+ * @param sock 
+ * @param buf 
+ * @param len 
+ * @return true on success, false if the connection failed.
+ */
+bool send_all(int sock, const void *buf, size_t len) {
+    const char *ptr = buf;
+    while (len > 0) {
+        ssize_t n = send(sock, ptr, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            return false;
+        }
+        ptr += n;
+        len -= n;
+    }
+    return true;
+}
+
+/**
+ * @brief Reads exactly len bytes of the reply stream.
+ * 
+ * @param reader 
+ * @param buf 
+ * @param len 
+ * @return true on success, false if the connection failed.
+ */
+bool read_exact(ReplyReader *reader, void *buf, size_t len) {
+    char *out = buf;
+    while (len > 0) {
+        if (reader->start == reader->end) {
+            // Large reads go straight to the caller
+            if (len >= sizeof(reader->data)) {
+                ssize_t n = recv(reader->sock, out, len, 0);
+                if (n <= 0) {
+                    return false;
+                }
+                out += n;
+                len -= n;
+                continue;
+            }
+            ssize_t n = recv(reader->sock, reader->data, sizeof(reader->data), 0);
+            if (n <= 0) {
+                return false;
+            }
+            reader->start = 0;
+            reader->end = n;
+        }
+        size_t chunk = reader->end - reader->start < len ? reader->end - reader->start : len;
+        memcpy(out, reader->data + reader->start, chunk);
+        reader->start += chunk;
+        out += chunk;
+        len -= chunk;
+    }
+    return true;
+}
+
+/**
+ * @brief Reads a reply payload as a string, dropping whatever does not fit.
+ * 
+ * @param reader 
+ * @param length 
+ * @param buf 
+ * @param size 
+ * @return true on success, false if the connection failed.
+ */
+static bool read_string(ReplyReader *reader, uint64_t length, char *buf, size_t size) {
+    size_t kept = length < size - 1 ? length : size - 1;
+    if (!read_exact(reader, buf, kept)) {
+        return false;
+    }
+    buf[kept] = '\0';
+
+    char scratch[BUFFER_SIZE];
+    for (length -= kept; length > 0; ) {
+        size_t chunk = length < sizeof(scratch) ? length : sizeof(scratch);
+        if (!read_exact(reader, scratch, chunk)) {
+            return false;
+        }
+        length -= chunk;
+    }
+    return true;
+}
+
+/**
+ * @brief Sends the request frame for a command, and the file content for a PUT.
+ * 
+ * GETs and PUTs are checksummed: a PUT ends with the CRC32C of the file, and
+ * a GET asks for one after the data.
+ * 
+ * @param socket_desc 
+ * @param cmd 
+ * @param file 
+ * @return true on success, false if the connection failed.
+ */
+bool send_command(int socket_desc, const PendingCommand *cmd, FILE *file) {
+    static const uint8_t opcodes[] = { [GET] = OP_GET, [INFO] = OP_INFO, [MD] = OP_MD, [PUT] = OP_PUT, [RM] = OP_RM,
+                                       [CP] = OP_COPY, [MV] = OP_MOVE, [STATS] = OP_STATS };
+    uint8_t request[FRAME_HEADER_SIZE + 2 * (2 + FRAME_MAX_PATH)];
+
+    size_t path_len = frame_encode_path(request + FRAME_HEADER_SIZE, cmd->remote_path);
+    if (path_len == 0) {
+        printf("Remote path too long: %s\n", cmd->remote_path);
+        return false;
+    }
+    // A copy or move names its destination after the source
+    if (cmd->type == CP || cmd->type == MV) {
+        size_t target_len = frame_encode_path(request + FRAME_HEADER_SIZE + path_len, cmd->target_path);
+        if (target_len == 0) {
+            printf("Remote path too long: %s\n", cmd->target_path);
+            return false;
+        }
+        path_len += target_len;
+    }
+
+    uint64_t file_size = 0;
+    if (cmd->type == PUT) {
+        fseek(file, 0, SEEK_END);
+        file_size = ftell(file);
+        fseek(file, 0, SEEK_SET);
+    }
+
+    uint8_t opcode = opcodes[cmd->type];
+    size_t trailer_len = 0;
+    if (cmd->type == GET || cmd->type == PUT) {
+        opcode |= OP_FLAG_CHECKSUM;
+        trailer_len = cmd->type == PUT ? CHECKSUM_TRAILER_SIZE : 0;
+    }
+    frame_encode_header(request, opcode, cmd->request_id, path_len + file_size + trailer_len);
+    if (!send_all(socket_desc, request, FRAME_HEADER_SIZE + path_len)) {
+        return false;
+    }
+    if (cmd->type != PUT) {
+        return true;
+    }
+
+    char client_message[BUFFER_SIZE];
+    size_t read_size;
+    uint32_t crc = 0;
+    while (file_size > 0 && (read_size = fread(client_message, 1, sizeof(client_message), file)) > 0) {
+        if (read_size > file_size) {
+            read_size = file_size;
+        }
+        crc = crc32c_update(crc, client_message, read_size);
+        if (!send_all(socket_desc, client_message, read_size)) {
+            return false;
+        }
+        file_size -= read_size;
+    }
+    // The frame promised file_size bytes, a file that shrank cannot keep that promise
+    if (file_size > 0) {
+        return false;
+    }
+    uint8_t trailer[CHECKSUM_TRAILER_SIZE];
+    frame_put_u32(trailer, crc);
+    return send_all(socket_desc, trailer, sizeof(trailer));
+}
+
+/**
+ * @brief Reads the reply to a command and reports it.
+ * 
+ * @param reader 
+ * @param cmd 
+ * @return int 1 if the command succeeded, 0 if it failed, -1 if the connection broke.
+ */
+int read_reply(ReplyReader *reader, const PendingCommand *cmd) {
+    uint8_t raw_header[FRAME_HEADER_SIZE];
+    FrameHeader header;
+    char message[BUFFER_SIZE];
+
+    if (!read_exact(reader, raw_header, sizeof(raw_header)) ||
+        frame_decode_header(raw_header, sizeof(raw_header), &header) != FRAME_OK ||
+        header.request_id != cmd->request_id) {
+        return -1;
+    }
+
+    if (header.opcode == OP_ERROR) {
+        if (!read_string(reader, header.length, message, sizeof(message))) {
+            return -1;
+        }
+        printf("%s\n", message);
+        return 0;
+    }
+    if (header.opcode != OP_OK) {
+        return -1;
+    }
+
+    switch (cmd->type) {
+        case GET: {
+            // Save the file data to a local file:
+            FILE *file = fopen(cmd->local_path, "wb");
+            if (file == NULL) {
+                perror("fopen");
+            }
+            // The data has to be drained even when it cannot be saved
+            uint8_t trailer[CHECKSUM_TRAILER_SIZE];
+            uint64_t remaining = header.length >= sizeof(trailer) ? header.length - sizeof(trailer) : 0;
+            uint32_t crc = 0;
+            while (remaining > 0) {
+                size_t chunk = remaining < sizeof(message) ? remaining : sizeof(message);
+                if (!read_exact(reader, message, chunk)) {
+                    if (file != NULL) {
+                        fclose(file);
+                    }
+                    return -1;
+                }
+                crc = crc32c_update(crc, message, chunk);
+                if (file != NULL) {
+                    fwrite(message, 1, chunk, file);
+                }
+                remaining -= chunk;
+            }
+            if (header.length < sizeof(trailer) || !read_exact(reader, trailer, sizeof(trailer))) {
+                if (file != NULL) {
+                    fclose(file);
+                }
+                return -1;
+            }
+            if (file == NULL) {
+                return 0;
+            }
+            fclose(file);
+            // What arrived is not what the server has, so it is not kept
+            if (frame_get_u32(trailer) != crc) {
+                printf("Error: Checksum mismatch: %s\n", cmd->local_path);
+                unlink(cmd->local_path);
+                return 0;
+            }
+            printf("File saved successfully: %s\n", cmd->local_path);
+            break;
+        }
+        case STATS:
+            // The metrics can be far larger than one message
+            for (uint64_t remaining = header.length; remaining > 0; ) {
+                size_t chunk = remaining < sizeof(message) ? remaining : sizeof(message);
+                if (!read_exact(reader, message, chunk)) {
+                    return -1;
+                }
+                fwrite(message, 1, chunk, stdout);
+                remaining -= chunk;
+            }
+            break;
+        case INFO:
+            if (!read_string(reader, header.length, message, sizeof(message))) {
+                return -1;
+            }
+            printf("File information:\n%s\n", message);
+            break;
+        case MD:
+            printf("Folder created successfully: %s\n", cmd->remote_path);
+            break;
+        case PUT:
+            printf("File sent successfully: %s\n", cmd->local_path);
+            break;
+        case RM:
+            printf("File deleted successfully: %s\n", cmd->remote_path);
+            break;
+        case CP:
+            printf("File copied successfully: %s -> %s\n", cmd->remote_path, cmd->target_path);
+            break;
+        case MV:
+            printf("File moved successfully: %s -> %s\n", cmd->remote_path, cmd->target_path);
+            break;
+        default:
+            break;
+    }
+
+    // Replies without a payload for this command are drained to keep the stream in step
+    if (cmd->type != GET && cmd->type != INFO && cmd->type != STATS && header.length > 0) {
+        if (!read_string(reader, header.length, message, sizeof(message))) {
+            return -1;
+        }
+    }
+    return 1;
+}
@@ -0,0 +1,1017 @@
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <math.h>
+#include <strings.h>
+#include <time.h>
+#include <netinet/tcp.h>
+#include "client.h"
+
+#define BENCH_MAX_THREADS 1024
+#define BENCH_MAX_CHOICES 16
+#define BENCH_PAYLOAD_SIZE (1024 * 1024)
+
+typedef enum {
+    BENCH_GET,
+    BENCH_PUT,
+    BENCH_INFO,
+    BENCH_MD,
+    BENCH_RM,
+    BENCH_OPS
+} BenchOp;
+
+static const char *op_names[BENCH_OPS] = { "GET", "PUT", "INFO", "MD", "RM" };
+static const uint8_t op_codes[BENCH_OPS] = { OP_GET, OP_PUT, OP_INFO, OP_MD, OP_RM };
+
+typedef enum {
+    SIZE_FIXED,
+    SIZE_UNIFORM,
+    SIZE_LOGNORMAL,
+    SIZE_CHOICE
+} SizeKind;
+
+/**
+ * @brief How the sizes of uploaded files are drawn.
+ */
+typedef struct {
+    SizeKind kind;
+    uint64_t min;       // fixed size, uniform lower bound or lognormal median
+    uint64_t max;       // uniform upper bound, or the largest lognormal or choice size
+    double sigma;       // lognormal shape
+    int choices;
+    uint64_t sizes[BENCH_MAX_CHOICES];
+    double weights[BENCH_MAX_CHOICES];
+} SizeDist;
+
+/**
+ * @brief Everything a run was asked to do, reported with its results.
+ */
+typedef struct {
+    char host[INET_ADDRSTRLEN];
+    int port;
+    int threads;
+    double duration;
+    double warmup;
+    double rate;        // requests per second over all connections, 0 for a closed loop
+    int files;
+    double zipf;        // skew of GET, PUT and INFO targets, 0 for uniform
+    double weights[BENCH_OPS];
+    char mix_spec[256];
+    char size_spec[256];
+    SizeDist sizes;
+    char prefix[256];
+    uint64_t seed;
+    const char *json_path;
+    bool keep;
+    bool checksum;      // GETs and PUTs carry CRC32C trailers, which are checked
+} BenchConfig;
+
+/**
+ * @brief The latencies and bytes of one operation on one connection.
+ */
+typedef struct {
+    uint64_t *latencies;    // nanoseconds, successful requests only
+    size_t count;
+    size_t capacity;
+    uint64_t errors;
+    uint64_t bytes;
+} OpStats;
+
+/**
+ * @brief One connection driving the server.
+ */
+typedef struct {
+    int id;
+    int sock;
+    uint64_t rng;
+    OpStats stats[BENCH_OPS];
+    uint64_t *dirs;         // MD directories not yet removed
+    size_t num_dirs;
+    size_t dirs_capacity;
+    uint64_t next_dir;
+    bool broken;
+    pthread_t thread;
+} Worker;
+
+static BenchConfig config;
+static double *file_cdf;            // zipf target distribution, NULL when uniform
+static uint8_t *payload;
+static struct timespec run_start;   // when the warmup begins
+
+/**
+ * @brief Nanoseconds on the monotonic clock.
+ *
+ * @return uint64_t
+ */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * @brief xorshift64*, one stream per connection so runs with the same seed repeat.
+ *
+ * @param state
+ * @return uint64_t
+ */
+static uint64_t next_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1Dull;
+}
+
+/**
+ * @brief A uniform double in [0, 1).
+ *
+ * @param state
+ * @return double
+ */
+static double next_uniform(uint64_t *state) {
+    return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * @brief Parses a size with an optional k, m or g suffix (powers of 1024).
+ *
+ * @param text
+ * @param out
+ * @return bool false if text is not a size.
+ */
+static bool parse_size(const char *text, uint64_t *out) {
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (errno != 0 || end == text) {
+        return false;
+    }
+    switch (*end) {
+        case 'k': case 'K': value <<= 10; end++; break;
+        case 'm': case 'M': value <<= 20; end++; break;
+        case 'g': case 'G': value <<= 30; end++; break;
+        default: break;
+    }
+    if (*end != '\0' && *end != ':' && *end != '=' && *end != ',') {
+        return false;
+    }
+    *out = value;
+    return true;
+}
+
+/**
+ * @brief Parses a size distribution: fixed:SIZE, uniform:MIN:MAX,
+ * lognormal:MEDIAN:SIGMA or SIZE=WEIGHT,SIZE=WEIGHT...
+ *
+ * @param spec
+ * @param dist
+ * @return bool false if spec is malformed.
+ */
+static bool parse_size_dist(const char *spec, SizeDist *dist) {
+    memset(dist, 0, sizeof(*dist));
+    if (strncmp(spec, "fixed:", 6) == 0) {
+        dist->kind = SIZE_FIXED;
+        if (!parse_size(spec + 6, &dist->min)) {
+            return false;
+        }
+        dist->max = dist->min;
+        return true;
+    }
+    if (strncmp(spec, "uniform:", 8) == 0) {
+        dist->kind = SIZE_UNIFORM;
+        const char *second = strchr(spec + 8, ':');
+        return second != NULL && parse_size(spec + 8, &dist->min) && parse_size(second + 1, &dist->max) &&
+               dist->min <= dist->max;
+    }
+    if (strncmp(spec, "lognormal:", 10) == 0) {
+        dist->kind = SIZE_LOGNORMAL;
+        const char *second = strchr(spec + 10, ':');
+        if (second == NULL || !parse_size(spec + 10, &dist->min) || dist->min == 0) {
+            return false;
+        }
+        dist->sigma = strtod(second + 1, NULL);
+        if (dist->sigma < 0) {
+            return false;
+        }
+        // The long tail is cut off where it would dwarf the rest of the run
+        dist->max = (uint64_t)(dist->min * exp(4 * dist->sigma));
+        return true;
+    }
+
+    dist->kind = SIZE_CHOICE;
+    double total = 0;
+    for (const char *item = spec; item != NULL && *item != '\0'; ) {
+        const char *weight = strchr(item, '=');
+        if (dist->choices == BENCH_MAX_CHOICES || weight == NULL ||
+            !parse_size(item, &dist->sizes[dist->choices])) {
+            return false;
+        }
+        double w = strtod(weight + 1, NULL);
+        if (w <= 0) {
+            return false;
+        }
+        total += w;
+        dist->weights[dist->choices] = total;
+        if (dist->sizes[dist->choices] > dist->max) {
+            dist->max = dist->sizes[dist->choices];
+        }
+        dist->choices++;
+        item = strchr(item, ',');
+        if (item != NULL) {
+            item++;
+        }
+    }
+    for (int i = 0; i < dist->choices; i++) {
+        dist->weights[i] /= total;
+    }
+    return dist->choices > 0;
+}
+
+/**
+ * @brief Draws a file size.
+ *
+ * @param dist
+ * @param rng
+ * @return uint64_t
+ */
+static uint64_t sample_size(const SizeDist *dist, uint64_t *rng) {
+    switch (dist->kind) {
+        case SIZE_FIXED:
+            return dist->min;
+        case SIZE_UNIFORM:
+            return dist->min + next_random(rng) % (dist->max - dist->min + 1);
+        case SIZE_LOGNORMAL: {
+            // Box-Muller
+            double u1 = 1.0 - next_uniform(rng), u2 = next_uniform(rng);
+            double normal = sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+            double size = dist->min * exp(dist->sigma * normal);
+            return size > dist->max ? dist->max : (uint64_t)size;
+        }
+        case SIZE_CHOICE: {
+            double u = next_uniform(rng);
+            for (int i = 0; i < dist->choices - 1; i++) {
+                if (u < dist->weights[i]) {
+                    return dist->sizes[i];
+                }
+            }
+            return dist->sizes[dist->choices - 1];
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Parses an operation mix such as get=70,put=20,info=10.
+ *
+ * @param spec
+ * @param weights receives the cumulative share of each operation
+ * @return bool false if spec is malformed.
+ */
+static bool parse_mix(const char *spec, double *weights) {
+    double share[BENCH_OPS] = {0};
+    for (const char *item = spec; item != NULL && *item != '\0'; ) {
+        const char *weight = strchr(item, '=');
+        if (weight == NULL) {
+            return false;
+        }
+        int op = 0;
+        while (op < BENCH_OPS && ((size_t)(weight - item) != strlen(op_names[op]) ||
+                                  strncasecmp(item, op_names[op], weight - item) != 0)) {
+            op++;
+        }
+        if (op == BENCH_OPS) {
+            return false;
+        }
+        share[op] = strtod(weight + 1, NULL);
+        if (share[op] < 0) {
+            return false;
+        }
+        item = strchr(item, ',');
+        if (item != NULL) {
+            item++;
+        }
+    }
+
+    double total = 0;
+    for (int op = 0; op < BENCH_OPS; op++) {
+        total += share[op];
+        weights[op] = total;
+    }
+    if (total <= 0) {
+        return false;
+    }
+    for (int op = 0; op < BENCH_OPS; op++) {
+        weights[op] /= total;
+    }
+    return true;
+}
+
+/**
+ * @brief Builds the cumulative distribution of a zipf popularity over the files.
+ *
+ * @param files
+ * @param theta
+ * @return double* NULL if it cannot be allocated.
+ */
+static double *build_zipf(int files, double theta) {
+    double *cdf = malloc(files * sizeof(double));
+    if (cdf == NULL) {
+        return NULL;
+    }
+    double total = 0;
+    for (int i = 0; i < files; i++) {
+        total += 1.0 / pow(i + 1, theta);
+        cdf[i] = total;
+    }
+    for (int i = 0; i < files; i++) {
+        cdf[i] /= total;
+    }
+    return cdf;
+}
+
+/**
+ * @brief Picks the file a GET, PUT or INFO targets.
+ *
+ * @param rng
+ * @return int
+ */
+static int pick_file(uint64_t *rng) {
+    if (file_cdf == NULL) {
+        return next_random(rng) % config.files;
+    }
+    double u = next_uniform(rng);
+    int low = 0, high = config.files - 1;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (file_cdf[mid] < u) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/**
+ * @brief Opens a connection to the server.
+ *
+ * @return int the socket, or -1 on failure.
+ */
+static int bench_connect(void) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("socket");
+        return -1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(config.port);
+    addr.sin_addr.s_addr = inet_addr(config.host);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        close(sock);
+        return -1;
+    }
+    // Requests go out as a header and payload in separate sends, which Nagle would hold back
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sock;
+}
+
+/**
+ * @brief Sends one request and waits for its reply, draining whatever it carries.
+ *
+ * With --checksum a GET or PUT is checksummed, and a GET whose data does not
+ * match its trailer counts as failed.
+ *
+ * @param reader
+ * @param opcode
+ * @param path
+ * @param put_size bytes of payload to upload, for a PUT
+ * @param reply_bytes receives the reply payload length
+ * @return int 1 on success, 0 if the server answered with an error, -1 if the connection broke.
+ */
+static int bench_request(ReplyReader *reader, uint8_t opcode, const char *path, uint64_t put_size, uint64_t *reply_bytes) {
+    uint8_t request[FRAME_HEADER_SIZE + 2 + FRAME_MAX_PATH];
+    size_t path_len = frame_encode_path(request + FRAME_HEADER_SIZE, path);
+    if (path_len == 0) {
+        return -1;
+    }
+    bool checksum = config.checksum && (opcode == OP_GET || opcode == OP_PUT);
+    size_t trailer_len = checksum && opcode == OP_PUT ? CHECKSUM_TRAILER_SIZE : 0;
+    frame_encode_header(request, checksum ? opcode | OP_FLAG_CHECKSUM : opcode, 1, path_len + put_size + trailer_len);
+    if (!send_all(reader->sock, request, FRAME_HEADER_SIZE + path_len)) {
+        return -1;
+    }
+    uint32_t crc = 0;
+    for (uint64_t sent = 0; sent < put_size; ) {
+        size_t chunk = put_size - sent < BENCH_PAYLOAD_SIZE ? put_size - sent : BENCH_PAYLOAD_SIZE;
+        if (checksum) {
+            crc = crc32c_update(crc, payload, chunk);
+        }
+        if (!send_all(reader->sock, payload, chunk)) {
+            return -1;
+        }
+        sent += chunk;
+    }
+    uint8_t trailer[CHECKSUM_TRAILER_SIZE];
+    frame_put_u32(trailer, crc);
+    if (trailer_len > 0 && !send_all(reader->sock, trailer, trailer_len)) {
+        return -1;
+    }
+
+    uint8_t raw_header[FRAME_HEADER_SIZE];
+    FrameHeader header;
+    if (!read_exact(reader, raw_header, sizeof(raw_header)) ||
+        frame_decode_header(raw_header, sizeof(raw_header), &header) != FRAME_OK) {
+        return -1;
+    }
+    // Only the data of a GET is hashed, its trailer is read apart
+    bool hashed = checksum && opcode == OP_GET && header.opcode == OP_OK;
+    if (hashed && header.length < CHECKSUM_TRAILER_SIZE) {
+        return -1;
+    }
+    static __thread uint8_t scratch[64 * 1024];
+    crc = 0;
+    for (uint64_t left = header.length - (hashed ? CHECKSUM_TRAILER_SIZE : 0); left > 0; ) {
+        size_t chunk = left < sizeof(scratch) ? left : sizeof(scratch);
+        if (!read_exact(reader, scratch, chunk)) {
+            return -1;
+        }
+        if (hashed) {
+            crc = crc32c_update(crc, scratch, chunk);
+        }
+        left -= chunk;
+    }
+    if (hashed && !read_exact(reader, trailer, sizeof(trailer))) {
+        return -1;
+    }
+    *reply_bytes = header.length;
+    if (hashed && frame_get_u32(trailer) != crc) {
+        return 0;
+    }
+    return header.opcode == OP_OK ? 1 : 0;
+}
+
+/**
+ * @brief Records the latency of a successful request.
+ *
+ * @param stats
+ * @param latency
+ */
+static void record_latency(OpStats *stats, uint64_t latency) {
+    if (stats->count == stats->capacity) {
+        size_t capacity = stats->capacity ? stats->capacity * 2 : 4096;
+        uint64_t *grown = realloc(stats->latencies, capacity * sizeof(uint64_t));
+        if (grown == NULL) {
+            stats->errors++;
+            return;
+        }
+        stats->latencies = grown;
+        stats->capacity = capacity;
+    }
+    stats->latencies[stats->count++] = latency;
+}
+
+/**
+ * @brief Builds the path of one of a connection's scratch directories.
+ *
+ * @param worker
+ * @param dir
+ * @param out
+ * @param size
+ */
+static void dir_path(const Worker *worker, uint64_t dir, char *out, size_t size) {
+    snprintf(out, size, "%s/w%d/d%" PRIu64, config.prefix, worker->id, dir);
+}
+
+/**
+ * @brief Runs one operation.
+ *
+ * @param worker
+ * @param reader
+ * @param op
+ * @param bytes receives the bytes transferred
+ * @return int 1 on success, 0 if the server answered with an error, -1 if the connection broke.
+ */
+static int run_op(Worker *worker, ReplyReader *reader, BenchOp op, uint64_t *bytes) {
+    char path[FRAME_MAX_PATH + 1];
+    uint64_t reply_bytes = 0;
+    *bytes = 0;
+
+    switch (op) {
+        case BENCH_GET:
+        case BENCH_INFO: {
+            snprintf(path, sizeof(path), "%s/f%06d", config.prefix, pick_file(&worker->rng));
+            int result = bench_request(reader, op_codes[op], path, 0, &reply_bytes);
+            *bytes = reply_bytes;
+            return result;
+        }
+        case BENCH_PUT: {
+            snprintf(path, sizeof(path), "%s/f%06d", config.prefix, pick_file(&worker->rng));
+            *bytes = sample_size(&config.sizes, &worker->rng);
+            return bench_request(reader, OP_PUT, path, *bytes, &reply_bytes);
+        }
+        case BENCH_MD: {
+            if (worker->num_dirs == worker->dirs_capacity) {
+                size_t capacity = worker->dirs_capacity ? worker->dirs_capacity * 2 : 256;
+                uint64_t *grown = realloc(worker->dirs, capacity * sizeof(uint64_t));
+                if (grown == NULL) {
+                    return 0;
+                }
+                worker->dirs = grown;
+                worker->dirs_capacity = capacity;
+            }
+            uint64_t dir = worker->next_dir++;
+            dir_path(worker, dir, path, sizeof(path));
+            int result = bench_request(reader, OP_MD, path, 0, &reply_bytes);
+            if (result == 1) {
+                worker->dirs[worker->num_dirs++] = dir;
+            }
+            return result;
+        }
+        case BENCH_RM:
+            // RM removes a directory the connection made, or a file if it has none left
+            if (worker->num_dirs > 0) {
+                dir_path(worker, worker->dirs[--worker->num_dirs], path, sizeof(path));
+            } else {
+                snprintf(path, sizeof(path), "%s/w%d/missing", config.prefix, worker->id);
+            }
+            return bench_request(reader, OP_RM, path, 0, &reply_bytes);
+        default:
+            return -1;
+    }
+}
+
+/**
+ * @brief Drives the server over one connection until the run ends.
+ *
+ * In a closed loop the next request goes out as soon as the previous reply
+ * arrives. In an open loop requests are due at Poisson arrival times, and a
+ * request's latency counts from when it was due, so a stalled server is not
+ * hidden by the requests it delayed.
+ *
+ * @param arg the Worker
+ * @return void*
+ */
+static void *worker_thread(void *arg) {
+    Worker *worker = arg;
+    ReplyReader *reader = malloc(sizeof(ReplyReader));
+    if (reader == NULL) {
+        worker->broken = true;
+        return NULL;
+    }
+    *reader = (ReplyReader){ .sock = worker->sock, .start = 0, .end = 0 };
+
+    uint64_t start = (uint64_t)run_start.tv_sec * 1000000000ull + run_start.tv_nsec;
+    uint64_t measured = start + (uint64_t)(config.warmup * 1e9);
+    uint64_t end = measured + (uint64_t)(config.duration * 1e9);
+    double per_thread_rate = config.rate / config.threads;
+    uint64_t due = start;
+
+    while (1) {
+        if (config.rate > 0) {
+            due += (uint64_t)(-log(1.0 - next_uniform(&worker->rng)) / per_thread_rate * 1e9);
+            if (due >= end) {
+                break;
+            }
+            struct timespec wake = { .tv_sec = due / 1000000000ull, .tv_nsec = due % 1000000000ull };
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR) {
+            }
+        } else {
+            due = now_ns();
+            if (due >= end) {
+                break;
+            }
+        }
+
+        double u = next_uniform(&worker->rng);
+        BenchOp op = BENCH_GET;
+        while (op < BENCH_RM && u >= config.weights[op]) {
+            op++;
+        }
+
+        uint64_t bytes;
+        int result = run_op(worker, reader, op, &bytes);
+        uint64_t done = now_ns();
+        if (result < 0) {
+            fprintf(stderr, "Connection %d lost\n", worker->id);
+            worker->broken = true;
+            break;
+        }
+        if (due < measured) {
+            continue;
+        }
+        OpStats *stats = &worker->stats[op];
+        if (result == 0) {
+            stats->errors++;
+        } else {
+            record_latency(stats, done - due);
+            stats->bytes += bytes;
+        }
+    }
+    free(reader);
+    return NULL;
+}
+
+/**
+ * @brief Creates the working set: the prefix, one directory per connection and the files.
+ *
+ * @param sock
+ * @return bool false if the server could not be prepared.
+ */
+static bool prepare(int sock) {
+    ReplyReader *reader = malloc(sizeof(ReplyReader));
+    if (reader == NULL) {
+        return false;
+    }
+    *reader = (ReplyReader){ .sock = sock, .start = 0, .end = 0 };
+    char path[FRAME_MAX_PATH + 1];
+    uint64_t reply_bytes, rng = config.seed ^ 0x9E3779B97F4A7C15ull;
+
+    // The prefix may be left over from an earlier run with --keep
+    bool ok = bench_request(reader, OP_MD, config.prefix, 0, &reply_bytes) >= 0;
+    for (int i = 0; ok && i < config.threads; i++) {
+        snprintf(path, sizeof(path), "%s/w%d", config.prefix, i);
+        ok = bench_request(reader, OP_MD, path, 0, &reply_bytes) >= 0;
+    }
+    for (int i = 0; ok && i < config.files; i++) {
+        snprintf(path, sizeof(path), "%s/f%06d", config.prefix, i);
+        int result = bench_request(reader, OP_PUT, path, sample_size(&config.sizes, &rng), &reply_bytes);
+        if (result == 0) {
+            fprintf(stderr, "Unable to upload %s\n", path);
+        }
+        ok = result == 1;
+    }
+    free(reader);
+    return ok;
+}
+
+/**
+ * @brief Removes the working set.
+ *
+ * @param sock
+ */
+static void clean_up(int sock) {
+    ReplyReader *reader = malloc(sizeof(ReplyReader));
+    if (reader == NULL) {
+        return;
+    }
+    *reader = (ReplyReader){ .sock = sock, .start = 0, .end = 0 };
+    uint64_t reply_bytes;
+    bench_request(reader, OP_RM, config.prefix, 0, &reply_bytes);
+    free(reader);
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief The results of one operation over every connection.
+ */
+typedef struct {
+    uint64_t count;
+    uint64_t errors;
+    uint64_t bytes;
+    double p50, p99, p999, max;  // milliseconds
+} OpSummary;
+
+/**
+ * @brief The latency below which a fraction of the sorted latencies fall, in milliseconds.
+ *
+ * @param sorted
+ * @param count
+ * @param fraction
+ * @return double
+ */
+static double percentile(const uint64_t *sorted, size_t count, double fraction) {
+    if (count == 0) {
+        return 0;
+    }
+    size_t rank = (size_t)ceil(fraction * count);
+    return sorted[rank > 0 ? rank - 1 : 0] / 1e6;
+}
+
+/**
+ * @brief Merges the connections' latencies for one operation, or for all of them.
+ *
+ * @param workers
+ * @param op BENCH_OPS for every operation
+ * @param summary
+ */
+static void summarize(const Worker *workers, int op, OpSummary *summary) {
+    memset(summary, 0, sizeof(*summary));
+    size_t total = 0;
+    for (int i = 0; i < config.threads; i++) {
+        for (int o = 0; o < BENCH_OPS; o++) {
+            if (op == BENCH_OPS || op == o) {
+                total += workers[i].stats[o].count;
+                summary->errors += workers[i].stats[o].errors;
+                summary->bytes += workers[i].stats[o].bytes;
+            }
+        }
+    }
+    summary->count = total;
+    uint64_t *all = malloc((total > 0 ? total : 1) * sizeof(uint64_t));
+    if (all == NULL) {
+        return;
+    }
+    size_t pos = 0;
+    for (int i = 0; i < config.threads; i++) {
+        for (int o = 0; o < BENCH_OPS; o++) {
+            if (op == BENCH_OPS || op == o) {
+                memcpy(all + pos, workers[i].stats[o].latencies, workers[i].stats[o].count * sizeof(uint64_t));
+                pos += workers[i].stats[o].count;
+            }
+        }
+    }
+    qsort(all, total, sizeof(uint64_t), compare_u64);
+    summary->p50 = percentile(all, total, 0.50);
+    summary->p99 = percentile(all, total, 0.99);
+    summary->p999 = percentile(all, total, 0.999);
+    summary->max = total > 0 ? all[total - 1] / 1e6 : 0;
+    free(all);
+}
+
+/**
+ * @brief Prints one operation's results as JSON.
+ *
+ * @param out
+ * @param summary
+ * @param elapsed
+ */
+static void print_json_summary(FILE *out, const OpSummary *summary, double elapsed) {
+    fprintf(out, "{\"count\": %" PRIu64 ", \"errors\": %" PRIu64 ", \"ops_per_sec\": %.2f, \"mib_per_sec\": %.3f, "
+                 "\"p50_ms\": %.3f, \"p99_ms\": %.3f, \"p999_ms\": %.3f, \"max_ms\": %.3f}",
+            summary->count, summary->errors, summary->count / elapsed, summary->bytes / elapsed / (1024.0 * 1024.0),
+            summary->p50, summary->p99, summary->p999, summary->max);
+}
+
+/**
+ * @brief Prints the results as a table, and as JSON when asked.
+ *
+ * @param workers
+ * @return int 0 on success, -1 if the JSON file could not be written.
+ */
+static int report(const Worker *workers) {
+    double elapsed = config.duration;
+    OpSummary summaries[BENCH_OPS + 1];
+    for (int op = 0; op <= BENCH_OPS; op++) {
+        summarize(workers, op, &summaries[op]);
+    }
+
+    printf("%d connections, %s, %.1f s after %.1f s warmup, %d files, sizes %s, mix %s\n",
+           config.threads, config.rate > 0 ? "open loop" : "closed loop", config.duration, config.warmup,
+           config.files, config.size_spec, config.mix_spec);
+    printf("%-6s %10s %8s %10s %9s %9s %9s %9s %9s\n",
+           "op", "count", "errors", "ops/s", "MiB/s", "p50 ms", "p99 ms", "p999 ms", "max ms");
+    for (int op = 0; op <= BENCH_OPS; op++) {
+        const OpSummary *s = &summaries[op];
+        if (op < BENCH_OPS && s->count == 0 && s->errors == 0) {
+            continue;
+        }
+        printf("%-6s %10" PRIu64 " %8" PRIu64 " %10.1f %9.2f %9.3f %9.3f %9.3f %9.3f\n",
+               op < BENCH_OPS ? op_names[op] : "total", s->count, s->errors, s->count / elapsed,
+               s->bytes / elapsed / (1024.0 * 1024.0), s->p50, s->p99, s->p999, s->max);
+    }
+
+    if (config.json_path == NULL) {
+        return 0;
+    }
+    FILE *out = strcmp(config.json_path, "-") == 0 ? stdout : fopen(config.json_path, "w");
+    if (out == NULL) {
+        perror("fopen");
+        return -1;
+    }
+    fprintf(out, "{\"config\": {\"host\": \"%s\", \"port\": %d, \"connections\": %d, \"duration_sec\": %.3f, "
+                 "\"warmup_sec\": %.3f, \"rate\": %.3f, \"files\": %d, \"zipf\": %.3f, \"sizes\": \"%s\", "
+                 "\"mix\": \"%s\", \"seed\": %" PRIu64 "},\n \"ops\": {",
+            config.host, config.port, config.threads, config.duration, config.warmup, config.rate, config.files,
+            config.zipf, config.size_spec, config.mix_spec, config.seed);
+    bool first = true;
+    for (int op = 0; op < BENCH_OPS; op++) {
+        if (summaries[op].count == 0 && summaries[op].errors == 0) {
+            continue;
+        }
+        fprintf(out, "%s\n  \"%s\": ", first ? "" : ",", op_names[op]);
+        print_json_summary(out, &summaries[op], elapsed);
+        first = false;
+    }
+    fprintf(out, "},\n \"total\": ");
+    print_json_summary(out, &summaries[BENCH_OPS], elapsed);
+    fprintf(out, "}\n");
+    if (out != stdout) {
+        fclose(out);
+    }
+    return 0;
+}
+
+/**
+ * @brief Prints the usage of the program.
+ *
+ * @param prog_name
+ */
+static void print_bench_usage(const char *prog_name) {
+    printf("Usage: %s [options]\n", prog_name);
+    printf("  -H, --host ADDR        server address (client.conf, else 127.0.0.1)\n");
+    printf("  -p, --port PORT        server port (client.conf)\n");
+    printf("  -c, --connections N    concurrent connections, one request in flight each (8)\n");
+    printf("  -d, --duration SEC     measured time (10)\n");
+    printf("  -w, --warmup SEC       time run before measuring (2)\n");
+    printf("  -r, --rate N           open loop at N requests/s in total; closed loop when omitted\n");
+    printf("  -m, --mix SPEC         operation shares, e.g. get=70,put=20,info=10,md=0,rm=0 (get=80,put=10,info=10)\n");
+    printf("  -s, --sizes SPEC       PUT sizes: fixed:SIZE, uniform:MIN:MAX, lognormal:MEDIAN:SIGMA\n");
+    printf("                         or SIZE=WEIGHT,SIZE=WEIGHT..., sizes take k, m, g (fixed:64k)\n");
+    printf("  -f, --files N          files in the working set (1000)\n");
+    printf("  -z, --zipf THETA       skew GETs, PUTs and INFOs towards popular files (0, uniform)\n");
+    printf("  -P, --prefix DIR       remote directory holding the working set (fbench)\n");
+    printf("  -S, --seed N           random seed (1)\n");
+    printf("  -j, --json FILE        also write the results as JSON, - for stdout\n");
+    printf("  -k, --keep             leave the working set on the server\n");
+    printf("  -C, --checksum         send and check CRC32C trailers on GETs and PUTs\n");
+}
+
+/**
+ * @brief Reads the server address from client.conf when it exists.
+ */
+static void load_bench_configuration(void) {
+    config_t cfg;
+    config_init(&cfg);
+    if (config_read_file(&cfg, "client.conf")) {
+        const char *host_str;
+        if (config_lookup_string(&cfg, "host", &host_str)) {
+            snprintf(config.host, sizeof(config.host), "%s", host_str);
+        }
+        config_lookup_int(&cfg, "port", &config.port);
+    }
+    config_destroy(&cfg);
+}
+
+/**
+ * @brief Parses the command line into config.
+ *
+ * @param argc
+ * @param argv
+ * @return bool false if the options are invalid.
+ */
+static bool parse_options(int argc, char *argv[]) {
+    static const struct option options[] = {
+        {"host", required_argument, NULL, 'H'},
+        {"port", required_argument, NULL, 'p'},
+        {"connections", required_argument, NULL, 'c'},
+        {"duration", required_argument, NULL, 'd'},
+        {"warmup", required_argument, NULL, 'w'},
+        {"rate", required_argument, NULL, 'r'},
+        {"mix", required_argument, NULL, 'm'},
+        {"sizes", required_argument, NULL, 's'},
+        {"files", required_argument, NULL, 'f'},
+        {"zipf", required_argument, NULL, 'z'},
+        {"prefix", required_argument, NULL, 'P'},
+        {"seed", required_argument, NULL, 'S'},
+        {"json", required_argument, NULL, 'j'},
+        {"keep", no_argument, NULL, 'k'},
+        {"checksum", no_argument, NULL, 'C'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    snprintf(config.host, sizeof(config.host), "127.0.0.1");
+    config.port = 15566;
+    load_bench_configuration();
+    config.threads = 8;
+    config.duration = 10;
+    config.warmup = 2;
+    config.files = 1000;
+    config.seed = 1;
+    snprintf(config.mix_spec, sizeof(config.mix_spec), "get=80,put=10,info=10");
+    snprintf(config.size_spec, sizeof(config.size_spec), "fixed:64k");
+    snprintf(config.prefix, sizeof(config.prefix), "fbench");
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "H:p:c:d:w:r:m:s:f:z:P:S:j:kCh", options, NULL)) != -1) {
+        switch (opt) {
+            case 'H': snprintf(config.host, sizeof(config.host), "%s", optarg); break;
+            case 'p': config.port = atoi(optarg); break;
+            case 'c': config.threads = atoi(optarg); break;
+            case 'd': config.duration = atof(optarg); break;
+            case 'w': config.warmup = atof(optarg); break;
+            case 'r': config.rate = atof(optarg); break;
+            case 'm': snprintf(config.mix_spec, sizeof(config.mix_spec), "%s", optarg); break;
+            case 's': snprintf(config.size_spec, sizeof(config.size_spec), "%s", optarg); break;
+            case 'f': config.files = atoi(optarg); break;
+            case 'z': config.zipf = atof(optarg); break;
+            case 'P': snprintf(config.prefix, sizeof(config.prefix), "%s", optarg); break;
+            case 'S': config.seed = strtoull(optarg, NULL, 10); break;
+            case 'j': config.json_path = optarg; break;
+            case 'k': config.keep = true; break;
+            case 'C': config.checksum = true; break;
+            default: return false;
+        }
+    }
+    if (optind != argc) {
+        return false;
+    }
+
+    if (config.threads < 1 || config.threads > BENCH_MAX_THREADS) {
+        fprintf(stderr, "Connections must be between 1 and %d\n", BENCH_MAX_THREADS);
+        return false;
+    }
+    if (config.duration <= 0 || config.warmup < 0 || config.rate < 0 || config.files < 1 || config.zipf < 0) {
+        fprintf(stderr, "Duration and files must be positive, warmup, rate and zipf not negative\n");
+        return false;
+    }
+    if (!parse_mix(config.mix_spec, config.weights)) {
+        fprintf(stderr, "Invalid mix: %s\n", config.mix_spec);
+        return false;
+    }
+    if (!parse_size_dist(config.size_spec, &config.sizes)) {
+        fprintf(stderr, "Invalid sizes: %s\n", config.size_spec);
+        return false;
+    }
+    if (config.prefix[0] == '\0' || strstr(config.prefix, "..") != NULL) {
+        fprintf(stderr, "Invalid prefix: %s\n", config.prefix);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    if (!parse_options(argc, argv)) {
+        print_bench_usage(argv[0]);
+        return -1;
+    }
+
+    payload = malloc(BENCH_PAYLOAD_SIZE);
+    Worker *workers = calloc(config.threads, sizeof(Worker));
+    if (payload == NULL || workers == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    uint64_t fill = config.seed;
+    for (size_t i = 0; i < BENCH_PAYLOAD_SIZE; i += 8) {
+        uint64_t word = next_random(&fill);
+        memcpy(payload + i, &word, 8);
+    }
+    if (config.zipf > 0 && (file_cdf = build_zipf(config.files, config.zipf)) == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    int control = bench_connect();
+    if (control < 0) {
+        return -1;
+    }
+    fprintf(stderr, "Preparing %d files under %s\n", config.files, config.prefix);
+    if (!prepare(control)) {
+        fprintf(stderr, "Unable to prepare the working set\n");
+        close(control);
+        return -1;
+    }
+
+    int started = 0;
+    for (int i = 0; i < config.threads; i++) {
+        workers[i].id = i;
+        workers[i].rng = config.seed * 0x9E3779B97F4A7C15ull + i + 1;
+        workers[i].sock = bench_connect();
+        if (workers[i].sock < 0) {
+            break;
+        }
+        started++;
+    }
+    int result = -1;
+    if (started == config.threads) {
+        clock_gettime(CLOCK_MONOTONIC, &run_start);
+        for (int i = 0; i < config.threads; i++) {
+            pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]);
+        }
+        bool broken = false;
+        for (int i = 0; i < config.threads; i++) {
+            pthread_join(workers[i].thread, NULL);
+            broken |= workers[i].broken;
+        }
+        result = report(workers) == 0 && !broken ? 0 : -1;
+    }
+
+    for (int i = 0; i < started; i++) {
+        close(workers[i].sock);
+    }
+    if (!config.keep) {
+        clean_up(control);
+    }
+    close(control);
+    for (int i = 0; i < config.threads; i++) {
+        for (int op = 0; op < BENCH_OPS; op++) {
+            free(workers[i].stats[op].latencies);
+        }
+        free(workers[i].dirs);
+    }
+    free(workers);
+    free(file_cdf);
+    free(payload);
+    return result;
+}
@@ -0,0 +1,126 @@
+#include <time.h>
+#include <sys/stat.h>
+#include "client.h"
+
+#define LS_PAGE_ENTRIES 1000
+#define LS_MAX_CURSOR 8192
+
+/**
+ * @brief Prints the entries of one OP_LS_DATA frame.
+ *
+ * @param data
+ * @param len
+ * @return bool false if the frame is malformed.
+ */
+static bool print_entries(const uint8_t *data, size_t len) {
+    size_t pos = 0;
+    while (pos < len) {
+        if (len - pos < LS_RECORD_SIZE) {
+            return false;
+        }
+        const uint8_t *record = data + pos;
+        uint64_t size = frame_get_u64(record);
+        time_t mtime = (time_t)frame_get_u64(record + 8);
+        uint32_t mode = frame_get_u32(record + 20);
+        size_t name_len = frame_get_u16(record + 24);
+        if (len - pos - LS_RECORD_SIZE < name_len) {
+            return false;
+        }
+
+        char mod_time[20];
+        struct tm local_time;
+        strftime(mod_time, sizeof(mod_time), "%Y-%m-%d %H:%M:%S", localtime_r(&mtime, &local_time));
+        printf("%c%c%c%c%c%c%c%c%c%c %12llu %s %.*s\n",
+               S_ISDIR(mode) ? 'd' : S_ISLNK(mode) ? 'l' : '-',
+               mode & S_IRUSR ? 'r' : '-', mode & S_IWUSR ? 'w' : '-', mode & S_IXUSR ? 'x' : '-',
+               mode & S_IRGRP ? 'r' : '-', mode & S_IWGRP ? 'w' : '-', mode & S_IXGRP ? 'x' : '-',
+               mode & S_IROTH ? 'r' : '-', mode & S_IWOTH ? 'w' : '-', mode & S_IXOTH ? 'x' : '-',
+               (unsigned long long)size, mod_time, (int)name_len, (const char *)record + LS_RECORD_SIZE);
+        pos += LS_RECORD_SIZE + name_len;
+    }
+    return true;
+}
+
+/**
+ * @brief Lists a remote directory page by page, following the server's cursor.
+ *
+ * @param socket_desc
+ * @param remote_path
+ * @param recursive
+ * @return int 0 on success, -1 on failure.
+ */
+int list_directory(int socket_desc, const char *remote_path, bool recursive) {
+    ReplyReader reader = { .sock = socket_desc, .start = 0, .end = 0 };
+    uint8_t *cursor = malloc(LS_MAX_CURSOR);
+    uint8_t *data = malloc(LS_MAX_DATA + LS_MAX_CURSOR);
+    uint8_t *request = malloc(FRAME_HEADER_SIZE + 2 + FRAME_MAX_PATH + LS_ARGS_SIZE + LS_MAX_CURSOR);
+    if (cursor == NULL || data == NULL || request == NULL) {
+        perror("malloc");
+        free(cursor);
+        free(data);
+        free(request);
+        return -1;
+    }
+
+    int result = -1;
+    size_t cursor_len = 0;
+    uint32_t request_id = 0;
+    do {
+        size_t path_len = frame_encode_path(request + FRAME_HEADER_SIZE, remote_path);
+        if (path_len == 0) {
+            printf("Remote path too long: %s\n", remote_path);
+            break;
+        }
+        uint8_t *args = request + FRAME_HEADER_SIZE + path_len;
+        frame_put_u32(args, recursive ? LS_RECURSIVE : 0);
+        frame_put_u32(args + 4, LS_PAGE_ENTRIES);
+        memcpy(args + LS_ARGS_SIZE, cursor, cursor_len);
+        size_t payload_len = path_len + LS_ARGS_SIZE + cursor_len;
+        frame_encode_header(request, OP_LS, ++request_id, payload_len);
+        if (!send_all(socket_desc, request, FRAME_HEADER_SIZE + payload_len)) {
+            printf("Unable to send message\n");
+            break;
+        }
+
+        // Entries arrive in data frames until the final reply
+        bool failed = false;
+        FrameHeader header;
+        while (!failed) {
+            uint8_t raw_header[FRAME_HEADER_SIZE];
+            if (!read_exact(&reader, raw_header, sizeof(raw_header)) ||
+                frame_decode_header(raw_header, sizeof(raw_header), &header) != FRAME_OK ||
+                header.length > LS_MAX_DATA + LS_MAX_CURSOR || !read_exact(&reader, data, header.length)) {
+                printf("Error while receiving server's msg\n");
+                failed = true;
+            } else if (header.opcode == OP_LS_DATA) {
+                if (!print_entries(data, header.length)) {
+                    printf("Malformed listing\n");
+                    failed = true;
+                }
+            } else {
+                break;
+            }
+        }
+        if (failed) {
+            break;
+        }
+        if (header.opcode == OP_ERROR) {
+            printf("%.*s\n", (int)header.length, (const char *)data);
+            break;
+        }
+        if (header.opcode != OP_OK || header.length > LS_MAX_CURSOR) {
+            printf("Error while receiving server's msg\n");
+            break;
+        }
+        cursor_len = header.length;
+        memcpy(cursor, data, cursor_len);
+        if (cursor_len == 0) {
+            result = 0;
+        }
+    } while (cursor_len > 0);
+
+    free(cursor);
+    free(data);
+    free(request);
+    return result;
+}
@@ -0,0 +1,409 @@
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include "client.h"
+
+#define RANGE_CHUNK_SIZE (64 * 1024)
+#define RANGE_RETRIES 5
+
+/**
+ * @brief Part of a remote file being written into the same offsets of a local file.
+ */
+typedef struct {
+    const char *remote_path;
+    int fd;
+    uint64_t offset;        // next byte to fetch, advances as data lands
+    uint64_t end;           // one past the last byte, RANGE_TO_END for the whole file
+    uint64_t file_size;     // as reported by the server
+    bool done;
+} RangeTransfer;
+
+/**
+ * @brief What identifies one version of a remote file.
+ */
+typedef struct {
+    uint64_t size;
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+} RemoteVersion;
+
+/**
+ * @brief Looks up the size and modification time of a remote file with a one-path STAT.
+ *
+ * @param remote_path
+ * @param version
+ * @return int 1 on success, 0 if the file is missing or the server refused, -1 if the connection broke.
+ */
+static int remote_version(const char *remote_path, RemoteVersion *version) {
+    int sock = connect_to_server();
+    if (sock < 0) {
+        return -1;
+    }
+
+    uint8_t request[FRAME_HEADER_SIZE + 2 + 2 + FRAME_MAX_PATH];
+    size_t path_len = frame_encode_path(request + FRAME_HEADER_SIZE, "");
+    size_t body_len = frame_encode_path(request + FRAME_HEADER_SIZE + path_len, remote_path);
+    if (body_len == 0) {
+        printf("Remote path too long: %s\n", remote_path);
+        close(sock);
+        return 0;
+    }
+    frame_encode_header(request, OP_STAT, 1, path_len + body_len);
+
+    ReplyReader reader = { .sock = sock, .start = 0, .end = 0 };
+    uint8_t raw_header[FRAME_HEADER_SIZE];
+    FrameHeader header;
+    uint8_t reply[4 + STAT_RECORD_SIZE + 2 * 256];
+    if (!send_all(sock, request, FRAME_HEADER_SIZE + path_len + body_len) ||
+        !read_exact(&reader, raw_header, sizeof(raw_header)) ||
+        frame_decode_header(raw_header, sizeof(raw_header), &header) != FRAME_OK ||
+        header.length > sizeof(reply) || !read_exact(&reader, reply, header.length)) {
+        close(sock);
+        return -1;
+    }
+    close(sock);
+
+    if (header.opcode == OP_ERROR) {
+        printf("%.*s\n", (int)header.length, (const char *)reply);
+        return 0;
+    }
+    if (header.opcode != OP_OK || header.length < 6 || frame_get_u32(reply) != 1) {
+        return -1;
+    }
+    int error = frame_get_u16(reply + 4);
+    if (error != 0) {
+        printf("Error: %s\n", strerror(error));
+        return 0;
+    }
+    if (header.length < 4 + STAT_RECORD_SIZE) {
+        return -1;
+    }
+    version->size = frame_get_u64(reply + 4 + 6);
+    version->mtime_sec = (int64_t)frame_get_u64(reply + 4 + 14);
+    version->mtime_nsec = frame_get_u32(reply + 4 + 22);
+    return 1;
+}
+
+static bool same_version(const RemoteVersion *a, const RemoteVersion *b) {
+    return a->size == b->size && a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec;
+}
+
+/**
+ * @brief Reads the remote version a partial download was started from.
+ *
+ * @param sidecar_path
+ * @param remote_path
+ * @param version
+ * @return true if the sidecar describes a download of remote_path.
+ */
+static bool read_sidecar(const char *sidecar_path, const char *remote_path, RemoteVersion *version) {
+    FILE *sidecar = fopen(sidecar_path, "r");
+    if (sidecar == NULL) {
+        return false;
+    }
+    char remote[2048];
+    bool match = fscanf(sidecar, "%" SCNu64 " %" SCNd64 " %" SCNu32 " %2047[^\n]",
+                        &version->size, &version->mtime_sec, &version->mtime_nsec, remote) == 4 &&
+                 strcmp(remote, remote_path) == 0;
+    fclose(sidecar);
+    return match;
+}
+
+/**
+ * @brief Records the remote version a download is taken from, so a later RGET can tell it is the same file.
+ *
+ * @param sidecar_path
+ * @param remote_path
+ * @param version
+ * @return true on success.
+ */
+static bool write_sidecar(const char *sidecar_path, const char *remote_path, const RemoteVersion *version) {
+    FILE *sidecar = fopen(sidecar_path, "w");
+    if (sidecar == NULL) {
+        perror("fopen");
+        return false;
+    }
+    fprintf(sidecar, "%" PRIu64 " %" PRId64 " %" PRIu32 " %s\n", version->size, version->mtime_sec, version->mtime_nsec, remote_path);
+    return fclose(sidecar) == 0;
+}
+
+/**
+ * @brief Requests the rest of a range over a fresh connection and writes what arrives.
+ *
+ * The reply ends with the CRC32C of its data. If that does not match, the
+ * range goes back to where this request started so a retry fetches it again.
+ *
+ * @param transfer
+ * @return int 1 once the range is complete, 0 if the server refused it, -1 if the connection broke.
+ */
+static int fetch_range(RangeTransfer *transfer) {
+    int sock = connect_to_server();
+    if (sock < 0) {
+        return -1;
+    }
+
+    uint8_t request[FRAME_HEADER_SIZE + 2 + FRAME_MAX_PATH + RANGE_ARGS_SIZE];
+    size_t path_len = frame_encode_path(request + FRAME_HEADER_SIZE, transfer->remote_path);
+    if (path_len == 0) {
+        printf("Remote path too long: %s\n", transfer->remote_path);
+        close(sock);
+        return 0;
+    }
+    uint8_t *args = request + FRAME_HEADER_SIZE + path_len;
+    frame_put_u64(args, transfer->offset);
+    frame_put_u64(args + 8, transfer->end == RANGE_TO_END ? RANGE_TO_END : transfer->end - transfer->offset);
+    frame_encode_header(request, OP_GET_RANGE | OP_FLAG_CHECKSUM, 1, path_len + RANGE_ARGS_SIZE);
+
+    ReplyReader reader = { .sock = sock, .start = 0, .end = 0 };
+    uint8_t raw_header[FRAME_HEADER_SIZE];
+    FrameHeader header;
+    uint8_t size[8];
+    if (!send_all(sock, request, FRAME_HEADER_SIZE + path_len + RANGE_ARGS_SIZE) ||
+        !read_exact(&reader, raw_header, sizeof(raw_header)) ||
+        frame_decode_header(raw_header, sizeof(raw_header), &header) != FRAME_OK) {
+        close(sock);
+        return -1;
+    }
+
+    if (header.opcode == OP_ERROR) {
+        char message[BUFFER_SIZE];
+        size_t kept = header.length < sizeof(message) - 1 ? header.length : sizeof(message) - 1;
+        bool read = read_exact(&reader, message, kept);
+        message[read ? kept : 0] = '\0';
+        printf("%s\n", message);
+        close(sock);
+        return 0;
+    }
+    uint8_t trailer[CHECKSUM_TRAILER_SIZE];
+    if (header.opcode != OP_OK || header.length < sizeof(size) + sizeof(trailer) || !read_exact(&reader, size, sizeof(size))) {
+        close(sock);
+        return -1;
+    }
+    transfer->file_size = frame_get_u64(size);
+
+    char *buf = malloc(RANGE_CHUNK_SIZE);
+    if (buf == NULL) {
+        perror("malloc");
+        close(sock);
+        return 0;
+    }
+
+    // Everything written so far is kept, a retry asks for the remainder only
+    int result = 1;
+    uint64_t started = transfer->offset;
+    uint64_t remaining = header.length - sizeof(size) - sizeof(trailer);
+    uint32_t crc = 0;
+    while (remaining > 0) {
+        size_t chunk = remaining < RANGE_CHUNK_SIZE ? remaining : RANGE_CHUNK_SIZE;
+        if (!read_exact(&reader, buf, chunk)) {
+            result = -1;
+            break;
+        }
+        crc = crc32c_update(crc, buf, chunk);
+        if (pwrite(transfer->fd, buf, chunk, transfer->offset) != (ssize_t)chunk) {
+            perror("pwrite");
+            result = 0;
+            break;
+        }
+        transfer->offset += chunk;
+        remaining -= chunk;
+    }
+    if (result == 1 && !read_exact(&reader, trailer, sizeof(trailer))) {
+        result = -1;
+    } else if (result == 1 && frame_get_u32(trailer) != crc) {
+        printf("Checksum mismatch in bytes %llu to %llu\n", (unsigned long long)started, (unsigned long long)transfer->offset);
+        transfer->offset = started;
+        result = -1;
+    }
+
+    free(buf);
+    close(sock);
+    if (result == 1) {
+        transfer->done = true;
+    }
+    return result;
+}
+
+/**
+ * @brief Fetches a range, reconnecting while the connection keeps breaking.
+ *
+ * @param transfer
+ * @return true if the whole range was fetched.
+ */
+static bool fetch_range_with_retries(RangeTransfer *transfer) {
+    int attempts = 0;
+    while (attempts < RANGE_RETRIES) {
+        uint64_t before = transfer->offset;
+        int result = fetch_range(transfer);
+        if (result >= 0) {
+            return result == 1;
+        }
+        // Only failures that made no progress count against the retry budget
+        attempts = transfer->offset > before ? 0 : attempts + 1;
+        printf("Connection lost at byte %llu, retrying\n", (unsigned long long)transfer->offset);
+        sleep(1);
+    }
+    return false;
+}
+
+/**
+ * @brief Downloads a file, continuing from the end of an existing partial local copy.
+ *
+ * The size and modification time of the remote file are kept in
+ * <local_path>.download until the download completes. A partial copy is only
+ * continued while the remote file still matches them, otherwise it is
+ * fetched again from the start rather than stitched from two files.
+ *
+ * @param remote_path
+ * @param local_path
+ * @return int 0 on success, -1 on failure.
+ */
+int resume_get(const char *remote_path, const char *local_path) {
+    RemoteVersion version, started;
+    if (remote_version(remote_path, &version) != 1) {
+        printf("Error: Failed to look up %s\n", remote_path);
+        return -1;
+    }
+
+    int fd = open(local_path, O_WRONLY | O_CREAT, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror("open");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    char sidecar_path[2100];
+    snprintf(sidecar_path, sizeof(sidecar_path), "%s.download", local_path);
+    RangeTransfer transfer = { .remote_path = remote_path, .fd = fd, .offset = st.st_size, .end = RANGE_TO_END };
+    if (transfer.offset > 0 && (!read_sidecar(sidecar_path, remote_path, &started) || !same_version(&started, &version))) {
+        printf("%s changed since %s was started, downloading it again\n", remote_path, local_path);
+        transfer.offset = 0;
+        if (ftruncate(fd, 0) < 0) {
+            perror("ftruncate");
+            close(fd);
+            return -1;
+        }
+    } else if (transfer.offset > 0) {
+        printf("Resuming %s at byte %llu\n", local_path, (unsigned long long)transfer.offset);
+    }
+    if (!write_sidecar(sidecar_path, remote_path, &version)) {
+        close(fd);
+        return -1;
+    }
+
+    bool ok = fetch_range_with_retries(&transfer);
+    // A local copy longer than the remote file is cut back to it
+    if (ok && (uint64_t)st.st_size > transfer.file_size && ftruncate(fd, transfer.file_size) < 0) {
+        perror("ftruncate");
+        ok = false;
+    }
+    close(fd);
+
+    // A file replaced while its ranges were in flight leaves a copy of neither version
+    RemoteVersion finished;
+    if (ok && (transfer.file_size != version.size || remote_version(remote_path, &finished) != 1 || !same_version(&finished, &version))) {
+        printf("Error: %s changed during the download\n", remote_path);
+        unlink(sidecar_path);
+        return -1;
+    }
+    if (!ok) {
+        return -1;
+    }
+    unlink(sidecar_path);
+    printf("File saved successfully: %s\n", local_path);
+    return 0;
+}
+
+static void *range_thread(void *arg) {
+    RangeTransfer *transfer = arg;
+    fetch_range_with_retries(transfer);
+    return NULL;
+}
+
+/**
+ * @brief Downloads a file as parts ranges fetched over parallel connections.
+ *
+ * @param remote_path
+ * @param local_path
+ * @param parts
+ * @return int 0 on success, -1 on failure.
+ */
+int parallel_get(const char *remote_path, const char *local_path, int parts) {
+    int fd = open(local_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+
+    // The size and modification time tell whether the file was replaced while the parts were fetched
+    RemoteVersion version;
+    if (remote_version(remote_path, &version) != 1) {
+        printf("Error: Failed to look up %s\n", remote_path);
+        close(fd);
+        return -1;
+    }
+    uint64_t size = version.size;
+    if (ftruncate(fd, size) < 0) {
+        perror("ftruncate");
+        close(fd);
+        return -1;
+    }
+    if ((uint64_t)parts > size / RANGE_CHUNK_SIZE) {
+        parts = size / RANGE_CHUNK_SIZE > 0 ? (int)(size / RANGE_CHUNK_SIZE) : 1;
+    }
+
+    RangeTransfer *transfers = calloc(parts, sizeof(RangeTransfer));
+    pthread_t *threads = calloc(parts, sizeof(pthread_t));
+    if (transfers == NULL || threads == NULL) {
+        perror("calloc");
+        free(transfers);
+        free(threads);
+        close(fd);
+        return -1;
+    }
+
+    for (int i = 0; i < parts; i++) {
+        transfers[i] = (RangeTransfer){
+            .remote_path = remote_path,
+            .fd = fd,
+            .offset = size / parts * i,
+            .end = i == parts - 1 ? size : size / parts * (i + 1),
+        };
+        if (pthread_create(&threads[i], NULL, range_thread, &transfers[i]) != 0) {
+            perror("pthread_create");
+            // Fetch it on this thread instead
+            range_thread(&transfers[i]);
+            threads[i] = 0;
+        }
+    }
+
+    bool ok = true;
+    for (int i = 0; i < parts; i++) {
+        if (threads[i] != 0) {
+            pthread_join(threads[i], NULL);
+        }
+        // A file that changed size in the meantime cannot be stitched together
+        if (!transfers[i].done || transfers[i].file_size != size) {
+            ok = false;
+        }
+    }
+
+    RemoteVersion finished;
+    if (ok && (remote_version(remote_path, &finished) != 1 || !same_version(&finished, &version))) {
+        printf("Error: %s changed during the download\n", remote_path);
+        ok = false;
+    }
+
+    free(transfers);
+    free(threads);
+    close(fd);
+    if (!ok) {
+        printf("Error: Failed to download %s\n", remote_path);
+        return -1;
+    }
+    printf("File saved successfully: %s\n", local_path);
+    return 0;
+}
@@ -0,0 +1,179 @@
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "client.h"
+
+#define STAT_BATCH_PATHS 4096
+#define STAT_BATCH_BYTES (1024 * 1024)
+
+/**
+ * @brief Prints one STAT record and moves past it.
+ *
+ * @param path the path it answers
+ * @param record
+ * @param end one past the last reply byte
+ * @return const uint8_t* the next record, or NULL if the reply is cut short.
+ */
+static const uint8_t *print_record(const char *path, const uint8_t *record, const uint8_t *end) {
+    if (end - record < 2) {
+        return NULL;
+    }
+    int error = frame_get_u16(record);
+    if (error != 0) {
+        printf("%s\tERROR: %s\n", path, strerror(error));
+        return record + 2;
+    }
+    if (end - record < STAT_RECORD_SIZE + 1) {
+        return NULL;
+    }
+
+    uint32_t mode = frame_get_u32(record + 2);
+    uint64_t size = frame_get_u64(record + 6);
+    time_t mtime = (time_t)frame_get_u64(record + 14);
+    const uint8_t *names = record + STAT_RECORD_SIZE;
+    if (names + 1 + names[0] >= end || names + 1 + names[0] + 1 + names[1 + names[0]] > end) {
+        return NULL;
+    }
+    int owner_len = names[0];
+    const uint8_t *group = names + 1 + owner_len;
+    int group_len = group[0];
+
+    char mod_time[20];
+    struct tm local_time;
+    strftime(mod_time, sizeof(mod_time), "%Y-%m-%d %H:%M:%S", localtime_r(&mtime, &local_time));
+    printf("%s\t%c%c%c%c%c%c%c%c%c%c\t%llu\t%.*s\t%.*s\t%s\n", path,
+           S_ISDIR(mode) ? 'd' : '-',
+           mode & S_IRUSR ? 'r' : '-', mode & S_IWUSR ? 'w' : '-', mode & S_IXUSR ? 'x' : '-',
+           mode & S_IRGRP ? 'r' : '-', mode & S_IWGRP ? 'w' : '-', mode & S_IXGRP ? 'x' : '-',
+           mode & S_IROTH ? 'r' : '-', mode & S_IWOTH ? 'w' : '-', mode & S_IXOTH ? 'x' : '-',
+           (unsigned long long)size, owner_len, (const char *)names + 1, group_len, (const char *)group + 1, mod_time);
+    return group + 1 + group_len;
+}
+
+/**
+ * @brief Sends one STAT request for a batch of paths and prints its records.
+ *
+ * @param reader
+ * @param paths
+ * @param count
+ * @param body the encoded path list
+ * @param body_len
+ * @return int 1 on success, 0 if the server refused the batch, -1 if the connection broke.
+ */
+static int stat_batch(ReplyReader *reader, char **paths, int count, const uint8_t *body, size_t body_len) {
+    uint8_t request[FRAME_HEADER_SIZE + 2];
+    size_t path_len = frame_encode_path(request + FRAME_HEADER_SIZE, "");
+    frame_encode_header(request, OP_STAT, 1, path_len + body_len);
+    if (!send_all(reader->sock, request, FRAME_HEADER_SIZE + path_len) || !send_all(reader->sock, body, body_len)) {
+        return -1;
+    }
+
+    uint8_t raw_header[FRAME_HEADER_SIZE];
+    FrameHeader header;
+    if (!read_exact(reader, raw_header, sizeof(raw_header)) ||
+        frame_decode_header(raw_header, sizeof(raw_header), &header) != FRAME_OK ||
+        header.length > (uint64_t)4 + (uint64_t)count * (STAT_RECORD_SIZE + 2 * 256)) {
+        return -1;
+    }
+    uint8_t *reply = malloc(header.length > 0 ? header.length : 1);
+    if (reply == NULL || !read_exact(reader, reply, header.length)) {
+        free(reply);
+        return -1;
+    }
+
+    int result = 1;
+    if (header.opcode == OP_ERROR) {
+        printf("%.*s\n", (int)header.length, (const char *)reply);
+        result = 0;
+    } else if (header.opcode != OP_OK || header.length < 4 || frame_get_u32(reply) != (uint32_t)count) {
+        result = -1;
+    } else {
+        const uint8_t *record = reply + 4;
+        for (int i = 0; i < count && record != NULL; i++) {
+            record = print_record(paths[i], record, reply + header.length);
+        }
+        if (record == NULL) {
+            result = -1;
+        }
+    }
+    free(reply);
+    return result;
+}
+
+/**
+ * @brief Prints the metadata of every remote path read from input, many paths per request.
+ *
+ * Each line of output is the path, permissions, size, owner, group and
+ * modification time separated by tabs, or the path and the error.
+ *
+ * @param socket_desc
+ * @param input one remote path per line
+ * @return int 0 if every batch was answered, -1 otherwise.
+ */
+int run_stat(int socket_desc, FILE *input) {
+    ReplyReader reader = { .sock = socket_desc, .start = 0, .end = 0 };
+    char **paths = calloc(STAT_BATCH_PATHS, sizeof(char *));
+    uint8_t *body = malloc(STAT_BATCH_BYTES);
+    if (paths == NULL || body == NULL) {
+        perror("malloc");
+        free(paths);
+        free(body);
+        return -1;
+    }
+
+    int result = 0;
+    int count = 0;
+    size_t body_len = 0;
+    char line[2 * FRAME_MAX_PATH];
+    bool more = true;
+    while (more) {
+        more = fgets(line, sizeof(line), input) != NULL;
+        if (more) {
+            line[strcspn(line, "\r\n")] = '\0';
+            size_t len = strlen(line);
+            if (len == 0) {
+                continue;
+            }
+            if (len > FRAME_MAX_PATH) {
+                printf("%s\tERROR: %s\n", line, strerror(ENAMETOOLONG));
+                result = -1;
+                continue;
+            }
+            paths[count] = strdup(line);
+            if (paths[count] == NULL) {
+                perror("strdup");
+                result = -1;
+                break;
+            }
+            frame_put_u16(body + body_len, (uint16_t)len);
+            memcpy(body + body_len + 2, line, len);
+            body_len += 2 + len;
+            count++;
+        }
+
+        // Send once the batch is full, or whatever is left at the end of the input
+        if (count > 0 && (!more || count == STAT_BATCH_PATHS || body_len + 2 + FRAME_MAX_PATH > STAT_BATCH_BYTES)) {
+            int sent = stat_batch(&reader, paths, count, body, body_len);
+            for (int i = 0; i < count; i++) {
+                free(paths[i]);
+            }
+            count = 0;
+            body_len = 0;
+            if (sent < 0) {
+                printf("Error while receiving server's msg\n");
+                result = -1;
+                break;
+            }
+            if (sent == 0) {
+                result = -1;
+            }
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        free(paths[i]);
+    }
+
+    free(paths);
+    free(body);
+    return result;
+}
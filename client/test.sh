@@ -7,15 +7,62 @@ base_dir="base_test_dir"
 log_file="test_logs.txt"
 echo "Client logs:" > $log_file
 
+# Failed checks are collected here, the concurrent clients run in subshells
+failures_file="test_failures.txt"
+: > $failures_file
+
+# The server from client.conf, for the raw frame tests
+server_host=$(sed -n 's/^ *host *= *"\(.*\)".*/\1/p' client.conf)
+server_port=$(sed -n 's/^ *port *= *\([0-9]*\).*/\1/p' client.conf)
+
+# Run a command and record whether it succeeded
+check() {
+    description=$1
+    shift
+    if "$@" >> $log_file 2>&1; then
+        echo "PASS: $description" >> $log_file
+    else
+        echo "FAIL: $description" >> $log_file
+        echo "FAIL: $description" >> $failures_file
+    fi
+}
+
+# Succeeds when the remote file downloads with the same content as the local one
+remote_matches() {
+    ./fget GET $1 check_$BASHPID.tmp && cmp $2 check_$BASHPID.tmp
+    status=$?
+    rm -f check_$BASHPID.tmp
+    return $status
+}
+
+# Succeeds when STAT output $1 has path $2 with size $3, or the error $3
+stat_reports() {
+    awk -F'\t' -v path="$2" -v field="$3" '$1 == path && ($3 == field || $2 == field) { found = 1 } END { exit !found }' $1
+}
+
+# Succeeds when the command fails
+fails() {
+    ! "$@"
+}
+
+# Send a raw frame and succeed when the server hangs up without replying
+server_rejects_frame() {
+    exec 3<>/dev/tcp/$server_host/$server_port || return 1
+    printf "$1" >&3
+    timeout 5 cat <&3 > raw_reply.bin
+    status=$?
+    exec 3<&-
+    [ $status -eq 0 ] && [ ! -s raw_reply.bin ]
+}
+
 # Create the base directory
-./fget MD $base_dir >> $log_file 2>&1
+check "MD $base_dir" ./fget MD $base_dir
 
 # Function for single client tests for MD (make directory)
 single_client_md_tests() {
     for i in {1..5}; do
         nested_dir="$base_dir/single_client_test_$i"
-        ./fget MD $nested_dir >> $log_file 2>&1
-        echo "Created directory: $nested_dir" >> $log_file
+        check "MD $nested_dir" ./fget MD $nested_dir
     done
 }
 
@@ -24,20 +71,18 @@ single_client_put_tests() {
     for i in {1..5}; do
         file_name="$base_dir/single_client_test_file_$i.txt"
         content=$(head /dev/urandom | tr -dc A-Za-z0-9 | head -c 32)
-        echo $content > temp.txt
-        ./fget PUT temp.txt $file_name >> $log_file 2>&1
-        echo "PUT file: $file_name with content: $content" >> $log_file
+        echo $content > expected_$i.txt
+        check "PUT $file_name" ./fget PUT expected_$i.txt $file_name
     done
-    rm temp.txt
 }
 
 # Function for single client tests for INFO (file information)
 single_client_info_tests() {
     for i in {1..5}; do
         file_name="$base_dir/single_client_test_file_$i.txt"
-        ./fget INFO $file_name >> $log_file 2>&1
-        echo "INFO for file: $file_name" >> $log_file >> $log_file
+        check "INFO $file_name" grep -q "Size: 33 bytes" <(./fget INFO $file_name)
     done
+    check "INFO of a missing file fails" fails ./fget INFO $base_dir/missing.txt
 }
 
 # Function for single client tests for GET (download file)
@@ -45,9 +90,88 @@ single_client_get_tests() {
     for i in {1..5}; do
         file_name="$base_dir/single_client_test_file_$i.txt"
         local_file="local_copy_$i.txt"
-        ./fget GET $file_name $local_file >> $log_file 2>&1
-        echo "GET file: $file_name to local file: $local_file" >> $log_file
+        check "GET $file_name" ./fget GET $file_name $local_file
+        check "GET $file_name content" cmp expected_$i.txt $local_file
+        rm -f $local_file
     done
+    check "GET of a missing file fails" fails ./fget GET $base_dir/missing.txt missing.txt
+    check "GET of a missing file leaves nothing behind" test ! -e missing.txt
+}
+
+# Function for ranged, parallel and multipart transfers of a file spanning many chunks
+single_client_large_file_tests() {
+    head -c 5000000 /dev/urandom > large.bin
+    file_name="$base_dir/large.bin"
+    check "PUT $file_name" ./fget PUT large.bin $file_name
+
+    check "RGET $file_name" ./fget RGET $file_name rget_copy.bin
+    check "RGET $file_name content" cmp large.bin rget_copy.bin
+    check "RGET removes its sidecar" test ! -e rget_copy.bin.download
+    # A local copy with no record of its download is fetched again from the start
+    head -c 1000 /dev/urandom > rget_copy.bin
+    check "RGET over an unrelated local file" ./fget RGET $file_name rget_copy.bin
+    check "RGET over an unrelated local file content" cmp large.bin rget_copy.bin
+
+    check "PGET $file_name" ./fget PGET $file_name pget_copy.bin 4
+    check "PGET $file_name content" cmp large.bin pget_copy.bin
+    check "PGET of a missing file fails" fails ./fget PGET $base_dir/missing.bin pget_missing.bin 4
+
+    check "MPUT $base_dir/multipart.bin" ./fget MPUT large.bin $base_dir/multipart.bin 3
+    check "MPUT $base_dir/multipart.bin content" remote_matches $base_dir/multipart.bin large.bin
+    check "MPUT removes its sidecar" test ! -e large.bin.upload
+
+    rm -f rget_copy.bin pget_copy.bin pget_missing.bin
+}
+
+# Function for single client tests for STAT and LS
+single_client_listing_tests() {
+    printf '%s\n' $base_dir/single_client_test_file_1.txt $base_dir/large.bin $base_dir/missing.txt > stat_paths.txt
+    ./fget STAT stat_paths.txt > stat_output.txt 2>> $log_file
+    check "STAT of a small file" stat_reports stat_output.txt $base_dir/single_client_test_file_1.txt 33
+    check "STAT of a large file" stat_reports stat_output.txt $base_dir/large.bin 5000000
+    check "STAT of a missing file" stat_reports stat_output.txt $base_dir/missing.txt "ERROR: No such file or directory"
+
+    ./fget LS $base_dir > ls_output.txt 2>> $log_file
+    check "LS lists files" grep -q " 5000000 .* large.bin$" ls_output.txt
+    check "LS lists directories" grep -q "^d.* single_client_test_1$" ls_output.txt
+    check "LS shows every entry" test $(wc -l < ls_output.txt) -eq 12
+    check "LS recursive" grep -q " $base_dir/single_client_test_file_5.txt$" <(./fget LS / -r)
+    check "LS of a missing directory fails" fails ./fget LS $base_dir/missing
+
+    rm -f stat_paths.txt stat_output.txt ls_output.txt
+}
+
+# Function for single client tests for CP and MV (copied and renamed on the server)
+single_client_copy_tests() {
+    check "CP $base_dir/large.bin" ./fget CP $base_dir/large.bin $base_dir/copy.bin
+    check "CP content" remote_matches $base_dir/copy.bin large.bin
+    check "CP of a directory" ./fget CP $base_dir/single_client_test_1 $base_dir/copied_dir
+    check "CP of a missing file fails" fails ./fget CP $base_dir/missing.bin $base_dir/other.bin
+
+    check "MV $base_dir/copy.bin" ./fget MV $base_dir/copy.bin $base_dir/moved.bin
+    check "MV content" remote_matches $base_dir/moved.bin large.bin
+    check "MV removes the source" fails ./fget INFO $base_dir/copy.bin
+    check "MV of a missing file fails" fails ./fget MV $base_dir/missing.bin $base_dir/other.bin
+}
+
+# Function for the server's metrics
+single_client_stats_tests() {
+    ./fget STATS > stats_output.txt 2>> $log_file
+    check "STATS has latency histograms" grep -q "^fs_request_duration_seconds_bucket{command=\"GET\"" stats_output.txt
+    check "STATS counts requests" grep -q "command=\"PUT\"" stats_output.txt
+    rm -f stats_output.txt
+}
+
+# Function for frames the server must refuse without falling over
+malformed_frame_tests() {
+    check "Bad magic is refused" server_rejects_frame '\x00\x00\x01\x02\x00\x00\x00\x01\x00\x00\x00\x00\x00\x00\x00\x00'
+    check "Unknown version is refused" server_rejects_frame '\x46\x53\x09\x02\x00\x00\x00\x01\x00\x00\x00\x00\x00\x00\x00\x02\x00\x00'
+    check "Path longer than the limit is refused" server_rejects_frame '\x46\x53\x01\x02\x00\x00\x00\x01\x00\x00\x00\x00\x00\x00\x00\x02\xff\xff'
+    check "Path longer than the frame is refused" server_rejects_frame '\x46\x53\x01\x02\x00\x00\x00\x01\x00\x00\x00\x00\x00\x00\x00\x04\x00\x0a\x61\x62'
+    check "Path with a NUL is refused" server_rejects_frame '\x46\x53\x01\x02\x00\x00\x00\x01\x00\x00\x00\x00\x00\x00\x00\x05\x00\x03\x61\x00\x62'
+    check "Oversized request is refused" server_rejects_frame '\x46\x53\x01\x02\x00\x00\x00\x01\x00\x00\x00\x00\xff\xff\xff\xff\x00\x01\x61'
+    check "Server still answers after malformed frames" grep -q "Size: 33 bytes" <(./fget INFO $base_dir/single_client_test_file_1.txt)
+    rm -f raw_reply.bin
 }
 
 # Define the number of clients to run concurrently
@@ -58,13 +182,12 @@ run_concurrent_tests() {
     client_id=$1
     client_base="$base_dir/client_$client_id"
 
-    ./fget MD $client_base >> $log_file 2>&1
+    check "Client $client_id MD $client_base" ./fget MD $client_base
 
     # Create nested directories
     for i in {1..5}; do
         nested_dir="$client_base/nested_$i"
-        ./fget MD $nested_dir >> $log_file 2>&1 &
-        echo "Client $client_id created directory: $nested_dir" >> $log_file
+        check "Client $client_id MD $nested_dir" ./fget MD $nested_dir &
     done
     wait
 
@@ -72,40 +195,37 @@ run_concurrent_tests() {
     for i in {1..5}; do
         file_name="$client_base/client_file_$i.txt"
         content=$(head /dev/urandom | tr -dc A-Za-z0-9 | head -c 32)
-        echo $content > temp_$client_id.txt
-        ./fget PUT temp_$client_id.txt $file_name >> $log_file 2>&1 &
-        echo "Client $client_id PUT file: $file_name with content: $content" >> $log_file
+        echo $content > temp_${client_id}_$i.txt
+        check "Client $client_id PUT $file_name" ./fget PUT temp_${client_id}_$i.txt $file_name &
     done
     wait
 
     # INFO command
     for i in {1..5}; do
         file_name="$client_base/client_file_$i.txt"
-        ./fget INFO $file_name >> $log_file 2>&1 &
-        echo "Client $client_id INFO for file: $file_name" >> $log_file
+        check "Client $client_id INFO $file_name" ./fget INFO $file_name &
     done
     wait
 
     # GET command
     for i in {1..5}; do
         file_name="$client_base/client_file_$i.txt"
-        local_file="local_copy_$client_id.txt"
-        ./fget GET $file_name $local_file >> $log_file 2>&1 &
-        echo "Client $client_id GET file: $file_name to local file: $local_file" >> $log_file
+        check "Client $client_id GET $file_name" remote_matches $file_name temp_${client_id}_$i.txt &
     done
     wait
 
     # RM command
     for i in {1..5}; do
         file_name="$client_base/client_file_$i.txt"
-        ./fget RM $file_name >> $log_file 2>&1 &
-        echo "Client $client_id RM file: $file_name" >> $log_file
+        check "Client $client_id RM $file_name" ./fget RM $file_name &
     done
     wait
+    for i in {1..5}; do
+        check "Client $client_id RM removed $client_base/client_file_$i.txt" fails ./fget INFO $client_base/client_file_$i.txt
+    done
 
     # Clean up
-    rm temp_$client_id.txt
-    rm local_copy_$client_id.txt
+    rm -f temp_${client_id}_*.txt
 }
 
 # Run single client tests
@@ -113,6 +233,11 @@ single_client_md_tests
 single_client_put_tests
 single_client_info_tests
 single_client_get_tests
+single_client_large_file_tests
+single_client_listing_tests
+single_client_copy_tests
+single_client_stats_tests
+malformed_frame_tests
 
 # Run concurrent tests
 echo "Running concurrent tests..."  >> $log_file
@@ -124,6 +249,15 @@ done
 wait
 
 # Clean up
-./fget RM $base_dir >> $log_file 2>&1
+check "RM $base_dir" ./fget RM $base_dir
+check "RM removed $base_dir" fails ./fget INFO $base_dir
+rm -f expected_*.txt large.bin
+
+echo "Concurrent tests completed."  >> $log_file
 
-echo "Concurrent tests completed."  >> $log_file
\ No newline at end of file
+if [ -s $failures_file ]; then
+    cat $failures_file
+    echo "$(wc -l < $failures_file) checks failed, see $log_file"
+    exit 1
+fi
+echo "All checks passed"
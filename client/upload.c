@@ -0,0 +1,327 @@
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include "client.h"
+
+#define MULTIPART_CHUNK_SIZE (8 * 1024 * 1024)
+#define MULTIPART_IO_SIZE (64 * 1024)
+#define MULTIPART_RETRIES 5
+
+/**
+ * @brief Shared state of the threads uploading the chunks of one file.
+ */
+typedef struct {
+    const char *remote_path;
+    int fd;
+    uint64_t id;
+    uint64_t size;
+    uint32_t chunk_size;
+    uint32_t *missing;      // chunks still to send
+    uint32_t num_missing;
+    uint32_t next;          // next entry of missing to hand out
+    bool failed;
+    pthread_mutex_t mutex;
+} MultipartUpload;
+
+/**
+ * @brief Sends one upload request, optionally with a body read from fd, and reads its reply.
+ *
+ * A chunk is followed by its CRC32C, which the server checks before it counts the chunk.
+ *
+ * @param sock
+ * @param opcode
+ * @param remote_path
+ * @param args
+ * @param args_len
+ * @param fd file the body is read from, -1 for none
+ * @param body_offset
+ * @param body_len
+ * @param reply receives up to reply_size bytes of the reply payload, the rest is dropped
+ * @param reply_size
+ * @return int 1 on success, 0 if the server refused the request, -1 if the connection broke.
+ */
+static int upload_request(int sock, uint8_t opcode, const char *remote_path, const uint8_t *args, size_t args_len,
+                          int fd, uint64_t body_offset, uint64_t body_len, uint8_t *reply, size_t reply_size) {
+    uint8_t request[FRAME_HEADER_SIZE + 2 + FRAME_MAX_PATH + 16];
+    size_t path_len = frame_encode_path(request + FRAME_HEADER_SIZE, remote_path);
+    if (path_len == 0) {
+        printf("Remote path too long: %s\n", remote_path);
+        return 0;
+    }
+    memcpy(request + FRAME_HEADER_SIZE + path_len, args, args_len);
+    bool checksum = opcode == OP_UPLOAD_CHUNK;
+    frame_encode_header(request, checksum ? opcode | OP_FLAG_CHECKSUM : opcode, 1,
+                        path_len + args_len + body_len + (checksum ? CHECKSUM_TRAILER_SIZE : 0));
+    if (!send_all(sock, request, FRAME_HEADER_SIZE + path_len + args_len)) {
+        return -1;
+    }
+
+    uint32_t crc = 0;
+    if (body_len > 0) {
+        char *buf = malloc(MULTIPART_IO_SIZE);
+        if (buf == NULL) {
+            return -1;
+        }
+        while (body_len > 0) {
+            size_t chunk = body_len < MULTIPART_IO_SIZE ? body_len : MULTIPART_IO_SIZE;
+            ssize_t n = pread(fd, buf, chunk, body_offset);
+            // The frame promised body_len bytes, a file that shrank cannot keep that promise
+            if (n <= 0 || !send_all(sock, buf, n)) {
+                free(buf);
+                return -1;
+            }
+            crc = crc32c_update(crc, buf, n);
+            body_offset += n;
+            body_len -= n;
+        }
+        free(buf);
+    }
+    if (checksum) {
+        uint8_t trailer[CHECKSUM_TRAILER_SIZE];
+        frame_put_u32(trailer, crc);
+        if (!send_all(sock, trailer, sizeof(trailer))) {
+            return -1;
+        }
+    }
+
+    ReplyReader reader = { .sock = sock, .start = 0, .end = 0 };
+    uint8_t raw_header[FRAME_HEADER_SIZE];
+    FrameHeader header;
+    if (!read_exact(&reader, raw_header, sizeof(raw_header)) ||
+        frame_decode_header(raw_header, sizeof(raw_header), &header) != FRAME_OK) {
+        return -1;
+    }
+
+    char scratch[BUFFER_SIZE];
+    uint64_t remaining = header.length;
+    if (header.opcode == OP_ERROR) {
+        size_t kept = remaining < sizeof(scratch) - 1 ? remaining : sizeof(scratch) - 1;
+        if (!read_exact(&reader, scratch, kept)) {
+            return -1;
+        }
+        scratch[kept] = '\0';
+        printf("%s\n", scratch);
+        remaining -= kept;
+    } else if (header.opcode == OP_OK) {
+        size_t kept = remaining < reply_size ? remaining : reply_size;
+        if (kept > 0 && !read_exact(&reader, reply, kept)) {
+            return -1;
+        }
+        remaining -= kept;
+    } else {
+        return -1;
+    }
+
+    // One request at a time, so nothing else can follow in the stream
+    while (remaining > 0) {
+        size_t chunk = remaining < sizeof(scratch) ? remaining : sizeof(scratch);
+        if (!read_exact(&reader, scratch, chunk)) {
+            return -1;
+        }
+        remaining -= chunk;
+    }
+    return header.opcode == OP_OK ? 1 : 0;
+}
+
+/**
+ * @brief Chunk sender thread, takes missing chunks until there are none left.
+ *
+ * @param arg
+ * @return void*
+ */
+static void *chunk_thread(void *arg) {
+    MultipartUpload *upload = arg;
+    int sock = -1;
+
+    while (1) {
+        pthread_mutex_lock(&upload->mutex);
+        if (upload->failed || upload->next == upload->num_missing) {
+            pthread_mutex_unlock(&upload->mutex);
+            break;
+        }
+        uint32_t index = upload->missing[upload->next++];
+        pthread_mutex_unlock(&upload->mutex);
+
+        uint8_t args[UPLOAD_CHUNK_ARGS_SIZE];
+        frame_put_u64(args, upload->id);
+        frame_put_u32(args + 8, index);
+        uint64_t offset = (uint64_t)index * upload->chunk_size;
+        uint64_t length = upload->size - offset < upload->chunk_size ? upload->size - offset : upload->chunk_size;
+
+        int result = -1;
+        for (int attempt = 0; result < 0 && attempt < MULTIPART_RETRIES; attempt++) {
+            if (sock < 0 && (sock = connect_to_server()) < 0) {
+                sleep(1);
+                continue;
+            }
+            result = upload_request(sock, OP_UPLOAD_CHUNK, upload->remote_path, args, sizeof(args),
+                                    upload->fd, offset, length, NULL, 0);
+            if (result < 0) {
+                // Only the chunk in flight is resent on a new connection
+                close(sock);
+                sock = -1;
+            }
+        }
+        if (result != 1) {
+            pthread_mutex_lock(&upload->mutex);
+            upload->failed = true;
+            pthread_mutex_unlock(&upload->mutex);
+        }
+    }
+
+    if (sock >= 0) {
+        close(sock);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Reads the upload a previous MPUT of the same file left behind.
+ *
+ * @param sidecar_path
+ * @param remote_path
+ * @param st the local file, which must be unchanged since
+ * @param id
+ * @return true if the sidecar describes this upload.
+ */
+static bool read_sidecar(const char *sidecar_path, const char *remote_path, const struct stat *st, uint64_t *id) {
+    FILE *sidecar = fopen(sidecar_path, "r");
+    if (sidecar == NULL) {
+        return false;
+    }
+    uint64_t size;
+    int64_t mtime;
+    char remote[2048];
+    bool match = fscanf(sidecar, "%" SCNx64 " %" SCNu64 " %" SCNd64 " %2047[^\n]", id, &size, &mtime, remote) == 4 &&
+                 size == (uint64_t)st->st_size && mtime == (int64_t)st->st_mtime && strcmp(remote, remote_path) == 0;
+    fclose(sidecar);
+    return match;
+}
+
+/**
+ * @brief Uploads a file in chunks over parallel connections, resuming an earlier attempt.
+ *
+ * The upload id is kept in <local_path>.upload until the upload is committed,
+ * so running the same MPUT again only sends the chunks the server is missing.
+ *
+ * @param local_path
+ * @param remote_path
+ * @param connections
+ * @return int 0 on success, -1 on failure.
+ */
+int multipart_put(const char *local_path, const char *remote_path, int connections) {
+    MultipartUpload upload = { .remote_path = remote_path, .chunk_size = MULTIPART_CHUNK_SIZE };
+    struct stat st;
+    upload.fd = open(local_path, O_RDONLY);
+    if (upload.fd < 0 || fstat(upload.fd, &st) < 0) {
+        printf("Error reading file %s\n", local_path);
+        if (upload.fd >= 0) {
+            close(upload.fd);
+        }
+        return -1;
+    }
+    upload.size = st.st_size;
+    uint32_t num_chunks = upload.size == 0 ? 1 : (uint32_t)((upload.size + upload.chunk_size - 1) / upload.chunk_size);
+
+    char sidecar_path[2100];
+    snprintf(sidecar_path, sizeof(sidecar_path), "%s.upload", local_path);
+
+    int sock = connect_to_server();
+    uint8_t *status = malloc(12 + (size_t)num_chunks);
+    upload.missing = malloc(sizeof(uint32_t) * num_chunks);
+    if (sock < 0 || status == NULL || upload.missing == NULL) {
+        free(status);
+        free(upload.missing);
+        close(upload.fd);
+        if (sock >= 0) {
+            close(sock);
+        }
+        return -1;
+    }
+
+    // Ask the server what it already has of an earlier attempt
+    bool resumed = false;
+    uint8_t args[UPLOAD_BEGIN_ARGS_SIZE];
+    if (read_sidecar(sidecar_path, remote_path, &st, &upload.id)) {
+        frame_put_u64(args, upload.id);
+        resumed = upload_request(sock, OP_UPLOAD_STATUS, remote_path, args, UPLOAD_ID_ARGS_SIZE, -1, 0, 0,
+                                 status, 12 + (size_t)num_chunks) == 1 &&
+                  frame_get_u64(status) == upload.size && frame_get_u32(status + 8) == upload.chunk_size;
+    }
+    if (resumed) {
+        for (uint32_t i = 0; i < num_chunks; i++) {
+            if (!status[12 + i]) {
+                upload.missing[upload.num_missing++] = i;
+            }
+        }
+        printf("Resuming upload of %s, %u of %u chunks left\n", local_path, upload.num_missing, num_chunks);
+    } else {
+        frame_put_u64(args, upload.size);
+        frame_put_u32(args + 8, upload.chunk_size);
+        uint8_t reply[8];
+        if (upload_request(sock, OP_UPLOAD_BEGIN, remote_path, args, sizeof(args), -1, 0, 0, reply, sizeof(reply)) != 1) {
+            free(status);
+            free(upload.missing);
+            close(upload.fd);
+            close(sock);
+            return -1;
+        }
+        upload.id = frame_get_u64(reply);
+        FILE *sidecar = fopen(sidecar_path, "w");
+        if (sidecar != NULL) {
+            fprintf(sidecar, "%016" PRIx64 " %" PRIu64 " %" PRId64 " %s\n", upload.id, upload.size, (int64_t)st.st_mtime, remote_path);
+            fclose(sidecar);
+        }
+        for (uint32_t i = 0; i < num_chunks; i++) {
+            upload.missing[upload.num_missing++] = i;
+        }
+    }
+    free(status);
+
+    if (connections > (int)upload.num_missing) {
+        connections = upload.num_missing > 0 ? (int)upload.num_missing : 1;
+    }
+    pthread_mutex_init(&upload.mutex, NULL);
+    pthread_t threads[connections];
+    int started = 0;
+    for (int i = 0; i < connections; i++) {
+        if (pthread_create(&threads[i], NULL, chunk_thread, &upload) != 0) {
+            perror("pthread_create");
+            break;
+        }
+        started++;
+    }
+    if (started == 0) {
+        chunk_thread(&upload);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&upload.mutex);
+    free(upload.missing);
+    close(upload.fd);
+
+    int result = -1;
+    if (upload.failed) {
+        printf("Upload incomplete, run MPUT again to send the remaining chunks\n");
+    } else {
+        frame_put_u64(args, upload.id);
+        int committed = upload_request(sock, OP_UPLOAD_COMMIT, remote_path, args, UPLOAD_ID_ARGS_SIZE, -1, 0, 0, NULL, 0);
+        if (committed < 0) {
+            // The control connection sat idle during the upload, try once more on a fresh one
+            close(sock);
+            sock = connect_to_server();
+            committed = sock < 0 ? -1 : upload_request(sock, OP_UPLOAD_COMMIT, remote_path, args, UPLOAD_ID_ARGS_SIZE, -1, 0, 0, NULL, 0);
+        }
+        if (committed == 1) {
+            unlink(sidecar_path);
+            printf("File sent successfully: %s\n", local_path);
+            result = 0;
+        }
+    }
+
+    if (sock >= 0) {
+        close(sock);
+    }
+    return result;
+}
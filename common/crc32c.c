@@ -0,0 +1,251 @@
+#include <pthread.h>
+#include <string.h>
+#include "crc32c.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_X86 1
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC32C_ARM 1
+#endif
+
+#define CRC32C_POLY 0x82F63B78  // reflected Castagnoli polynomial
+#define CRC32C_LONG 8192        // lane length of the interleaved loop for large buffers
+#define CRC32C_SHORT 256        // and for what is left of them
+
+static uint32_t byte_table[8][256];     // slice-by-8, for CPUs without CRC instructions
+static uint32_t zeros_power[64][32];    // [k]: what 2^k zero bytes do to each bit of a CRC
+static uint32_t long_shift[4][256];     // appends CRC32C_LONG zero bytes, a byte of the CRC at a time
+static uint32_t short_shift[4][256];
+static int hardware = 0;
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Apply a linear operator on CRCs, given as the images of its 32 bits.
+ *
+ * @param op
+ * @param crc
+ * @return uint32_t
+ */
+static uint32_t apply(const uint32_t op[32], uint32_t crc) {
+    uint32_t out = 0;
+    for (int bit = 0; crc != 0; bit++, crc >>= 1) {
+        if (crc & 1) {
+            out ^= op[bit];
+        }
+    }
+    return out;
+}
+
+/**
+ * @brief What appending len zero bytes does to a CRC register.
+ *
+ * @param crc
+ * @param len
+ * @return uint32_t
+ */
+static uint32_t zeros(uint32_t crc, uint64_t len) {
+    for (int k = 0; len != 0; k++, len >>= 1) {
+        if (len & 1) {
+            crc = apply(zeros_power[k], crc);
+        }
+    }
+    return crc;
+}
+
+static uint32_t shift(const uint32_t table[4][256], uint32_t crc) {
+    return table[0][crc & 0xff] ^ table[1][(crc >> 8) & 0xff] ^ table[2][(crc >> 16) & 0xff] ^ table[3][crc >> 24];
+}
+
+static void make_shift_table(uint32_t table[4][256], uint64_t len) {
+    for (int k = 0; k < 4; k++) {
+        for (uint32_t v = 0; v < 256; v++) {
+            table[k][v] = zeros(v << (8 * k), len);
+        }
+    }
+}
+
+static void make_tables(void) {
+    for (uint32_t v = 0; v < 256; v++) {
+        uint32_t crc = v;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        byte_table[0][v] = crc;
+    }
+    for (uint32_t v = 0; v < 256; v++) {
+        for (int k = 1; k < 8; k++) {
+            byte_table[k][v] = byte_table[0][byte_table[k - 1][v] & 0xff] ^ (byte_table[k - 1][v] >> 8);
+        }
+    }
+
+    // One zero byte, then each power of two as the square of the one before
+    for (int bit = 0; bit < 32; bit++) {
+        uint32_t crc = 1u << bit;
+        zeros_power[0][bit] = byte_table[0][crc & 0xff] ^ (crc >> 8);
+    }
+    for (int k = 1; k < 64; k++) {
+        for (int bit = 0; bit < 32; bit++) {
+            zeros_power[k][bit] = apply(zeros_power[k - 1], zeros_power[k - 1][bit]);
+        }
+    }
+    make_shift_table(long_shift, CRC32C_LONG);
+    make_shift_table(short_shift, CRC32C_SHORT);
+
+#if defined(CRC32C_X86)
+    hardware = __builtin_cpu_supports("sse4.2");
+#elif defined(CRC32C_ARM)
+    hardware = 1;
+#endif
+}
+
+/**
+ * @brief Table driven CRC32C, eight bytes per step.
+ *
+ * @param crc the register, inverted
+ * @param p
+ * @param len
+ * @return uint32_t
+ */
+static uint32_t crc32c_table(uint32_t crc, const uint8_t *p, size_t len) {
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = byte_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        word ^= crc;
+        crc = byte_table[7][word & 0xff] ^ byte_table[6][(word >> 8) & 0xff] ^
+              byte_table[5][(word >> 16) & 0xff] ^ byte_table[4][(word >> 24) & 0xff] ^
+              byte_table[3][(word >> 32) & 0xff] ^ byte_table[2][(word >> 40) & 0xff] ^
+              byte_table[1][(word >> 48) & 0xff] ^ byte_table[0][word >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc = byte_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    return crc;
+}
+
+#if defined(CRC32C_X86) || defined(CRC32C_ARM)
+#if defined(CRC32C_X86) && defined(__x86_64__)
+#define CRC32C_ATTR __attribute__((target("sse4.2")))
+#define CRC_WORD(crc, word) _mm_crc32_u64(crc, word)
+#define CRC_BYTE(crc, byte) _mm_crc32_u8((uint32_t)(crc), byte)
+typedef uint64_t crc_word;
+#elif defined(CRC32C_X86)
+#define CRC32C_ATTR __attribute__((target("sse4.2")))
+#define CRC_WORD(crc, word) _mm_crc32_u32(crc, word)
+#define CRC_BYTE(crc, byte) _mm_crc32_u8(crc, byte)
+typedef uint32_t crc_word;
+#else
+#define CRC32C_ATTR
+#define CRC_WORD(crc, word) __crc32cd((uint32_t)(crc), word)
+#define CRC_BYTE(crc, byte) __crc32cb((uint32_t)(crc), byte)
+typedef uint64_t crc_word;
+#endif
+
+/**
+ * @brief Run the CRC instruction over three lanes of lane bytes at once, then join them.
+ *
+ * The instruction takes several cycles but starts a new one every cycle, so
+ * three independent lanes keep it busy where one would wait on itself.
+ *
+ * @param crc the register, inverted
+ * @param p advanced past what was processed
+ * @param len reduced by what was processed
+ * @param lane
+ * @param table appends lane zero bytes
+ * @return uint32_t
+ */
+CRC32C_ATTR
+static crc_word crc32c_lanes(crc_word crc, const uint8_t **p, size_t *len, size_t lane, const uint32_t table[4][256]) {
+    const uint8_t *next = *p;
+    while (*len >= 3 * lane) {
+        crc_word crc1 = 0, crc2 = 0;
+        const uint8_t *end = next + lane;
+        do {
+            crc_word a, b, c;
+            memcpy(&a, next, sizeof(a));
+            memcpy(&b, next + lane, sizeof(b));
+            memcpy(&c, next + 2 * lane, sizeof(c));
+            crc = CRC_WORD(crc, a);
+            crc1 = CRC_WORD(crc1, b);
+            crc2 = CRC_WORD(crc2, c);
+            next += sizeof(crc_word);
+        } while (next < end);
+        crc = shift(table, (uint32_t)crc) ^ (uint32_t)crc1;
+        crc = shift(table, (uint32_t)crc) ^ (uint32_t)crc2;
+        next += 2 * lane;
+        *len -= 3 * lane;
+    }
+    *p = next;
+    return crc;
+}
+
+/**
+ * @brief CRC32C with the CPU's CRC instructions.
+ *
+ * @param crc the register, inverted
+ * @param p
+ * @param len
+ * @return uint32_t
+ */
+CRC32C_ATTR
+static uint32_t crc32c_hardware(uint32_t crc, const uint8_t *p, size_t len) {
+    crc_word reg = crc;
+    while (len > 0 && ((uintptr_t)p & (sizeof(crc_word) - 1)) != 0) {
+        reg = CRC_BYTE(reg, *p++);
+        len--;
+    }
+    reg = crc32c_lanes(reg, &p, &len, CRC32C_LONG, long_shift);
+    reg = crc32c_lanes(reg, &p, &len, CRC32C_SHORT, short_shift);
+    while (len >= sizeof(crc_word)) {
+        crc_word word;
+        memcpy(&word, p, sizeof(word));
+        reg = CRC_WORD(reg, word);
+        p += sizeof(word);
+        len -= sizeof(word);
+    }
+    while (len > 0) {
+        reg = CRC_BYTE(reg, *p++);
+        len--;
+    }
+    return (uint32_t)reg;
+}
+#endif
+
+/**
+ * @brief Extends a CRC32C with more data, starting from 0 for the first part.
+ *
+ * @param crc
+ * @param data
+ * @param len
+ * @return uint32_t
+ */
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t len) {
+    pthread_once(&tables_once, make_tables);
+#if defined(CRC32C_X86) || defined(CRC32C_ARM)
+    if (hardware) {
+        return ~crc32c_hardware(~crc, data, len);
+    }
+#endif
+    return ~crc32c_table(~crc, data, len);
+}
+
+/**
+ * @brief The CRC32C of two parts back to back, from the CRC32C of each.
+ *
+ * @param crc1
+ * @param crc2
+ * @param len2
+ * @return uint32_t
+ */
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2) {
+    pthread_once(&tables_once, make_tables);
+    return zeros(crc1, len2) ^ crc2;
+}
@@ -0,0 +1,33 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC32C (Castagnoli), the checksum carried in the trailers of checksummed
+ * transfers. Computed with the SSE4.2 or ARMv8 CRC instructions where the CPU
+ * has them, with tables otherwise.
+ */
+
+/**
+ * @brief Extends a CRC32C with more data, starting from 0 for the first part.
+ *
+ * @param crc of everything before data
+ * @param data
+ * @param len
+ * @return uint32_t the CRC32C of everything up to the end of data
+ */
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t len);
+
+/**
+ * @brief The CRC32C of two parts back to back, from the CRC32C of each.
+ *
+ * @param crc1 of the first part
+ * @param crc2 of the second part
+ * @param len2 length of the second part
+ * @return uint32_t
+ */
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2);
+
+#endif // CRC32C_H
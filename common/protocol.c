@@ -0,0 +1,123 @@
+#include <string.h>
+#include "protocol.h"
+
+/**
+ * @brief Tells whether requests with this opcode carry bulk data after their arguments.
+ * 
+ * @param opcode 
+ * @return int 
+ */
+int frame_has_body(uint8_t opcode) {
+    return opcode == OP_PUT || opcode == OP_UPLOAD_CHUNK || opcode == OP_STAT;
+}
+
+/**
+ * @brief Tells whether requests with this opcode may have OP_FLAG_CHECKSUM set.
+ * 
+ * @param opcode 
+ * @return int 
+ */
+int frame_has_checksum(uint8_t opcode) {
+    return opcode == OP_GET || opcode == OP_GET_RANGE || opcode == OP_PUT || opcode == OP_UPLOAD_CHUNK;
+}
+
+/**
+ * @brief Size of the fixed arguments between the path and the body of a bulk request.
+ * 
+ * @param opcode 
+ * @return size_t 
+ */
+size_t frame_args_size(uint8_t opcode) {
+    return opcode == OP_UPLOAD_CHUNK ? UPLOAD_CHUNK_ARGS_SIZE : 0;
+}
+
+/**
+ * @brief Writes a frame header into out, which must hold FRAME_HEADER_SIZE bytes.
+ * 
+ * @param out 
+ * @param opcode 
+ * @param request_id 
+ * @param length 
+ */
+void frame_encode_header(uint8_t *out, uint8_t opcode, uint32_t request_id, uint64_t length) {
+    frame_put_u16(out, FRAME_MAGIC);
+    out[2] = FRAME_VERSION;
+    out[3] = opcode;
+    frame_put_u32(out + 4, request_id);
+    frame_put_u64(out + 8, length);
+}
+
+/**
+ * @brief Parses a frame header from the start of buf without allocating.
+ * 
+ * @param buf 
+ * @param len 
+ * @param header 
+ * @return FrameStatus 
+ */
+FrameStatus frame_decode_header(const uint8_t *buf, size_t len, FrameHeader *header) {
+    // Reject garbage as soon as the magic is visible instead of waiting for a full header
+    if (len >= 2 && frame_get_u16(buf) != FRAME_MAGIC) {
+        return FRAME_INVALID;
+    }
+    if (len < FRAME_HEADER_SIZE) {
+        return FRAME_INCOMPLETE;
+    }
+
+    header->magic = FRAME_MAGIC;
+    header->version = buf[2];
+    header->opcode = buf[3];
+    header->request_id = frame_get_u32(buf + 4);
+    header->length = frame_get_u64(buf + 8);
+
+    if (header->version != FRAME_VERSION) {
+        return FRAME_INVALID;
+    }
+    return FRAME_OK;
+}
+
+/**
+ * @brief Writes the length prefixed path that starts a request payload.
+ * 
+ * @param out 
+ * @param path 
+ * @return size_t 
+ */
+size_t frame_encode_path(uint8_t *out, const char *path) {
+    size_t len = strlen(path);
+    if (len > FRAME_MAX_PATH) {
+        return 0;
+    }
+    frame_put_u16(out, (uint16_t)len);
+    memcpy(out + 2, path, len);
+    return 2 + len;
+}
+
+/**
+ * @brief Copies the length prefixed path at the start of a request payload into path.
+ * 
+ * @param payload 
+ * @param len 
+ * @param path 
+ * @param path_size 
+ * @return FrameStatus 
+ */
+FrameStatus frame_decode_path(const uint8_t *payload, size_t len, char *path, size_t path_size) {
+    if (len < 2) {
+        return FRAME_INCOMPLETE;
+    }
+    size_t path_len = frame_get_u16(payload);
+    if (path_len > FRAME_MAX_PATH || path_len >= path_size) {
+        return FRAME_INVALID;
+    }
+    if (len < 2 + path_len) {
+        return FRAME_INCOMPLETE;
+    }
+    // An embedded NUL would silently truncate the path
+    if (memchr(payload + 2, '\0', path_len) != NULL) {
+        return FRAME_INVALID;
+    }
+    memcpy(path, payload + 2, path_len);
+    path[path_len] = '\0';
+    return FRAME_OK;
+}
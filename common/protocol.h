@@ -0,0 +1,183 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Every request and reply is a frame: a fixed 16 byte header followed by
+ * `length` payload bytes. All integers are big-endian on the wire.
+ *
+ *   0      2        3       4            8                16
+ *   | magic | version | opcode | request_id | length        | payload ...
+ *
+ * A request payload starts with the remote path as a u16 length and the path
+ * bytes (no NUL), followed by any opcode specific fields and bulk data. Replies
+ * carry the request_id they answer and are sent in request order.
+ *
+ * A GET, GET_RANGE, PUT or UPLOAD_CHUNK whose opcode has OP_FLAG_CHECKSUM set
+ * is checksummed end to end: the body of the request, or the OP_OK reply, ends
+ * with a u32 CRC32C trailer of the file data it carries, counted in `length`.
+ * The receiver checks it against the data as it arrived.
+ */
+
+#define FRAME_MAGIC 0x4653  // "FS"
+#define FRAME_VERSION 1
+#define FRAME_HEADER_SIZE 16
+#define FRAME_MAX_PATH 2047
+#define RANGE_ARGS_SIZE 16
+#define RANGE_TO_END UINT64_MAX // GET_RANGE length reaching to the end of the file
+#define UPLOAD_BEGIN_ARGS_SIZE 12
+#define UPLOAD_CHUNK_ARGS_SIZE 12
+#define UPLOAD_ID_ARGS_SIZE 8
+#define UPLOAD_MIN_CHUNK_SIZE (64 * 1024)
+#define UPLOAD_MAX_CHUNK_SIZE (64 * 1024 * 1024)
+#define UPLOAD_MAX_CHUNKS (1 << 20)
+#define STAT_MAX_PATHS 65536
+#define STAT_MAX_BODY (16 * 1024 * 1024)
+#define STAT_RECORD_SIZE 34     // a found path's record before its owner and group names
+#define LS_ARGS_SIZE 8          // before the cursor
+#define LS_RECURSIVE 0x1
+#define LS_RECORD_SIZE 28       // an entry's record before its name
+#define LS_MAX_DATA (64 * 1024) // largest OP_LS_DATA payload
+#define CHECKSUM_TRAILER_SIZE 4
+
+typedef enum {
+    OP_GET = 0x01,
+    OP_INFO = 0x02,
+    OP_MD = 0x03,
+    OP_PUT = 0x04,
+    OP_RM = 0x05,
+    OP_GET_RANGE = 0x06,    // args: u64 offset, u64 length; reply: u64 file size, then the bytes
+    OP_UPLOAD_BEGIN = 0x07, // args: u64 file size, u32 chunk size; reply: u64 upload id
+    OP_UPLOAD_CHUNK = 0x08, // args: u64 upload id, u32 chunk index; body: the chunk
+    OP_UPLOAD_STATUS = 0x09, // args: u64 upload id; reply: u64 file size, u32 chunk size, one byte per chunk,
+                             // non-zero once the chunk arrived
+    OP_UPLOAD_COMMIT = 0x0A, // args: u64 upload id; moves the assembled file into place
+    OP_STAT = 0x0B,         // body: u16 length and bytes of each path below the request path;
+                            // reply: u32 count, then per path u16 errno, and when it is 0
+                            // u32 mode, u64 size, u64 mtime sec, u32 mtime nsec, u32 uid, u32 gid,
+                            // u8 length and bytes of the owner name, the same for the group name
+    OP_LS = 0x0C,           // args: u32 flags, u32 max entries (0 for the default), the cursor of the previous
+                            // reply or nothing; reply: OP_LS_DATA frames, then OP_OK with the cursor to
+                            // continue from, empty once the listing is complete
+    OP_COPY = 0x0D,         // args: u16 length and bytes of the destination path; copies in place on every device
+    OP_MOVE = 0x0E,         // args: u16 length and bytes of the destination path; renames on every device
+    OP_STATS = 0x0F,        // reply: the server's metrics in the Prometheus text format
+
+    OP_FLAG_CHECKSUM = 0x40, // or'ed into a request opcode for a CRC32C trailer
+
+    OP_OK = 0x80,           // success, payload is the result
+    OP_ERROR = 0x81,        // failure, payload is the error message
+    OP_LS_DATA = 0x82       // part of an LS reply, per entry u64 size, u64 mtime sec, u32 mtime nsec,
+                            // u32 mode, u16 name length, u16 reserved, then the name below the listed directory
+} FrameOpcode;
+
+typedef struct {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t opcode;
+    uint32_t request_id;
+    uint64_t length;
+} FrameHeader;
+
+typedef enum {
+    FRAME_OK = 0,
+    FRAME_INCOMPLETE = 1,
+    FRAME_INVALID = -1
+} FrameStatus;
+
+static inline void frame_put_u16(uint8_t *out, uint16_t v) {
+    out[0] = (uint8_t)(v >> 8);
+    out[1] = (uint8_t)v;
+}
+
+static inline void frame_put_u32(uint8_t *out, uint32_t v) {
+    out[0] = (uint8_t)(v >> 24);
+    out[1] = (uint8_t)(v >> 16);
+    out[2] = (uint8_t)(v >> 8);
+    out[3] = (uint8_t)v;
+}
+
+static inline void frame_put_u64(uint8_t *out, uint64_t v) {
+    frame_put_u32(out, (uint32_t)(v >> 32));
+    frame_put_u32(out + 4, (uint32_t)v);
+}
+
+static inline uint16_t frame_get_u16(const uint8_t *in) {
+    return (uint16_t)((in[0] << 8) | in[1]);
+}
+
+static inline uint32_t frame_get_u32(const uint8_t *in) {
+    return ((uint32_t)in[0] << 24) | ((uint32_t)in[1] << 16) | ((uint32_t)in[2] << 8) | in[3];
+}
+
+static inline uint64_t frame_get_u64(const uint8_t *in) {
+    return ((uint64_t)frame_get_u32(in) << 32) | frame_get_u32(in + 4);
+}
+
+/**
+ * @brief Tells whether requests with this opcode carry bulk data after their arguments.
+ * 
+ * @param opcode 
+ * @return int 1 if the opcode streams a body, 0 otherwise
+ */
+int frame_has_body(uint8_t opcode);
+
+/**
+ * @brief Tells whether requests with this opcode may have OP_FLAG_CHECKSUM set.
+ * 
+ * @param opcode without the flag
+ * @return int 1 if the body or reply can carry a CRC32C trailer, 0 otherwise
+ */
+int frame_has_checksum(uint8_t opcode);
+
+/**
+ * @brief Size of the fixed arguments between the path and the body of a bulk request.
+ * 
+ * @param opcode 
+ * @return size_t 
+ */
+size_t frame_args_size(uint8_t opcode);
+
+/**
+ * @brief Writes a frame header into out, which must hold FRAME_HEADER_SIZE bytes.
+ * 
+ * @param out 
+ * @param opcode 
+ * @param request_id 
+ * @param length payload bytes that follow the header
+ */
+void frame_encode_header(uint8_t *out, uint8_t opcode, uint32_t request_id, uint64_t length);
+
+/**
+ * @brief Parses a frame header from the start of buf without allocating.
+ * 
+ * @param buf 
+ * @param len bytes available in buf
+ * @param header 
+ * @return FrameStatus FRAME_INCOMPLETE until a whole header is available.
+ */
+FrameStatus frame_decode_header(const uint8_t *buf, size_t len, FrameHeader *header);
+
+/**
+ * @brief Writes the length prefixed path that starts a request payload.
+ * 
+ * @param out must hold 2 + strlen(path) bytes
+ * @param path 
+ * @return size_t bytes written, 0 if the path is too long
+ */
+size_t frame_encode_path(uint8_t *out, const char *path);
+
+/**
+ * @brief Copies the length prefixed path at the start of a request payload into path.
+ * 
+ * @param payload 
+ * @param len bytes available in payload
+ * @param path 
+ * @param path_size 
+ * @return FrameStatus FRAME_INCOMPLETE if len does not cover the whole path.
+ */
+FrameStatus frame_decode_path(const uint8_t *payload, size_t len, char *path, size_t path_size);
+
+#endif // PROTOCOL_H
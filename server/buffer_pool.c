@@ -0,0 +1,256 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <sys/mman.h>
+#include "server.h"
+
+#define BUFFER_SLAB_SIZE (2 * 1024 * 1024)      // one huge page, carved into blocks of one size
+#define BUFFER_CLASSES 5                        // BUFFER_BLOCK_MIN doubled up to BUFFER_BLOCK_MAX
+#define THREAD_CACHE_BYTES (2 * 1024 * 1024)    // kept per size class by each thread
+#define THREAD_CACHE_MAX (THREAD_CACHE_BYTES / BUFFER_BLOCK_MIN)
+
+/**
+ * @brief A free block, linked through its own first bytes
+ */
+typedef struct FreeBlock {
+    struct FreeBlock *next;
+} FreeBlock;
+
+/**
+ * @brief Free blocks of one size that no thread holds
+ */
+typedef struct SizeClass {
+    pthread_mutex_t mutex;
+    FreeBlock *free;
+} SizeClass;
+
+/**
+ * @brief Blocks a thread keeps for itself, taken and given back without locking
+ */
+typedef struct ThreadCache {
+    void *blocks[BUFFER_CLASSES][THREAD_CACHE_MAX];
+    int count[BUFFER_CLASSES];
+} ThreadCache;
+
+static char *arena = NULL;
+static size_t arena_size = 0;
+static size_t arena_used = 0;           // carved into slabs so far
+static pthread_mutex_t arena_mutex = PTHREAD_MUTEX_INITIALIZER;
+static SizeClass classes[BUFFER_CLASSES];
+
+static __thread ThreadCache *thread_cache = NULL;
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+static size_t class_size(int c) {
+    return (size_t)BUFFER_BLOCK_MIN << c;
+}
+
+static int cache_limit(int c) {
+    return THREAD_CACHE_BYTES / class_size(c);
+}
+
+/**
+ * @brief The smallest size class holding size bytes
+ *
+ * @param size
+ * @return int -1 if it is larger than BUFFER_BLOCK_MAX
+ */
+static int size_class(size_t size) {
+    for (int c = 0; c < BUFFER_CLASSES; c++) {
+        if (size <= class_size(c)) {
+            return c;
+        }
+    }
+    return -1;
+}
+
+static size_t page_round(size_t size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return (size + page - 1) / page * page;
+}
+
+/**
+ * @brief Give every block of a thread's cache back to the shared lists when the thread exits
+ *
+ * @param arg the cache
+ */
+static void cache_free(void *arg) {
+    ThreadCache *cache = arg;
+    for (int c = 0; c < BUFFER_CLASSES; c++) {
+        pthread_mutex_lock(&classes[c].mutex);
+        while (cache->count[c] > 0) {
+            FreeBlock *block = cache->blocks[c][--cache->count[c]];
+            block->next = classes[c].free;
+            classes[c].free = block;
+        }
+        pthread_mutex_unlock(&classes[c].mutex);
+    }
+    // Destructors that run after this one, such as a ring's, may still release buffers
+    thread_cache = NULL;
+    free(cache);
+}
+
+static void make_cache_key(void) {
+    pthread_key_create(&cache_key, cache_free);
+}
+
+static ThreadCache *get_cache(void) {
+    if (thread_cache == NULL) {
+        pthread_once(&cache_key_once, make_cache_key);
+        thread_cache = calloc(1, sizeof(ThreadCache));
+        if (thread_cache != NULL) {
+            pthread_setspecific(cache_key, thread_cache);
+        }
+    }
+    return thread_cache;
+}
+
+/**
+ * @brief Move half a cache's worth of blocks from the shared list into a thread's cache
+ *
+ * An empty shared list is filled by carving the next slab of the arena.
+ *
+ * @param cache
+ * @param c
+ * @return int blocks moved, 0 once the arena is used up
+ */
+static int cache_refill(ThreadCache *cache, int c) {
+    SizeClass *list = &classes[c];
+    pthread_mutex_lock(&list->mutex);
+    if (list->free == NULL) {
+        char *slab = NULL;
+        pthread_mutex_lock(&arena_mutex);
+        if (arena_size - arena_used >= BUFFER_SLAB_SIZE) {
+            slab = arena + arena_used;
+            arena_used += BUFFER_SLAB_SIZE;
+        }
+        pthread_mutex_unlock(&arena_mutex);
+        for (size_t offset = 0; slab != NULL && offset < BUFFER_SLAB_SIZE; offset += class_size(c)) {
+            FreeBlock *block = (FreeBlock *)(slab + offset);
+            block->next = list->free;
+            list->free = block;
+        }
+    }
+
+    int moved = 0;
+    while (list->free != NULL && moved < cache_limit(c) / 2 + 1) {
+        cache->blocks[c][cache->count[c]++] = list->free;
+        list->free = list->free->next;
+        moved++;
+    }
+    pthread_mutex_unlock(&list->mutex);
+    return moved;
+}
+
+/**
+ * @brief Map a block outside the arena, for sizes past BUFFER_BLOCK_MAX or a used up arena
+ *
+ * @param size
+ * @return void* NULL on failure
+ */
+static void *map_block(size_t size) {
+    void *block = mmap(NULL, page_round(size), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return block == MAP_FAILED ? NULL : block;
+}
+
+/**
+ * @brief Reserve the buffer arena
+ *
+ * The arena is address space of buffer_pool_mb, filled with pages as slabs
+ * are carved from it. With buffer_hugepages it is made of reserved huge
+ * pages when the system has enough of them and asks for transparent ones
+ * otherwise. Pages are touched first by the thread that first takes a block
+ * from them, so they start out on that thread's NUMA node, and the thread
+ * caches keep handing them back to the same thread.
+ *
+ * @return int 0 on success, -1 if every buffer will be mapped on its own
+ */
+int buffer_pool_start(void) {
+    for (int c = 0; c < BUFFER_CLASSES; c++) {
+        pthread_mutex_init(&classes[c].mutex, NULL);
+        classes[c].free = NULL;
+    }
+    size_t size = (size_t)server_config.buffer_pool_mb * 1024 * 1024 / BUFFER_SLAB_SIZE * BUFFER_SLAB_SIZE;
+    if (size == 0) {
+        return 0;
+    }
+
+    void *region = MAP_FAILED;
+    if (server_config.buffer_hugepages) {
+        region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if (region == MAP_FAILED) {
+        // Over-reserve by a slab so the arena can start on a huge page boundary
+        char *reserved = mmap(NULL, size + BUFFER_SLAB_SIZE, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (reserved == MAP_FAILED) {
+            perror("mmap buffer arena");
+            return -1;
+        }
+        char *aligned = (char *)(((uintptr_t)reserved + BUFFER_SLAB_SIZE - 1) & ~(uintptr_t)(BUFFER_SLAB_SIZE - 1));
+        if (aligned > reserved) {
+            munmap(reserved, aligned - reserved);
+        }
+        munmap(aligned + size, reserved + BUFFER_SLAB_SIZE - aligned);
+        if (server_config.buffer_hugepages) {
+            madvise(aligned, size, MADV_HUGEPAGE);
+        }
+        region = aligned;
+    }
+
+    arena = region;
+    arena_size = size;
+    return 0;
+}
+
+/**
+ * @brief Take a page aligned I/O buffer of at least size bytes
+ *
+ * @param size
+ * @return void* NULL on failure
+ */
+void *buffer_acquire(size_t size) {
+    int c = size_class(size);
+    ThreadCache *cache = c >= 0 && arena != NULL ? get_cache() : NULL;
+    if (cache == NULL || (cache->count[c] == 0 && cache_refill(cache, c) == 0)) {
+        return map_block(size);
+    }
+    return cache->blocks[c][--cache->count[c]];
+}
+
+/**
+ * @brief Give back a buffer from buffer_acquire
+ *
+ * @param block may be NULL
+ * @param size as passed to buffer_acquire
+ */
+void buffer_release(void *block, size_t size) {
+    if (block == NULL) {
+        return;
+    }
+    if (arena == NULL || (char *)block < arena || (char *)block >= arena + arena_size) {
+        munmap(block, page_round(size));
+        return;
+    }
+
+    int c = size_class(size);
+    ThreadCache *cache = get_cache();
+    if (cache == NULL) {
+        pthread_mutex_lock(&classes[c].mutex);
+        ((FreeBlock *)block)->next = classes[c].free;
+        classes[c].free = block;
+        pthread_mutex_unlock(&classes[c].mutex);
+        return;
+    }
+    if (cache->count[c] == cache_limit(c)) {
+        // Keep half, so a thread going back and forth does not lock every time
+        pthread_mutex_lock(&classes[c].mutex);
+        while (cache->count[c] > cache_limit(c) / 2) {
+            FreeBlock *spare = cache->blocks[c][--cache->count[c]];
+            spare->next = classes[c].free;
+            classes[c].free = spare;
+        }
+        pthread_mutex_unlock(&classes[c].mutex);
+    }
+    cache->blocks[c][cache->count[c]++] = block;
+}
@@ -0,0 +1,297 @@
+#define _GNU_SOURCE
+#include "server.h"
+
+#define CACHE_BUCKETS 4096
+#define CACHE_PROTECTED_SHARE 80    // percent of the budget reachable by entries read twice
+
+typedef enum {
+    SEGMENT_NONE,           // dropped from the table, freed with its last reference
+    SEGMENT_PROBATION,      // read once since it was loaded
+    SEGMENT_PROTECTED       // read again while on probation
+} CacheSegment;
+
+typedef struct CacheList {
+    CacheEntry *head;       // most recently used
+    CacheEntry *tail;       // next to be evicted
+    size_t bytes;
+} CacheList;
+
+static CacheEntry *buckets[CACHE_BUCKETS];
+static CacheList probation;
+static CacheList protected;
+static size_t budget = 0;
+static size_t max_file = 0;
+static uint64_t generation = 0;    // bumped by every invalidation
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief FNV-1a hash of a normalised path.
+ *
+ * @param key
+ * @return uint64_t
+ */
+static uint64_t hash_key(const char *key) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (const unsigned char *p = (const unsigned char *)key; *p != '\0'; p++) {
+        hash ^= *p;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void list_remove(CacheList *list, CacheEntry *entry) {
+    if (entry->prev != NULL) {
+        entry->prev->next = entry->next;
+    } else {
+        list->head = entry->next;
+    }
+    if (entry->next != NULL) {
+        entry->next->prev = entry->prev;
+    } else {
+        list->tail = entry->prev;
+    }
+    entry->prev = entry->next = NULL;
+    list->bytes -= entry->charge;
+}
+
+static void list_push_head(CacheList *list, CacheEntry *entry) {
+    entry->prev = NULL;
+    entry->next = list->head;
+    if (list->head != NULL) {
+        list->head->prev = entry;
+    } else {
+        list->tail = entry;
+    }
+    list->head = entry;
+    list->bytes += entry->charge;
+}
+
+static void free_entry(CacheEntry *entry) {
+    free(entry->data);
+    free(entry->key);
+    free(entry);
+}
+
+/**
+ * @brief Take an entry out of the table, it is freed once no GET is sending it.
+ *
+ * Called with cache_mutex held.
+ *
+ * @param entry
+ */
+static void drop_entry(CacheEntry *entry) {
+    CacheEntry **link = &buckets[entry->hash % CACHE_BUCKETS];
+    while (*link != entry) {
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+    list_remove(entry->segment == SEGMENT_PROTECTED ? &protected : &probation, entry);
+    entry->segment = SEGMENT_NONE;
+    if (entry->refs == 0) {
+        free_entry(entry);
+    }
+}
+
+/**
+ * @brief Evict from the tail of probation, then protected, until the cache fits its budget.
+ *
+ * Called with cache_mutex held.
+ */
+static void evict(void) {
+    while (probation.bytes + protected.bytes > budget) {
+        CacheEntry *victim = probation.tail != NULL ? probation.tail : protected.tail;
+        drop_entry(victim);
+    }
+}
+
+/**
+ * @brief Size the cache, a budget of 0 turns it off
+ *
+ * @param budget_bytes
+ * @param max_file_bytes files larger than this are always read from the devices
+ */
+void cache_start(size_t budget_bytes, size_t max_file_bytes) {
+    budget = budget_bytes;
+    max_file = max_file_bytes < budget_bytes ? max_file_bytes : budget_bytes;
+}
+
+/**
+ * @brief Whether a file of this size may be kept in memory
+ *
+ * @param size
+ * @return int 1 if it may
+ */
+int cache_admits(uint64_t size) {
+    return budget > 0 && size <= max_file;
+}
+
+/**
+ * @brief Find the cached contents of a logical path
+ *
+ * A hit on probation earns the entry a place in the protected segment, so
+ * files read once do not push out the ones read over and over.
+ *
+ * @param path
+ * @return CacheEntry* a reference to drop with cache_release, or NULL on a miss
+ */
+CacheEntry *cache_lookup(const char *path) {
+    if (budget == 0) {
+        return NULL;
+    }
+    char key[FRAME_MAX_PATH + 1];
+    normalize_path(path, key, sizeof(key));
+    uint64_t hash = hash_key(key);
+
+    pthread_mutex_lock(&cache_mutex);
+    CacheEntry *entry = buckets[hash % CACHE_BUCKETS];
+    while (entry != NULL && (entry->hash != hash || strcmp(entry->key, key) != 0)) {
+        entry = entry->hash_next;
+    }
+    if (entry != NULL) {
+        entry->refs++;
+        list_remove(entry->segment == SEGMENT_PROTECTED ? &protected : &probation, entry);
+        list_push_head(&protected, entry);
+        entry->segment = SEGMENT_PROTECTED;
+        // Protected overflow goes back on probation for one more chance
+        while (protected.bytes > budget / 100 * CACHE_PROTECTED_SHARE && protected.tail != entry) {
+            CacheEntry *demoted = protected.tail;
+            list_remove(&protected, demoted);
+            list_push_head(&probation, demoted);
+            demoted->segment = SEGMENT_PROBATION;
+        }
+    }
+    pthread_mutex_unlock(&cache_mutex);
+    return entry;
+}
+
+/**
+ * @brief Current invalidation generation, taken before a file is read for cache_fill
+ *
+ * @return uint64_t
+ */
+uint64_t cache_generation(void) {
+    if (budget == 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&cache_mutex);
+    uint64_t current = generation;
+    pthread_mutex_unlock(&cache_mutex);
+    return current;
+}
+
+/**
+ * @brief Read a whole file into memory and add it to the cache
+ *
+ * The entry is only added if nothing was invalidated since the generation was
+ * taken, otherwise the caller still gets its contents to send this once.
+ *
+ * @param path
+ * @param fd open file on one replica
+ * @param size its size
+ * @param since generation taken before the file was opened
+ * @return CacheEntry* a reference to drop with cache_release, or NULL if the file could not be read
+ */
+CacheEntry *cache_fill(const char *path, int fd, uint64_t size, uint64_t since) {
+    CacheEntry *entry = calloc(1, sizeof(CacheEntry));
+    char key[FRAME_MAX_PATH + 1];
+    normalize_path(path, key, sizeof(key));
+    if (entry == NULL || (entry->key = strdup(key)) == NULL || (entry->data = malloc(size > 0 ? size : 1)) == NULL) {
+        if (entry != NULL) {
+            free(entry->key);
+            free(entry);
+        }
+        return NULL;
+    }
+    entry->size = size;
+    entry->charge = size + strlen(key) + sizeof(CacheEntry);
+    entry->hash = hash_key(key);
+    entry->refs = 1;
+
+    uint64_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, entry->data + done, size - done, done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            // The file changed size underneath us
+            free_entry(entry);
+            return NULL;
+        }
+        done += n;
+    }
+    // Checksummed GETs of it then cost nothing extra
+    entry->crc = crc32c_update(0, entry->data, size);
+
+    pthread_mutex_lock(&cache_mutex);
+    if (since == generation) {
+        // Another GET may have filled it meanwhile, the newer read wins
+        for (CacheEntry *old = buckets[entry->hash % CACHE_BUCKETS]; old != NULL; old = old->hash_next) {
+            if (old->hash == entry->hash && strcmp(old->key, key) == 0) {
+                drop_entry(old);
+                break;
+            }
+        }
+        entry->hash_next = buckets[entry->hash % CACHE_BUCKETS];
+        buckets[entry->hash % CACHE_BUCKETS] = entry;
+        list_push_head(&probation, entry);
+        entry->segment = SEGMENT_PROBATION;
+        evict();
+    }
+    pthread_mutex_unlock(&cache_mutex);
+    return entry;
+}
+
+/**
+ * @brief Drop a reference taken by cache_lookup or cache_fill
+ *
+ * @param entry
+ */
+void cache_release(CacheEntry *entry) {
+    pthread_mutex_lock(&cache_mutex);
+    if (--entry->refs == 0 && entry->segment == SEGMENT_NONE) {
+        free_entry(entry);
+    }
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+/**
+ * @brief Forget the cached contents and metadata of a logical path
+ *
+ * Handlers call this while still holding the path's write lock, so the next
+ * GET or INFO of the path reads the devices again.
+ *
+ * @param path the root of the storage folder forgets everything
+ * @param subtree also forget everything below the path, for removed or resynced directories
+ */
+void cache_invalidate(const char *path, int subtree) {
+    meta_cache_invalidate(path, subtree);
+    if (budget == 0) {
+        return;
+    }
+    char key[FRAME_MAX_PATH + 1];
+    normalize_path(path, key, sizeof(key));
+    size_t len = strlen(key);
+    uint64_t hash = hash_key(key);
+
+    pthread_mutex_lock(&cache_mutex);
+    generation++;
+    for (int i = subtree ? 0 : CACHE_BUCKETS; i < CACHE_BUCKETS; i++) {
+        CacheEntry *entry = buckets[i];
+        while (entry != NULL) {
+            CacheEntry *next = entry->hash_next;
+            if ((entry->hash == hash && strcmp(entry->key, key) == 0) ||
+                len == 0 || (strncmp(entry->key, key, len) == 0 && entry->key[len] == '/')) {
+                drop_entry(entry);
+            }
+            entry = next;
+        }
+    }
+    for (CacheEntry *entry = subtree ? NULL : buckets[hash % CACHE_BUCKETS]; entry != NULL; entry = entry->hash_next) {
+        if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+            drop_entry(entry);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache_mutex);
+}
@@ -0,0 +1,156 @@
+#include <inttypes.h>
+#include <sys/xattr.h>
+#include "server.h"
+
+#define CHECKSUM_XATTR "user.fs.crc32c"
+#define CHECKSUM_RECORD_SIZE 24 // u32 CRC32C, u64 size, u64 mtime sec, u32 mtime nsec
+
+/**
+ * @brief Build the path of a file's sidecar, kept under CHECKSUM_DIR at the mount point.
+ *
+ * @param device
+ * @param file_path below the storage folder
+ * @param out
+ * @param size
+ */
+static void sidecar_path(const USBDevice *device, const char *file_path, char *out, size_t size) {
+    snprintf(out, size, "%s/%s/%s", device->mount_point, CHECKSUM_DIR, file_path);
+}
+
+/**
+ * @brief Create the directories above a sidecar.
+ *
+ * @param path of the sidecar
+ */
+static void make_parents(const char *path) {
+    char dir[4096];
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char *slash = strchr(dir + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(dir, 0755);
+        *slash = '/';
+    }
+}
+
+/**
+ * @brief Look up the digest stored for a device file
+ *
+ * The digest is kept in an extended attribute of the file, or in a sidecar
+ * on filesystems without them such as FAT. It carries the size and
+ * modification time the file had, so a file changed behind the server's back
+ * has no digest rather than a wrong one.
+ *
+ * @param device
+ * @param file_path below the storage folder
+ * @param fd the file on that device
+ * @param crc receives the CRC32C of the whole file
+ * @return int 0 if a digest matching the file is stored, -1 otherwise
+ */
+int checksum_load(const USBDevice *device, const char *file_path, int fd, uint32_t *crc) {
+    uint8_t record[CHECKSUM_RECORD_SIZE];
+    ssize_t n = fgetxattr(fd, CHECKSUM_XATTR, record, sizeof(record));
+    if (n < 0 && errno == ENOTSUP) {
+        char path[4096];
+        sidecar_path(device, file_path, path, sizeof(path));
+        int sidecar = open(path, O_RDONLY | O_CLOEXEC);
+        n = sidecar < 0 ? -1 : pread(sidecar, record, sizeof(record), 0);
+        if (sidecar >= 0) {
+            close(sidecar);
+        }
+    }
+
+    struct stat st;
+    if (n != sizeof(record) || fstat(fd, &st) < 0 || frame_get_u64(record + 4) != (uint64_t)st.st_size ||
+        frame_get_u64(record + 12) != (uint64_t)st.st_mtim.tv_sec || frame_get_u32(record + 20) != (uint32_t)st.st_mtim.tv_nsec) {
+        return -1;
+    }
+    *crc = frame_get_u32(record);
+    return 0;
+}
+
+/**
+ * @brief Store the digest of a device file, so GETs send it without reading the file twice
+ *
+ * @param device
+ * @param file_path below the storage folder, where the file is now
+ * @param fd the file on that device, fully written
+ * @param crc the CRC32C of the whole file
+ */
+void checksum_store(const USBDevice *device, const char *file_path, int fd, uint32_t crc) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return;
+    }
+    uint8_t record[CHECKSUM_RECORD_SIZE];
+    frame_put_u32(record, crc);
+    frame_put_u64(record + 4, st.st_size);
+    frame_put_u64(record + 12, st.st_mtim.tv_sec);
+    frame_put_u32(record + 20, st.st_mtim.tv_nsec);
+    if (fsetxattr(fd, CHECKSUM_XATTR, record, sizeof(record), 0) == 0) {
+        return;
+    }
+    if (errno != ENOTSUP) {
+        perror("fsetxattr");
+        return;
+    }
+
+    // Written aside and renamed over, so a concurrent reader never sees half a record
+    char path[4096], staged[4200];
+    sidecar_path(device, file_path, path, sizeof(path));
+    snprintf(staged, sizeof(staged), "%s.%016" PRIx64, path, random_id());
+    make_parents(path);
+    int sidecar = open(staged, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (sidecar < 0) {
+        perror("checksum sidecar");
+        return;
+    }
+    int written = write(sidecar, record, sizeof(record)) == sizeof(record);
+    close(sidecar);
+    if (!written || rename(staged, path) < 0) {
+        perror("checksum sidecar");
+        unlink(staged);
+    }
+}
+
+/**
+ * @brief Drop the sidecars of a removed file or directory
+ *
+ * Extended attributes go with the file, so only sidecars need this.
+ *
+ * @param device
+ * @param file_path below the storage folder
+ */
+void checksum_remove(const USBDevice *device, const char *file_path) {
+    char path[4096];
+    sidecar_path(device, file_path, path, sizeof(path));
+    struct stat st;
+    if (lstat(path, &st) < 0) {
+        return;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        delete_directory(path);
+    } else {
+        unlink(path);
+    }
+}
+
+/**
+ * @brief Move the sidecars of a renamed file or directory along with it
+ *
+ * @param device
+ * @param from below the storage folder
+ * @param to
+ */
+void checksum_rename(const USBDevice *device, const char *from, const char *to) {
+    char from_path[4096], to_path[4096];
+    sidecar_path(device, from, from_path, sizeof(from_path));
+    sidecar_path(device, to, to_path, sizeof(to_path));
+    if (access(from_path, F_OK) < 0) {
+        return;
+    }
+    make_parents(to_path);
+    if (rename(from_path, to_path) < 0) {
+        // A stale sidecar is ignored anyway, a missing one only costs a recomputation
+        checksum_remove(device, from);
+    }
+}
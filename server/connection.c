@@ -0,0 +1,387 @@
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#include "server.h"
+
+/**
+ * @brief Allocate the state for a newly accepted client socket
+ *
+ * @param sock
+ * @param epoll_fd
+ * @return Connection* or NULL on allocation failure
+ */
+Connection *connection_create(int sock, int epoll_fd) {
+    Connection *conn = malloc(sizeof(Connection));
+    if (conn == NULL) {
+        return NULL;
+    }
+    conn->sock = sock;
+    conn->epoll_fd = epoll_fd;
+    conn->broken = 0;
+    conn->request_id = 0;
+    conn->checksum = 0;
+    conn->args = NULL;
+    conn->args_len = 0;
+    conn->body_remaining = 0;
+    conn->start = 0;
+    conn->end = 0;
+    metrics_connection(1);
+    return conn;
+}
+
+/**
+ * @brief Close the client socket and free the connection
+ *
+ * @param conn
+ */
+void connection_close(Connection *conn) {
+    close(conn->sock);
+    free(conn);
+    metrics_connection(-1);
+}
+
+/**
+ * @brief Read whatever the socket has ready into the connection buffer without blocking
+ *
+ * @param conn
+ * @return ssize_t bytes read, 0 on orderly shutdown, -1 on error (EAGAIN if nothing was ready)
+ */
+ssize_t connection_fill(Connection *conn) {
+    if (conn->start > 0) {
+        memmove(conn->buffer, conn->buffer + conn->start, conn->end - conn->start);
+        conn->end -= conn->start;
+        conn->start = 0;
+    }
+    if (conn->end == sizeof(conn->buffer)) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    ssize_t n = recv(conn->sock, conn->buffer + conn->end, sizeof(conn->buffer) - conn->end, MSG_DONTWAIT);
+    if (n > 0) {
+        conn->end += n;
+    }
+    return n;
+}
+
+/**
+ * @brief Take the next complete request frame out of the connection buffer
+ *
+ * On success the request id, opcode specific arguments and the size of any
+ * bulk data still on the socket are recorded in the connection.
+ *
+ * @param conn
+ * @param header receives the frame header
+ * @param path receives the NUL terminated remote path
+ * @param path_size
+ * @return FrameStatus FRAME_INCOMPLETE until the whole request is buffered
+ */
+FrameStatus connection_next_request(Connection *conn, FrameHeader *header, char *path, size_t path_size) {
+    const uint8_t *frame = (const uint8_t *)conn->buffer + conn->start;
+    size_t buffered = conn->end - conn->start;
+
+    FrameStatus status = frame_decode_header(frame, buffered, header);
+    if (status != FRAME_OK) {
+        return status;
+    }
+
+    // A checksum flag on an opcode that cannot carry one leaves it unknown
+    int checksum = (header->opcode & OP_FLAG_CHECKSUM) && frame_has_checksum(header->opcode & ~OP_FLAG_CHECKSUM);
+    if (checksum) {
+        header->opcode &= ~OP_FLAG_CHECKSUM;
+    }
+
+    const uint8_t *payload = frame + FRAME_HEADER_SIZE;
+    size_t available = buffered - FRAME_HEADER_SIZE;
+    size_t args_size = frame_args_size(header->opcode);
+    int has_body = frame_has_body(header->opcode);
+
+    // Everything but bulk data has to fit in the buffer
+    if (!has_body && header->length > sizeof(conn->buffer) - FRAME_HEADER_SIZE) {
+        return FRAME_INVALID;
+    }
+
+    status = frame_decode_path(payload, available < header->length ? available : header->length, path, path_size);
+    if (status == FRAME_INCOMPLETE && available >= header->length) {
+        return FRAME_INVALID;
+    }
+    if (status != FRAME_OK) {
+        return status;
+    }
+
+    size_t path_len = 2 + strlen(path);
+    size_t consumed = has_body ? path_len + args_size : header->length;
+    if (consumed > header->length) {
+        return FRAME_INVALID;
+    }
+    if (available < consumed) {
+        return FRAME_INCOMPLETE;
+    }
+
+    conn->request_id = header->request_id;
+    conn->checksum = checksum;
+    conn->args = payload + path_len;
+    conn->args_len = has_body ? args_size : header->length - path_len;
+    conn->body_remaining = header->length - consumed;
+    conn->start += FRAME_HEADER_SIZE + consumed;
+    return FRAME_OK;
+}
+
+/**
+ * @brief Receive from the client, handing out buffered bytes before reading the socket
+ *
+ * @param conn
+ * @param buf
+ * @param len
+ * @param flags recv(2) flags, MSG_WAITALL waits for the full length
+ * @return ssize_t bytes received, 0 on orderly shutdown, -1 on error
+ */
+ssize_t connection_recv(Connection *conn, void *buf, size_t len, int flags) {
+    size_t buffered = conn->end - conn->start;
+    size_t taken = buffered < len ? buffered : len;
+
+    if (taken > 0) {
+        memcpy(buf, conn->buffer + conn->start, taken);
+        conn->start += taken;
+        if (taken == len || !(flags & MSG_WAITALL)) {
+            return taken;
+        }
+    }
+
+    ssize_t n = recv(conn->sock, (char *)buf + taken, len - taken, flags);
+    if (n < 0) {
+        return taken > 0 ? (ssize_t)taken : -1;
+    }
+    return taken + n;
+}
+
+/**
+ * @brief Receive bulk request data, never reading past the end of the current frame
+ *
+ * @param conn
+ * @param buf
+ * @param len
+ * @return ssize_t bytes received, 0 once the body is used up or the client hung up, -1 on error
+ */
+ssize_t connection_recv_body(Connection *conn, void *buf, size_t len) {
+    if (len > conn->body_remaining) {
+        len = conn->body_remaining;
+    }
+    if (len == 0) {
+        return 0;
+    }
+
+    uint64_t started = metrics_now();
+    ssize_t n = connection_recv(conn, buf, len, MSG_WAITALL);
+    metrics_phase_add(METRICS_NETWORK, metrics_now() - started);
+    if (n > 0) {
+        conn->body_remaining -= n;
+    }
+    if ((size_t)n != len) {
+        conn->broken = 1;
+    }
+    return n;
+}
+
+/**
+ * @brief Read and drop whatever bulk data of the current request is left
+ *
+ * @param conn
+ * @return int 0 on success, -1 if the client hung up
+ */
+int connection_discard_body(Connection *conn) {
+    char *scratch = buffer_acquire(BUFFER_BLOCK_MIN);
+    int result = scratch == NULL ? -1 : 0;
+    while (result == 0 && conn->body_remaining > 0) {
+        if (connection_recv_body(conn, scratch, BUFFER_BLOCK_MIN) <= 0) {
+            result = -1;
+        }
+    }
+    buffer_release(scratch, BUFFER_BLOCK_MIN);
+    return result;
+}
+
+/**
+ * @brief Receive the CRC32C trailer that ends a checksummed request body
+ *
+ * @param conn
+ * @param crc what the data before it hashed to
+ * @return int 0 if the trailer matches, -1 if it does not or never arrived
+ */
+int connection_check_trailer(Connection *conn, uint32_t crc) {
+    uint8_t trailer[CHECKSUM_TRAILER_SIZE];
+    if (conn->body_remaining != sizeof(trailer) || connection_recv_body(conn, trailer, sizeof(trailer)) != sizeof(trailer)) {
+        return -1;
+    }
+    return frame_get_u32(trailer) == crc ? 0 : -1;
+}
+
+/**
+ * @brief Send a frame header and the start of its payload, gathered from parts
+ *
+ * @param conn
+ * @param opcode
+ * @param length full payload length
+ * @param parts
+ * @param num_parts at most REPLY_MAX_PARTS
+ * @return int 0 on success, -1 on failure
+ */
+static int send_frame(Connection *conn, uint8_t opcode, uint64_t length, const struct iovec *parts, int num_parts) {
+    uint8_t header[FRAME_HEADER_SIZE];
+    frame_encode_header(header, opcode, conn->request_id, length);
+
+    struct iovec iov[1 + REPLY_MAX_PARTS] = {
+        { .iov_base = header, .iov_len = sizeof(header) },
+    };
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 1 };
+    size_t total = sizeof(header);
+    uint64_t sent_payload = 0;
+    for (int i = 0; i < num_parts; i++) {
+        if (parts[i].iov_len > 0) {
+            iov[msg.msg_iovlen++] = parts[i];
+            total += parts[i].iov_len;
+            sent_payload += parts[i].iov_len;
+        }
+    }
+    // The caller streams the rest, let it share packets with this part
+    int flags = length > sent_payload ? MSG_MORE : 0;
+
+    uint64_t started = metrics_now();
+    while (total > 0) {
+        ssize_t sent = sendmsg(conn->sock, &msg, flags);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("send");
+            conn->broken = 1;
+            metrics_phase_add(METRICS_NETWORK, metrics_now() - started);
+            return -1;
+        }
+        total -= sent;
+        // Skip whatever the kernel already took
+        while (msg.msg_iovlen > 0 && (size_t)sent >= msg.msg_iov->iov_len) {
+            sent -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + sent;
+            msg.msg_iov->iov_len -= sent;
+        }
+    }
+    metrics_phase_add(METRICS_NETWORK, metrics_now() - started);
+    return 0;
+}
+
+/**
+ * @brief Send the header of a reply whose payload the caller streams afterwards
+ *
+ * @param conn
+ * @param opcode
+ * @param length
+ * @return int 0 on success, -1 on failure
+ */
+int connection_send_header(Connection *conn, uint8_t opcode, uint64_t length) {
+    return send_frame(conn, opcode, length, NULL, 0);
+}
+
+/**
+ * @brief Send the header of a reply and the start of its payload, the caller streams the rest
+ *
+ * @param conn
+ * @param opcode
+ * @param length full payload length
+ * @param head
+ * @param head_len
+ * @return int 0 on success, -1 on failure
+ */
+int connection_send_reply_head(Connection *conn, uint8_t opcode, uint64_t length, const void *head, size_t head_len) {
+    struct iovec part = { .iov_base = (void *)head, .iov_len = head_len };
+    return send_frame(conn, opcode, length, &part, 1);
+}
+
+/**
+ * @brief Send a complete reply frame to the current request
+ *
+ * @param conn
+ * @param opcode
+ * @param payload
+ * @param length
+ * @return int 0 on success, -1 on failure
+ */
+int connection_send_reply(Connection *conn, uint8_t opcode, const void *payload, size_t length) {
+    struct iovec part = { .iov_base = (void *)payload, .iov_len = length };
+    return send_frame(conn, opcode, length, &part, 1);
+}
+
+/**
+ * @brief Send a complete reply frame whose payload is gathered from several buffers
+ *
+ * @param conn
+ * @param opcode
+ * @param parts
+ * @param num_parts at most REPLY_MAX_PARTS
+ * @return int 0 on success, -1 on failure
+ */
+int connection_send_reply_parts(Connection *conn, uint8_t opcode, const struct iovec *parts, int num_parts) {
+    uint64_t length = 0;
+    for (int i = 0; i < num_parts; i++) {
+        length += parts[i].iov_len;
+    }
+    return send_frame(conn, opcode, length, parts, num_parts);
+}
+
+/**
+ * @brief Send an OP_ERROR reply carrying a message
+ *
+ * @param conn
+ * @param message
+ * @return int 0 on success, -1 on failure
+ */
+int connection_send_error(Connection *conn, const char *message) {
+    return connection_send_reply(conn, OP_ERROR, message, strlen(message));
+}
+
+/**
+ * @brief Hold back partial packets of a streamed reply until its trailer is sent
+ *
+ * Otherwise the end of the file goes out alone and Nagle keeps the trailer
+ * back until the client gets round to acknowledging it.
+ *
+ * @param conn
+ */
+void connection_cork(Connection *conn) {
+    int on = 1;
+    setsockopt(conn->sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+/**
+ * @brief Send the CRC32C trailer that ends a checksummed reply, and whatever connection_cork held back
+ *
+ * @param conn
+ * @param crc
+ * @return int 0 on success, -1 on failure
+ */
+int connection_send_trailer(Connection *conn, uint32_t crc) {
+    uint8_t trailer[CHECKSUM_TRAILER_SIZE];
+    frame_put_u32(trailer, crc);
+    size_t done = 0;
+    uint64_t started = metrics_now();
+    while (done < sizeof(trailer)) {
+        ssize_t sent = send(conn->sock, trailer + done, sizeof(trailer) - done, 0);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0) {
+            perror("send");
+            conn->broken = 1;
+            break;
+        }
+        done += sent;
+    }
+    int off = 0;
+    setsockopt(conn->sock, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+    metrics_phase_add(METRICS_NETWORK, metrics_now() - started);
+    return done == sizeof(trailer) ? 0 : -1;
+}
@@ -0,0 +1,227 @@
+#include <errno.h>
+#include <inttypes.h>
+#include "server.h"
+
+/**
+ * @brief Read the destination path of a COPY or MOVE and check both paths.
+ *
+ * @param conn
+ * @param src
+ * @param dst receives the destination path
+ * @param size
+ * @return const char* NULL if the request is valid, the error message otherwise.
+ */
+static const char *parse_paths(Connection *conn, const char *src, char *dst, size_t size) {
+    if (frame_decode_path(conn->args, conn->args_len, dst, size) != FRAME_OK ||
+        conn->args_len != 2 + strlen(dst)) {
+        return "Error: Invalid argument";
+    }
+    if (strstr(src, "..") != NULL || strstr(dst, "..") != NULL) {
+        return "Error: Invalid argument";
+    }
+
+    char src_key[FRAME_MAX_PATH + 1], dst_key[FRAME_MAX_PATH + 1];
+    normalize_path(src, src_key, sizeof(src_key));
+    normalize_path(dst, dst_key, sizeof(dst_key));
+    if (src_key[0] == '\0' || dst_key[0] == '\0' || strcmp(src_key, dst_key) == 0) {
+        return "Error: Invalid argument";
+    }
+    return NULL;
+}
+
+/**
+ * @brief Copy src to dst on every device that holds it
+ *
+ * Each copy is staged under the device's upload directory and renamed into
+ * place, so readers of dst see either the old content or the whole copy.
+ * copy_file clones the file when the filesystem supports it and otherwise
+ * copies it inside the kernel.
+ *
+ * @param src_paths
+ * @param dst_paths
+ * @param usb_devices
+ * @param num_usb_devices
+ * @param copied receives the number of devices that now hold the copy
+ * @return int 0 on success, the errno of the first failure otherwise
+ */
+static int copy_replicas(char (*src_paths)[4096], char (*dst_paths)[4096], USBDevice *usb_devices,
+                         int num_usb_devices, int *copied) {
+    uint64_t staging_id = random_id();
+    char staging_paths[num_usb_devices][4096];
+    int fds[num_usb_devices];
+    int is_dir[num_usb_devices];
+    int error = 0;
+
+    for (int i = 0; i < num_usb_devices; i++) {
+        fds[i] = -1;
+        is_dir[i] = -1;
+        struct stat st;
+        if (!device_mounted(&usb_devices[i]) || lstat(src_paths[i], &st) == -1) {
+            continue;
+        }
+        is_dir[i] = S_ISDIR(st.st_mode);
+
+        char staging_dir[3072];
+        snprintf(staging_dir, sizeof(staging_dir), "%s/%s", usb_devices[i].mount_point, UPLOAD_DIR);
+        mkdir(staging_dir, 0755);
+        snprintf(staging_paths[i], sizeof(staging_paths[i]), "%s/copy-%016" PRIx64, staging_dir, staging_id);
+
+        if (is_dir[i]) {
+            // A directory is never merged into an existing one
+            if (lstat(dst_paths[i], &st) == 0) {
+                error = EEXIST;
+                is_dir[i] = -1;
+            } else if (!copy_directory(src_paths[i], staging_paths[i], i)) {
+                error = EIO;
+                delete_directory(staging_paths[i]);
+                is_dir[i] = -1;
+            }
+        } else if (copy_file(src_paths[i], staging_paths[i]) < 0 ||
+                   (fds[i] = open(staging_paths[i], O_RDONLY | O_CLOEXEC)) < 0) {
+            error = errno;
+            unlink(staging_paths[i]);
+            is_dir[i] = -1;
+        }
+    }
+
+    // Copied files become durable before they are visible, as uploads do
+    if (error == 0 && durability_sync(fds, num_usb_devices) < 0) {
+        error = EIO;
+    }
+
+    *copied = 0;
+    char placed[num_usb_devices][4096];
+    for (int i = 0; i < num_usb_devices; i++) {
+        placed[i][0] = '\0';
+        if (fds[i] != -1) {
+            close(fds[i]);
+        }
+        if (is_dir[i] == -1) {
+            continue;
+        }
+        if (error == 0 && rename(staging_paths[i], dst_paths[i]) == 0) {
+            (*copied)++;
+            snprintf(placed[i], sizeof(placed[i]), "%s", dst_paths[i]);
+            continue;
+        }
+        if (error == 0) {
+            error = errno;
+        }
+        if (is_dir[i]) {
+            delete_directory(staging_paths[i]);
+        } else {
+            unlink(staging_paths[i]);
+        }
+    }
+    if (*copied > 0 && durability_sync_parents(placed, num_usb_devices) < 0 && error == 0) {
+        error = EIO;
+    }
+    return error;
+}
+
+/**
+ * @brief Handle a COPY or MOVE command from the client
+ *
+ * The request path is the source and the arguments carry the destination.
+ * Both act on every replica in place, so no file data crosses the network.
+ * A device without the source is skipped, as RM does.
+ *
+ * @param conn
+ * @param src
+ * @param usb_devices
+ * @param num_usb_devices
+ * @param move rename src instead of copying it
+ */
+static void handle_copy_or_move(Connection *conn, const char *src, USBDevice *usb_devices, const int num_usb_devices, int move) {
+    char dst[FRAME_MAX_PATH + 1];
+    const char *invalid = parse_paths(conn, src, dst, sizeof(dst));
+    if (invalid != NULL) {
+        connection_send_error(conn, invalid);
+        return;
+    }
+
+    // Locks are taken in path order, so a MOVE a b racing a MOVE b a cannot deadlock
+    PathLockMode src_mode = move ? PATH_LOCK_WRITE : PATH_LOCK_READ;
+    PathLock *src_lock, *dst_lock;
+    if (path_lock_acquire_pair(src, src_mode, dst, PATH_LOCK_WRITE, server_config.lock_timeout_ms, &src_lock, &dst_lock) < 0) {
+        connection_send_error(conn, "Error: File is busy");
+        return;
+    }
+
+    char src_paths[num_usb_devices][4096], dst_paths[num_usb_devices][4096];
+    for (int i = 0; i < num_usb_devices; i++) {
+        snprintf(src_paths[i], sizeof(src_paths[i]), "%s%s%s", usb_devices[i].mount_point, usb_devices[i].storage_folder, src);
+        snprintf(dst_paths[i], sizeof(dst_paths[i]), "%s%s%s", usb_devices[i].mount_point, usb_devices[i].storage_folder, dst);
+    }
+
+    int done = 0, error = 0;
+    if (move) {
+        char placed[num_usb_devices][4096], left[num_usb_devices][4096];
+        for (int i = 0; i < num_usb_devices; i++) {
+            placed[i][0] = '\0';
+            left[i][0] = '\0';
+            if (!device_mounted(&usb_devices[i])) {
+                continue;
+            }
+            if (rename(src_paths[i], dst_paths[i]) == 0) {
+                checksum_rename(&usb_devices[i], src, dst);
+                snprintf(placed[i], sizeof(placed[i]), "%s", dst_paths[i]);
+                snprintf(left[i], sizeof(left[i]), "%s", src_paths[i]);
+                done++;
+            } else if (errno != ENOENT && error == 0) {
+                error = errno;
+            }
+        }
+        // The source's directory as well, when the move left it
+        if (done > 0 && (durability_sync_parents(placed, num_usb_devices) < 0 ||
+                         durability_sync_parents(left, num_usb_devices) < 0) && error == 0) {
+            error = EIO;
+        }
+    } else {
+        error = copy_replicas(src_paths, dst_paths, usb_devices, num_usb_devices, &done);
+    }
+
+    if (done > 0) {
+        if (move) {
+            cache_invalidate(src, 1);
+        }
+        cache_invalidate(dst, 1);
+    }
+    path_lock_release(dst_lock, PATH_LOCK_WRITE);
+    path_lock_release(src_lock, src_mode);
+
+    if (error == 0 && done == 0) {
+        error = ENOENT;
+    }
+    if (error == 0) {
+        connection_send_reply(conn, OP_OK, NULL, 0);
+    } else {
+        char error_msg[256];
+        snprintf(error_msg, sizeof(error_msg), "Error: %s", strerror(error));
+        connection_send_error(conn, error_msg);
+    }
+}
+
+/**
+ * @brief Handle a COPY command from the client
+ *
+ * @param conn
+ * @param src
+ * @param usb_devices
+ * @param num_usb_devices
+ */
+void handle_copy_command(Connection *conn, const char *src, USBDevice* usb_devices, const int num_usb_devices) {
+    handle_copy_or_move(conn, src, usb_devices, num_usb_devices, 0);
+}
+
+/**
+ * @brief Handle a MOVE command from the client
+ *
+ * @param conn
+ * @param src
+ * @param usb_devices
+ * @param num_usb_devices
+ */
+void handle_move_command(Connection *conn, const char *src, USBDevice* usb_devices, const int num_usb_devices) {
+    handle_copy_or_move(conn, src, usb_devices, num_usb_devices, 1);
+}
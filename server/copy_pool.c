@@ -0,0 +1,186 @@
+#include <semaphore.h>
+#include "server.h"
+
+typedef struct CopyJob {
+    char *src;
+    char *dst;
+    CopyDone done;
+    void *arg;
+} CopyJob;
+
+struct CopyPool {
+    CopyJob *queue;
+    int capacity;
+    int head;
+    int count;
+    int closing;            // no more jobs, threads exit once the queue drains
+    int failures;
+    int num_threads;
+    int device;             // destination, whose copy slots the threads take
+    Throttle *throttle;     // shared by the copy threads, NULL for full speed
+    pthread_t *threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+};
+
+// copy_threads per destination device, shared by every pool copying to it
+static sem_t copy_slots[MAX_USB_DEVICES];
+static pthread_once_t slots_once = PTHREAD_ONCE_INIT;
+
+static void init_slots(void) {
+    int slots = server_config.copy_threads < 1 ? 1 : server_config.copy_threads;
+    for (int i = 0; i < MAX_USB_DEVICES; i++) {
+        sem_init(&copy_slots[i], 0, slots);
+    }
+}
+
+/**
+ * @brief Copy thread, runs copy_file for queued jobs until the pool is closed.
+ *
+ * @param arg
+ * @return void*
+ */
+static void *copy_thread(void *arg) {
+    CopyPool *pool = arg;
+    throttle_attach(pool->throttle);
+
+    while (1) {
+        pthread_mutex_lock(&pool->mutex);
+        while (pool->count == 0 && !pool->closing) {
+            pthread_cond_wait(&pool->not_empty, &pool->mutex);
+        }
+        if (pool->count == 0) {
+            pthread_mutex_unlock(&pool->mutex);
+            break;
+        }
+        CopyJob job = pool->queue[pool->head];
+        pool->head = (pool->head + 1) % pool->capacity;
+        pool->count--;
+        pthread_cond_signal(&pool->not_full);
+        pthread_mutex_unlock(&pool->mutex);
+
+        // A resync and any number of directory COPYs to one device stay within copy_threads between them
+        sem_t *slot = &copy_slots[pool->device];
+        while (sem_wait(slot) < 0 && errno == EINTR) {
+        }
+        int result = copy_file_throttled(job.src, job.dst, pool->throttle);
+        sem_post(slot);
+        if (result < 0) {
+            pthread_mutex_lock(&pool->mutex);
+            pool->failures++;
+            pthread_mutex_unlock(&pool->mutex);
+        }
+        if (job.done != NULL) {
+            job.done(job.arg, result);
+        }
+        free(job.src);
+        free(job.dst);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Start a pool of threads copying files for one destination device
+ *
+ * The pool has copy_threads threads, but every pool copying to the same
+ * device shares its copy_threads slots, so that is how many files are
+ * copied to it at once however many requests copy directories there.
+ *
+ * @param device index of the destination device
+ * @param throttle paces the copies and sets the threads' I/O priority, may be NULL
+ * @return CopyPool* or NULL on failure
+ */
+CopyPool *copy_pool_start(int device, Throttle *throttle) {
+    pthread_once(&slots_once, init_slots);
+    int num_threads = server_config.copy_threads < 1 ? 1 : server_config.copy_threads;
+
+    CopyPool *pool = calloc(1, sizeof(CopyPool));
+    if (pool == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    pool->capacity = num_threads * 4;
+    pool->device = device;
+    pool->throttle = throttle;
+    pool->queue = calloc(pool->capacity, sizeof(CopyJob));
+    pool->threads = calloc(num_threads, sizeof(pthread_t));
+    if (pool->queue == NULL || pool->threads == NULL) {
+        perror("calloc");
+        free(pool->queue);
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->not_empty, NULL);
+    pthread_cond_init(&pool->not_full, NULL);
+
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, copy_thread, pool) != 0) {
+            perror("Copy thread creation failed");
+            break;
+        }
+        pool->num_threads++;
+    }
+    if (pool->num_threads == 0) {
+        copy_pool_finish(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+/**
+ * @brief Queue a file copy, blocks while the pool's queue is full
+ *
+ * @param pool
+ * @param src
+ * @param dst
+ * @param done called on the copy thread with copy_file's result, may be NULL
+ * @param arg passed to done
+ * @return int 0 on success, -1 if the job could not be queued
+ */
+int copy_pool_submit(CopyPool *pool, const char *src, const char *dst, CopyDone done, void *arg) {
+    CopyJob job = { .src = strdup(src), .dst = strdup(dst), .done = done, .arg = arg };
+    if (job.src == NULL || job.dst == NULL) {
+        free(job.src);
+        free(job.dst);
+        return -1;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->count == pool->capacity) {
+        pthread_cond_wait(&pool->not_full, &pool->mutex);
+    }
+    pool->queue[(pool->head + pool->count) % pool->capacity] = job;
+    pool->count++;
+    pthread_cond_signal(&pool->not_empty);
+    pthread_mutex_unlock(&pool->mutex);
+    return 0;
+}
+
+/**
+ * @brief Wait for every queued copy, then stop the threads and free the pool
+ *
+ * @param pool
+ * @return int number of copies that failed
+ */
+int copy_pool_finish(CopyPool *pool) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->closing = 1;
+    pthread_cond_broadcast(&pool->not_empty);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (int i = 0; i < pool->num_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    int failures = pool->failures;
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->not_empty);
+    pthread_cond_destroy(&pool->not_full);
+    free(pool->threads);
+    free(pool->queue);
+    free(pool);
+    return failures;
+}
@@ -0,0 +1,203 @@
+#define _GNU_SOURCE
+#include "server.h"
+
+/**
+ * @brief A file waiting for its data to reach the device
+ */
+typedef struct FlushRequest {
+    int fd;
+    int directory;  // flushed with fsync, so the entries renamed into it last
+    int error;
+    int done;
+    struct FlushRequest *next;
+} FlushRequest;
+
+typedef struct DeviceFlusher {
+    FlushRequest *pending;  // requests for the next flush cycle
+    pthread_mutex_t mutex;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    pthread_t thread;
+} DeviceFlusher;
+
+static DeviceFlusher flushers[MAX_USB_DEVICES];
+static int num_flushers = 0;
+
+/**
+ * @brief Flusher thread, makes each batch of pending files durable in one cycle.
+ *
+ * With group commit a single syncfs covers every file and directory in the
+ * batch, however many PUTs queued them; otherwise each file gets its own
+ * fdatasync and each directory its own fsync.
+ *
+ * @param arg
+ * @return void*
+ */
+static void *flusher_thread(void *arg) {
+    DeviceFlusher *flusher = (DeviceFlusher *)arg;
+
+    while (1) {
+        pthread_mutex_lock(&flusher->mutex);
+        while (flusher->pending == NULL) {
+            pthread_cond_wait(&flusher->work, &flusher->mutex);
+        }
+        FlushRequest *batch = flusher->pending;
+        flusher->pending = NULL;
+        pthread_mutex_unlock(&flusher->mutex);
+
+        // The waiters keep their files open until they are marked done
+        if (server_config.durability == DURABILITY_GROUP) {
+            int error = syncfs(batch->fd) < 0 ? errno : 0;
+            for (FlushRequest *request = batch; request != NULL; request = request->next) {
+                request->error = error;
+            }
+        } else {
+            for (FlushRequest *request = batch; request != NULL; request = request->next) {
+                int failed = request->directory ? fsync(request->fd) : fdatasync(request->fd);
+                request->error = failed < 0 ? errno : 0;
+            }
+        }
+
+        pthread_mutex_lock(&flusher->mutex);
+        while (batch != NULL) {
+            FlushRequest *next = batch->next;
+            batch->done = 1;
+            batch = next;
+        }
+        pthread_cond_broadcast(&flusher->done);
+        pthread_mutex_unlock(&flusher->mutex);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Start one flusher thread per device unless durability is off
+ *
+ * @param num_devices
+ * @return int 0 on success, -1 on failure
+ */
+int durability_start(int num_devices) {
+    if (server_config.durability == DURABILITY_NONE) {
+        return 0;
+    }
+
+    for (int i = 0; i < num_devices; i++) {
+        DeviceFlusher *flusher = &flushers[i];
+        flusher->pending = NULL;
+        pthread_mutex_init(&flusher->mutex, NULL);
+        pthread_cond_init(&flusher->work, NULL);
+        pthread_cond_init(&flusher->done, NULL);
+        if (pthread_create(&flusher->thread, NULL, flusher_thread, flusher) != 0) {
+            perror("Flusher thread creation failed");
+            return -1;
+        }
+        pthread_detach(flusher->thread);
+        num_flushers++;
+    }
+    return 0;
+}
+
+/**
+ * @brief Queue one file or directory per device with its flusher and wait for all of them
+ *
+ * @param fds -1 for devices to skip
+ * @param num_devices
+ * @param directory
+ * @return int 0 on success, -1 if any device failed to flush
+ */
+static int flush_all(const int *fds, int num_devices, int directory) {
+    FlushRequest requests[MAX_USB_DEVICES];
+    int count = num_devices < num_flushers ? num_devices : num_flushers;
+    for (int i = 0; i < count; i++) {
+        requests[i] = (FlushRequest){ .fd = fds[i], .directory = directory };
+        if (fds[i] == -1) {
+            continue;
+        }
+        DeviceFlusher *flusher = &flushers[i];
+        pthread_mutex_lock(&flusher->mutex);
+        requests[i].next = flusher->pending;
+        flusher->pending = &requests[i];
+        pthread_cond_signal(&flusher->work);
+        pthread_mutex_unlock(&flusher->mutex);
+    }
+
+    int result = 0;
+    for (int i = 0; i < count; i++) {
+        if (fds[i] == -1) {
+            continue;
+        }
+        DeviceFlusher *flusher = &flushers[i];
+        pthread_mutex_lock(&flusher->mutex);
+        while (!requests[i].done) {
+            pthread_cond_wait(&flusher->done, &flusher->mutex);
+        }
+        pthread_mutex_unlock(&flusher->mutex);
+        if (requests[i].error != 0) {
+            errno = requests[i].error;
+            perror("durability_sync");
+            result = -1;
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief Make the data written to each device file durable, as the durability setting asks
+ *
+ * All devices flush in parallel and the call returns once every one is done.
+ *
+ * @param fds the device files, -1 for devices to skip
+ * @param num_devices
+ * @return int 0 on success, -1 if any device failed to flush
+ */
+int durability_sync(const int *fds, int num_devices) {
+    if (server_config.durability == DURABILITY_NONE) {
+        return 0;
+    }
+    return flush_all(fds, num_devices, 0);
+}
+
+/**
+ * @brief Make the renames that put files in place durable, as the durability setting asks
+ *
+ * The data of a file flushed before its rename is of no use after a crash
+ * that loses the new name, so the directory holding it is flushed as well,
+ * in the same per-device batches as file data.
+ *
+ * @param paths where each device's file now is, empty for devices to skip
+ * @param num_devices
+ * @return int 0 on success, -1 if any device failed to flush
+ */
+int durability_sync_parents(char (*paths)[4096], int num_devices) {
+    if (server_config.durability == DURABILITY_NONE) {
+        return 0;
+    }
+
+    int fds[MAX_USB_DEVICES];
+    int count = num_devices < MAX_USB_DEVICES ? num_devices : MAX_USB_DEVICES;
+    int result = 0;
+    for (int i = 0; i < count; i++) {
+        fds[i] = -1;
+        char *slash = strrchr(paths[i], '/');
+        if (paths[i][0] == '\0' || slash == NULL) {
+            continue;
+        }
+        char dir[4096];
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - paths[i]) > 0 ? (int)(slash - paths[i]) : 1, paths[i]);
+        fds[i] = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fds[i] < 0) {
+            perror("durability_sync_parents");
+            result = -1;
+        }
+    }
+    if (flush_all(fds, count, 1) < 0) {
+        result = -1;
+    }
+    for (int i = 0; i < count; i++) {
+        if (fds[i] != -1) {
+            close(fds[i]);
+        }
+    }
+    return result;
+}
@@ -0,0 +1,167 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <sys/epoll.h>
+#include "server.h"
+
+#define MAX_EVENTS 256
+
+typedef struct Reactor {
+    int id;
+    int epoll_fd;
+    int server_socket;
+    pthread_t thread;
+} Reactor;
+
+/**
+ * @brief Accept every pending connection and register it with the reactor.
+ *
+ * Client sockets stay blocking because the command handlers use blocking
+ * send/recv, and are armed EPOLLONESHOT so only one worker owns a socket at a time.
+ *
+ * @param reactor
+ */
+static void accept_pending(Reactor *reactor) {
+    struct sockaddr_in client_address;
+    socklen_t client_address_len = sizeof(client_address);
+    int client_socket;
+
+    while ((client_socket = accept4(reactor->server_socket, (struct sockaddr *)&client_address,
+                                    &client_address_len, SOCK_CLOEXEC)) >= 0) {
+        printf("Client connected at IP: %s and port: %i\n",
+               inet_ntoa(client_address.sin_addr),
+               ntohs(client_address.sin_port));
+
+        Connection *conn = connection_create(client_socket, reactor->epoll_fd);
+        if (conn == NULL) {
+            perror("malloc");
+            close(client_socket);
+            continue;
+        }
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+        ev.data.ptr = conn;
+        if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, client_socket, &ev) < 0) {
+            perror("epoll_ctl");
+            connection_close(conn);
+        }
+        client_address_len = sizeof(client_address);
+    }
+
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        perror("Accept failed");
+    }
+}
+
+/**
+ * @brief Reactor thread, waits for readiness and hands ready sockets to the worker pool.
+ *
+ * @param arg
+ * @return void*
+ */
+static void *reactor_thread(void *arg) {
+    Reactor *reactor = (Reactor *)arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        int n = epoll_wait(reactor->epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            // The listening socket is registered without a connection
+            if (events[i].data.ptr == NULL) {
+                accept_pending(reactor);
+            } else {
+                // EPOLLONESHOT keeps the socket disarmed until the worker is done with it
+                worker_pool_submit(events[i].data.ptr);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Run the epoll reactors on the listening socket, does not return on success
+ *
+ * @param server_socket
+ * @param num_reactors
+ * @return int -1 on failure
+ */
+int event_loop_run(int server_socket, int num_reactors) {
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_reactors <= 0) {
+        num_reactors = num_cpus > 0 ? (int)num_cpus : 1;
+    }
+
+    int flags = fcntl(server_socket, F_GETFL, 0);
+    if (flags < 0 || fcntl(server_socket, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("fcntl");
+        return -1;
+    }
+
+    Reactor *reactors = calloc(num_reactors, sizeof(Reactor));
+    if (reactors == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
+    for (int i = 0; i < num_reactors; i++) {
+        reactors[i].id = i;
+        reactors[i].server_socket = server_socket;
+        reactors[i].epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (reactors[i].epoll_fd < 0) {
+            perror("epoll_create1");
+            return -1;
+        }
+
+        // EPOLLEXCLUSIVE wakes a single reactor per incoming connection
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(reactors[i].epoll_fd, EPOLL_CTL_ADD, server_socket, &ev) < 0) {
+            perror("epoll_ctl");
+            return -1;
+        }
+
+        if (pthread_create(&reactors[i].thread, NULL, reactor_thread, &reactors[i]) != 0) {
+            perror("Reactor thread creation failed");
+            return -1;
+        }
+
+        if (num_cpus > 0) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(i % num_cpus, &cpus);
+            pthread_setaffinity_np(reactors[i].thread, sizeof(cpus), &cpus);
+        }
+    }
+
+    printf("Event loop running with %d reactor(s)\n", num_reactors);
+
+    for (int i = 0; i < num_reactors; i++) {
+        pthread_join(reactors[i].thread, NULL);
+    }
+    return -1;
+}
+
+/**
+ * @brief Hand a session connection back to its reactor to wait for the next command
+ *
+ * @param conn
+ */
+void event_loop_rearm(Connection *conn) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = conn;
+    if (epoll_ctl(conn->epoll_fd, EPOLL_CTL_MOD, conn->sock, &ev) < 0) {
+        perror("epoll_ctl");
+        connection_close(conn);
+    }
+}
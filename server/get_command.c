@@ -2,55 +2,201 @@
 #include "server.h"
 
 /**
- * @brief handle a GET command from the client
+ * @brief Send part of a file held in memory as one reply
+ * 
+ * @param conn 
+ * @param entry 
+ * @param offset 
+ * @param length clamped to the end of the file
+ * @param ranged prefix the data with the file size, as GET_RANGE replies do
+ */
+static void send_cached_part(Connection *conn, const CacheEntry *entry, uint64_t offset, uint64_t length, int ranged) {
+    if (offset > entry->size) {
+        offset = entry->size;
+    }
+    if (length > entry->size - offset) {
+        length = entry->size - offset;
+    }
+
+    uint8_t prefix[8], trailer[CHECKSUM_TRAILER_SIZE];
+    frame_put_u64(prefix, entry->size);
+    if (conn->checksum) {
+        frame_put_u32(trailer, length == entry->size ? entry->crc : crc32c_update(0, entry->data + offset, length));
+    }
+    struct iovec parts[3] = {
+        { .iov_base = prefix, .iov_len = ranged ? sizeof(prefix) : 0 },
+        { .iov_base = entry->data + offset, .iov_len = length },
+        { .iov_base = trailer, .iov_len = conn->checksum ? sizeof(trailer) : 0 },
+    };
+    connection_send_reply_parts(conn, OP_OK, parts, 3);
+}
+
+/**
+ * @brief Check a file just read into the cache against its stored digest, storing one if it has none
+ * 
+ * @param device 
+ * @param file_path 
+ * @param fd 
+ * @param entry 
+ */
+static void check_cached(const USBDevice *device, const char *file_path, int fd, const CacheEntry *entry) {
+    uint32_t stored;
+    if (checksum_load(device, file_path, fd, &stored) < 0) {
+        checksum_store(device, file_path, fd, entry->crc);
+    } else if (stored != entry->crc) {
+        fprintf(stderr, "Checksum mismatch: %s on %s\n", file_path, device->mount_point);
+    }
+}
+
+/**
+ * @brief Send part of a file from the best replica
  * 
- * @param client_sock 
+ * @param conn 
  * @param file_path 
  * @param usb_devices 
  * @param num_usb_devices 
+ * @param offset 
+ * @param length clamped to the end of the file
+ * @param ranged prefix the data with the file size, as GET_RANGE replies do
  */
-void handle_get_command(int client_sock, const char *file_path, USBDevice *usb_devices, int num_usb_devices) {
-    char file_buffer[BUFFER_SIZE];
-    ssize_t bytes_read;
-    FILE *file = NULL;
-    char status = 0;
-
-    for (int i = 0; i < num_usb_devices; i++) {
-        char full_path[4096];
-        snprintf(full_path, sizeof(full_path), "%s%s%s", usb_devices[i].mount_point, usb_devices[i].storage_folder, file_path);
-
-        file = fopen(full_path, "r+");
-        if (file) {
-            break;
-        }
+static void send_file_part(Connection *conn, const char *file_path, USBDevice *usb_devices, int num_usb_devices,
+                           uint64_t offset, uint64_t length, int ranged) {
+    int client_sock = conn->sock;
+    int fd;
+
+    // Hot files are served from memory without touching the devices or the path lock
+    CacheEntry *entry = cache_lookup(file_path);
+    if (entry != NULL) {
+        send_cached_part(conn, entry, offset, length, ranged);
+        cache_release(entry);
+        return;
     }
 
-    char message[1024];
-    if (!file) {
-        snprintf(message, sizeof(message), "%s", strerror(errno));
-        send(client_sock, &status, 1, 0); // Send failure status
-        send(client_sock, message, strlen(message), 0); // Send errno value
+    // Concurrent GETs share the path lock, a PUT or RM of the same path waits for them
+    PathLock *path_lock = path_lock_acquire(file_path, PATH_LOCK_READ, server_config.lock_timeout_ms);
+    if (path_lock == NULL) {
+        connection_send_error(conn, "Error: File is busy");
+        return;
+    }
+
+    // Spread GETs over the replicas instead of always reading the first device
+    uint64_t generation = cache_generation();
+    ReplicaRead replica;
+    struct stat file_stat;
+    if (replica_open(usb_devices, num_usb_devices, file_path, &replica) == -1) {
+        connection_send_error(conn, strerror(errno)); // Send errno value
+        path_lock_release(path_lock, PATH_LOCK_READ);
+        return;
+    }
+    fd = replica.fd;
+    if (fstat(fd, &file_stat) == -1) {
+        connection_send_error(conn, strerror(errno));
+        replica_close(&replica);
+        path_lock_release(path_lock, PATH_LOCK_READ);
         return;
     }
 
     // Add read lock on the file
-    int fd = fileno(file);
     if (lock_file_read(fd) == -1) {
         perror("ERROR: lock_file_read() failed");
+        connection_send_error(conn, strerror(errno));
+        replica_close(&replica);
+        path_lock_release(path_lock, PATH_LOCK_READ);
+        return;
+    }
+
+    // A small enough file is read whole and kept for the next GET
+    if (S_ISREG(file_stat.st_mode) && cache_admits(file_stat.st_size) &&
+        (entry = cache_fill(file_path, fd, file_stat.st_size, generation)) != NULL) {
+        metrics_device_io(replica.device, 0, file_stat.st_size);
+        check_cached(&usb_devices[replica.device], file_path, fd, entry);
+        unlock_file(fd);
+        replica_close(&replica);
+        path_lock_release(path_lock, PATH_LOCK_READ);
+        send_cached_part(conn, entry, offset, length, ranged);
+        cache_release(entry);
         return;
     }
-    status = 1;
-    send(client_sock, &status, 1, 0); // Send success status
 
-    while ((bytes_read = fread(file_buffer, sizeof(char), BUFFER_SIZE, file)) > 0) {
-        if (send(client_sock, file_buffer, bytes_read, 0) < 0) {
+    uint64_t size = file_stat.st_size;
+    if (offset > size) {
+        offset = size;
+    }
+    if (length > size - offset) {
+        length = size - offset;
+    }
+
+    // A whole file's digest is stored when it is uploaded, anything else is hashed as it is sent
+    uint32_t crc = 0;
+    int whole = offset == 0 && length == size;
+    int hashing = conn->checksum && (!whole || checksum_load(&usb_devices[replica.device], file_path, fd, &crc) < 0);
+
+    // The data follows the header straight from the file
+    uint8_t prefix[8];
+    size_t prefix_len = ranged ? sizeof(prefix) : 0;
+    size_t trailer_len = conn->checksum ? CHECKSUM_TRAILER_SIZE : 0;
+    frame_put_u64(prefix, size);
+    if (conn->checksum) {
+        connection_cork(conn);
+    }
+    if (connection_send_reply_head(conn, OP_OK, prefix_len + length + trailer_len, prefix, prefix_len) == 0) {
+        off_t sent = 0;
+        if (length > 0) {
+            // The device is read as the socket drains, so the whole transfer counts as network time
+            uint64_t started = metrics_now();
+            sent = hashing ? send_file_range_hashed(client_sock, fd, offset, length, &crc) : send_file_range(client_sock, fd, offset, length);
+            metrics_phase_add(METRICS_NETWORK, metrics_now() - started);
+        }
+        if (sent > 0) {
+            metrics_device_io(replica.device, 0, sent);
+        }
+        if (sent != (off_t)length) {
             printf("Error: Failed to send file.\n");
-            break;
+            conn->broken = 1;
+        } else if (conn->checksum) {
+            connection_send_trailer(conn, crc);
+            if (hashing && whole) {
+                // Later GETs of this replica go back to sending it straight from the file
+                checksum_store(&usb_devices[replica.device], file_path, fd, crc);
+            }
         }
     }
 
     // Unlock the file
     unlock_file(fd);
 
-    fclose(file);
-}
\ No newline at end of file
+    replica_close(&replica);
+    path_lock_release(path_lock, PATH_LOCK_READ);
+}
+
+/**
+ * @brief handle a GET command from the client
+ * 
+ * @param conn 
+ * @param file_path 
+ * @param usb_devices 
+ * @param num_usb_devices 
+ */
+void handle_get_command(Connection *conn, const char *file_path, USBDevice *usb_devices, int num_usb_devices) {
+    send_file_part(conn, file_path, usb_devices, num_usb_devices, 0, RANGE_TO_END, 0);
+}
+
+/**
+ * @brief handle a GET_RANGE command from the client
+ * 
+ * A length of 0 only reports the file size, RANGE_TO_END reads to the end.
+ * 
+ * @param conn 
+ * @param file_path 
+ * @param usb_devices 
+ * @param num_usb_devices 
+ */
+void handle_get_range_command(Connection *conn, const char *file_path, USBDevice *usb_devices, int num_usb_devices) {
+    if (conn->args_len != RANGE_ARGS_SIZE) {
+        connection_send_error(conn, "Error: Malformed range");
+        return;
+    }
+    uint64_t offset = frame_get_u64(conn->args);
+    uint64_t length = frame_get_u64(conn->args + 8);
+    send_file_part(conn, file_path, usb_devices, num_usb_devices, offset, length, 1);
+}
@@ -4,76 +4,179 @@
 /**
  * @brief Handle an INFO command from the client
  * 
- * @param client_sock 
+ * @param conn 
  * @param file_path 
  * @param usb_devices 
  * @param num_usb_devices 
  */
-void handle_info_command(int client_sock, const char *file_path, USBDevice* usb_devices, const int num_usb_devices) {
+void handle_info_command(Connection *conn, const char *file_path, USBDevice* usb_devices, const int num_usb_devices) {
 
     struct stat file_stat;
     char file_info[4096];
 
-    for(int i = 0; i < num_usb_devices; i++) {
-        char full_file_path[4096];
-        memset(full_file_path, '\0', sizeof(full_file_path));
-        snprintf(full_file_path, sizeof(full_file_path), "%s%s%s", usb_devices[i].mount_point, usb_devices[i].storage_folder, file_path);
+    // Repeated INFOs of a path are answered without touching the devices
+    if (meta_cache_stat(usb_devices, num_usb_devices, file_path, &file_stat) == 0) {
+        char owner[64];
+        char group[64];
+        char mod_time[20];
+        char permissions[11];
+        struct tm local_time;
 
-        if (stat(full_file_path, &file_stat) == -1) {
-            continue;
-        } else {
-            struct passwd *user = getpwuid(file_stat.st_uid);
-            struct group *group = getgrgid(file_stat.st_gid);
-            char mod_time[20];
-            char permissions[11];
+        meta_cache_user(file_stat.st_uid, owner, sizeof(owner));
+        meta_cache_group(file_stat.st_gid, group, sizeof(group));
+        strftime(mod_time, sizeof(mod_time), "%Y-%m-%d %H:%M:%S", localtime_r(&file_stat.st_mtime, &local_time));
 
-            strftime(mod_time, sizeof(mod_time), "%Y-%m-%d %H:%M:%S", localtime(&file_stat.st_mtime));
+        // Convert permissions to ls -l style
+        snprintf(permissions, sizeof(permissions),
+                "%c%c%c%c%c%c%c%c%c%c",
+                S_ISDIR(file_stat.st_mode) ? 'd' : '-',
+                file_stat.st_mode & S_IRUSR ? 'r' : '-',
+                file_stat.st_mode & S_IWUSR ? 'w' : '-',
+                file_stat.st_mode & S_IXUSR ? 'x' : '-',
+                file_stat.st_mode & S_IRGRP ? 'r' : '-',
+                file_stat.st_mode & S_IWGRP ? 'w' : '-',
+                file_stat.st_mode & S_IXGRP ? 'x' : '-',
+                file_stat.st_mode & S_IROTH ? 'r' : '-',
+                file_stat.st_mode & S_IWOTH ? 'w' : '-',
+                file_stat.st_mode & S_IXOTH ? 'x' : '-');
 
-            // Convert permissions to ls -l style
-            snprintf(permissions, sizeof(permissions),
-                    "%c%c%c%c%c%c%c%c%c%c",
-                    S_ISDIR(file_stat.st_mode) ? 'd' : '-',
-                    file_stat.st_mode & S_IRUSR ? 'r' : '-',
-                    file_stat.st_mode & S_IWUSR ? 'w' : '-',
-                    file_stat.st_mode & S_IXUSR ? 'x' : '-',
-                    file_stat.st_mode & S_IRGRP ? 'r' : '-',
-                    file_stat.st_mode & S_IWGRP ? 'w' : '-',
-                    file_stat.st_mode & S_IXGRP ? 'x' : '-',
-                    file_stat.st_mode & S_IROTH ? 'r' : '-',
-                    file_stat.st_mode & S_IWOTH ? 'w' : '-',
-                    file_stat.st_mode & S_IXOTH ? 'x' : '-');
+        snprintf(file_info, sizeof(file_info),
+                "File: %s\n"
+                "Size: %ld bytes\n"
+                "Permissions: %s\n"
+                "Owner: %s\n"
+                "Group: %s\n"
+                "Last modified: %s\n",
+                file_path, file_stat.st_size, permissions,
+                owner, group, mod_time);
+        // Send the file information back to the client
+        connection_send_reply(conn, OP_OK, file_info, strlen(file_info));
+        return;
+    }
+    
+    // No device has the path
+    snprintf(file_info, sizeof(file_info), "ERROR: %s", strerror(errno));
+    connection_send_error(conn, file_info);
+}
+
+/**
+ * @brief Append one path's STAT record to the reply
+ * 
+ * @param out 
+ * @param st 
+ * @param error 
+ * @return size_t bytes written, names are under 64 bytes so at most STAT_RECORD_SIZE + 2 * 64
+ */
+static size_t put_stat_record(uint8_t *out, const struct stat *st, int error) {
+    frame_put_u16(out, (uint16_t)error);
+    if (error != 0) {
+        return 2;
+    }
+    frame_put_u32(out + 2, st->st_mode);
+    frame_put_u64(out + 6, st->st_size);
+    frame_put_u64(out + 14, st->st_mtim.tv_sec);
+    frame_put_u32(out + 22, st->st_mtim.tv_nsec);
+    frame_put_u32(out + 26, st->st_uid);
+    frame_put_u32(out + 30, st->st_gid);
+    size_t len = STAT_RECORD_SIZE;
 
-            snprintf(file_info, sizeof(file_info),
-                    "File: %s\n"
-                    "Size: %ld bytes\n"
-                    "Permissions: %s\n"
-                    "Owner: %s\n"
-                    "Group: %s\n"
-                    "Last modified: %s\n",
-                    file_path, file_stat.st_size, permissions,
-                    user->pw_name, group->gr_name, mod_time);
-            char status = 1;
-            if (send(client_sock, &status, sizeof(status), 0) < 0) {
-                perror("ERROR: send() failed");
-                return;
-            }
+    char name[64];
+    meta_cache_user(st->st_uid, name, sizeof(name));
+    out[len] = (uint8_t)strlen(name);
+    memcpy(out + len + 1, name, out[len]);
+    len += 1 + out[len];
+    meta_cache_group(st->st_gid, name, sizeof(name));
+    out[len] = (uint8_t)strlen(name);
+    memcpy(out + len + 1, name, out[len]);
+    len += 1 + out[len];
+    return len;
+}
 
-            // Send the file information back to the client
-            if (send(client_sock, file_info, strlen(file_info) + 1, 0) < 0) {
-                perror("ERROR: send() failed");
-            }
+/**
+ * @brief Handle a STAT command, a batched INFO answering many paths in one binary reply
+ * 
+ * @param conn 
+ * @param base_path directory the requested paths are relative to, empty for the storage folder
+ * @param usb_devices 
+ * @param num_usb_devices 
+ */
+void handle_stat_command(Connection *conn, const char *base_path, USBDevice* usb_devices, const int num_usb_devices) {
+    uint64_t body_len = conn->body_remaining;
+    if (body_len > STAT_MAX_BODY) {
+        if (connection_discard_body(conn) == 0) {
+            connection_send_error(conn, "Error: Too many paths");
+        }
+        return;
+    }
+
+    uint8_t *body = malloc(body_len > 0 ? body_len : 1);
+    if (body == NULL) {
+        connection_discard_body(conn);
+        connection_send_error(conn, "Error: Out of memory");
+        return;
+    }
+    size_t received = 0;
+    while (received < body_len) {
+        ssize_t n = connection_recv_body(conn, body + received, body_len - received);
+        if (n <= 0) {
+            // The client hung up mid-request
+            free(body);
+            conn->broken = 1;
             return;
         }
+        received += n;
     }
-    
-    // When the loop ends, an error occurred
-    snprintf(file_info, sizeof(file_info), "ERROR: %s", strerror(errno));
-    char status = 0;
-    if (send(client_sock, &status, sizeof(status), 0) < 0) {
-        perror("ERROR: send() failed");
+
+    // Count the paths first so the reply buffer is allocated once
+    uint32_t count = 0;
+    size_t offset = 0;
+    while (offset + 2 <= body_len) {
+        size_t len = frame_get_u16(body + offset);
+        if (len > FRAME_MAX_PATH || offset + 2 + len > body_len) {
+            break;
+        }
+        offset += 2 + len;
+        count++;
+    }
+    if (offset != body_len || count > STAT_MAX_PATHS) {
+        free(body);
+        connection_send_error(conn, "Error: Malformed path list");
         return;
     }
-    if (send(client_sock, file_info, strlen(file_info) + 1, 0) < 0) {
-        perror("ERROR: send() failed");
+
+    size_t max_record = STAT_RECORD_SIZE + 2 * 64;
+    uint8_t *reply = malloc(4 + (size_t)count * max_record);
+    if (reply == NULL) {
+        free(body);
+        connection_send_error(conn, "Error: Out of memory");
+        return;
+    }
+    frame_put_u32(reply, count);
+    size_t reply_len = 4;
+
+    size_t base_len = strlen(base_path);
+    char path[2 * FRAME_MAX_PATH + 2];
+    memcpy(path, base_path, base_len);
+    if (base_len > 0) {
+        path[base_len++] = '/';
     }
-}
\ No newline at end of file
+    offset = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        size_t len = frame_get_u16(body + offset);
+        memcpy(path + base_len, body + offset + 2, len);
+        path[base_len + len] = '\0';
+        offset += 2 + len;
+
+        // Each part fits a frame, together they may not
+        struct stat st;
+        int error = ENAMETOOLONG;
+        if (base_len + len <= FRAME_MAX_PATH) {
+            error = meta_cache_stat(usb_devices, num_usb_devices, path, &st) == 0 ? 0 : errno;
+        }
+        reply_len += put_stat_record(reply + reply_len, &st, error);
+    }
+    free(body);
+
+    connection_send_reply(conn, OP_OK, reply, reply_len);
+    free(reply);
+}
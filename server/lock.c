@@ -1,31 +1,270 @@
+#define _GNU_SOURCE
 #include "server.h"
 
-int lock_file_read(int fd) {
-    struct flock lock;
-    lock.l_type = F_RDLCK; // Read lock
-    lock.l_whence = SEEK_SET;
-    lock.l_start = 0;
-    lock.l_len = 0; // Lock the entire file
+#define LOCK_SHARDS 64
+
+struct PathLock {
+    char path[FRAME_MAX_PATH + 1];
+    uint64_t hash;
+    int readers;            // threads holding the lock shared
+    int writer;             // 1 while a thread holds it exclusively
+    int waiting_writers;    // queued writers, new readers wait behind them
+    int refs;               // holders and waiters, the entry is freed at 0
+    pthread_cond_t cond;
+    struct PathLock *next;
+};
 
-    return fcntl(fd, F_SETLK, &lock);
+typedef struct LockShard {
+    pthread_mutex_t mutex;
+    PathLock *head;
+} LockShard;
+
+static LockShard shards[LOCK_SHARDS];
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Initialise the shard mutexes once.
+ */
+static void init_shards(void) {
+    for (int i = 0; i < LOCK_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].mutex, NULL);
+        shards[i].head = NULL;
+    }
 }
 
-int lock_file_write(int fd) {
+/**
+ * @brief Normalise a logical path so "a//b/", "/a/b" and "./a/b" share one lock.
+ *
+ * @param path
+ * @param out
+ * @param size
+ */
+void normalize_path(const char *path, char *out, size_t size) {
+    size_t len = 0;
+    while (path[0] == '.' && path[1] == '/') {
+        path += 2;
+    }
+    for (const char *p = path; *p != '\0' && len < size - 1; p++) {
+        if (*p == '/' && (len == 0 || out[len - 1] == '/')) {
+            continue;
+        }
+        out[len++] = *p;
+    }
+    while (len > 0 && out[len - 1] == '/') {
+        len--;
+    }
+    out[len] = '\0';
+}
+
+/**
+ * @brief FNV-1a hash of the normalised path.
+ *
+ * @param path
+ * @return uint64_t
+ */
+static uint64_t hash_path(const char *path) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (const unsigned char *p = (const unsigned char *)path; *p != '\0'; p++) {
+        hash ^= *p;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * @brief Lock a logical path in the in-process lock table
+ *
+ * Readers share the lock, writers are exclusive and queued writers hold back
+ * new readers so a stream of GETs cannot starve a PUT or RM.
+ *
+ * @param path
+ * @param mode
+ * @param timeout_ms how long to wait, negative waits forever
+ * @return PathLock* the held lock, or NULL with errno set to ETIMEDOUT
+ */
+PathLock *path_lock_acquire(const char *path, PathLockMode mode, int timeout_ms) {
+    pthread_once(&shards_once, init_shards);
+
+    char key[FRAME_MAX_PATH + 1];
+    normalize_path(path, key, sizeof(key));
+    uint64_t hash = hash_path(key);
+    LockShard *shard = &shards[hash % LOCK_SHARDS];
+
+    struct timespec deadline;
+    if (timeout_ms >= 0) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    uint64_t wait_started = metrics_now();
+    pthread_mutex_lock(&shard->mutex);
+
+    PathLock *lock = shard->head;
+    while (lock != NULL && (lock->hash != hash || strcmp(lock->path, key) != 0)) {
+        lock = lock->next;
+    }
+    if (lock == NULL) {
+        lock = calloc(1, sizeof(PathLock));
+        if (lock == NULL) {
+            pthread_mutex_unlock(&shard->mutex);
+            return NULL;
+        }
+        strcpy(lock->path, key);
+        lock->hash = hash;
+        pthread_cond_init(&lock->cond, NULL);
+        lock->next = shard->head;
+        shard->head = lock;
+    }
+    lock->refs++;
+
+    int rc = 0;
+    if (mode == PATH_LOCK_WRITE) {
+        lock->waiting_writers++;
+        while (rc == 0 && (lock->writer || lock->readers > 0)) {
+            rc = timeout_ms >= 0 ? pthread_cond_timedwait(&lock->cond, &shard->mutex, &deadline)
+                                 : pthread_cond_wait(&lock->cond, &shard->mutex);
+        }
+        lock->waiting_writers--;
+        if (rc == 0) {
+            lock->writer = 1;
+        }
+    } else {
+        while (rc == 0 && (lock->writer || lock->waiting_writers > 0)) {
+            rc = timeout_ms >= 0 ? pthread_cond_timedwait(&lock->cond, &shard->mutex, &deadline)
+                                 : pthread_cond_wait(&lock->cond, &shard->mutex);
+        }
+        if (rc == 0) {
+            lock->readers++;
+        }
+    }
+
+    if (rc != 0) {
+        // Readers held back by this writer may go now
+        pthread_cond_broadcast(&lock->cond);
+        pthread_mutex_unlock(&shard->mutex);
+        path_lock_release(lock, PATH_LOCK_NONE);
+        metrics_phase_add(METRICS_LOCK, metrics_now() - wait_started);
+        errno = ETIMEDOUT;
+        return NULL;
+    }
+
+    pthread_mutex_unlock(&shard->mutex);
+    metrics_phase_add(METRICS_LOCK, metrics_now() - wait_started);
+    return lock;
+}
+
+/**
+ * @brief Release a lock taken with path_lock_acquire
+ *
+ * @param lock
+ * @param mode the mode it was acquired in
+ */
+void path_lock_release(PathLock *lock, PathLockMode mode) {
+    if (lock == NULL) {
+        return;
+    }
+    LockShard *shard = &shards[lock->hash % LOCK_SHARDS];
+
+    pthread_mutex_lock(&shard->mutex);
+    if (mode == PATH_LOCK_WRITE) {
+        lock->writer = 0;
+    } else if (mode == PATH_LOCK_READ) {
+        lock->readers--;
+    }
+    if (!lock->writer && (lock->readers == 0 || lock->waiting_writers == 0)) {
+        pthread_cond_broadcast(&lock->cond);
+    }
+
+    if (--lock->refs == 0) {
+        PathLock **link = &shard->head;
+        while (*link != lock) {
+            link = &(*link)->next;
+        }
+        *link = lock->next;
+        pthread_cond_destroy(&lock->cond);
+        free(lock);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+/**
+ * @brief Lock two different logical paths, always in the same order
+ *
+ * Requests naming the same two paths in opposite roles, a MOVE from a to b
+ * and one from b to a, take them in one global order and cannot deadlock.
+ *
+ * @param first
+ * @param first_mode
+ * @param second
+ * @param second_mode
+ * @param timeout_ms how long to wait for each lock, negative waits forever
+ * @param first_lock receives the lock on first
+ * @param second_lock receives the lock on second
+ * @return int 0 with both held, -1 with neither held and errno set to ETIMEDOUT
+ */
+int path_lock_acquire_pair(const char *first, PathLockMode first_mode, const char *second, PathLockMode second_mode,
+                           int timeout_ms, PathLock **first_lock, PathLock **second_lock) {
+    char first_key[FRAME_MAX_PATH + 1], second_key[FRAME_MAX_PATH + 1];
+    normalize_path(first, first_key, sizeof(first_key));
+    normalize_path(second, second_key, sizeof(second_key));
+    int swap = strcmp(first_key, second_key) > 0;
+
+    PathLock *outer = path_lock_acquire(swap ? second : first, swap ? second_mode : first_mode, timeout_ms);
+    if (outer == NULL) {
+        return -1;
+    }
+    PathLock *inner = path_lock_acquire(swap ? first : second, swap ? first_mode : second_mode, timeout_ms);
+    if (inner == NULL) {
+        path_lock_release(outer, swap ? second_mode : first_mode);
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    *first_lock = swap ? inner : outer;
+    *second_lock = swap ? outer : inner;
+    return 0;
+}
+
+/**
+ * @brief Set an open file description lock, only when cross_process_locks is enabled.
+ *
+ * OFD locks belong to the open file rather than the process, and F_OFD_SETLKW
+ * waits for a conflicting lock instead of failing straight away.
+ *
+ * @param fd
+ * @param type
+ * @return int 0 on success, -1 on failure
+ */
+static int set_file_lock(int fd, short type) {
+    if (!server_config.cross_process_locks) {
+        return 0;
+    }
+
     struct flock lock;
-    lock.l_type = F_WRLCK; // Write lock
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = type;
     lock.l_whence = SEEK_SET;
     lock.l_start = 0;
     lock.l_len = 0; // Lock the entire file
 
-    return fcntl(fd, F_SETLK, &lock);
+    int rc;
+    while ((rc = fcntl(fd, F_OFD_SETLKW, &lock)) == -1 && errno == EINTR) {
+    }
+    return rc;
 }
 
-int unlock_file(int fd) {
-    struct flock lock;
-    lock.l_type = F_UNLCK; // Unlock
-    lock.l_whence = SEEK_SET;
-    lock.l_start = 0;
-    lock.l_len = 0; // Unlock the entire file
+int lock_file_read(int fd) {
+    return set_file_lock(fd, F_RDLCK); // Read lock
+}
 
-    return fcntl(fd, F_SETLK, &lock);
-}
\ No newline at end of file
+int lock_file_write(int fd) {
+    return set_file_lock(fd, F_WRLCK); // Write lock
+}
+
+int unlock_file(int fd) {
+    return set_file_lock(fd, F_UNLCK); // Unlock
+}
@@ -0,0 +1,367 @@
+#define _GNU_SOURCE
+#include <sys/syscall.h>
+#include "server.h"
+
+#define LS_DEFAULT_LIMIT 1000
+#define LS_MAX_LIMIT 100000
+#define LS_MAX_DEPTH 32             // deeper directories are listed but not entered
+#define LS_DIRENT_BUFFER (64 * 1024)
+#define LS_CURSOR_VERSION 1
+
+/**
+ * @brief Entry layout returned by getdents64
+ */
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/**
+ * @brief An open directory on the walk, and where to read it from next
+ */
+typedef struct ListLevel {
+    int fd;
+    uint64_t offset;        // d_off of the last entry handled, 0 for the start
+    size_t rel_len;         // length of its path below the listed directory
+} ListLevel;
+
+/**
+ * @brief A listing in progress, everything needed to stop and resume it
+ */
+typedef struct Listing {
+    int device;
+    int recursive;
+    int depth;              // index of the innermost open level
+    ListLevel levels[LS_MAX_DEPTH + 1];
+    char rel[2 * FRAME_MAX_PATH + 2];   // path of the innermost level below the listed directory
+    int at_root;            // the listed directory is the storage folder itself
+} Listing;
+
+/**
+ * @brief Encode where a listing stopped, so the next LS carries on from there
+ *
+ * Offsets are getdents positions on one device, so the cursor names the device.
+ *
+ * @param listing
+ * @param out
+ * @return size_t cursor length
+ */
+static size_t encode_cursor(const Listing *listing, uint8_t *out) {
+    size_t len = 0;
+    out[len++] = LS_CURSOR_VERSION;
+    out[len++] = (uint8_t)listing->device;
+    out[len++] = (uint8_t)listing->depth;
+    for (int i = 0; i <= listing->depth; i++) {
+        frame_put_u64(out + len, listing->levels[i].offset);
+        len += 8;
+    }
+    size_t rel_len = listing->levels[listing->depth].rel_len;
+    memcpy(out + len, listing->rel, rel_len);
+    return len + rel_len;
+}
+
+/**
+ * @brief Reopen the directories a cursor points into
+ *
+ * A directory that disappeared since is skipped, its parent's offset
+ * already points past it.
+ *
+ * @param listing
+ * @param root open listed directory on the cursor's device
+ * @param cursor
+ * @param len
+ * @return int 0 on success, -1 if the cursor is malformed, with only root left open
+ */
+static int resume_cursor(Listing *listing, int root, const uint8_t *cursor, size_t len) {
+    listing->depth = 0;
+    listing->levels[0] = (ListLevel){ .fd = root, .offset = 0, .rel_len = 0 };
+    int depth = cursor[2];
+    if (depth > LS_MAX_DEPTH || len < 3 + 8 * (size_t)(depth + 1)) {
+        return -1;
+    }
+    const uint8_t *offsets = cursor + 3;
+    const char *rel = (const char *)offsets + 8 * (depth + 1);
+    size_t rel_len = len - 3 - 8 * (depth + 1);
+    if (rel_len >= sizeof(listing->rel) || memchr(rel, '\0', rel_len) != NULL) {
+        return -1;
+    }
+    memcpy(listing->rel, rel, rel_len);
+    listing->rel[rel_len] = '\0';
+
+    listing->levels[0].offset = frame_get_u64(offsets);
+    char *component = listing->rel;
+    for (int i = 1; i <= depth; i++) {
+        char *slash = strchr(component, '/');
+        size_t component_len = slash != NULL ? (size_t)(slash - component) : strlen(component);
+        char name[NAME_MAX + 1];
+        if (component_len == 0 || component_len > NAME_MAX || (i < depth) != (slash != NULL) ||
+            strncmp(component, ".", component_len) == 0 || strncmp(component, "..", component_len) == 0) {
+            while (listing->depth > 0) {
+                close(listing->levels[listing->depth--].fd);
+            }
+            return -1;
+        }
+        memcpy(name, component, component_len);
+        name[component_len] = '\0';
+
+        int fd = openat(listing->levels[i - 1].fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0) {
+            break;
+        }
+        listing->depth = i;
+        listing->levels[i] = (ListLevel){ .fd = fd, .offset = frame_get_u64(offsets + 8 * i),
+                                          .rel_len = (size_t)(component + component_len - listing->rel) };
+        component += component_len + 1;
+    }
+    listing->rel[listing->levels[listing->depth].rel_len] = '\0';
+    return 0;
+}
+
+/**
+ * @brief Append an entry's record to the frame buffer, sending the buffer first if it is full
+ *
+ * @param conn
+ * @param frame
+ * @param frame_len
+ * @param stx
+ * @param name
+ * @param name_len
+ * @return int 0 on success, -1 if the client went away
+ */
+static int add_record(Connection *conn, uint8_t *frame, size_t *frame_len, const struct statx *stx,
+                      const char *name, size_t name_len) {
+    if (*frame_len + LS_RECORD_SIZE + name_len > LS_MAX_DATA) {
+        if (connection_send_reply(conn, OP_LS_DATA, frame, *frame_len) < 0) {
+            return -1;
+        }
+        *frame_len = 0;
+    }
+    uint8_t *record = frame + *frame_len;
+    frame_put_u64(record, stx->stx_size);
+    frame_put_u64(record + 8, stx->stx_mtime.tv_sec);
+    frame_put_u32(record + 16, stx->stx_mtime.tv_nsec);
+    frame_put_u32(record + 20, stx->stx_mode);
+    frame_put_u16(record + 24, (uint16_t)name_len);
+    frame_put_u16(record + 26, 0);
+    memcpy(record + LS_RECORD_SIZE, name, name_len);
+    *frame_len += LS_RECORD_SIZE + name_len;
+    return 0;
+}
+
+/**
+ * @brief Walk the listing depth first until limit entries went out or nothing is left
+ *
+ * @param conn
+ * @param listing
+ * @param limit
+ * @param dirents getdents64 buffer
+ * @param frame records not sent yet
+ * @param frame_len
+ * @return int 1 if entries are left, 0 once the listing is complete, -1 on failure with errno set
+ */
+static int walk(Connection *conn, Listing *listing, uint32_t limit, char *dirents, uint8_t *frame, size_t *frame_len) {
+    uint32_t emitted = 0;
+
+    while (listing->depth >= 0) {
+        ListLevel *level = &listing->levels[listing->depth];
+        // Entries of a parent read before descending are read again from its offset
+        if (lseek(level->fd, level->offset, SEEK_SET) < 0) {
+            return -1;
+        }
+        long n = syscall(SYS_getdents64, level->fd, dirents, LS_DIRENT_BUFFER);
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            if (listing->depth == 0) {
+                return 0;
+            }
+            close(level->fd);
+            listing->depth--;
+            listing->rel[listing->levels[listing->depth].rel_len] = '\0';
+            continue;
+        }
+
+        for (long pos = 0; pos < n; ) {
+            struct linux_dirent64 *entry = (struct linux_dirent64 *)(dirents + pos);
+            pos += entry->d_reclen;
+            level->offset = entry->d_off;
+
+            const char *name = entry->d_name;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+                continue;
+            }
+            // The server's own bookkeeping is not part of the storage folder
+            if (listing->at_root && listing->depth == 0 && (strcmp(name, MANIFEST_FILE) == 0 || strcmp(name, UPLOAD_DIR) == 0 ||
+                                                            strcmp(name, CHECKSUM_DIR) == 0)) {
+                continue;
+            }
+
+            struct statx stx;
+            if (statx(level->fd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+                      STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME, &stx) < 0) {
+                // Removed since it was read
+                continue;
+            }
+
+            size_t rel_len = level->rel_len;
+            size_t name_len = strlen(name);
+            if (rel_len + 1 + name_len > FRAME_MAX_PATH) {
+                continue;
+            }
+            char *full_name = listing->rel;
+            if (rel_len > 0) {
+                full_name[rel_len] = '/';
+                memcpy(full_name + rel_len + 1, name, name_len + 1);
+                name_len += rel_len + 1;
+            } else {
+                memcpy(full_name, name, name_len + 1);
+            }
+            if (add_record(conn, frame, frame_len, &stx, full_name, name_len) < 0) {
+                errno = EPIPE;
+                return -1;
+            }
+            emitted++;
+
+            int descend = 0;
+            if (listing->recursive && S_ISDIR(stx.stx_mode) && listing->depth < LS_MAX_DEPTH) {
+                int fd = openat(level->fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                if (fd >= 0) {
+                    listing->depth++;
+                    listing->levels[listing->depth] = (ListLevel){ .fd = fd, .offset = 0, .rel_len = name_len };
+                    descend = 1;
+                }
+            }
+            if (!descend) {
+                full_name[rel_len] = '\0';
+            }
+            if (emitted == limit) {
+                return 1;
+            }
+            if (descend) {
+                break;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Handle an LS command, streaming a directory listing a bounded number of entries at a time
+ *
+ * Entries go out in OP_LS_DATA frames as the walk produces them, and at most
+ * limit of them per request, so neither side holds a whole directory with
+ * millions of entries. The final OP_OK carries the cursor to ask for the rest.
+ *
+ * @param conn
+ * @param dir_path
+ * @param usb_devices
+ * @param num_usb_devices
+ */
+void handle_ls_command(Connection *conn, const char *dir_path, USBDevice* usb_devices, const int num_usb_devices) {
+    if (conn->args_len < LS_ARGS_SIZE || strstr(dir_path, "..") != NULL) {
+        connection_send_error(conn, "Error: Invalid argument");
+        return;
+    }
+    uint32_t flags = frame_get_u32(conn->args);
+    uint32_t limit = frame_get_u32(conn->args + 4);
+    const uint8_t *cursor = conn->args + LS_ARGS_SIZE;
+    size_t cursor_len = conn->args_len - LS_ARGS_SIZE;
+    if (limit == 0) {
+        limit = LS_DEFAULT_LIMIT;
+    } else if (limit > LS_MAX_LIMIT) {
+        limit = LS_MAX_LIMIT;
+    }
+
+    Listing *listing = calloc(1, sizeof(Listing));
+    char *dirents = buffer_acquire(LS_DIRENT_BUFFER);
+    uint8_t *frame = buffer_acquire(LS_MAX_DATA);
+    if (listing == NULL || dirents == NULL || frame == NULL) {
+        free(listing);
+        buffer_release(dirents, LS_DIRENT_BUFFER);
+        buffer_release(frame, LS_MAX_DATA);
+        connection_send_error(conn, "Error: Out of memory");
+        return;
+    }
+    listing->recursive = (flags & LS_RECURSIVE) != 0;
+    char normalized[FRAME_MAX_PATH + 1];
+    normalize_path(dir_path, normalized, sizeof(normalized));
+    listing->at_root = normalized[0] == '\0';
+
+    // A new listing reads the first healthy replica that has the directory, a resumed one stays on its device
+    const char *failure = NULL;
+    int error = ENOENT;
+    int root = -1;
+    if (cursor_len > 0) {
+        listing->device = cursor_len >= 3 && cursor[0] == LS_CURSOR_VERSION ? cursor[1] : num_usb_devices;
+        if (listing->device >= num_usb_devices || !device_mounted(&usb_devices[listing->device])) {
+            failure = "Error: Listing cursor expired";
+        }
+    }
+    for (int i = 0; failure == NULL && i < num_usb_devices && root < 0; i++) {
+        int device = cursor_len > 0 ? listing->device : i;
+        if (cursor_len == 0 && (!device_mounted(&usb_devices[device]) || !replica_healthy(device))) {
+            continue;
+        }
+        char full_path[4096];
+        snprintf(full_path, sizeof(full_path), "%s%s%s", usb_devices[device].mount_point, usb_devices[device].storage_folder, dir_path);
+        root = open(full_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (root >= 0) {
+            listing->device = device;
+        } else {
+            // A replica that lacks the path does not hide why another one could not list it
+            if (error == ENOENT) {
+                error = errno;
+            }
+            if (cursor_len > 0) {
+                break;
+            }
+        }
+    }
+    if (failure == NULL && root < 0) {
+        failure = strerror(error);
+    }
+
+    if (failure == NULL) {
+        if (cursor_len > 0) {
+            if (resume_cursor(listing, root, cursor, cursor_len) < 0) {
+                failure = "Error: Malformed listing cursor";
+            }
+        } else {
+            listing->levels[0] = (ListLevel){ .fd = root, .offset = 0, .rel_len = 0 };
+        }
+    }
+
+    size_t frame_len = 0;
+    int more = 0;
+    if (failure == NULL) {
+        more = walk(conn, listing, limit, dirents, frame, &frame_len);
+        if (more < 0 && errno == EPIPE) {
+            failure = "";
+        } else if (more < 0) {
+            failure = strerror(errno);
+        } else if (frame_len > 0 && connection_send_reply(conn, OP_LS_DATA, frame, frame_len) < 0) {
+            failure = "";
+        }
+    }
+
+    if (failure == NULL) {
+        // The cursor is the whole reply, an empty one means the listing is complete
+        size_t cursor_out_len = more ? encode_cursor(listing, frame) : 0;
+        connection_send_reply(conn, OP_OK, frame, cursor_out_len);
+    } else if (failure[0] != '\0') {
+        connection_send_error(conn, failure);
+    }
+
+    if (root >= 0) {
+        for (int i = listing->depth; i >= 0; i--) {
+            close(listing->levels[i].fd);
+        }
+    }
+    free(listing);
+    buffer_release(dirents, LS_DIRENT_BUFFER);
+    buffer_release(frame, LS_MAX_DATA);
+}
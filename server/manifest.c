@@ -0,0 +1,755 @@
+#include <inttypes.h>
+#include "server.h"
+
+#define MANIFEST_HEADER "FSMANIFEST 1\n"
+#define MANIFEST_CHECKPOINT_OPS 64
+
+typedef struct ManifestEntry {
+    char *path;             // relative to the device root
+    uint64_t size;
+    int64_t mtime_sec;
+    long mtime_nsec;
+    uint64_t hash;
+    int is_dir;
+    int used;               // claimed by a rename during a diff
+} ManifestEntry;
+
+typedef struct Manifest {
+    ManifestEntry *entries;
+    size_t count;
+    size_t capacity;
+    size_t sorted;          // leading entries in path order, the ones manifest_find sees
+} Manifest;
+
+/**
+ * @brief A destination file that may have moved on the source, for rename detection.
+ */
+typedef struct RenameCandidate {
+    uint64_t hash;
+    uint64_t size;
+    size_t index;           // into the destination manifest
+} RenameCandidate;
+
+/**
+ * @brief Add an entry, taking a copy of the path.
+ *
+ * @param manifest
+ * @param entry
+ * @return ManifestEntry* the stored entry, NULL on allocation failure
+ */
+static ManifestEntry *manifest_add(Manifest *manifest, const ManifestEntry *entry) {
+    if (manifest->count == manifest->capacity) {
+        size_t capacity = manifest->capacity ? manifest->capacity * 2 : 256;
+        ManifestEntry *entries = realloc(manifest->entries, capacity * sizeof(ManifestEntry));
+        if (entries == NULL) {
+            return NULL;
+        }
+        manifest->entries = entries;
+        manifest->capacity = capacity;
+    }
+    ManifestEntry *stored = &manifest->entries[manifest->count];
+    *stored = *entry;
+    stored->path = strdup(entry->path);
+    if (stored->path == NULL) {
+        return NULL;
+    }
+    manifest->count++;
+    return stored;
+}
+
+/**
+ * @brief Free the entries of a manifest.
+ *
+ * @param manifest
+ */
+static void manifest_free(Manifest *manifest) {
+    for (size_t i = 0; i < manifest->count; i++) {
+        free(manifest->entries[i].path);
+    }
+    free(manifest->entries);
+    manifest->entries = NULL;
+    manifest->count = manifest->capacity = manifest->sorted = 0;
+}
+
+static int compare_entry_path(const void *a, const void *b) {
+    return strcmp(((const ManifestEntry *)a)->path, ((const ManifestEntry *)b)->path);
+}
+
+/**
+ * @brief Sort entries by path, parents before children, so lookups can bsearch.
+ *
+ * @param manifest
+ */
+static void manifest_sort(Manifest *manifest) {
+    qsort(manifest->entries, manifest->count, sizeof(ManifestEntry), compare_entry_path);
+    manifest->sorted = manifest->count;
+}
+
+/**
+ * @brief Find an entry by path among those sorted by the last manifest_sort.
+ *
+ * Entries added since then are not found.
+ *
+ * @param manifest
+ * @param path
+ * @return ManifestEntry* or NULL
+ */
+static ManifestEntry *manifest_find(const Manifest *manifest, const char *path) {
+    ManifestEntry key = { .path = (char *)path };
+    return bsearch(&key, manifest->entries, manifest->sorted, sizeof(ManifestEntry), compare_entry_path);
+}
+
+/**
+ * @brief Load a manifest written by manifest_save. A missing file is an empty manifest.
+ *
+ * @param file
+ * @param manifest
+ * @return int 0 on success, -1 if the file exists but cannot be used
+ */
+static int manifest_load(const char *file, Manifest *manifest) {
+    FILE *fp = fopen(file, "r");
+    if (fp == NULL) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    char line[4096];
+    if (fgets(line, sizeof(line), fp) == NULL || strcmp(line, MANIFEST_HEADER) != 0) {
+        fclose(fp);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        ManifestEntry entry = { 0 };
+        int offset = 0;
+        line[strcspn(line, "\n")] = '\0';
+        if (sscanf(line, "%d %" SCNx64 " %" SCNu64 " %" SCNd64 ".%ld %n",
+                   &entry.is_dir, &entry.hash, &entry.size, &entry.mtime_sec, &entry.mtime_nsec, &offset) != 5 ||
+            line[offset] == '\0') {
+            continue;
+        }
+        entry.path = line + offset;
+        if (manifest_add(manifest, &entry) == NULL) {
+            fclose(fp);
+            return -1;
+        }
+    }
+
+    fclose(fp);
+    manifest_sort(manifest);
+    return 0;
+}
+
+/**
+ * @brief Write a manifest atomically through a temporary file, leaving out dropped entries.
+ *
+ * Entries are written in whatever order they are in, manifest_load sorts them.
+ *
+ * @param file
+ * @param manifest
+ * @return int 0 on success, -1 on failure
+ */
+static int manifest_save(const char *file, const Manifest *manifest) {
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+
+    FILE *fp = fopen(tmp, "w");
+    if (fp == NULL) {
+        perror("fopen manifest");
+        return -1;
+    }
+
+    fputs(MANIFEST_HEADER, fp);
+    for (size_t i = 0; i < manifest->count; i++) {
+        const ManifestEntry *e = &manifest->entries[i];
+        if (e->is_dir == -1) {
+            continue;
+        }
+        fprintf(fp, "%d %016" PRIx64 " %" PRIu64 " %" PRId64 ".%09ld %s\n",
+                e->is_dir, e->hash, e->size, e->mtime_sec, e->mtime_nsec, e->path);
+    }
+
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+        perror("write manifest");
+        fclose(fp);
+        unlink(tmp);
+        return -1;
+    }
+    fclose(fp);
+
+    if (rename(tmp, file) < 0) {
+        perror("rename manifest");
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Hash a file's content, 8 bytes at a time.
+ *
+ * @param path
+ * @param hash
+ * @return int 0 on success, -1 on failure
+ */
+static int hash_file(const char *path, uint64_t *hash) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    uint64_t *words = buffer_acquire(BUFFER_BLOCK_MIN);
+    if (words == NULL) {
+        close(fd);
+        return -1;
+    }
+    uint64_t h = 0x9E3779B97F4A7C15ULL;
+    uint64_t total = 0;
+    ssize_t n;
+
+    while ((n = read(fd, words, BUFFER_BLOCK_MIN)) > 0) {
+        size_t full = n / sizeof(uint64_t);
+        for (size_t i = 0; i < full; i++) {
+            h ^= words[i];
+            h *= 0xFF51AFD7ED558CCDULL;
+            h ^= h >> 32;
+        }
+        // Mix in the tail bytes of a short read
+        const unsigned char *tail = (const unsigned char *)(words + full);
+        for (size_t i = 0; i < (size_t)n % sizeof(uint64_t); i++) {
+            h ^= tail[i];
+            h *= 0x100000001B3ULL;
+        }
+        total += n;
+    }
+    close(fd);
+    buffer_release(words, BUFFER_BLOCK_MIN);
+    if (n < 0) {
+        return -1;
+    }
+
+    h ^= total;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    *hash = h;
+    return 0;
+}
+
+/**
+ * @brief Walk a device tree into a manifest, reusing hashes from the previous
+ * manifest for files whose size and mtime have not changed.
+ *
+ * @param root
+ * @param relative current directory relative to root, "" at the top
+ * @param previous
+ * @param manifest
+ * @return int 0 on success, -1 on failure
+ */
+static int manifest_scan(const char *root, const char *relative, const Manifest *previous, Manifest *manifest) {
+    char dir_path[4096];
+    snprintf(dir_path, sizeof(dir_path), "%s/%s", root, relative);
+
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL) {
+        // A device without its storage folder yet is simply empty
+        return (errno == ENOENT && relative[0] == '\0') ? 0 : -1;
+    }
+
+    int result = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+            strncmp(entry->d_name, MANIFEST_FILE, strlen(MANIFEST_FILE)) == 0 ||
+            (relative[0] == '\0' && (strcmp(entry->d_name, UPLOAD_DIR) == 0 || strcmp(entry->d_name, CHECKSUM_DIR) == 0))) {
+            continue;
+        }
+
+        char rel_path[2048], full_path[4096];
+        snprintf(rel_path, sizeof(rel_path), "%s%s%s", relative, relative[0] ? "/" : "", entry->d_name);
+        snprintf(full_path, sizeof(full_path), "%s/%s", root, rel_path);
+
+        struct stat st;
+        if (lstat(full_path, &st) < 0) {
+            perror("lstat");
+            continue;
+        }
+
+        ManifestEntry item = {
+            .path = rel_path,
+            .size = S_ISREG(st.st_mode) ? (uint64_t)st.st_size : 0,
+            .mtime_sec = st.st_mtim.tv_sec,
+            .mtime_nsec = st.st_mtim.tv_nsec,
+            .is_dir = S_ISDIR(st.st_mode),
+        };
+
+        if (S_ISDIR(st.st_mode)) {
+            if (manifest_add(manifest, &item) == NULL || manifest_scan(root, rel_path, previous, manifest) < 0) {
+                result = -1;
+            }
+        } else if (S_ISREG(st.st_mode)) {
+            const ManifestEntry *known = previous ? manifest_find(previous, rel_path) : NULL;
+            if (known != NULL && !known->is_dir && known->size == item.size &&
+                known->mtime_sec == item.mtime_sec && known->mtime_nsec == item.mtime_nsec) {
+                item.hash = known->hash;
+            } else if (hash_file(full_path, &item.hash) < 0) {
+                perror("hash_file");
+                continue;
+            }
+            if (manifest_add(manifest, &item) == NULL) {
+                result = -1;
+            }
+        }
+    }
+
+    closedir(dir);
+    return result;
+}
+
+/**
+ * @brief Build the up to date manifest of a device and store it.
+ *
+ * @param root
+ * @param manifest_file
+ * @param manifest
+ * @return int 0 on success, -1 on failure
+ */
+static int manifest_refresh(const char *root, const char *manifest_file, Manifest *manifest) {
+    Manifest previous = { 0 };
+    if (manifest_load(manifest_file, &previous) < 0) {
+        fprintf(stderr, "Ignoring unreadable manifest %s\n", manifest_file);
+        manifest_free(&previous);
+    }
+
+    int result = manifest_scan(root, "", &previous, manifest);
+    manifest_free(&previous);
+    if (result < 0) {
+        return -1;
+    }
+    manifest_sort(manifest);
+    // A read-only device can still be a source, it just rehashes every time
+    manifest_save(manifest_file, manifest);
+    return 0;
+}
+
+/**
+ * @brief Create the parent directories of a relative path under root.
+ *
+ * @param root
+ * @param relative
+ */
+static void make_parents(const char *root, const char *relative) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", root, relative);
+    size_t root_len = strlen(root) + 1;
+    for (char *p = path + root_len; *p != '\0'; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            mkdir(path, 0755);
+            *p = '/';
+        }
+    }
+}
+
+/**
+ * @brief Record an entry in the destination manifest after the device has been changed.
+ *
+ * A path the destination did not have is appended unsorted, as a resync
+ * records each path at most once. Entries never move, so indices into the
+ * manifest stay valid for the whole resync.
+ *
+ * @param dst
+ * @param entry the new state, or NULL to drop the path
+ * @param path
+ */
+static void record_entry(Manifest *dst, const ManifestEntry *entry, const char *path) {
+    ManifestEntry *existing = manifest_find(dst, path);
+    if (entry == NULL) {
+        if (existing != NULL) {
+            // Left in place, manifest_save skips it
+            existing->is_dir = -1;
+        }
+        return;
+    }
+    if (existing != NULL) {
+        char *kept = existing->path;
+        *existing = *entry;
+        existing->path = kept;
+    } else {
+        manifest_add(dst, entry);
+    }
+}
+
+/**
+ * @brief Write the destination manifest as it stands.
+ *
+ * @param file
+ * @param dst
+ */
+static void checkpoint(const char *file, Manifest *dst) {
+    manifest_save(file, dst);
+}
+
+static int compare_candidate(const void *a, const void *b) {
+    const RenameCandidate *x = a, *y = b;
+    if (x->hash != y->hash) {
+        return x->hash < y->hash ? -1 : 1;
+    }
+    if (x->size != y->size) {
+        return x->size < y->size ? -1 : 1;
+    }
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/**
+ * @brief Index the destination files the source no longer has by content, for rename detection.
+ *
+ * @param src
+ * @param dst
+ * @param count receives the number of candidates
+ * @return RenameCandidate* sorted by hash and size, NULL if there are none or on allocation failure
+ */
+static RenameCandidate *rename_candidates(const Manifest *src, const Manifest *dst, size_t *count) {
+    *count = 0;
+    RenameCandidate *candidates = malloc((dst->count ? dst->count : 1) * sizeof(RenameCandidate));
+    if (candidates == NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i < dst->count; i++) {
+        const ManifestEntry *d = &dst->entries[i];
+        if (d->is_dir == 0 && manifest_find(src, d->path) == NULL) {
+            candidates[(*count)++] = (RenameCandidate){ .hash = d->hash, .size = d->size, .index = i };
+        }
+    }
+    qsort(candidates, *count, sizeof(RenameCandidate), compare_candidate);
+    return candidates;
+}
+
+/**
+ * @brief Find an unclaimed destination file with the content of a source file.
+ *
+ * @param candidates from rename_candidates
+ * @param count
+ * @param dst
+ * @param s
+ * @return ManifestEntry* or NULL
+ */
+static ManifestEntry *find_moved(const RenameCandidate *candidates, size_t count, Manifest *dst, const ManifestEntry *s) {
+    size_t low = 0, high = count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (candidates[mid].hash < s->hash || (candidates[mid].hash == s->hash && candidates[mid].size < s->size)) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    for (size_t i = low; i < count && candidates[i].hash == s->hash && candidates[i].size == s->size; i++) {
+        ManifestEntry *candidate = &dst->entries[candidates[i].index];
+        if (candidate->is_dir == 0 && !candidate->used) {
+            return candidate;
+        }
+    }
+    return NULL;
+}
+
+typedef struct Resync {
+    Manifest dst;           // what the destination holds, updated as files land
+    const char *src_root;
+    const char *dst_root;
+    const char *dst_manifest;
+    pthread_mutex_t mutex;
+    size_t copies;
+    uint64_t copy_bytes;
+    size_t done;
+    uint64_t done_bytes;
+    size_t since_checkpoint;
+    time_t last_report;     // when progress was last printed
+    size_t changed;         // files a client rewrote while they were being copied
+    int failures;
+} Resync;
+
+typedef struct ResyncCopy {
+    Resync *resync;
+    const ManifestEntry *entry;
+    char staging_path[4096];
+} ResyncCopy;
+
+/**
+ * @brief Record a file that now matches the source, checkpointing and reporting progress from time to time.
+ *
+ * @param resync
+ * @param entry the source entry
+ * @param bytes bytes written to the device for it
+ */
+static void resync_file_done(Resync *resync, const ManifestEntry *entry, uint64_t bytes) {
+    char dst_path[4096];
+    snprintf(dst_path, sizeof(dst_path), "%s/%s", resync->dst_root, entry->path);
+
+    // Match the source mtime so the next scan trusts the recorded hash
+    ManifestEntry result = *entry;
+    struct timespec times[2] = { { .tv_nsec = UTIME_OMIT }, { .tv_sec = entry->mtime_sec, .tv_nsec = entry->mtime_nsec } };
+    utimensat(AT_FDCWD, dst_path, times, 0);
+    struct stat st;
+    if (stat(dst_path, &st) == 0) {
+        result.mtime_sec = st.st_mtim.tv_sec;
+        result.mtime_nsec = st.st_mtim.tv_nsec;
+    }
+
+    pthread_mutex_lock(&resync->mutex);
+    record_entry(&resync->dst, &result, entry->path);
+    resync->done++;
+    resync->done_bytes += bytes;
+    if (++resync->since_checkpoint == MANIFEST_CHECKPOINT_OPS) {
+        checkpoint(resync->dst_manifest, &resync->dst);
+        resync->since_checkpoint = 0;
+    }
+    // Progress goes out at most once a second, printed after the mutex is dropped
+    time_t now = time(NULL);
+    int report = now != resync->last_report;
+    resync->last_report = now;
+    size_t done = resync->done;
+    uint64_t done_bytes = resync->done_bytes;
+    pthread_mutex_unlock(&resync->mutex);
+
+    if (report) {
+        printf("Resync %s: %zu/%zu files, %" PRIu64 "/%" PRIu64 " bytes\n", resync->dst_root,
+               done, resync->copies, done_bytes, resync->copy_bytes);
+    }
+}
+
+/**
+ * @brief Copy pool callback for a resync copy, moves the staged copy into place.
+ *
+ * The copy itself ran without the path lock. Under the lock the source is
+ * checked against its manifest entry; if a client rewrote it meanwhile the
+ * upload already reached this device too, so the stale copy is dropped.
+ *
+ * @param arg
+ * @param result
+ */
+static void resync_copy_done(void *arg, int result) {
+    ResyncCopy *copy = arg;
+    Resync *resync = copy->resync;
+    const ManifestEntry *entry = copy->entry;
+    if (result < 0) {
+        unlink(copy->staging_path);
+        free(copy);
+        return;
+    }
+
+    char src_path[4096], dst_path[4096];
+    snprintf(src_path, sizeof(src_path), "%s/%s", resync->src_root, entry->path);
+    snprintf(dst_path, sizeof(dst_path), "%s/%s", resync->dst_root, entry->path);
+
+    PathLock *lock = path_lock_acquire(entry->path, PATH_LOCK_WRITE, -1);
+    struct stat st;
+    if (stat(src_path, &st) < 0 || (uint64_t)st.st_size != entry->size ||
+        st.st_mtim.tv_sec != entry->mtime_sec || st.st_mtim.tv_nsec != entry->mtime_nsec) {
+        unlink(copy->staging_path);
+        pthread_mutex_lock(&resync->mutex);
+        resync->changed++;
+        pthread_mutex_unlock(&resync->mutex);
+    } else if (rename(copy->staging_path, dst_path) == 0) {
+        resync_file_done(resync, entry, entry->size);
+    } else {
+        perror("rename");
+        unlink(copy->staging_path);
+        pthread_mutex_lock(&resync->mutex);
+        resync->failures++;
+        pthread_mutex_unlock(&resync->mutex);
+    }
+    path_lock_release(lock, PATH_LOCK_WRITE);
+    free(copy);
+}
+
+/**
+ * @brief Bring a device up to date with another by copying, renaming and deleting only what differs
+ *
+ * Both devices' manifests are refreshed first, rehashing only files whose size
+ * or mtime changed. Directories and renames are applied on the calling thread,
+ * then the remaining files are copied by a pool of copy_threads threads into
+ * staging_dir and renamed into place, so a path is only locked for the rename.
+ * Progress is checkpointed into the destination manifest, so an interrupted
+ * resync picks up where it stopped.
+ *
+ * @param src_root
+ * @param src_manifest
+ * @param dst_root
+ * @param dst_manifest
+ * @param staging_dir on the destination's filesystem
+ * @param device index of the destination device
+ * @param throttle paces the copies, may be NULL
+ * @return int 1 on success, 0 on failure
+ */
+int resync_device(const char *src_root, const char *src_manifest, const char *dst_root, const char *dst_manifest,
+                  const char *staging_dir, int device, Throttle *throttle) {
+    Manifest src = { 0 };
+    Resync resync = { .src_root = src_root, .dst_root = dst_root, .dst_manifest = dst_manifest };
+    Manifest *dst = &resync.dst;
+
+    if (manifest_refresh(src_root, src_manifest, &src) < 0 ||
+        manifest_refresh(dst_root, dst_manifest, dst) < 0) {
+        fprintf(stderr, "Resync %s -> %s: cannot build manifests\n", src_root, dst_root);
+        manifest_free(&src);
+        manifest_free(dst);
+        return 0;
+    }
+    if (mkdir(dst_root, 0755) < 0 && errno != EEXIST) {
+        perror("mkdir");
+    }
+    if (mkdir(staging_dir, 0755) < 0 && errno != EEXIST) {
+        perror("mkdir");
+    }
+    pthread_mutex_init(&resync.mutex, NULL);
+
+    // Work out what has to change before touching the device
+    size_t deletes = 0;
+    unsigned char *pending = calloc(src.count ? src.count : 1, 1);
+    for (size_t i = 0; i < src.count; i++) {
+        const ManifestEntry *s = &src.entries[i];
+        const ManifestEntry *d = manifest_find(dst, s->path);
+        if (s->is_dir || (d != NULL && !d->is_dir && d->size == s->size && d->hash == s->hash)) {
+            continue;
+        }
+        resync.copies++;
+        resync.copy_bytes += s->size;
+    }
+    for (size_t i = 0; i < dst->count; i++) {
+        if (manifest_find(&src, dst->entries[i].path) == NULL) {
+            deletes++;
+        }
+    }
+    printf("Resync %s -> %s: %zu of %zu files differ (%" PRIu64 " bytes), %zu stale entries\n",
+           src_root, dst_root, resync.copies, src.count, resync.copy_bytes, deletes);
+
+    size_t num_candidates = 0;
+    RenameCandidate *candidates = rename_candidates(&src, dst, &num_candidates);
+    int success = pending != NULL;
+    size_t renames = 0;
+    char src_path[4096], dst_path[4096];
+
+    // Directories first, then content that only moved on the source is renamed into place
+    for (size_t i = 0; success && i < src.count; i++) {
+        const ManifestEntry *s = &src.entries[i];
+        ManifestEntry *d = manifest_find(dst, s->path);
+        snprintf(dst_path, sizeof(dst_path), "%s/%s", dst_root, s->path);
+
+        if (s->is_dir) {
+            if (d == NULL || !d->is_dir) {
+                if (d != NULL) {
+                    remove_file(dst_path);
+                }
+                if (mkdir(dst_path, 0755) < 0 && errno != EEXIST) {
+                    perror("mkdir");
+                    success = 0;
+                    continue;
+                }
+                record_entry(dst, s, s->path);
+            }
+            continue;
+        }
+        if (d != NULL && !d->is_dir && d->size == s->size && d->hash == s->hash) {
+            continue;
+        }
+        if (d != NULL && d->is_dir == 1) {
+            delete_directory(dst_path);
+            record_entry(dst, NULL, s->path);
+        }
+
+        ManifestEntry *moved = candidates != NULL ? find_moved(candidates, num_candidates, dst, s) : NULL;
+        if (moved == NULL) {
+            pending[i] = 1;
+            continue;
+        }
+
+        // Clients see the same logical paths, hold them off while the replica changes
+        PathLock *lock = path_lock_acquire(s->path, PATH_LOCK_WRITE, -1);
+        char old_path[4096];
+        snprintf(old_path, sizeof(old_path), "%s/%s", dst_root, moved->path);
+        make_parents(dst_root, s->path);
+        if (rename(old_path, dst_path) == 0) {
+            moved->used = 1;
+            moved->is_dir = -1;
+            renames++;
+            resync_file_done(&resync, s, 0);
+        } else {
+            perror("rename");
+            pending[i] = 1;
+        }
+        path_lock_release(lock, PATH_LOCK_WRITE);
+    }
+
+    // The destination manifest is only touched under the mutex from here on
+    CopyPool *pool = success ? copy_pool_start(device, throttle) : NULL;
+    uint64_t staging_id = random_id();
+    for (size_t i = 0; pool != NULL && i < src.count; i++) {
+        if (!pending[i]) {
+            continue;
+        }
+        const ManifestEntry *s = &src.entries[i];
+        ResyncCopy *copy = malloc(sizeof(ResyncCopy));
+        if (copy == NULL) {
+            pthread_mutex_lock(&resync.mutex);
+            resync.failures++;
+            pthread_mutex_unlock(&resync.mutex);
+            continue;
+        }
+        copy->resync = &resync;
+        copy->entry = s;
+        snprintf(copy->staging_path, sizeof(copy->staging_path), "%s/resync-%016" PRIx64 "-%zu", staging_dir, staging_id, i);
+        make_parents(dst_root, s->path);
+        snprintf(src_path, sizeof(src_path), "%s/%s", src_root, s->path);
+        if (copy_pool_submit(pool, src_path, copy->staging_path, resync_copy_done, copy) < 0) {
+            free(copy);
+            pthread_mutex_lock(&resync.mutex);
+            resync.failures++;
+            pthread_mutex_unlock(&resync.mutex);
+        }
+    }
+    if (pool != NULL) {
+        resync.failures += copy_pool_finish(pool);
+    } else {
+        success = 0;
+    }
+    if (resync.failures > 0) {
+        success = 0;
+    }
+
+    // Drop what the source no longer has, children before their directories
+    for (size_t i = dst->count; i-- > 0; ) {
+        ManifestEntry *d = &dst->entries[i];
+        if (d->is_dir == -1 || manifest_find(&src, d->path) != NULL) {
+            continue;
+        }
+        // A client may have created the path on every device since the source was scanned
+        PathLock *lock = path_lock_acquire(d->path, PATH_LOCK_WRITE, -1);
+        struct stat st;
+        snprintf(src_path, sizeof(src_path), "%s/%s", src_root, d->path);
+        if (lstat(src_path, &st) == 0) {
+            path_lock_release(lock, PATH_LOCK_WRITE);
+            continue;
+        }
+        snprintf(dst_path, sizeof(dst_path), "%s/%s", dst_root, d->path);
+        int removed = d->is_dir ? rmdir(dst_path) == 0 : remove_file(dst_path);
+        int error = errno;
+        path_lock_release(lock, PATH_LOCK_WRITE);
+        if (!removed && error != ENOENT) {
+            errno = error;
+            perror("resync remove");
+            success = 0;
+            continue;
+        }
+        d->is_dir = -1;
+    }
+
+    manifest_sort(dst);
+    checkpoint(dst_manifest, dst);
+    printf("Resync %s -> %s %s: %zu copied, %zu renamed, %zu changed by clients meanwhile\n", src_root, dst_root,
+           success ? "complete" : "incomplete", resync.done - renames, renames, resync.changed);
+
+    pthread_mutex_destroy(&resync.mutex);
+    free(pending);
+    free(candidates);
+    manifest_free(&src);
+    manifest_free(dst);
+    return success;
+}
@@ -0,0 +1,316 @@
+#define _GNU_SOURCE
+#include "server.h"
+
+#define STAT_BUCKETS 16384
+#define NAME_SLOTS 256
+#define NAME_TTL_SEC 300        // how long a uid or gid name is trusted
+
+/**
+ * @brief The stat result of a logical path, or the error it gave
+ */
+typedef struct StatEntry {
+    char *key;              // normalised logical path
+    uint64_t hash;
+    int error;              // 0, or ENOENT/ENOTDIR for a path known to be missing
+    struct stat st;
+    struct StatEntry *hash_next;
+    struct StatEntry *prev;
+    struct StatEntry *next;
+} StatEntry;
+
+/**
+ * @brief A resolved user or group name
+ */
+typedef struct NameEntry {
+    int used;
+    int is_group;
+    unsigned int id;
+    time_t expires;
+    char name[64];
+} NameEntry;
+
+static StatEntry *stat_buckets[STAT_BUCKETS];
+static StatEntry *lru_head = NULL;     // most recently used
+static StatEntry *lru_tail = NULL;     // next to be evicted
+static int num_entries = 0;
+static int max_entries = 0;
+static uint64_t stat_generation = 0;   // bumped by every invalidation
+static pthread_mutex_t stat_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static NameEntry names[NAME_SLOTS];
+static pthread_mutex_t name_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief FNV-1a hash of a normalised path.
+ *
+ * @param key
+ * @return uint64_t
+ */
+static uint64_t hash_key(const char *key) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (const unsigned char *p = (const unsigned char *)key; *p != '\0'; p++) {
+        hash ^= *p;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void lru_remove(StatEntry *entry) {
+    if (entry->prev != NULL) {
+        entry->prev->next = entry->next;
+    } else {
+        lru_head = entry->next;
+    }
+    if (entry->next != NULL) {
+        entry->next->prev = entry->prev;
+    } else {
+        lru_tail = entry->prev;
+    }
+}
+
+static void lru_push_head(StatEntry *entry) {
+    entry->prev = NULL;
+    entry->next = lru_head;
+    if (lru_head != NULL) {
+        lru_head->prev = entry;
+    } else {
+        lru_tail = entry;
+    }
+    lru_head = entry;
+}
+
+/**
+ * @brief Unlink and free an entry, called with stat_mutex held.
+ *
+ * @param entry
+ */
+static void drop_entry(StatEntry *entry) {
+    StatEntry **link = &stat_buckets[entry->hash % STAT_BUCKETS];
+    while (*link != entry) {
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+    lru_remove(entry);
+    num_entries--;
+    free(entry->key);
+    free(entry);
+}
+
+static StatEntry *find_entry(const char *key, uint64_t hash) {
+    StatEntry *entry = stat_buckets[hash % STAT_BUCKETS];
+    while (entry != NULL && (entry->hash != hash || strcmp(entry->key, key) != 0)) {
+        entry = entry->hash_next;
+    }
+    return entry;
+}
+
+/**
+ * @brief Size the stat cache, 0 entries turns it off
+ *
+ * @param entries
+ */
+void meta_cache_start(int entries) {
+    max_entries = entries;
+}
+
+/**
+ * @brief Stat a logical path on the first device that has it, through the cache
+ *
+ * Missing paths are remembered too, an inventory of files that are gone
+ * should not cost a stat per device every time.
+ *
+ * @param usb_devices
+ * @param num_usb_devices
+ * @param path
+ * @param st
+ * @return int 0 on success, -1 with errno set
+ */
+int meta_cache_stat(USBDevice *usb_devices, int num_usb_devices, const char *path, struct stat *st) {
+    char key[FRAME_MAX_PATH + 1];
+    // A path the key cannot hold would share an entry with every other path it truncates to
+    int cached = max_entries > 0 && strlen(path) < sizeof(key);
+    normalize_path(path, key, sizeof(key));
+    uint64_t hash = hash_key(key);
+    uint64_t since = 0;
+
+    if (cached) {
+        pthread_mutex_lock(&stat_mutex);
+        StatEntry *entry = find_entry(key, hash);
+        if (entry != NULL) {
+            lru_remove(entry);
+            lru_push_head(entry);
+            int error = entry->error;
+            *st = entry->st;
+            pthread_mutex_unlock(&stat_mutex);
+            errno = error;
+            return error == 0 ? 0 : -1;
+        }
+        since = stat_generation;
+        pthread_mutex_unlock(&stat_mutex);
+    }
+
+    int error = ENOENT;
+    for (int i = 0; i < num_usb_devices; i++) {
+        if (resync_active(i)) {
+            continue;
+        }
+        char full_path[4096];
+        snprintf(full_path, sizeof(full_path), "%s%s%s", usb_devices[i].mount_point, usb_devices[i].storage_folder, path);
+        if (stat(full_path, st) == 0) {
+            error = 0;
+            break;
+        }
+        error = errno;
+    }
+
+    // Only answers that hold until the path is changed through this server are kept
+    if (cached && (error == 0 || error == ENOENT || error == ENOTDIR)) {
+        StatEntry *entry = calloc(1, sizeof(StatEntry));
+        if (entry != NULL && (entry->key = strdup(key)) != NULL) {
+            entry->hash = hash;
+            entry->error = error;
+            if (error == 0) {
+                entry->st = *st;
+            }
+            pthread_mutex_lock(&stat_mutex);
+            if (since == stat_generation && find_entry(key, hash) == NULL) {
+                entry->hash_next = stat_buckets[hash % STAT_BUCKETS];
+                stat_buckets[hash % STAT_BUCKETS] = entry;
+                lru_push_head(entry);
+                entry = NULL;
+                if (++num_entries > max_entries) {
+                    drop_entry(lru_tail);
+                }
+            }
+            pthread_mutex_unlock(&stat_mutex);
+        }
+        if (entry != NULL) {
+            free(entry->key);
+            free(entry);
+        }
+    }
+
+    errno = error;
+    return error == 0 ? 0 : -1;
+}
+
+/**
+ * @brief Forget the stat results of a logical path and its parent
+ *
+ * The parent goes too, creating or removing an entry changes its directory.
+ *
+ * @param path the root of the storage folder forgets everything
+ * @param subtree also forget everything below the path
+ */
+void meta_cache_invalidate(const char *path, int subtree) {
+    if (max_entries == 0) {
+        return;
+    }
+    char key[FRAME_MAX_PATH + 1];
+    normalize_path(path, key, sizeof(key));
+    size_t len = strlen(key);
+    char parent[FRAME_MAX_PATH + 1];
+    memcpy(parent, key, len + 1);
+    char *slash = strrchr(parent, '/');
+    if (slash != NULL) {
+        *slash = '\0';
+    } else {
+        parent[0] = '\0';
+    }
+
+    pthread_mutex_lock(&stat_mutex);
+    stat_generation++;
+    if (len == 0) {
+        while (lru_head != NULL) {
+            drop_entry(lru_head);
+        }
+    } else {
+        StatEntry *entry = find_entry(parent, hash_key(parent));
+        if (entry != NULL) {
+            drop_entry(entry);
+        }
+        entry = find_entry(key, hash_key(key));
+        if (entry != NULL) {
+            drop_entry(entry);
+        }
+        for (StatEntry *next, *candidate = subtree ? lru_head : NULL; candidate != NULL; candidate = next) {
+            next = candidate->next;
+            if (strncmp(candidate->key, key, len) == 0 && candidate->key[len] == '/') {
+                drop_entry(candidate);
+            }
+        }
+    }
+    pthread_mutex_unlock(&stat_mutex);
+}
+
+/**
+ * @brief Resolve a uid or gid to its name, the number itself if it has none
+ *
+ * Uses the reentrant NSS calls and keeps the answer for NAME_TTL_SEC, so a
+ * directory listing of one owner's files asks NSS once.
+ *
+ * @param id
+ * @param is_group
+ * @param out
+ * @param size
+ */
+static void lookup_name(unsigned int id, int is_group, char *out, size_t size) {
+    time_t now = time(NULL);
+    unsigned int slot = (id * 2654435761u + (unsigned int)is_group) % NAME_SLOTS;
+
+    pthread_mutex_lock(&name_mutex);
+    NameEntry *entry = &names[slot];
+    if (entry->used && entry->id == id && entry->is_group == is_group && entry->expires > now) {
+        snprintf(out, size, "%s", entry->name);
+        pthread_mutex_unlock(&name_mutex);
+        return;
+    }
+    pthread_mutex_unlock(&name_mutex);
+
+    char buffer[4096];
+    char name[64];
+    snprintf(name, sizeof(name), "%u", id);
+    if (is_group) {
+        struct group group, *found = NULL;
+        if (getgrgid_r(id, &group, buffer, sizeof(buffer), &found) == 0 && found != NULL) {
+            snprintf(name, sizeof(name), "%s", found->gr_name);
+        }
+    } else {
+        struct passwd user, *found = NULL;
+        if (getpwuid_r(id, &user, buffer, sizeof(buffer), &found) == 0 && found != NULL) {
+            snprintf(name, sizeof(name), "%s", found->pw_name);
+        }
+    }
+
+    // Colliding ids simply take turns in the slot
+    pthread_mutex_lock(&name_mutex);
+    entry->used = 1;
+    entry->id = id;
+    entry->is_group = is_group;
+    entry->expires = now + NAME_TTL_SEC;
+    snprintf(entry->name, sizeof(entry->name), "%s", name);
+    pthread_mutex_unlock(&name_mutex);
+    snprintf(out, size, "%s", name);
+}
+
+/**
+ * @brief Name of a user, its uid as text if it has none
+ *
+ * @param uid
+ * @param out
+ * @param size
+ */
+void meta_cache_user(uid_t uid, char *out, size_t size) {
+    lookup_name(uid, 0, out, size);
+}
+
+/**
+ * @brief Name of a group, its gid as text if it has none
+ *
+ * @param gid
+ * @param out
+ * @param size
+ */
+void meta_cache_group(gid_t gid, char *out, size_t size) {
+    lookup_name(gid, 1, out, size);
+}
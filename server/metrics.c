@@ -0,0 +1,571 @@
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/uio.h>
+#include "server.h"
+
+// Log-linear buckets as in HdrHistogram: 8 per power of two, so a recorded
+// latency is off by at most 12.5%, from 1 ns up to METRICS_MAX_NS
+#define SUB_BUCKET_BITS 3
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define MAX_EXPONENT 40
+#define METRICS_MAX_NS ((1ull << (MAX_EXPONENT + 1)) - 1)
+#define NUM_BUCKETS ((MAX_EXPONENT - SUB_BUCKET_BITS + 2) * SUB_BUCKETS)
+#define METRICS_COMMANDS 16     // opcodes below 0x10, slot 0 for anything unknown
+
+typedef struct Histogram {
+    _Atomic uint64_t counts[NUM_BUCKETS];
+    _Atomic uint64_t sum_ns;
+} Histogram;
+
+/**
+ * @brief Counters written by one thread only, so updates need no locked instructions
+ *
+ * Slots of threads that exit are reused by the next thread that records,
+ * which keeps every counter cumulative.
+ */
+typedef struct MetricsThread {
+    Histogram histograms[METRICS_COMMANDS][METRICS_PHASES];
+    _Atomic uint64_t device_bytes[MAX_USB_DEVICES][2];
+    _Atomic uint64_t device_ops[MAX_USB_DEVICES][2];
+    struct MetricsThread *next;      // every slot ever made
+    struct MetricsThread *next_free;
+} MetricsThread;
+
+static const char *command_names[METRICS_COMMANDS] = {
+    "UNKNOWN", "GET", "INFO", "MD", "PUT", "RM", "GET_RANGE", "UPLOAD_BEGIN", "UPLOAD_CHUNK",
+    "UPLOAD_STATUS", "UPLOAD_COMMIT", "STAT", "LS", "COPY", "MOVE", "STATS"
+};
+static const char *phase_names[METRICS_PHASES] = { "parse", "lock", "device", "network", "total" };
+
+// Bucket bounds of the Prometheus histogram, in seconds
+static const double export_bounds[] = {
+    0.00001, 0.000025, 0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005,
+    0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+
+static MetricsThread *all_threads = NULL;
+static MetricsThread *free_threads = NULL;
+static pthread_mutex_t threads_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t thread_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+static __thread MetricsThread *local = NULL;
+static __thread uint64_t request_start;
+static __thread uint64_t request_parse_ns;
+static __thread uint64_t request_phase_ns[METRICS_PHASES];
+
+static atomic_long active_connections = 0;
+static _Atomic uint64_t accepted_connections = 0;
+static int metrics_num_devices = 0;
+
+/**
+ * @brief Give an exiting thread's slot to the next thread that records.
+ *
+ * @param slot
+ */
+static void release_thread(void *slot) {
+    pthread_mutex_lock(&threads_mutex);
+    ((MetricsThread *)slot)->next_free = free_threads;
+    free_threads = slot;
+    pthread_mutex_unlock(&threads_mutex);
+}
+
+static void make_thread_key(void) {
+    pthread_key_create(&thread_key, release_thread);
+}
+
+/**
+ * @brief The calling thread's slot, taken on its first record.
+ *
+ * @return MetricsThread* NULL if none could be allocated
+ */
+static MetricsThread *thread_slot(void) {
+    if (local != NULL) {
+        return local;
+    }
+    pthread_once(&key_once, make_thread_key);
+    pthread_mutex_lock(&threads_mutex);
+    MetricsThread *slot = free_threads;
+    if (slot != NULL) {
+        free_threads = slot->next_free;
+    } else if ((slot = calloc(1, sizeof(MetricsThread))) != NULL) {
+        slot->next = all_threads;
+        all_threads = slot;
+    }
+    pthread_mutex_unlock(&threads_mutex);
+    if (slot != NULL) {
+        pthread_setspecific(thread_key, slot);
+    }
+    local = slot;
+    return slot;
+}
+
+/**
+ * @brief Add to a counter only this thread writes.
+ *
+ * @param counter
+ * @param value
+ */
+static inline void counter_add(_Atomic uint64_t *counter, uint64_t value) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+/**
+ * @brief The bucket a latency falls in.
+ *
+ * @param ns
+ * @return int
+ */
+static inline int bucket_index(uint64_t ns) {
+    if (ns > METRICS_MAX_NS) {
+        ns = METRICS_MAX_NS;
+    }
+    if (ns < SUB_BUCKETS) {
+        return (int)ns;
+    }
+    int exponent = 63 - __builtin_clzll(ns);
+    int sub = (int)(ns >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+    return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+/**
+ * @brief The largest latency a bucket holds.
+ *
+ * @param index
+ * @return uint64_t nanoseconds
+ */
+static uint64_t bucket_upper(int index) {
+    if (index < SUB_BUCKETS) {
+        return index;
+    }
+    int exponent = index / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+    uint64_t width = 1ull << (exponent - SUB_BUCKET_BITS);
+    return (uint64_t)(SUB_BUCKETS + index % SUB_BUCKETS) * width + width - 1;
+}
+
+/**
+ * @brief Nanoseconds on the monotonic clock, for timing phases.
+ *
+ * @return uint64_t
+ */
+uint64_t metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * @brief Start timing a request whose frame took parse_started until now to decode.
+ *
+ * @param parse_started
+ */
+void metrics_request_begin(uint64_t parse_started) {
+    request_start = metrics_now();
+    request_parse_ns = request_start - parse_started;
+    for (int i = 0; i < METRICS_PHASES; i++) {
+        request_phase_ns[i] = 0;
+    }
+}
+
+/**
+ * @brief Charge time to a phase of the request the calling thread is running.
+ *
+ * @param phase METRICS_LOCK or METRICS_NETWORK
+ * @param ns
+ */
+void metrics_phase_add(MetricsPhase phase, uint64_t ns) {
+    request_phase_ns[phase] += ns;
+}
+
+/**
+ * @brief Record the phases of the request the calling thread has finished.
+ *
+ * Device time is whatever the handler spent outside lock waits and the
+ * socket: opens, stats, reads and writes, and waits for device writers.
+ *
+ * @param opcode
+ */
+void metrics_request_end(uint8_t opcode) {
+    MetricsThread *slot = thread_slot();
+    if (slot == NULL) {
+        return;
+    }
+    uint64_t handler_ns = metrics_now() - request_start;
+    uint64_t outside = request_phase_ns[METRICS_LOCK] + request_phase_ns[METRICS_NETWORK];
+    request_phase_ns[METRICS_PARSE] = request_parse_ns;
+    request_phase_ns[METRICS_DEVICE] = handler_ns > outside ? handler_ns - outside : 0;
+    request_phase_ns[METRICS_TOTAL] = request_parse_ns + handler_ns;
+
+    Histogram *histograms = slot->histograms[opcode < METRICS_COMMANDS ? opcode : 0];
+    for (int i = 0; i < METRICS_PHASES; i++) {
+        counter_add(&histograms[i].counts[bucket_index(request_phase_ns[i])], 1);
+        counter_add(&histograms[i].sum_ns, request_phase_ns[i]);
+    }
+}
+
+/**
+ * @brief Requests finished so far, and how many of them took longer than a threshold.
+ *
+ * Both counts are cumulative, callers compare two readings. The threshold is
+ * rounded to a bucket bound, within the histograms' 12.5%.
+ *
+ * @param threshold_ns
+ * @param total receives the number of requests
+ * @return uint64_t requests slower than threshold_ns
+ */
+uint64_t metrics_requests_over(uint64_t threshold_ns, uint64_t *total) {
+    int first_over = bucket_index(threshold_ns) + 1;
+    uint64_t over = 0, all = 0;
+    pthread_mutex_lock(&threads_mutex);
+    for (MetricsThread *slot = all_threads; slot != NULL; slot = slot->next) {
+        for (int c = 0; c < METRICS_COMMANDS; c++) {
+            const Histogram *h = &slot->histograms[c][METRICS_TOTAL];
+            for (int b = 0; b < NUM_BUCKETS; b++) {
+                uint64_t count = atomic_load_explicit(&h->counts[b], memory_order_relaxed);
+                all += count;
+                if (b >= first_over) {
+                    over += count;
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&threads_mutex);
+    *total = all;
+    return over;
+}
+
+/**
+ * @brief Count bytes read from or written to a device.
+ *
+ * @param device
+ * @param write 1 for a write, 0 for a read
+ * @param bytes
+ */
+void metrics_device_io(int device, int write, uint64_t bytes) {
+    MetricsThread *slot = thread_slot();
+    if (slot == NULL || device < 0 || device >= MAX_USB_DEVICES) {
+        return;
+    }
+    counter_add(&slot->device_bytes[device][write], bytes);
+    counter_add(&slot->device_ops[device][write], 1);
+}
+
+/**
+ * @brief Count a client connection opening or closing.
+ *
+ * @param delta 1 on accept, -1 on close
+ */
+void metrics_connection(int delta) {
+    atomic_fetch_add_explicit(&active_connections, delta, memory_order_relaxed);
+    if (delta > 0) {
+        atomic_fetch_add_explicit(&accepted_connections, 1, memory_order_relaxed);
+    }
+}
+
+/**
+ * @brief A growing text buffer.
+ */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+    int failed;
+} Text;
+
+static void text_printf(Text *text, const char *format, ...) {
+    while (!text->failed) {
+        va_list args;
+        va_start(args, format);
+        int n = vsnprintf(text->data + text->len, text->capacity - text->len, format, args);
+        va_end(args);
+        if (n < 0) {
+            text->failed = 1;
+            return;
+        }
+        if ((size_t)n < text->capacity - text->len) {
+            text->len += n;
+            return;
+        }
+        size_t capacity = text->capacity * 2 + n;
+        char *grown = realloc(text->data, capacity);
+        if (grown == NULL) {
+            text->failed = 1;
+            return;
+        }
+        text->data = grown;
+        text->capacity = capacity;
+    }
+}
+
+/**
+ * @brief The latency below which a fraction of the recorded requests fall.
+ *
+ * @param counts
+ * @param total
+ * @param fraction
+ * @return double seconds
+ */
+static double quantile(const uint64_t *counts, uint64_t total, double fraction) {
+    uint64_t rank = (uint64_t)(fraction * total + 0.999999);
+    uint64_t seen = 0;
+    for (int i = 0; i < NUM_BUCKETS; i++) {
+        seen += counts[i];
+        if (seen >= rank) {
+            return bucket_upper(i) / 1e9;
+        }
+    }
+    return bucket_upper(NUM_BUCKETS - 1) / 1e9;
+}
+
+/**
+ * @brief Write the latency histograms of every command and phase that saw a request.
+ *
+ * @param text
+ */
+static void format_latencies(Text *text) {
+    static uint64_t counts[NUM_BUCKETS];
+    static double quantiles[METRICS_COMMANDS][METRICS_PHASES][3];
+    static uint64_t totals[METRICS_COMMANDS][METRICS_PHASES];
+    static const double fractions[3] = { 0.5, 0.99, 0.999 };
+
+    text_printf(text, "# HELP fs_request_duration_seconds Time spent on requests by command and phase\n");
+    text_printf(text, "# TYPE fs_request_duration_seconds histogram\n");
+    for (int c = 0; c < METRICS_COMMANDS; c++) {
+        for (int p = 0; p < METRICS_PHASES; p++) {
+            memset(counts, 0, sizeof(counts));
+            uint64_t total = 0, sum_ns = 0;
+            for (MetricsThread *slot = all_threads; slot != NULL; slot = slot->next) {
+                Histogram *h = &slot->histograms[c][p];
+                for (int i = 0; i < NUM_BUCKETS; i++) {
+                    uint64_t n = atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+                    counts[i] += n;
+                    total += n;
+                }
+                sum_ns += atomic_load_explicit(&h->sum_ns, memory_order_relaxed);
+            }
+            totals[c][p] = total;
+            if (total == 0) {
+                continue;
+            }
+
+            char labels[64];
+            snprintf(labels, sizeof(labels), "command=\"%s\",phase=\"%s\"", command_names[c], phase_names[p]);
+            uint64_t cumulative = 0;
+            int bucket = 0;
+            for (size_t b = 0; b < sizeof(export_bounds) / sizeof(export_bounds[0]); b++) {
+                while (bucket < NUM_BUCKETS && bucket_upper(bucket) / 1e9 <= export_bounds[b]) {
+                    cumulative += counts[bucket++];
+                }
+                text_printf(text, "fs_request_duration_seconds_bucket{%s,le=\"%g\"} %llu\n",
+                            labels, export_bounds[b], (unsigned long long)cumulative);
+            }
+            text_printf(text, "fs_request_duration_seconds_bucket{%s,le=\"+Inf\"} %llu\n", labels, (unsigned long long)total);
+            text_printf(text, "fs_request_duration_seconds_sum{%s} %.9f\n", labels, sum_ns / 1e9);
+            text_printf(text, "fs_request_duration_seconds_count{%s} %llu\n", labels, (unsigned long long)total);
+            for (int q = 0; q < 3; q++) {
+                quantiles[c][p][q] = quantile(counts, total, fractions[q]);
+            }
+        }
+    }
+
+    text_printf(text, "# HELP fs_request_duration_quantile_seconds Latency quantiles from the same histograms\n");
+    text_printf(text, "# TYPE fs_request_duration_quantile_seconds gauge\n");
+    for (int c = 0; c < METRICS_COMMANDS; c++) {
+        for (int p = 0; p < METRICS_PHASES; p++) {
+            for (int q = 0; totals[c][p] > 0 && q < 3; q++) {
+                text_printf(text, "fs_request_duration_quantile_seconds{command=\"%s\",phase=\"%s\",quantile=\"%g\"} %.9f\n",
+                            command_names[c], phase_names[p], fractions[q], quantiles[c][p][q]);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Render every metric in the Prometheus text format.
+ *
+ * @param length receives the text length
+ * @return char* the text, for the caller to free, or NULL if it could not be built
+ */
+char *metrics_format(size_t *length) {
+    Text text = { .data = malloc(16384), .len = 0, .capacity = 16384, .failed = 0 };
+    if (text.data == NULL) {
+        return NULL;
+    }
+
+    // Only one report is built at a time, and no slot is added meanwhile
+    pthread_mutex_lock(&threads_mutex);
+    format_latencies(&text);
+
+    uint64_t bytes[MAX_USB_DEVICES][2] = {{0}}, ops[MAX_USB_DEVICES][2] = {{0}};
+    for (MetricsThread *slot = all_threads; slot != NULL; slot = slot->next) {
+        for (int d = 0; d < metrics_num_devices; d++) {
+            for (int w = 0; w < 2; w++) {
+                bytes[d][w] += atomic_load_explicit(&slot->device_bytes[d][w], memory_order_relaxed);
+                ops[d][w] += atomic_load_explicit(&slot->device_ops[d][w], memory_order_relaxed);
+            }
+        }
+    }
+    pthread_mutex_unlock(&threads_mutex);
+
+    static const char *directions[2] = { "read", "write" };
+    text_printf(&text, "# HELP fs_device_bytes_total Bytes read from and written to each device\n");
+    text_printf(&text, "# TYPE fs_device_bytes_total counter\n");
+    for (int d = 0; d < metrics_num_devices; d++) {
+        for (int w = 0; w < 2; w++) {
+            text_printf(&text, "fs_device_bytes_total{device=\"%d\",direction=\"%s\"} %llu\n",
+                        d, directions[w], (unsigned long long)bytes[d][w]);
+        }
+    }
+    text_printf(&text, "# HELP fs_device_operations_total Reads and writes issued to each device\n");
+    text_printf(&text, "# TYPE fs_device_operations_total counter\n");
+    for (int d = 0; d < metrics_num_devices; d++) {
+        for (int w = 0; w < 2; w++) {
+            text_printf(&text, "fs_device_operations_total{device=\"%d\",direction=\"%s\"} %llu\n",
+                        d, directions[w], (unsigned long long)ops[d][w]);
+        }
+    }
+    text_printf(&text, "# HELP fs_device_outstanding_reads GETs reading from each device\n");
+    text_printf(&text, "# TYPE fs_device_outstanding_reads gauge\n");
+    for (int d = 0; d < metrics_num_devices; d++) {
+        text_printf(&text, "fs_device_outstanding_reads{device=\"%d\"} %d\n", d, replica_outstanding(d));
+    }
+    text_printf(&text, "# HELP fs_device_write_queue_depth Upload chunks queued for each device writer\n");
+    text_printf(&text, "# TYPE fs_device_write_queue_depth gauge\n");
+    for (int d = 0; d < metrics_num_devices; d++) {
+        text_printf(&text, "fs_device_write_queue_depth{device=\"%d\"} %d\n", d, replication_queue_depth(d));
+    }
+
+    text_printf(&text, "# HELP fs_device_resyncing 1 while a device is being rebuilt and kept out of reads\n");
+    text_printf(&text, "# TYPE fs_device_resyncing gauge\n");
+    for (int d = 0; d < metrics_num_devices; d++) {
+        text_printf(&text, "fs_device_resyncing{device=\"%d\"} %d\n", d, resync_active(d));
+    }
+
+    text_printf(&text, "# HELP fs_connections_active Open client connections\n");
+    text_printf(&text, "# TYPE fs_connections_active gauge\n");
+    text_printf(&text, "fs_connections_active %ld\n", atomic_load(&active_connections));
+    text_printf(&text, "# HELP fs_connections_accepted_total Client connections accepted\n");
+    text_printf(&text, "# TYPE fs_connections_accepted_total counter\n");
+    text_printf(&text, "fs_connections_accepted_total %llu\n", (unsigned long long)atomic_load(&accepted_connections));
+    text_printf(&text, "# HELP fs_worker_queue_depth Ready connections waiting for a worker\n");
+    text_printf(&text, "# TYPE fs_worker_queue_depth gauge\n");
+    text_printf(&text, "fs_worker_queue_depth %d\n", worker_pool_queued());
+
+    if (text.failed) {
+        free(text.data);
+        return NULL;
+    }
+    *length = text.len;
+    return text.data;
+}
+
+/**
+ * @brief Answer one scrape on the metrics port, whatever it asked for.
+ *
+ * @param client
+ */
+static void serve_scrape(int client) {
+    // The request itself does not matter, it only has to be read before replying
+    struct timeval timeout = { .tv_sec = 1, .tv_usec = 0 };
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    char request[4096];
+    if (recv(client, request, sizeof(request), 0) <= 0) {
+        return;
+    }
+
+    size_t length;
+    char *body = metrics_format(&length);
+    char header[256];
+    int header_len = body != NULL
+        ? snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                           "Content-Length: %zu\r\nConnection: close\r\n\r\n", length)
+        : snprintf(header, sizeof(header), "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\n"
+                                           "Connection: close\r\n\r\n");
+    struct iovec parts[2] = {
+        { .iov_base = header, .iov_len = header_len },
+        { .iov_base = body, .iov_len = body != NULL ? length : 0 },
+    };
+    struct msghdr msg = { .msg_iov = parts, .msg_iovlen = 2 };
+    while (msg.msg_iovlen > 0) {
+        ssize_t sent = sendmsg(client, &msg, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            break;
+        }
+        while (msg.msg_iovlen > 0 && (size_t)sent >= msg.msg_iov->iov_len) {
+            sent -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + sent;
+            msg.msg_iov->iov_len -= sent;
+        }
+    }
+    free(body);
+}
+
+/**
+ * @brief Metrics listener thread, answers scrapes one at a time.
+ *
+ * @param arg the listening socket
+ * @return void*
+ */
+static void *metrics_thread(void *arg) {
+    int listener = (int)(intptr_t)arg;
+    while (1) {
+        int client = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (client < 0) {
+            if (errno != EINTR) {
+                perror("metrics accept");
+            }
+            continue;
+        }
+        serve_scrape(client);
+        close(client);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Set up the metrics, and serve them over HTTP on a local port when one is given
+ *
+ * @param num_devices
+ * @param port 0 for no listener
+ * @return int 0 on success, -1 if the listener could not be started
+ */
+int metrics_start(int num_devices, int port) {
+    metrics_num_devices = num_devices < MAX_USB_DEVICES ? num_devices : MAX_USB_DEVICES;
+    if (port <= 0) {
+        return 0;
+    }
+
+    int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0) {
+        perror("metrics socket");
+        return -1;
+    }
+    int one = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener, 16) < 0) {
+        perror("metrics listen");
+        close(listener);
+        return -1;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, metrics_thread, (void *)(intptr_t)listener) != 0) {
+        perror("pthread_create");
+        close(listener);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
@@ -0,0 +1,303 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include "server.h"
+
+#define MOUNT_BUCKETS 256
+#define MOUNTINFO_PATH "/proc/self/mountinfo"
+
+/**
+ * @brief A block device mounted somewhere, one per line of mountinfo
+ */
+typedef struct MountEntry {
+    char *device;               // mount source, e.g. /dev/sdb1
+    char *mount_point;
+    uint64_t hash;              // of mount_point
+    struct MountEntry *hash_next;
+    struct MountEntry *next;    // every entry, in mountinfo order
+} MountEntry;
+
+typedef struct MountTable {
+    MountEntry *buckets[MOUNT_BUCKETS];
+    MountEntry *entries;
+} MountTable;
+
+static MountTable *mount_table = NULL;
+static pthread_rwlock_t mount_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/**
+ * @brief FNV-1a hash of a mount point, without trailing slashes
+ *
+ * @param key
+ * @param len receives the length that was hashed
+ * @return uint64_t
+ */
+static uint64_t hash_key(const char *key, size_t *len) {
+    size_t n = strlen(key);
+    while (n > 1 && key[n - 1] == '/') {
+        n--;
+    }
+    uint64_t hash = 1469598103934665603ULL;
+    for (size_t i = 0; i < n; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 1099511628211ULL;
+    }
+    *len = n;
+    return hash;
+}
+
+/**
+ * @brief Undo the octal escapes mountinfo uses for spaces, tabs, newlines and backslashes
+ *
+ * @param s decoded in place
+ */
+static void unescape(char *s) {
+    char *out = s;
+    while (*s != '\0') {
+        if (s[0] == '\\' && s[1] >= '0' && s[1] <= '3' && s[2] >= '0' && s[2] <= '7' && s[3] >= '0' && s[3] <= '7') {
+            *out++ = (char)((s[1] - '0') * 64 + (s[2] - '0') * 8 + (s[3] - '0'));
+            s += 4;
+        } else {
+            *out++ = *s++;
+        }
+    }
+    *out = '\0';
+}
+
+static void table_free(MountTable *table) {
+    if (table == NULL) {
+        return;
+    }
+    MountEntry *entry = table->entries;
+    while (entry != NULL) {
+        MountEntry *next = entry->next;
+        free(entry->device);
+        free(entry->mount_point);
+        free(entry);
+        entry = next;
+    }
+    free(table);
+}
+
+static MountEntry *table_find(MountTable *table, const char *mount_point, size_t len, uint64_t hash, const char *device) {
+    MountEntry *entry = table->buckets[hash % MOUNT_BUCKETS];
+    while (entry != NULL && (entry->hash != hash || strncmp(entry->mount_point, mount_point, len) != 0 ||
+                             entry->mount_point[len] != '\0' || (device != NULL && strcmp(entry->device, device) != 0))) {
+        entry = entry->hash_next;
+    }
+    return entry;
+}
+
+/**
+ * @brief Read the whole of mountinfo from the start
+ *
+ * @param fd
+ * @return char* NUL terminated contents, NULL on failure
+ */
+static char *read_mountinfo(int fd) {
+    size_t capacity = 16384, len = 0;
+    char *text = malloc(capacity);
+    if (text == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    if (lseek(fd, 0, SEEK_SET) < 0) {
+        perror("lseek");
+        free(text);
+        return NULL;
+    }
+    while (1) {
+        if (capacity - len < 4096) {
+            char *bigger = realloc(text, capacity * 2);
+            if (bigger == NULL) {
+                perror("realloc");
+                free(text);
+                return NULL;
+            }
+            text = bigger;
+            capacity *= 2;
+        }
+        ssize_t n = read(fd, text + len, capacity - len - 1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("read mountinfo");
+            free(text);
+            return NULL;
+        }
+        if (n == 0) {
+            break;
+        }
+        len += n;
+    }
+    text[len] = '\0';
+    return text;
+}
+
+/**
+ * @brief Build a table of the block device mounts listed in mountinfo
+ *
+ * A line reads "id parent major:minor root mount_point options [optional...] - fstype source super_options".
+ * Only sources under /dev are kept, which leaves out proc, tmpfs, overlays and the like.
+ *
+ * @param fd
+ * @return MountTable* NULL on failure
+ */
+static MountTable *table_load(int fd) {
+    char *text = read_mountinfo(fd);
+    if (text == NULL) {
+        return NULL;
+    }
+    MountTable *table = calloc(1, sizeof(MountTable));
+    if (table == NULL) {
+        perror("calloc");
+        free(text);
+        return NULL;
+    }
+
+    MountEntry **tail = &table->entries;
+    char *save_line;
+    for (char *line = strtok_r(text, "\n", &save_line); line != NULL; line = strtok_r(NULL, "\n", &save_line)) {
+        char *save, *mount_point = NULL, *source = NULL;
+        int field = 0, after_separator = -1;
+        for (char *tok = strtok_r(line, " ", &save); tok != NULL; tok = strtok_r(NULL, " ", &save), field++) {
+            if (field == 4) {
+                mount_point = tok;
+            } else if (after_separator < 0 && field > 5 && strcmp(tok, "-") == 0) {
+                after_separator = 0;
+            } else if (after_separator >= 0 && ++after_separator == 2) {
+                source = tok;
+                break;
+            }
+        }
+        if (mount_point == NULL || source == NULL || strncmp(source, "/dev/", 5) != 0) {
+            continue;
+        }
+
+        MountEntry *entry = calloc(1, sizeof(MountEntry));
+        if (entry == NULL || (entry->device = strdup(source)) == NULL || (entry->mount_point = strdup(mount_point)) == NULL) {
+            perror("strdup");
+            if (entry != NULL) {
+                free(entry->device);
+                free(entry);
+            }
+            table_free(table);
+            free(text);
+            return NULL;
+        }
+        unescape(entry->device);
+        unescape(entry->mount_point);
+        size_t len;
+        entry->hash = hash_key(entry->mount_point, &len);
+        entry->hash_next = table->buckets[entry->hash % MOUNT_BUCKETS];
+        table->buckets[entry->hash % MOUNT_BUCKETS] = entry;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    free(text);
+    return table;
+}
+
+/**
+ * @brief Open mountinfo and load the current mounts
+ *
+ * @return int the descriptor to poll for POLLPRI, -1 on failure
+ */
+int mount_watch_open(void) {
+    int fd = open(MOUNTINFO_PATH, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror("open " MOUNTINFO_PATH);
+        return -1;
+    }
+    MountTable *table = table_load(fd);
+    if (table == NULL) {
+        close(fd);
+        return -1;
+    }
+    pthread_rwlock_wrlock(&mount_lock);
+    MountTable *old = mount_table;
+    mount_table = table;
+    pthread_rwlock_unlock(&mount_lock);
+    table_free(old);
+    return fd;
+}
+
+/**
+ * @brief Reload the mount table after poll reported a change and report what was mounted and unmounted
+ *
+ * @param fd from mount_watch_open
+ * @param on_mount called for every block device mount that was not there before, without locks held
+ * @param on_unmount called for every one that is gone, without locks held
+ * @return int number of mounts added or removed, -1 on failure
+ */
+int mount_watch_refresh(int fd, void (*on_mount)(const char *device, const char *mount_point),
+                        void (*on_unmount)(const char *device, const char *mount_point)) {
+    MountTable *table = table_load(fd);
+    if (table == NULL) {
+        return -1;
+    }
+
+    // Only this thread replaces the table, so the old one can be read after the swap
+    pthread_rwlock_wrlock(&mount_lock);
+    MountTable *old = mount_table;
+    mount_table = table;
+    pthread_rwlock_unlock(&mount_lock);
+
+    int changed = 0;
+    for (MountEntry *entry = old != NULL ? old->entries : NULL; entry != NULL; entry = entry->next) {
+        if (table_find(table, entry->mount_point, strlen(entry->mount_point), entry->hash, entry->device) == NULL) {
+            changed++;
+            if (on_unmount != NULL) {
+                on_unmount(entry->device, entry->mount_point);
+            }
+        }
+    }
+    for (MountEntry *entry = table->entries; entry != NULL; entry = entry->next) {
+        if (old == NULL || table_find(old, entry->mount_point, strlen(entry->mount_point), entry->hash, entry->device) == NULL) {
+            changed++;
+            if (on_mount != NULL) {
+                on_mount(entry->device, entry->mount_point);
+            }
+        }
+    }
+    table_free(old);
+    return changed;
+}
+
+/**
+ * @brief Whether a block device is mounted on a mount point
+ *
+ * Without a mount table, because mountinfo could not be read, the mount point
+ * counts as mounted when it is on another filesystem than its parent.
+ *
+ * @param mount_point trailing slashes are ignored
+ * @return int 1 if it is mounted
+ */
+int mount_watch_is_mounted(const char *mount_point) {
+    size_t len;
+    uint64_t hash = hash_key(mount_point, &len);
+    pthread_rwlock_rdlock(&mount_lock);
+    int mounted = mount_table == NULL ? -1 : table_find(mount_table, mount_point, len, hash, NULL) != NULL;
+    pthread_rwlock_unlock(&mount_lock);
+    if (mounted >= 0) {
+        return mounted;
+    }
+
+    char parent[4096];
+    struct stat st, parent_st;
+    snprintf(parent, sizeof(parent), "%.*s/..", (int)len, mount_point);
+    if (stat(mount_point, &st) < 0 || stat(parent, &parent_st) < 0) {
+        return 0;
+    }
+    return st.st_dev != parent_st.st_dev || st.st_ino == parent_st.st_ino;
+}
+
+/**
+ * @brief Whether a device can be read and written: its storage is mounted, or it is not removable
+ *
+ * @param usb_device
+ * @return int
+ */
+int device_mounted(const USBDevice *usb_device) {
+    return !usb_device->removable || mount_watch_is_mounted(usb_device->mount_point);
+}
@@ -1,72 +1,115 @@
 #include <errno.h>
+#include <inttypes.h>
 #include "server.h"
 
 /**
  * @brief Handle a PUT command from the client
  * 
- * @param client_sock 
+ * @param conn 
  * @param file_name 
  * @param usb_devices 
  * @param num_usb_devices 
  */
-void handle_put_command(int client_sock, const char *file_name, USBDevice* usb_devices, const int num_usb_devices) {
-    // Send ACK to client
-    char ack = 1;
-    if (send(client_sock, &ack, 1, 0) < 0) {
-        perror("send");
-        return;
-    }
-
-    // Receive file size from the client
-    long file_size;
-    if (recv(client_sock, &file_size, sizeof(file_size), 0) < 0) {
-        perror("recv");
+void handle_put_command(Connection *conn, const char *file_name, USBDevice* usb_devices, const int num_usb_devices) {
+    // The file size is whatever the request frame carries after the path, up to any checksum trailer
+    if (conn->checksum && conn->body_remaining < CHECKSUM_TRAILER_SIZE) {
+        if (connection_discard_body(conn) == 0) {
+            connection_send_error(conn, "Error: Malformed checksum");
+        }
         return;
     }
-    file_size = ntohl(file_size);  // Convert to host byte order
+    uint64_t file_size = conn->body_remaining - (conn->checksum ? CHECKSUM_TRAILER_SIZE : 0);
 
-    // Open the file for writing on each USB device
+    // Stage the upload in a temporary file on each USB device. Readers keep
+    // seeing the old file, and a failed upload never replaces it
+    uint64_t staging_id = random_id();
     int fds[num_usb_devices];
+    char staging_paths[num_usb_devices][4096];
     for (int i = 0; i < num_usb_devices; i++) {
-        char full_file_path[4096];
-        memset(full_file_path, '\0', sizeof(full_file_path));
-        snprintf(full_file_path, sizeof(full_file_path), "%s%s%s", usb_devices[i].mount_point, usb_devices[i].storage_folder, file_name);
+        fds[i] = -1;
+        staging_paths[i][0] = '\0';
+        if (!device_mounted(&usb_devices[i])) {
+            continue;
+        }
+        char staging_dir[3072];
+        snprintf(staging_dir, sizeof(staging_dir), "%s/%s", usb_devices[i].mount_point, UPLOAD_DIR);
+        mkdir(staging_dir, 0755);
+        snprintf(staging_paths[i], sizeof(staging_paths[i]), "%s/put-%016" PRIx64, staging_dir, staging_id);
 
-        fds[i] = open(full_file_path, O_WRONLY | O_CREAT, 0644);
+        fds[i] = open(staging_paths[i], O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
         if (fds[i] != -1) {
-            lock_file_write(fds[i]);
+            write_policy_preallocate(&usb_devices[i], fds[i], file_size);
+            write_policy_open(&usb_devices[i], fds[i], file_size);
         }
     }
 
-    // Receive file data from the client and write to all available USB devices
-    ssize_t recv_size;
-    char buffer[BUFFER_SIZE];
-    long bytes_received = 0;
-    while (bytes_received < file_size) {
-        recv_size = recv(client_sock, buffer, (BUFFER_SIZE < (file_size - bytes_received)) ? BUFFER_SIZE : (file_size - bytes_received), 0);
-        if (recv_size <= 0) {
-            // Connection closed or error
-            break;
+    const char *failure = NULL;
+    PathLock *path_lock = NULL;
+    uint32_t crc = 0;
+    int received = put_stream_receive(conn, fds, num_usb_devices, file_size, &crc);
+    if (received < 0) {
+        failure = "Error: Upload incomplete";
+        if (conn->checksum && !conn->broken) {
+            // Keeps the stream in step for the error reply
+            connection_discard_body(conn);
         }
-        for (int i = 0; i < num_usb_devices; i++) {
-            if (fds[i] != -1) {
-                write(fds[i], buffer, recv_size);
-            }
-        }
-        bytes_received += recv_size;
+    } else if (conn->checksum && connection_check_trailer(conn, crc) < 0) {
+        // Nothing the client did not send replaces the file
+        failure = "Error: Checksum mismatch";
+    } else if (durability_sync(fds, num_usb_devices) < 0) {
+        failure = "Error: Failed to flush upload";
+    } else if ((path_lock = path_lock_acquire(file_name, PATH_LOCK_WRITE, server_config.lock_timeout_ms)) == NULL) {
+        // Only the rename has to exclude readers of the path
+        failure = "Error: File is busy";
     }
 
-    // Close the files on all USB devices
+    int renamed = 0, error = ENOENT;
+    char placed[num_usb_devices][4096];
     for (int i = 0; i < num_usb_devices; i++) {
-        if (fds[i] != -1) {
-            unlock_file(fds[i]);
+        placed[i][0] = '\0';
+        if (fds[i] == -1) {
+            continue;
+        }
+
+        char *full_file_path = placed[i];
+        snprintf(full_file_path, sizeof(placed[i]), "%s%s%s", usb_devices[i].mount_point, usb_devices[i].storage_folder, file_name);
+        if (failure == NULL && rename(staging_paths[i], full_file_path) == 0) {
+            renamed++;
+            // GETs then send the digest without hashing the file again
+            if (received == 0) {
+                checksum_store(&usb_devices[i], file_name, fds[i], crc);
+            }
+            close(fds[i]);
+        } else {
             close(fds[i]);
+            if (failure == NULL) {
+                // A device missing the directory is skipped, as when the file could not be created there
+                error = errno;
+            }
+            unlink(staging_paths[i]);
+            full_file_path[0] = '\0';
+        }
+    }
+    if (renamed > 0) {
+        cache_invalidate(file_name, 0);
+        if (durability_sync_parents(placed, num_usb_devices) < 0) {
+            failure = "Error: Failed to flush upload";
         }
     }
+    path_lock_release(path_lock, PATH_LOCK_WRITE);
+
+    // A client that hung up mid-upload gets no reply
+    if (conn->broken) {
+        return;
+    }
 
     // Send a success message to the client
-    char status = (bytes_received == file_size) ? 1 : 0;
-    if (send(client_sock, &status, 1, 0) < 0) {
-        perror("send");
+    if (failure == NULL && renamed == 0) {
+        failure = strerror(error);
+    }
+    if (failure == NULL) {
+        connection_send_reply(conn, OP_OK, NULL, 0);
+    } else {
+        connection_send_error(conn, failure);
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,466 @@
+#include "server.h"
+
+#define PROBE_READ_SIZE (16 * 1024)
+#define HEDGE_MIN_DELAY_US 1000
+#define UNHEALTHY_AFTER_ERRORS 3
+#define UNHEALTHY_SECONDS 10
+
+typedef struct DeviceHealth {
+    int outstanding;        // GETs currently reading from the device
+    double ewma_us;         // smoothed time to open a file and read its first block
+    double p95_us;          // streaming estimate of the 95th percentile of the same
+    int samples;
+    int consecutive_errors;
+    time_t unhealthy_until;
+} DeviceHealth;
+
+/**
+ * @brief One attempt to open a file on a replica, shared by the GET and a hedge thread
+ */
+typedef struct ReadProbe {
+    struct HedgedRead *owner;
+    int device;
+    char path[4096];
+    int fd;
+    int error;              // errno when the probe failed
+    int done;
+} ReadProbe;
+
+typedef struct HedgedRead {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    ReadProbe probes[MAX_USB_DEVICES];
+    int winner;             // probe whose fd the GET took, -1 until then
+    int refs;               // the GET and every running probe
+} HedgedRead;
+
+static DeviceHealth health[MAX_USB_DEVICES];
+static pthread_mutex_t health_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int rotation = 0;
+
+static ReadProbe **probe_queue;
+static int probe_capacity;
+static int probe_head = 0;
+static int probe_count = 0;
+static pthread_mutex_t probe_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t probe_not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t probe_not_full = PTHREAD_COND_INITIALIZER;
+
+static long elapsed_us(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/**
+ * @brief Record the outcome of opening a file on a device.
+ *
+ * @param device
+ * @param latency_us time to first byte, ignored on error
+ * @param error 0, or the errno of the failure
+ */
+static void record_probe(int device, long latency_us, int error) {
+    pthread_mutex_lock(&health_mutex);
+    DeviceHealth *h = &health[device];
+    if (error == 0) {
+        h->consecutive_errors = 0;
+        h->unhealthy_until = 0;
+        if (h->samples++ == 0) {
+            h->ewma_us = h->p95_us = latency_us;
+        } else {
+            h->ewma_us += (latency_us - h->ewma_us) / 8;
+            // Step up on 5% of samples as far as down on the other 95%
+            double step = h->ewma_us / 16 + 1;
+            h->p95_us += latency_us > h->p95_us ? step * 0.95 : -step * 0.05;
+        }
+    } else if (error != ENOENT && error != ENOTDIR && error != EISDIR) {
+        // A missing file is the client's problem, anything else the device's
+        if (++h->consecutive_errors >= UNHEALTHY_AFTER_ERRORS) {
+            h->unhealthy_until = time(NULL) + UNHEALTHY_SECONDS;
+        }
+    }
+    pthread_mutex_unlock(&health_mutex);
+}
+
+/**
+ * @brief Open a file on one replica and read its first block to time the device.
+ *
+ * @param probe
+ */
+static void run_probe(ReadProbe *probe) {
+    char *scratch = buffer_acquire(PROBE_READ_SIZE);
+    if (scratch == NULL) {
+        // Nothing to blame on the device
+        probe->fd = -1;
+        probe->error = ENOMEM;
+        return;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    probe->error = 0;
+    // Read-only so replicas on read-only mounts can still be served
+    probe->fd = open(probe->path, O_RDONLY | O_CLOEXEC);
+    if (probe->fd < 0 || pread(probe->fd, scratch, PROBE_READ_SIZE, 0) < 0) {
+        probe->error = errno;
+        if (probe->fd >= 0) {
+            close(probe->fd);
+            probe->fd = -1;
+        }
+    }
+    buffer_release(scratch, PROBE_READ_SIZE);
+    record_probe(probe->device, elapsed_us(&start), probe->error);
+}
+
+/**
+ * @brief Drop a reference to a hedged read, the last one closes losing replicas.
+ *
+ * @param read
+ */
+static void hedged_read_put(HedgedRead *read) {
+    pthread_mutex_lock(&read->mutex);
+    int refs = --read->refs;
+    pthread_mutex_unlock(&read->mutex);
+    if (refs > 0) {
+        return;
+    }
+
+    for (int i = 0; i < MAX_USB_DEVICES; i++) {
+        ReadProbe *probe = &read->probes[i];
+        if (i != read->winner && probe->done && probe->fd >= 0) {
+            close(probe->fd);
+        }
+    }
+    pthread_mutex_destroy(&read->mutex);
+    pthread_cond_destroy(&read->cond);
+    free(read);
+}
+
+/**
+ * @brief Hedge thread, runs probes so a GET can give up waiting on a slow replica.
+ *
+ * @param arg
+ * @return void*
+ */
+static void *probe_thread(void *arg) {
+    (void)arg;
+
+    while (1) {
+        pthread_mutex_lock(&probe_mutex);
+        while (probe_count == 0) {
+            pthread_cond_wait(&probe_not_empty, &probe_mutex);
+        }
+        ReadProbe *probe = probe_queue[probe_head];
+        probe_head = (probe_head + 1) % probe_capacity;
+        probe_count--;
+        pthread_cond_signal(&probe_not_full);
+        pthread_mutex_unlock(&probe_mutex);
+
+        run_probe(probe);
+
+        HedgedRead *read = probe->owner;
+        pthread_mutex_lock(&read->mutex);
+        probe->done = 1;
+        pthread_cond_broadcast(&read->cond);
+        pthread_mutex_unlock(&read->mutex);
+        hedged_read_put(read);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Start the hedge threads when hedged reads are enabled
+ *
+ * @param num_threads
+ * @return int 0 on success, -1 on failure
+ */
+int replica_start(int num_threads) {
+    if (!server_config.hedged_reads) {
+        return 0;
+    }
+
+    probe_capacity = num_threads * 2;
+    probe_queue = malloc(sizeof(ReadProbe *) * probe_capacity);
+    if (probe_queue == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    for (int i = 0; i < num_threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, probe_thread, NULL) != 0) {
+            perror("Hedge thread creation failed");
+            return -1;
+        }
+        pthread_detach(thread);
+    }
+    return 0;
+}
+
+/**
+ * @brief Order the replicas best first: healthy devices by expected wait, then the rest.
+ *
+ * @param usb_devices
+ * @param num_usb_devices
+ * @param order receives device indexes
+ * @return int number of devices in order
+ */
+static int rank_replicas(USBDevice *usb_devices, int num_usb_devices, int *order) {
+    double score[MAX_USB_DEVICES];
+    int count = 0;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&health_mutex);
+    // Start from a rotating device so equal replicas share the load
+    unsigned int first = rotation++;
+    for (int k = 0; k < num_usb_devices; k++) {
+        int i = (first + k) % num_usb_devices;
+        // A device being rebuilt may hold stale or missing files
+        if (!device_mounted(&usb_devices[i]) || resync_active(i)) {
+            continue;
+        }
+        const DeviceHealth *h = &health[i];
+        double s = (h->outstanding + 1) * (h->ewma_us + 100);
+        if (h->unhealthy_until > now) {
+            s += 1e12;
+        }
+
+        // Insertion sort, n is tiny
+        int j = count++;
+        while (j > 0 && score[j - 1] > s) {
+            score[j] = score[j - 1];
+            order[j] = order[j - 1];
+            j--;
+        }
+        score[j] = s;
+        order[j] = i;
+    }
+    pthread_mutex_unlock(&health_mutex);
+    return count;
+}
+
+static void add_outstanding(int device, int delta) {
+    pthread_mutex_lock(&health_mutex);
+    health[device].outstanding += delta;
+    pthread_mutex_unlock(&health_mutex);
+}
+
+/**
+ * @brief Try the ranked replicas one after another on the calling thread.
+ *
+ * @param usb_devices
+ * @param order
+ * @param count
+ * @param file_path
+ * @param read
+ * @return int 0 on success, -1 with errno set
+ */
+static int open_sequential(USBDevice *usb_devices, const int *order, int count, const char *file_path, ReplicaRead *read) {
+    int error = ENOENT;
+    for (int k = 0; k < count; k++) {
+        ReadProbe probe = { .device = order[k] };
+        snprintf(probe.path, sizeof(probe.path), "%s%s%s", usb_devices[probe.device].mount_point,
+                 usb_devices[probe.device].storage_folder, file_path);
+
+        add_outstanding(probe.device, 1);
+        run_probe(&probe);
+        if (probe.fd >= 0) {
+            read->fd = probe.fd;
+            read->device = probe.device;
+            return 0;
+        }
+        add_outstanding(probe.device, -1);
+        error = probe.error;
+    }
+    errno = error;
+    return -1;
+}
+
+/**
+ * @brief Queue a probe on the hedge threads, called with read->mutex held.
+ *
+ * The mutex is dropped while waiting for queue space, hedge threads finishing
+ * this read's other probes need it.
+ *
+ * @param read
+ * @param device
+ */
+static void launch_probe(HedgedRead *read, int device) {
+    ReadProbe *probe = &read->probes[device];
+    probe->owner = read;
+    probe->device = device;
+    probe->fd = -1;
+    read->refs++;
+    add_outstanding(device, 1);
+    pthread_mutex_unlock(&read->mutex);
+
+    pthread_mutex_lock(&probe_mutex);
+    while (probe_count == probe_capacity) {
+        pthread_cond_wait(&probe_not_full, &probe_mutex);
+    }
+    probe_queue[(probe_head + probe_count) % probe_capacity] = probe;
+    probe_count++;
+    pthread_cond_signal(&probe_not_empty);
+    pthread_mutex_unlock(&probe_mutex);
+
+    pthread_mutex_lock(&read->mutex);
+}
+
+/**
+ * @brief Open the best replica, hedging to the next one if it stalls past its p95.
+ *
+ * Called and returns with read->mutex held.
+ *
+ * @param read
+ * @param usb_devices
+ * @param order
+ * @param count
+ * @param file_path
+ * @return int the winning probe's device, or -1 with errno set
+ */
+static int open_hedged(HedgedRead *read, USBDevice *usb_devices, const int *order, int count, const char *file_path) {
+    for (int k = 0; k < count; k++) {
+        ReadProbe *probe = &read->probes[order[k]];
+        snprintf(probe->path, sizeof(probe->path), "%s%s%s", usb_devices[order[k]].mount_point,
+                 usb_devices[order[k]].storage_folder, file_path);
+    }
+
+    int launched = 0, hedged = 0, error = ENOENT;
+    launch_probe(read, order[launched++]);
+
+    while (1) {
+        int running = 0;
+        for (int k = 0; k < launched; k++) {
+            ReadProbe *probe = &read->probes[order[k]];
+            if (!probe->done) {
+                running++;
+            } else if (probe->fd >= 0) {
+                return order[k];
+            } else if (probe->error != ENOENT) {
+                error = probe->error;
+            }
+        }
+
+        if (running == 0) {
+            // Every replica tried so far failed, fall through to the next one
+            if (launched == count) {
+                errno = error;
+                return -1;
+            }
+            launch_probe(read, order[launched++]);
+            continue;
+        }
+
+        if (hedged || launched == count) {
+            pthread_cond_wait(&read->cond, &read->mutex);
+            continue;
+        }
+
+        pthread_mutex_lock(&health_mutex);
+        double delay_us = health[order[0]].p95_us;
+        pthread_mutex_unlock(&health_mutex);
+        if (delay_us < HEDGE_MIN_DELAY_US) {
+            delay_us = HEDGE_MIN_DELAY_US;
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        long long nsec = deadline.tv_nsec + (long long)(delay_us * 1000);
+        deadline.tv_sec += nsec / 1000000000LL;
+        deadline.tv_nsec = nsec % 1000000000LL;
+        if (pthread_cond_timedwait(&read->cond, &read->mutex, &deadline) == ETIMEDOUT) {
+            hedged = 1;
+            launch_probe(read, order[launched++]);
+        }
+    }
+}
+
+/**
+ * @brief Open a file on the replica expected to serve it fastest
+ *
+ * Replicas are ranked by in-flight GETs and recent time to first byte, and
+ * devices that keep failing are tried last. With hedged_reads a second
+ * replica is opened when the first takes longer than its p95.
+ *
+ * @param usb_devices
+ * @param num_usb_devices
+ * @param file_path
+ * @param read receives the open file and its device
+ * @return int 0 on success, -1 with errno set
+ */
+int replica_open(USBDevice *usb_devices, int num_usb_devices, const char *file_path, ReplicaRead *read) {
+    int order[MAX_USB_DEVICES];
+    int count = rank_replicas(usb_devices, num_usb_devices, order);
+    if (count == 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (!server_config.hedged_reads || count == 1) {
+        return open_sequential(usb_devices, order, count, file_path, read);
+    }
+
+    HedgedRead *hedged = calloc(1, sizeof(HedgedRead));
+    if (hedged == NULL) {
+        return open_sequential(usb_devices, order, count, file_path, read);
+    }
+    pthread_mutex_init(&hedged->mutex, NULL);
+    pthread_cond_init(&hedged->cond, NULL);
+    hedged->winner = -1;
+    hedged->refs = 1;
+
+    pthread_mutex_lock(&hedged->mutex);
+    int device = open_hedged(hedged, usb_devices, order, count, file_path);
+    int error = errno;
+    if (device >= 0) {
+        hedged->winner = device;
+        read->fd = hedged->probes[device].fd;
+        read->device = device;
+    }
+    // Losing probes no longer count as load on their device
+    for (int i = 0; i < MAX_USB_DEVICES; i++) {
+        if (i != device && hedged->probes[i].owner != NULL) {
+            add_outstanding(i, -1);
+        }
+    }
+    pthread_mutex_unlock(&hedged->mutex);
+
+    hedged_read_put(hedged);
+    errno = error;
+    return device >= 0 ? 0 : -1;
+}
+
+/**
+ * @brief Whether a device is serving requests or resting after repeated failures
+ *
+ * @param device
+ * @return int 1 if it is healthy and not being rebuilt
+ */
+int replica_healthy(int device) {
+    pthread_mutex_lock(&health_mutex);
+    int healthy = health[device].unhealthy_until <= time(NULL) && !resync_active(device);
+    pthread_mutex_unlock(&health_mutex);
+    return healthy;
+}
+
+/**
+ * @brief GETs currently reading from a device
+ *
+ * @param device
+ * @return int
+ */
+int replica_outstanding(int device) {
+    pthread_mutex_lock(&health_mutex);
+    int outstanding = health[device].outstanding;
+    pthread_mutex_unlock(&health_mutex);
+    return outstanding;
+}
+
+/**
+ * @brief Close a file opened with replica_open
+ *
+ * @param read
+ */
+void replica_close(ReplicaRead *read) {
+    close(read->fd);
+    add_outstanding(read->device, -1);
+}
@@ -0,0 +1,706 @@
+#define _GNU_SOURCE
+#include <linux/io_uring.h>
+#include "server.h"
+
+#define SPLICE_MIN_SIZE (256 * 1024) // below this setting up the pipes costs more than the copies
+
+typedef struct WriteJob {
+    PutStream *stream;
+    ReplicaBuffer *buffer;
+    int device;
+} WriteJob;
+
+typedef struct DeviceWriter {
+    WriteJob *jobs;
+    int capacity;
+    int head;
+    int count;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    pthread_t thread;
+} DeviceWriter;
+
+static DeviceWriter writers[MAX_USB_DEVICES];
+static int num_writers = 0;
+static const USBDevice *devices;
+
+/**
+ * @brief Drop one device's reference to a buffer, waking the receiver when it is free again.
+ *
+ * @param stream
+ * @param buffer
+ * @param device
+ * @param error errno of a failed write, 0 on success
+ */
+static void release_buffer(PutStream *stream, ReplicaBuffer *buffer, int device, int error) {
+    pthread_mutex_lock(&stream->mutex);
+    if (error != 0 && stream->errors[device] == 0) {
+        stream->errors[device] = error;
+    }
+    if (--buffer->refcount == 0) {
+        pthread_cond_broadcast(&stream->released);
+    }
+    pthread_mutex_unlock(&stream->mutex);
+}
+
+/**
+ * @brief Write all of a chunk to a device file
+ *
+ * @param fd
+ * @param ptr
+ * @param len
+ * @return int 0 on success, errno of the failed write otherwise
+ */
+static int write_chunk(int fd, const char *ptr, size_t len) {
+    while (len > 0) {
+        ssize_t bytes_written = write(fd, ptr, len);
+        if (bytes_written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            int error = errno;
+            perror("write");
+            return error;
+        }
+        ptr += bytes_written;
+        len -= bytes_written;
+    }
+    return 0;
+}
+
+/**
+ * @brief Move a chunk from a device's pipe into its file
+ *
+ * A file that rejects splice gets this and every later chunk of the upload
+ * through a read and write of the pipe instead.
+ *
+ * @param stream
+ * @param device
+ * @param buffer the ring slot whose pipe holds the chunk
+ * @return int 0 on success, errno of the failed write otherwise
+ */
+static int drain_pipe(PutStream *stream, int device, const ReplicaBuffer *buffer) {
+    int pipe = stream->pipes[buffer - stream->ring][device][0];
+    size_t len = buffer->len;
+    int fd = stream->fds[device];
+    char *scratch = NULL;
+    int error = 0;
+
+    while (len > 0 && error == 0) {
+        ssize_t moved;
+        if (!stream->buffered[device]) {
+            moved = splice(pipe, NULL, fd, NULL, len, SPLICE_F_MOVE);
+            if (moved < 0 && errno == EINVAL) {
+                stream->buffered[device] = 1;
+                continue;
+            }
+        } else {
+            if (scratch == NULL && (scratch = buffer_acquire(BUFFER_BLOCK_MIN)) == NULL) {
+                return ENOMEM;
+            }
+            moved = read(pipe, scratch, len < BUFFER_BLOCK_MIN ? len : BUFFER_BLOCK_MIN);
+            if (moved > 0) {
+                error = write_chunk(fd, scratch, moved);
+            }
+        }
+        if (moved < 0 && errno == EINTR) {
+            continue;
+        }
+        if (moved < 0) {
+            error = errno;
+            perror(stream->buffered[device] ? "read" : "splice");
+        } else if (moved == 0) {
+            // The pipe holds the whole chunk, so this never happens
+            error = EIO;
+        }
+        len -= moved > 0 ? (size_t)moved : 0;
+    }
+    buffer_release(scratch, BUFFER_BLOCK_MIN);
+    return error;
+}
+
+/**
+ * @brief Take a device file out of O_DIRECT before a chunk direct I/O cannot write
+ *
+ * Only the last chunk of an upload is ever short, so the rest of it goes
+ * through the page cache.
+ *
+ * @param stream
+ * @param device
+ * @param buffer
+ */
+static void direct_fit(PutStream *stream, int device, const ReplicaBuffer *buffer) {
+    uint64_t position = stream->base[device] + buffer->offset;
+    if (!stream->direct[device] || (buffer->len % DIRECT_IO_ALIGN == 0 && position % DIRECT_IO_ALIGN == 0 &&
+                                    (uintptr_t)buffer->data % DIRECT_IO_ALIGN == 0)) {
+        return;
+    }
+    int flags = fcntl(stream->fds[device], F_GETFL);
+    if (flags >= 0) {
+        fcntl(stream->fds[device], F_SETFL, flags & ~O_DIRECT);
+    }
+    stream->direct[device] = 0;
+}
+
+/**
+ * @brief Account for a chunk that is on a device and keep its write-behind going
+ *
+ * @param stream
+ * @param device
+ * @param buffer
+ */
+static void chunk_written(PutStream *stream, int device, const ReplicaBuffer *buffer) {
+    metrics_device_io(device, 1, buffer->len);
+    if (!stream->direct[device]) {
+        write_behind(&devices[device], stream->fds[device], &stream->behind[device],
+                     stream->base[device] + buffer->offset + buffer->len);
+    }
+}
+
+/**
+ * @brief Device writer thread, drains its queue into the device files in order.
+ *
+ * @param arg
+ * @return void*
+ */
+static void *device_writer_thread(void *arg) {
+    DeviceWriter *writer = (DeviceWriter *)arg;
+
+    while (1) {
+        pthread_mutex_lock(&writer->mutex);
+        while (writer->count == 0) {
+            pthread_cond_wait(&writer->not_empty, &writer->mutex);
+        }
+        WriteJob job = writer->jobs[writer->head];
+        writer->head = (writer->head + 1) % writer->capacity;
+        writer->count--;
+        pthread_cond_signal(&writer->not_full);
+        pthread_mutex_unlock(&writer->mutex);
+
+        PutStream *stream = job.stream;
+        int error = 0;
+        // Once a device has failed the rest of its chunks are dropped, only this thread sets it
+        if (stream->errors[job.device] == 0) {
+            if (stream->spliced) {
+                error = drain_pipe(stream, job.device, job.buffer);
+            } else {
+                direct_fit(stream, job.device, job.buffer);
+                error = write_chunk(stream->fds[job.device], job.buffer->data, job.buffer->len);
+            }
+            if (error == 0) {
+                chunk_written(stream, job.device, job.buffer);
+            }
+        }
+
+        release_buffer(stream, job.buffer, job.device, error);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Take completed device writes off the upload's ring, releasing their buffers.
+ *
+ * Writes carry explicit offsets, so they may complete in any order. A short
+ * write, which regular files only give near a full device, is finished with
+ * pwrite so the error, if any, is the real one.
+ *
+ * @param stream
+ * @param wait block for at least one completion
+ */
+static void uring_reap(PutStream *stream, int wait) {
+    struct io_uring_cqe cqe;
+    while (uring_complete(stream->uring, wait, &cqe) == 1) {
+        ReplicaBuffer *buffer = &stream->ring[cqe.user_data >> 8];
+        int device = (int)(cqe.user_data & 0xff);
+        int error = 0;
+        if (cqe.res < 0) {
+            error = -cqe.res;
+        } else if ((size_t)cqe.res < buffer->len) {
+            size_t done = cqe.res;
+            while (done < buffer->len) {
+                ssize_t n = pwrite(stream->fds[device], buffer->data + done, buffer->len - done,
+                                   stream->base[device] + buffer->offset + done);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    error = n < 0 ? errno : ENOSPC;
+                    break;
+                }
+                done += n;
+            }
+        }
+        if (error != 0) {
+            errno = error;
+            perror("write");
+            if (stream->errors[device] == 0) {
+                stream->errors[device] = error;
+            }
+        } else {
+            chunk_written(stream, device, buffer);
+        }
+        buffer->refcount--;
+        wait = 0;
+    }
+}
+
+/**
+ * @brief Start one writer thread per configured USB device
+ *
+ * @param usb_devices
+ * @param num_devices
+ * @param queue_depth
+ * @return int 0 on success, -1 on failure
+ */
+int replication_start(const USBDevice *usb_devices, int num_devices, int queue_depth) {
+    devices = usb_devices;
+    for (int i = 0; i < num_devices; i++) {
+        DeviceWriter *writer = &writers[i];
+        writer->capacity = queue_depth;
+        writer->jobs = malloc(sizeof(WriteJob) * queue_depth);
+        if (writer->jobs == NULL) {
+            perror("malloc");
+            return -1;
+        }
+        pthread_mutex_init(&writer->mutex, NULL);
+        pthread_cond_init(&writer->not_empty, NULL);
+        pthread_cond_init(&writer->not_full, NULL);
+
+        if (pthread_create(&writer->thread, NULL, device_writer_thread, writer) != 0) {
+            perror("Device writer thread creation failed");
+            return -1;
+        }
+        pthread_detach(writer->thread);
+        num_writers++;
+    }
+    return 0;
+}
+
+/**
+ * @brief Upload chunks queued for one device's writer
+ *
+ * @param device
+ * @return int
+ */
+int replication_queue_depth(int device) {
+    if (device >= num_writers) {
+        return 0;
+    }
+    DeviceWriter *writer = &writers[device];
+    pthread_mutex_lock(&writer->mutex);
+    int depth = writer->count;
+    pthread_mutex_unlock(&writer->mutex);
+    return depth;
+}
+
+/**
+ * @brief Start a replicated upload to the given device files
+ *
+ * @param fds
+ * @param num_devices
+ * @param window
+ * @param spliced the chunks go through pipes, so the ring gets no buffers
+ * @return PutStream* or NULL on allocation failure
+ */
+PutStream *put_stream_open(const int *fds, int num_devices, int window, int spliced) {
+    PutStream *stream = calloc(1, sizeof(PutStream));
+    if (stream == NULL) {
+        return NULL;
+    }
+
+    stream->window = window;
+    stream->spliced = spliced;
+    stream->ring = calloc(window, sizeof(ReplicaBuffer));
+
+    if (stream->ring == NULL) {
+        free(stream);
+        return NULL;
+    }
+
+    // With io_uring the chunks live in the thread's registered region and the
+    // receiving thread writes them itself, one submission for every device
+    size_t chunk = server_config.put_chunk_size;
+    size_t region_size = 0;
+    stream->uring = spliced ? NULL : uring_thread();
+    if (stream->uring != NULL) {
+        stream->memory = uring_buffers(stream->uring, &region_size);
+        if (region_size < (size_t)window * chunk || uring_set_files(stream->uring, 0, fds, num_devices) < 0) {
+            stream->uring = NULL;
+            stream->memory = NULL;
+        }
+    }
+    for (int i = 0; i < window && !spliced; i++) {
+        stream->ring[i].data = stream->uring != NULL ? stream->memory + (size_t)i * chunk : buffer_acquire(chunk);
+        if (stream->ring[i].data == NULL) {
+            for (int j = 0; j < i; j++) {
+                buffer_release(stream->ring[j].data, chunk);
+            }
+            free(stream->ring);
+            free(stream);
+            return NULL;
+        }
+    }
+
+    stream->num_devices = num_devices < num_writers ? num_devices : num_writers;
+    for (int i = 0; i < stream->num_devices; i++) {
+        stream->fds[i] = fds[i];
+        if (fds[i] != -1) {
+            off_t position = lseek(fds[i], 0, SEEK_CUR);
+            stream->base[i] = position > 0 ? (uint64_t)position : 0;
+            stream->behind[i].started = stream->behind[i].dropped = stream->base[i];
+            stream->direct[i] = (fcntl(fds[i], F_GETFL) & O_DIRECT) != 0;
+        }
+    }
+    pthread_mutex_init(&stream->mutex, NULL);
+    pthread_cond_init(&stream->released, NULL);
+    return stream;
+}
+
+/**
+ * @brief Take the next ring buffer, waiting until every device has released it
+ *
+ * @param stream
+ * @return ReplicaBuffer*
+ */
+ReplicaBuffer *put_stream_acquire(PutStream *stream) {
+    ReplicaBuffer *buffer = &stream->ring[stream->next];
+
+    if (stream->uring != NULL) {
+        while (buffer->refcount > 0) {
+            uring_reap(stream, 1);
+        }
+        stream->next = (stream->next + 1) % stream->window;
+        return buffer;
+    }
+
+    pthread_mutex_lock(&stream->mutex);
+    while (buffer->refcount > 0) {
+        pthread_cond_wait(&stream->released, &stream->mutex);
+    }
+    pthread_mutex_unlock(&stream->mutex);
+
+    stream->next = (stream->next + 1) % stream->window;
+    return buffer;
+}
+
+/**
+ * @brief Hand a filled buffer to every device writer, blocking only on a full device queue
+ *
+ * @param stream
+ * @param buffer
+ * @param len
+ */
+void put_stream_submit(PutStream *stream, ReplicaBuffer *buffer, size_t len) {
+    buffer->len = len;
+
+    int targets[MAX_USB_DEVICES];
+    int num_targets = 0;
+
+    // Hold every reference up front so a fast device cannot free the buffer early
+    pthread_mutex_lock(&stream->mutex);
+    for (int i = 0; i < stream->num_devices; i++) {
+        if (stream->fds[i] != -1 && stream->errors[i] == 0) {
+            targets[num_targets++] = i;
+        }
+    }
+    buffer->refcount = num_targets;
+    pthread_mutex_unlock(&stream->mutex);
+
+    buffer->offset = stream->submitted;
+    stream->submitted += len;
+    if (stream->uring != NULL) {
+        uint64_t index = buffer - stream->ring;
+        for (int t = 0; t < num_targets; t++) {
+            int device = targets[t];
+            direct_fit(stream, device, buffer);
+            uring_queue_fixed(stream->uring, 1, device, buffer->data, len, stream->base[device] + buffer->offset,
+                              index << 8 | device, 0);
+        }
+        if (uring_submit(stream->uring, 0) < 0) {
+            perror("io_uring_enter");
+        }
+        uring_reap(stream, 0);
+        return;
+    }
+
+    for (int t = 0; t < num_targets; t++) {
+        DeviceWriter *writer = &writers[targets[t]];
+        pthread_mutex_lock(&writer->mutex);
+        while (writer->count == writer->capacity) {
+            pthread_cond_wait(&writer->not_full, &writer->mutex);
+        }
+        WriteJob *job = &writer->jobs[(writer->head + writer->count) % writer->capacity];
+        job->stream = stream;
+        job->buffer = buffer;
+        job->device = targets[t];
+        writer->count++;
+        pthread_cond_signal(&writer->not_empty);
+        pthread_mutex_unlock(&writer->mutex);
+    }
+}
+
+/**
+ * @brief Wait for every queued write of the upload to finish and free the stream
+ *
+ * @param stream
+ * @param errors receives the errno of each device's first failed write, may be NULL
+ * @return int 0 if every device wrote all data, -1 otherwise
+ */
+int put_stream_close(PutStream *stream, int *errors) {
+    if (stream->uring != NULL) {
+        for (int i = 0; i < stream->window; i++) {
+            while (stream->ring[i].refcount > 0) {
+                uring_reap(stream, 1);
+            }
+        }
+        // The slots hold references that would keep the device files open
+        int empty[MAX_USB_DEVICES];
+        for (int i = 0; i < stream->num_devices; i++) {
+            empty[i] = -1;
+        }
+        uring_set_files(stream->uring, 0, empty, stream->num_devices);
+    }
+
+    pthread_mutex_lock(&stream->mutex);
+    for (int i = 0; i < stream->window; i++) {
+        while (stream->ring[i].refcount > 0) {
+            pthread_cond_wait(&stream->released, &stream->mutex);
+        }
+    }
+    pthread_mutex_unlock(&stream->mutex);
+
+    int result = 0;
+    for (int i = 0; i < stream->num_devices; i++) {
+        if (stream->fds[i] != -1 && stream->errors[i] == 0 && !stream->direct[i]) {
+            write_behind_finish(&devices[i], stream->fds[i], &stream->behind[i], stream->base[i] + stream->submitted);
+        }
+        if (errors != NULL) {
+            errors[i] = stream->errors[i];
+        }
+        if (stream->errors[i] != 0) {
+            result = -1;
+        }
+    }
+
+    pthread_mutex_destroy(&stream->mutex);
+    pthread_cond_destroy(&stream->released);
+    if (stream->uring == NULL && !stream->spliced) {
+        for (int i = 0; i < stream->window; i++) {
+            buffer_release(stream->ring[i].data, server_config.put_chunk_size);
+        }
+    }
+    free(stream->ring);
+    free(stream);
+    return result;
+}
+
+/**
+ * @brief Close the pipes of a spliced upload
+ *
+ * @param pipes per ring slot, -1 for pipes that were never opened
+ * @param window
+ * @param num_devices
+ */
+static void close_pipes(int (*pipes)[MAX_USB_DEVICES][2], int window, int num_devices) {
+    for (int slot = 0; slot < window; slot++) {
+        for (int i = 0; i < num_devices; i++) {
+            for (int end = 0; end < 2; end++) {
+                if (pipes[slot][i][end] != -1) {
+                    close(pipes[slot][i][end]);
+                }
+            }
+        }
+    }
+    free(pipes);
+}
+
+/**
+ * @brief Open a pipe per ring slot for every open device, each holding a whole chunk
+ *
+ * @param stream
+ * @return int 0 on success, -1 if the pipes could not be had
+ */
+static int open_pipes(PutStream *stream) {
+    stream->pipes = malloc(sizeof(*stream->pipes) * stream->window);
+    if (stream->pipes == NULL) {
+        return -1;
+    }
+    memset(stream->pipes, 0xff, sizeof(*stream->pipes) * stream->window);
+    for (int slot = 0; slot < stream->window; slot++) {
+        for (int i = 0; i < stream->num_devices; i++) {
+            if (stream->fds[i] == -1) {
+                continue;
+            }
+            // Fails once the user's pipes hold too much memory, buffering is used then
+            int *pipe = stream->pipes[slot][i];
+            if (pipe2(pipe, O_CLOEXEC) < 0 ||
+                fcntl(pipe[1], F_SETPIPE_SZ, (int)server_config.put_chunk_size) < (int)server_config.put_chunk_size) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Receive request body into every open device file without copying it through user space
+ *
+ * Every device has a pipe per ring slot. Each chunk is spliced from the socket
+ * into the slot's pipe of the first writable device and teed from there into
+ * the slot's pipes of the others, then every device writer splices the pipe
+ * into its file. A slot is only reused once every writer has emptied its pipe,
+ * so a slow device holds back the upload only when it is put_window chunks
+ * behind, as with the ring buffers. All pipes hold one chunk, so a tee always
+ * takes the whole of it.
+ *
+ * @param conn
+ * @param fds the device files, -1 for devices to skip
+ * @param num_devices
+ * @param length
+ * @return int 0 if all of it arrived and every open device wrote it, -1 otherwise, 1 if the files or pipes do not allow splicing and nothing was read
+ */
+static int splice_receive(Connection *conn, const int *fds, int num_devices, uint64_t length) {
+    PutStream *stream = put_stream_open(fds, num_devices, server_config.put_window, 1);
+    if (stream == NULL) {
+        return 1;
+    }
+    for (int i = 0; i < stream->num_devices; i++) {
+        if (stream->direct[i]) {
+            // Direct I/O needs the aligned, whole chunks of the ring buffers
+            put_stream_close(stream, NULL);
+            return 1;
+        }
+    }
+
+    // The stream is gone by the time the pipes are closed
+    int opened = open_pipes(stream);
+    int (*pipes)[MAX_USB_DEVICES][2] = stream->pipes;
+    int window = stream->window, num_pipes = stream->num_devices;
+    if (opened < 0) {
+        put_stream_close(stream, NULL);
+        if (pipes != NULL) {
+            close_pipes(pipes, window, num_pipes);
+        }
+        return 1;
+    }
+
+    uint64_t bytes_received = 0;
+    while (bytes_received < length) {
+        // Waits for every device to have emptied this slot's pipe
+        ReplicaBuffer *buffer = put_stream_acquire(stream);
+        int (*slot)[2] = pipes[buffer - stream->ring];
+        int head = -1;
+        for (int i = 0; i < stream->num_devices && head == -1; i++) {
+            if (stream->fds[i] != -1 && stream->errors[i] == 0) {
+                head = i;
+            }
+        }
+        if (head == -1) {
+            break;
+        }
+
+        size_t want = length - bytes_received < server_config.put_chunk_size ? length - bytes_received : server_config.put_chunk_size;
+        size_t buffered = conn->end - conn->start;
+        ssize_t received;
+        if (buffered > 0) {
+            // What arrived along with the request header is already in user space
+            received = write(slot[head][1], conn->buffer + conn->start, buffered < want ? buffered : want);
+            if (received > 0) {
+                conn->start += received;
+            }
+        } else {
+            uint64_t started = metrics_now();
+            received = splice(conn->sock, NULL, slot[head][1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+            metrics_phase_add(METRICS_NETWORK, metrics_now() - started);
+        }
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            if (received < 0) {
+                perror("splice");
+            }
+            conn->broken = 1;
+            break;
+        }
+        conn->body_remaining -= received;
+
+        for (int i = head + 1; i < stream->num_devices; i++) {
+            if (stream->fds[i] == -1 || stream->errors[i] != 0) {
+                continue;
+            }
+            ssize_t teed;
+            while ((teed = tee(slot[head][0], slot[i][1], received, 0)) < 0 && errno == EINTR) {
+            }
+            if (teed != received) {
+                perror("tee");
+                pthread_mutex_lock(&stream->mutex);
+                stream->errors[i] = teed < 0 ? errno : EIO;
+                pthread_mutex_unlock(&stream->mutex);
+            }
+        }
+        put_stream_submit(stream, buffer, received);
+        bytes_received += received;
+    }
+
+    int write_failed = put_stream_close(stream, NULL) < 0;
+    close_pipes(pipes, window, num_pipes);
+    if (bytes_received < length && !conn->broken) {
+        // Every device failed, the rest of the body still has to be read
+        connection_discard_body(conn);
+    }
+    return bytes_received == length && !write_failed ? 0 : -1;
+}
+
+/**
+ * @brief Receive the next length bytes of request body into every open device file
+ *
+ * Large bodies are spliced straight into the files when put_splice is on, the
+ * sync backend is in use and the request has no checksum trailer to verify.
+ * Everything else goes through the ring buffers and is hashed as it arrives,
+ * which keeps well ahead of the network with the CPU's CRC instructions.
+ *
+ * @param conn
+ * @param fds the device files, -1 for devices to skip
+ * @param num_devices
+ * @param length
+ * @param crc receives the CRC32C of the data
+ * @return int 0 if all of it arrived and every open device wrote it, 1 if so but it was spliced without
+ *             being hashed, -1 otherwise
+ */
+int put_stream_receive(Connection *conn, const int *fds, int num_devices, uint64_t length, uint32_t *crc) {
+    if (server_config.put_splice && !server_config.io_uring && !conn->checksum && length >= SPLICE_MIN_SIZE) {
+        int result = splice_receive(conn, fds, num_devices, length);
+        if (result != 1) {
+            return result == 0 ? 1 : -1;
+        }
+    }
+
+    // Receive data from the client while the device writers drain it in parallel
+    PutStream *stream = put_stream_open(fds, num_devices, server_config.put_window, 0);
+    if (stream == NULL) {
+        perror("put_stream_open");
+        connection_discard_body(conn);
+        return -1;
+    }
+
+    uint64_t bytes_received = 0;
+    *crc = 0;
+    while (bytes_received < length) {
+        ReplicaBuffer *buffer = put_stream_acquire(stream);
+        uint64_t want = length - bytes_received < server_config.put_chunk_size ? length - bytes_received : server_config.put_chunk_size;
+        ssize_t recv_size = connection_recv_body(conn, buffer->data, want);
+        if (recv_size <= 0) {
+            // Connection closed or error
+            break;
+        }
+        *crc = crc32c_update(*crc, buffer->data, recv_size);
+        put_stream_submit(stream, buffer, recv_size);
+        bytes_received += recv_size;
+    }
+
+    int write_failed = put_stream_close(stream, NULL) < 0;
+    return bytes_received == length && !write_failed ? 0 : -1;
+}
@@ -0,0 +1,288 @@
+#define _GNU_SOURCE
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include "server.h"
+
+// From linux/ioprio.h, which older distributions do not ship
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+
+#define THROTTLE_BURST_SEC 0.1      // unused budget kept for later, in seconds of rate
+#define LATENCY_WINDOW_MS 250       // how often client latency is sampled
+#define LATENCY_MIN_REQUESTS 20     // fewer requests in a window say nothing about p99
+#define LATENCY_PAUSE_MS 50
+#define RESYNC_RETRY_SEC 30
+
+/**
+ * @brief Token buckets pacing the copies of one device's resync
+ *
+ * Both budgets may go negative: a caller takes what it needs and sleeps
+ * off the debt, so a large step is not starved by small ones.
+ */
+struct Throttle {
+    pthread_mutex_t mutex;
+    double bytes_per_sec;       // 0 for no limit
+    double ops_per_sec;         // 0 for no limit
+    double bytes;               // budget left
+    double ops;
+    struct timespec refilled;
+};
+
+static USBDevice *resync_devices;
+static int resync_num_devices;
+static Throttle throttles[MAX_USB_DEVICES];
+
+static atomic_int resyncing[MAX_USB_DEVICES];
+static int resync_running[MAX_USB_DEVICES];
+static int resync_pending[MAX_USB_DEVICES];
+static pthread_mutex_t resync_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_mutex_t latency_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct timespec latency_checked;
+static uint64_t latency_total;
+static uint64_t latency_over;
+static int latency_high = 0;
+
+static double elapsed_sec(const struct timespec *since, const struct timespec *now) {
+    return (now->tv_sec - since->tv_sec) + (now->tv_nsec - since->tv_nsec) / 1e9;
+}
+
+static void sleep_sec(double seconds) {
+    struct timespec ts = { .tv_sec = (time_t)seconds, .tv_nsec = (long)((seconds - (time_t)seconds) * 1e9) };
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+    }
+}
+
+/**
+ * @brief Whether clients are currently slower than resync_latency_target_ms at the 99th percentile.
+ *
+ * The request histograms are sampled at most every LATENCY_WINDOW_MS by
+ * whichever copy thread asks first; more than 1% of the requests finished
+ * since the last sample taking longer than the target means p99 is over it.
+ *
+ * @return int 1 if resync should hold off
+ */
+static int clients_slow(void) {
+    if (server_config.resync_latency_target_ms <= 0) {
+        return 0;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&latency_mutex);
+    if (elapsed_sec(&latency_checked, &now) * 1000 >= LATENCY_WINDOW_MS) {
+        uint64_t total;
+        uint64_t over = metrics_requests_over((uint64_t)server_config.resync_latency_target_ms * 1000000, &total);
+        uint64_t window_total = total - latency_total;
+        uint64_t window_over = over - latency_over;
+        int high = window_total >= LATENCY_MIN_REQUESTS && window_over * 100 > window_total;
+        if (high != latency_high) {
+            printf("Resync %s: client p99 %s %d ms\n", high ? "paused" : "resumed",
+                   high ? "above" : "back under", server_config.resync_latency_target_ms);
+        }
+        latency_high = high;
+        latency_total = total;
+        latency_over = over;
+        latency_checked = now;
+    }
+    int high = latency_high;
+    pthread_mutex_unlock(&latency_mutex);
+    return high;
+}
+
+/**
+ * @brief Wait until a resync may issue another step of I/O
+ *
+ * Holds off while clients are slow, then charges one operation and the
+ * given bytes to the device's budget and sleeps until it is back in credit.
+ *
+ * @param throttle NULL returns at once
+ * @param bytes
+ */
+void throttle_wait(Throttle *throttle, uint64_t bytes) {
+    if (throttle == NULL) {
+        return;
+    }
+    while (clients_slow()) {
+        sleep_sec(LATENCY_PAUSE_MS / 1000.0);
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&throttle->mutex);
+    double elapsed = elapsed_sec(&throttle->refilled, &now);
+    throttle->refilled = now;
+
+    double delay = 0;
+    if (throttle->bytes_per_sec > 0) {
+        throttle->bytes += elapsed * throttle->bytes_per_sec;
+        if (throttle->bytes > throttle->bytes_per_sec * THROTTLE_BURST_SEC) {
+            throttle->bytes = throttle->bytes_per_sec * THROTTLE_BURST_SEC;
+        }
+        throttle->bytes -= bytes;
+        if (throttle->bytes < 0) {
+            delay = -throttle->bytes / throttle->bytes_per_sec;
+        }
+    }
+    if (throttle->ops_per_sec > 0) {
+        throttle->ops += elapsed * throttle->ops_per_sec;
+        if (throttle->ops > throttle->ops_per_sec * THROTTLE_BURST_SEC) {
+            throttle->ops = throttle->ops_per_sec * THROTTLE_BURST_SEC;
+        }
+        throttle->ops -= 1;
+        if (throttle->ops < 0 && -throttle->ops / throttle->ops_per_sec > delay) {
+            delay = -throttle->ops / throttle->ops_per_sec;
+        }
+    }
+    pthread_mutex_unlock(&throttle->mutex);
+
+    if (delay > 0) {
+        sleep_sec(delay);
+    }
+}
+
+/**
+ * @brief Move the calling thread to the idle I/O class when resync_idle_priority asks for it
+ *
+ * The block layer then only serves the thread's requests when no client
+ * I/O is waiting on the same device. Schedulers without I/O classes ignore it.
+ *
+ * @param throttle NULL leaves the thread alone
+ */
+void throttle_attach(Throttle *throttle) {
+    if (throttle == NULL || !server_config.resync_idle_priority) {
+        return;
+    }
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) < 0) {
+        perror("ioprio_set");
+    }
+}
+
+/**
+ * @brief Bring one device up to date from another mounted device, preferring one that is not being rebuilt itself.
+ *
+ * @param idx
+ * @return int 1 once the device matches, 0 if the resync has to run again
+ */
+static int sync_device(int idx) {
+    USBDevice *usb_devices = resync_devices;
+    // A device pulled while it was being rebuilt starts over when it is mounted again
+    if (!device_mounted(&usb_devices[idx])) {
+        return 1;
+    }
+    int i = -1;
+    for (int j = 0; j < resync_num_devices; ++j) {
+        if (j != idx && device_mounted(&usb_devices[j]) && (i == -1 || (resync_active(i) && !resync_active(j)))) {
+            i = j;
+        }
+    }
+    if (i == -1) {
+        return 1;
+    }
+
+    // sync files from source USB (i) to available USB (idx)
+    char src_root[256], dst_root[256];
+    snprintf(src_root, sizeof(src_root), "%.*s/%.*s", (int)(sizeof(src_root) / 2 - 1), usb_devices[i].mount_point, (int)(sizeof(src_root) / 2 - 1), usb_devices[i].storage_folder);
+    snprintf(dst_root, sizeof(dst_root), "%.*s/%.*s", (int)(sizeof(dst_root) / 2 - 1), usb_devices[idx].mount_point, (int)(sizeof(dst_root) / 2 - 1), usb_devices[idx].storage_folder);
+
+    char src_manifest[512], dst_manifest[512], staging_dir[512];
+    snprintf(src_manifest, sizeof(src_manifest), "%s/%s", usb_devices[i].mount_point, MANIFEST_FILE);
+    snprintf(dst_manifest, sizeof(dst_manifest), "%s/%s", usb_devices[idx].mount_point, MANIFEST_FILE);
+    snprintf(staging_dir, sizeof(staging_dir), "%s/%s", usb_devices[idx].mount_point, UPLOAD_DIR);
+
+    // Only files that differ are copied, renamed or deleted
+    int complete = resync_device(src_root, src_manifest, dst_root, dst_manifest, staging_dir, idx, &throttles[idx]);
+    if (!complete) {
+        fprintf(stderr, "Resync of %s incomplete, retrying in %d s\n", dst_root, RESYNC_RETRY_SEC);
+    }
+    // GETs served between the mount and the resync starting may have cached stale contents
+    cache_invalidate("", 1);
+    return complete;
+}
+
+/**
+ * @brief Resync one device until it is consistent, again if it was remounted meanwhile
+ *
+ * @param arg device index
+ * @return void*
+ */
+static void *resync_thread(void *arg) {
+    int idx = (int)(intptr_t)arg;
+    // Scanning the manifests is resync I/O too
+    throttle_attach(&throttles[idx]);
+
+    pthread_mutex_lock(&resync_mutex);
+    while (resync_pending[idx]) {
+        resync_pending[idx] = 0;
+        pthread_mutex_unlock(&resync_mutex);
+        int complete = sync_device(idx);
+        if (!complete) {
+            sleep_sec(RESYNC_RETRY_SEC);
+        }
+        pthread_mutex_lock(&resync_mutex);
+        if (!complete) {
+            resync_pending[idx] = 1;
+        }
+    }
+    // Only a resync that ran to the end puts the device back into read selection
+    atomic_store(&resyncing[idx], 0);
+    resync_running[idx] = 0;
+    pthread_mutex_unlock(&resync_mutex);
+    printf("Device %s is consistent and serving reads\n", resync_devices[idx].mount_point);
+    return NULL;
+}
+
+/**
+ * @brief Set up the per-device throttles from the configuration
+ *
+ * @param usb_devices
+ * @param num_usb_devices
+ */
+void resync_start(USBDevice *usb_devices, int num_usb_devices) {
+    resync_devices = usb_devices;
+    resync_num_devices = num_usb_devices;
+    for (int i = 0; i < MAX_USB_DEVICES; i++) {
+        Throttle *throttle = &throttles[i];
+        pthread_mutex_init(&throttle->mutex, NULL);
+        throttle->bytes_per_sec = server_config.resync_bandwidth_mb * 1024.0 * 1024.0;
+        throttle->ops_per_sec = server_config.resync_iops;
+        clock_gettime(CLOCK_MONOTONIC, &throttle->refilled);
+    }
+}
+
+/**
+ * @brief Rebuild a device in the background, keeping it out of reads until it is consistent
+ *
+ * Returns at once. A request for a device whose resync is running makes that
+ * resync run once more when it finishes.
+ *
+ * @param idx
+ */
+void resync_schedule(int idx) {
+    pthread_mutex_lock(&resync_mutex);
+    atomic_store(&resyncing[idx], 1);
+    resync_pending[idx] = 1;
+    if (!resync_running[idx]) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, resync_thread, (void *)(intptr_t)idx) == 0) {
+            resync_running[idx] = 1;
+            pthread_detach(thread);
+        } else {
+            perror("Resync thread creation failed");
+            atomic_store(&resyncing[idx], 0);
+        }
+    }
+    pthread_mutex_unlock(&resync_mutex);
+}
+
+/**
+ * @brief Whether a device is being rebuilt, and so must not serve reads
+ *
+ * @param idx
+ * @return int
+ */
+int resync_active(int idx) {
+    return idx >= 0 && idx < MAX_USB_DEVICES && atomic_load_explicit(&resyncing[idx], memory_order_relaxed);
+}
@@ -3,27 +3,23 @@
 /**
  * @brief Handle a RM command from the client
  * 
- * @param client_sock 
+ * @param conn 
  * @param path 
  * @param usb_devices 
  * @param num_usb_devices 
  */
-void handle_rm_command(int client_sock, const char *path, USBDevice* usb_devices, const int num_usb_devices) {
+void handle_rm_command(Connection *conn, const char *path, USBDevice* usb_devices, const int num_usb_devices) {
     if (strcmp(path, ".") == 0 || strcmp(path, "./") == 0 || strstr(path, "..") != NULL) {
-        // Send failure status to the client
-        char status = (char) 0;
-        if (send(client_sock, &status, 1, 0) < 0) {
-            perror("send");
-        }
-
         // Send the error message to the client
-        char error_msg[256];
-        snprintf(error_msg, sizeof(error_msg), "Error: Invalid argument");
-        if (send(client_sock, error_msg, strlen(error_msg) + 1, 0) < 0) {
-            perror("send");
-        }
+        connection_send_error(conn, "Error: Invalid argument");
+        return;
+    }
+    PathLock *path_lock = path_lock_acquire(path, PATH_LOCK_WRITE, server_config.lock_timeout_ms);
+    if (path_lock == NULL) {
+        connection_send_error(conn, "Error: File is busy");
         return;
     }
+
     struct stat path_stat;
     int success = 0;
 
@@ -38,20 +34,19 @@ void handle_rm_command(int client_sock, const char *path, USBDevice* usb_devices
         } else {
             success = remove_file(full_file_path); // Use full_file_path here
         }
+        checksum_remove(&usb_devices[i], path);
     }
+    int saved_errno = errno;
+    cache_invalidate(path, 1);
+    path_lock_release(path_lock, PATH_LOCK_WRITE);
+    errno = saved_errno;
 
-    // Send the success status to the client
-    char status = (char)success;
-    if (send(client_sock, &status, 1, 0) < 0) {
-        perror("send");
-    }
-
-    // If the operation failed, send the error message
-    if (!success) {
+    // Send the success status to the client, or the error message if the operation failed
+    if (success) {
+        connection_send_reply(conn, OP_OK, NULL, 0);
+    } else {
         char error_msg[256];
         snprintf(error_msg, sizeof(error_msg), "Error: %s", strerror(errno));
-        if (send(client_sock, error_msg, strlen(error_msg) + 1, 0) < 0) {
-            perror("send");
-        }
+        connection_send_error(conn, error_msg);
     }
 }
@@ -1,5 +1,35 @@
+#include <poll.h>
+#include <stdint.h>
+#include <sys/resource.h>
 #include "server.h"
 
+ServerConfig server_config = {
+    .reactor_threads = 0,
+    .worker_threads = DEFAULT_WORKER_THREADS,
+    .queue_depth = DEFAULT_QUEUE_DEPTH,
+    .put_window = DEFAULT_PUT_WINDOW,
+    .put_chunk_size = DEFAULT_PUT_CHUNK_KB * 1024,
+    .device_queue_depth = DEFAULT_DEVICE_QUEUE_DEPTH,
+    .lock_timeout_ms = DEFAULT_LOCK_TIMEOUT_MS,
+    .cross_process_locks = 0,
+    .copy_threads = DEFAULT_COPY_THREADS,
+    .hedged_reads = 0,
+    .durability = DURABILITY_NONE,
+    .upload_expiry_hours = DEFAULT_UPLOAD_EXPIRY_HOURS,
+    .cache_memory_mb = DEFAULT_CACHE_MEMORY_MB,
+    .cache_max_file_kb = DEFAULT_CACHE_MAX_FILE_KB,
+    .stat_cache_entries = DEFAULT_STAT_CACHE_ENTRIES,
+    .metrics_port = DEFAULT_METRICS_PORT,
+    .resync_bandwidth_mb = 0,
+    .resync_iops = 0,
+    .resync_idle_priority = 1,
+    .resync_latency_target_ms = 0,
+    .io_uring = 0,
+    .put_splice = 1,
+    .buffer_pool_mb = DEFAULT_BUFFER_POOL_MB,
+    .buffer_hugepages = 1,
+};
+
 static int socket_desc;
 static char host[INET_ADDRSTRLEN] = {0};
 static int port;
@@ -25,8 +55,9 @@ void handle_sigint(int sig) {
  * @param port 
  * @param usb_devices 
  * @param num_usb_devices 
+ * @param config 
  */
-void load_configuration(const char *config_file, char *host, int *port, USBDevice *usb_devices, int *num_usb_devices) {
+void load_configuration(const char *config_file, char *host, int *port, USBDevice *usb_devices, int *num_usb_devices, ServerConfig *config) {
     config_t cfg;
     config_setting_t *setting;
 
@@ -48,6 +79,96 @@ void load_configuration(const char *config_file, char *host, int *port, USBDevic
     // Read port
     config_lookup_int(&cfg, "port", port);
 
+    // Read event loop and worker pool sizing
+    config_lookup_int(&cfg, "reactor_threads", &config->reactor_threads);
+    config_lookup_int(&cfg, "worker_threads", &config->worker_threads);
+    config_lookup_int(&cfg, "queue_depth", &config->queue_depth);
+    if (config->worker_threads <= 0) {
+        config->worker_threads = DEFAULT_WORKER_THREADS;
+    }
+    if (config->queue_depth <= 0) {
+        config->queue_depth = DEFAULT_QUEUE_DEPTH;
+    }
+
+    // Read PUT replication limits
+    config_lookup_int(&cfg, "put_window", &config->put_window);
+    config_lookup_int(&cfg, "device_queue_depth", &config->device_queue_depth);
+    if (config->put_window <= 0) {
+        config->put_window = DEFAULT_PUT_WINDOW;
+    }
+    if (config->device_queue_depth <= 0) {
+        config->device_queue_depth = DEFAULT_DEVICE_QUEUE_DEPTH;
+    }
+    int put_chunk_kb;
+    if (config_lookup_int(&cfg, "put_chunk_kb", &put_chunk_kb)) {
+        if (put_chunk_kb < BUFFER_BLOCK_MIN / 1024) {
+            put_chunk_kb = BUFFER_BLOCK_MIN / 1024;
+        } else if (put_chunk_kb > BUFFER_BLOCK_MAX / 1024) {
+            put_chunk_kb = BUFFER_BLOCK_MAX / 1024;
+        }
+        config->put_chunk_size = (size_t)put_chunk_kb * 1024;
+    }
+
+    // Read locking behaviour
+    config_lookup_int(&cfg, "lock_timeout_ms", &config->lock_timeout_ms);
+    config_lookup_bool(&cfg, "cross_process_locks", &config->cross_process_locks);
+    config_lookup_int(&cfg, "copy_threads", &config->copy_threads);
+    config_lookup_bool(&cfg, "hedged_reads", &config->hedged_reads);
+
+    // Read how hard PUT works to get data onto the devices
+    const char *durability;
+    if (config_lookup_string(&cfg, "durability", &durability)) {
+        if (strcmp(durability, "fdatasync") == 0) {
+            config->durability = DURABILITY_FDATASYNC;
+        } else if (strcmp(durability, "group") == 0) {
+            config->durability = DURABILITY_GROUP;
+        } else if (strcmp(durability, "none") != 0) {
+            fprintf(stderr, "Unknown durability \"%s\", using none\n", durability);
+        }
+    }
+    config_lookup_int(&cfg, "upload_expiry_hours", &config->upload_expiry_hours);
+
+    // Read GET content cache sizing
+    config_lookup_int(&cfg, "cache_memory_mb", &config->cache_memory_mb);
+    config_lookup_int(&cfg, "cache_max_file_kb", &config->cache_max_file_kb);
+    if (config->cache_memory_mb < 0) {
+        config->cache_memory_mb = 0;
+    }
+    if (config->cache_max_file_kb < 0) {
+        config->cache_max_file_kb = 0;
+    }
+    config_lookup_int(&cfg, "stat_cache_entries", &config->stat_cache_entries);
+    if (config->stat_cache_entries < 0) {
+        config->stat_cache_entries = 0;
+    }
+
+    // Read which system calls move file data
+    const char *io_backend;
+    if (config_lookup_string(&cfg, "io_backend", &io_backend)) {
+        if (strcmp(io_backend, "uring") == 0) {
+            config->io_uring = 1;
+        } else if (strcmp(io_backend, "sync") != 0) {
+            fprintf(stderr, "Unknown io_backend \"%s\", using sync\n", io_backend);
+        }
+    }
+    config_lookup_bool(&cfg, "put_splice", &config->put_splice);
+
+    // Read the I/O buffer arena sizing
+    config_lookup_int(&cfg, "buffer_pool_mb", &config->buffer_pool_mb);
+    config_lookup_bool(&cfg, "buffer_hugepages", &config->buffer_hugepages);
+    if (config->buffer_pool_mb < 0) {
+        config->buffer_pool_mb = 0;
+    }
+
+    // Read the Prometheus metrics port
+    config_lookup_int(&cfg, "metrics_port", &config->metrics_port);
+
+    // Read how hard a device resync may compete with clients
+    config_lookup_int(&cfg, "resync_bandwidth_mb", &config->resync_bandwidth_mb);
+    config_lookup_int(&cfg, "resync_iops", &config->resync_iops);
+    config_lookup_bool(&cfg, "resync_idle_priority", &config->resync_idle_priority);
+    config_lookup_int(&cfg, "resync_latency_target_ms", &config->resync_latency_target_ms);
+
     // Read usb_devices
     setting = config_lookup(&cfg, "usb_devices");
     if (setting) {
@@ -80,6 +201,27 @@ void load_configuration(const char *config_file, char *host, int *port, USBDevic
             }
 
             strncpy(usb_devices[i].mount_point, mount_point, sizeof(usb_devices[i].mount_point));
+
+            // How uploads are written to this device
+            const char *write_policy;
+            usb_devices[i].write_policy = WRITE_CACHED;
+            if (config_setting_lookup_string(usb_device_setting, "write_policy", &write_policy)) {
+                if (strcmp(write_policy, "writebehind") == 0) {
+                    usb_devices[i].write_policy = WRITE_BEHIND;
+                } else if (strcmp(write_policy, "direct") == 0) {
+                    usb_devices[i].write_policy = WRITE_DIRECT;
+                } else if (strcmp(write_policy, "cached") != 0) {
+                    fprintf(stderr, "Unknown write_policy \"%s\" for %s, using cached\n", write_policy, usb_devices[i].mount_point);
+                }
+            }
+            int direct_min_mb = DEFAULT_DIRECT_MIN_MB;
+            config_setting_lookup_int(usb_device_setting, "direct_min_mb", &direct_min_mb);
+            usb_devices[i].direct_min_size = direct_min_mb > 0 ? (uint64_t)direct_min_mb * 1024 * 1024 : 0;
+
+            // A plain directory is always served, a removable device only while it is mounted
+            int removable = 1;
+            config_setting_lookup_bool(usb_device_setting, "removable", &removable);
+            usb_devices[i].removable = removable;
         }
     }
 
@@ -87,229 +229,217 @@ void load_configuration(const char *config_file, char *host, int *port, USBDevic
 }
 
 /**
- * @brief Get the mount point from the device name.
+ * @brief Get the index of the USB device with the specified mount point.
+ * 
+ * A trailing slash in server.conf does not matter, mountinfo has none.
  * 
- * @param dev_name 
  * @param mount_point 
  * @return int 
  */
-int get_mount_point(const char *dev_name, char *mount_point) {
-    int max_retries = 5;
-    int retry_interval_ms = 500;
-    int found_mount_point = 0;
-
-    for (int attempt = 0; attempt < max_retries; ++attempt) {
-        FILE *fp = fopen("/proc/mounts", "r");
-        if (!fp) {
-            perror("fopen");
-            return 0;
-        }
-
-        char line[256];
-        while (fgets(line, sizeof(line), fp)) {
-            char device[64], mp[128], fs_type[64], options[128];
-            sscanf(line, "%63s %127s %63s %127s", device, mp, fs_type, options);
-
-            if (strcmp(device, dev_name) == 0) {
-                strcpy(mount_point, mp);
-                found_mount_point = 1;
-                break;
-            }
+int usb_in_list(const char *mount_point) {
+    size_t len = strlen(mount_point);
+    for (int i = 0; i < num_usb_devices; ++i) {
+        size_t configured = strlen(usb_devices[i].mount_point);
+        while (configured > 1 && usb_devices[i].mount_point[configured - 1] == '/') {
+            configured--;
         }
-        fclose(fp);
-
-        if (found_mount_point) {
-            break;
+        if (configured == len && strncmp(usb_devices[i].mount_point, mount_point, len) == 0) {
+            return i;
         }
-
-        // Sleep for the specified interval before retrying
-        struct timespec sleep_time;
-        sleep_time.tv_sec = retry_interval_ms / 1000;
-        sleep_time.tv_nsec = (retry_interval_ms % 1000) * 1000000L;
-        nanosleep(&sleep_time, NULL);
-    }
-
-    if (!found_mount_point) {
-        mount_point[0] = '\0';  // Set mount_point to an empty string
-        return 0;
     }
-    return 1;
+    return -1;
 }
 
 /**
- * @brief Get the index of the USB device with the specified mount point.
+ * @brief Start a background resync of a configured device that was just mounted
  * 
+ * @param device 
  * @param mount_point 
- * @return int 
  */
-int usb_in_list(const char *mount_point) {
-    for (int i = 0; i < num_usb_devices; ++i) {
-        if (strcmp(usb_devices[i].mount_point, mount_point) == 0) {
-            return i;
-        }
+static void on_mount(const char *device, const char *mount_point) {
+    int idx = usb_in_list(mount_point);
+    if (idx < 0) {
+        return;
     }
-    return -1;
+    printf("%s mounted on %s, resyncing\n", device, mount_point);
+    resync_schedule(idx);
 }
 
 /**
- * @brief Syncs the files from the source USB to the destination USB.
+ * @brief Take a configured device that was unmounted out of reads and writes
  * 
- * @param idx 
- * @param usb_devices 
+ * device_mounted already answers from the new mount table, so this only has
+ * to drop what was cached from the device.
+ * 
+ * @param device 
+ * @param mount_point 
  */
-void sync_usb(int idx, USBDevice *usb_devices) {
-    for (int i = 0; i < MAX_USB_DEVICES; ++i) {
-        if (i != idx && usb_devices[i].mount_point[0] != '\0') {
-            // sync_usb files from source USB (i) to available USB (idx)
-            char src_root[256], dst_root[256];
-            snprintf(src_root, sizeof(src_root), "%.*s/%.*s", (int)(sizeof(src_root) / 2 - 1), usb_devices[i].mount_point, (int)(sizeof(src_root) / 2 - 1), usb_devices[i].storage_folder);
-            snprintf(dst_root, sizeof(dst_root), "%.*s/%.*s", (int)(sizeof(dst_root) / 2 - 1), usb_devices[idx].mount_point, (int)(sizeof(dst_root) / 2 - 1), usb_devices[idx].storage_folder);
-
-            // Clean up the destination directory before sync_usbing
-            if (!delete_directory(dst_root)) {
-                perror("remove_directory");
-            }
-
-            // Copy the contents of the source directory to the destination directory
-            if (!copy_directory(src_root, dst_root)) {
-                perror("copy_directory");
-            }
-            break;
-        }
+static void on_unmount(const char *device, const char *mount_point) {
+    int idx = usb_in_list(mount_point);
+    if (idx < 0 || !usb_devices[idx].removable || mount_watch_is_mounted(mount_point)) {
+        return;
     }
+    printf("%s unmounted from %s, no longer served\n", device, mount_point);
+    cache_invalidate("", 1);
 }
 
 /**
- * @brief Monitor the /dev directory for USB device events.
+ * @brief Watch the mount table and resync configured USB devices as they are mounted.
+ * 
+ * The kernel flags /proc/self/mountinfo with POLLPRI whenever a mount is
+ * added or removed, so the thread sleeps in poll until something changes
+ * instead of rereading the mounts after every node created in /dev.
  * 
- * @param arg 
+ * @param arg the descriptor from mount_watch_open, -1 to only sweep uploads
  * @return void* 
  */
 void *usb_monitor(void *arg) {
-    int inotify_fd = inotify_init();
-    if (inotify_fd < 0) {
-        perror("inotify_init");
-        return NULL;
-    }
-
-    int watch_fd = inotify_add_watch(inotify_fd, "/dev", IN_CREATE | IN_DELETE);
-    if (watch_fd < 0) {
-        perror("inotify_add_watch");
-        close(inotify_fd);
-        return NULL;
-    }
+    int fd = (int)(intptr_t)arg;
 
-    // char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
-    char buffer[4096];
+    // Abandoned multipart uploads are swept from here too, between mount changes
+    struct pollfd pfd = { .fd = fd, .events = POLLPRI };
+    time_t last_sweep = time(NULL);
     while (1) {
-        ssize_t len = read(inotify_fd, buffer, sizeof(buffer));
-        if (len < 0) {
-            perror("read");
+        int ready = poll(&pfd, 1, UPLOAD_SWEEP_INTERVAL * 1000);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
             break;
         }
-
-        const struct inotify_event *event;
-        char *ptr;
-        for (ptr = buffer; ptr < buffer + len; ptr += sizeof(struct inotify_event) + event->len) {
-            event = (const struct inotify_event *)ptr;
-
-            if (event->mask & IN_CREATE) {
-                // USB device added
-                char dev_path[64];
-                snprintf(dev_path, sizeof(dev_path), "/dev/%s", event->name);
-                char mount_point[128];
-                int found = get_mount_point(dev_path, mount_point);
-                if (!found) continue;
-                int idx = usb_in_list(mount_point);
-                if (idx >= 0) {
-                    sync_usb(idx, usb_devices);
-                }
-            }
+        if (ready > 0 && (pfd.revents & (POLLPRI | POLLERR))) {
+            mount_watch_refresh(fd, on_mount, on_unmount);
+        }
+        if (time(NULL) - last_sweep >= UPLOAD_SWEEP_INTERVAL) {
+            upload_sweep(usb_devices, num_usb_devices, 0);
+            last_sweep = time(NULL);
         }
     }
 
-    // Clean up
-    inotify_rm_watch(inotify_fd, watch_fd);
-    close(inotify_fd);
+    if (fd >= 0) {
+        close(fd);
+    }
     return NULL;
 }
 
 /**
- * @brief Client handler thread.
+ * @brief Run the handler for one decoded request
  * 
- * @param client_sock 
+ * @param conn 
+ * @param header 
  * @param file_path 
- * @param usb_devices 
- * @param num_usb_devices 
  */
-void *client_handler(void *arg) {
-    int client_sock = *(int *)arg;
-    char client_message[BUFFER_SIZE];
-
-    if (recv(client_sock, client_message, sizeof(client_message), 0) < 0) {
-        perror("Recv failed1");
-        close(client_sock);
-        pthread_exit(NULL);
-    }
-
-    char command[16], file_path[2048];
-    memset(command, '\0', sizeof(command));
-    memset(file_path, '\0', sizeof(file_path));
-    sscanf(client_message, "%s %s", command, file_path);
-
-    if (strcmp(command, "GET") == 0) {
-        handle_get_command(client_sock, file_path, usb_devices, num_usb_devices);
-    } else if (strcmp(command, "INFO") == 0) {
-        handle_info_command(client_sock, file_path, usb_devices, num_usb_devices);
-    } else if (strcmp(command, "MD") == 0) {
-        handle_md_command(client_sock, file_path, usb_devices, num_usb_devices);
-    } else if (strcmp(command, "PUT") == 0) {
-        handle_put_command(client_sock, file_path, usb_devices, num_usb_devices);
-    } else if (strcmp(command, "RM") == 0) {
-        handle_rm_command(client_sock, file_path, usb_devices, num_usb_devices);
-    } else {
-        printf("Unknown command: %s\n", client_message);
-    }
-
-    memset(client_message, '\0', sizeof(client_message));
-    close(client_sock);
-
-    pthread_exit(NULL);
+static void dispatch_request(Connection *conn, const FrameHeader *header, const char *file_path) {
+    switch (header->opcode) {
+        case OP_GET:
+            handle_get_command(conn, file_path, usb_devices, num_usb_devices);
+            break;
+        case OP_INFO:
+            handle_info_command(conn, file_path, usb_devices, num_usb_devices);
+            break;
+        case OP_MD:
+            handle_md_command(conn, file_path, usb_devices, num_usb_devices);
+            break;
+        case OP_PUT:
+            handle_put_command(conn, file_path, usb_devices, num_usb_devices);
+            break;
+        case OP_RM:
+            handle_rm_command(conn, file_path, usb_devices, num_usb_devices);
+            break;
+        case OP_GET_RANGE:
+            handle_get_range_command(conn, file_path, usb_devices, num_usb_devices);
+            break;
+        case OP_UPLOAD_BEGIN:
+            handle_upload_begin_command(conn, file_path, usb_devices, num_usb_devices);
+            break;
+        case OP_UPLOAD_CHUNK:
+            handle_upload_chunk_command(conn, file_path, usb_devices, num_usb_devices);
+            break;
+        case OP_UPLOAD_STATUS:
+            handle_upload_status_command(conn, file_path, usb_devices, num_usb_devices);
+            break;
+        case OP_UPLOAD_COMMIT:
+            handle_upload_commit_command(conn, file_path, usb_devices, num_usb_devices);
+            break;
+        case OP_STAT:
+            handle_stat_command(conn, file_path, usb_devices, num_usb_devices);
+            break;
+        case OP_LS:
+            handle_ls_command(conn, file_path, usb_devices, num_usb_devices);
+            break;
+        case OP_COPY:
+            handle_copy_command(conn, file_path, usb_devices, num_usb_devices);
+            break;
+        case OP_MOVE:
+            handle_move_command(conn, file_path, usb_devices, num_usb_devices);
+            break;
+        case OP_STATS:
+            handle_stats_command(conn, file_path, usb_devices, num_usb_devices);
+            break;
+        default:
+            printf("Unknown opcode: %d\n", header->opcode);
+            // Answer anyway so a pipelining client stays in step with its replies
+            connection_send_error(conn, "Error: Unknown command");
+            break;
+    }
 }
 
 /**
- * @brief Accept connections from clients.
+ * @brief Run the requests a ready client has sent, then re-arm or close it
+ * 
+ * Requests are length prefixed frames, so a connection can carry any number
+ * of them back-to-back. They are answered in order.
  * 
- * @param server_socket 
+ * @param conn 
  */
-void accept_connections(int server_socket) {
-    int client_socket;
-    struct sockaddr_in client_address;
-    socklen_t client_address_len = sizeof(client_address);
-
-    while ((client_socket = accept(server_socket, (struct sockaddr *)&client_address, &client_address_len)) >= 0) {
-        if (client_socket < 0) {
-            perror("Accept failed");
-            continue;
+void handle_client(Connection *conn) {
+    ssize_t received = connection_fill(conn);
+    if (received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        if (received < 0) {
+            perror("Recv failed1");
         }
+        connection_close(conn);
+        return;
+    }
 
-        int *client_socket_ptr = malloc(sizeof(int));
-        if (client_socket_ptr == NULL) {
-            perror("Malloc failed");
-            continue;
+    while (1) {
+        FrameHeader header;
+        char file_path[FRAME_MAX_PATH + 1];
+        uint64_t parse_started = metrics_now();
+        FrameStatus status = connection_next_request(conn, &header, file_path, sizeof(file_path));
+        if (status == FRAME_INCOMPLETE) {
+            break;
+        }
+        if (status == FRAME_INVALID) {
+            fprintf(stderr, "Malformed request, closing connection\n");
+            connection_close(conn);
+            return;
         }
 
-        *client_socket_ptr = client_socket;
+        metrics_request_begin(parse_started);
+        dispatch_request(conn, &header, file_path);
+        metrics_request_end(header.opcode);
+
+        // A handler that could not consume its body leaves the stream out of step
+        if (conn->broken || conn->body_remaining > 0) {
+            connection_close(conn);
+            return;
+        }
+    }
 
-        printf("Client connected at IP: %s and port: %i\n",
-               inet_ntoa(client_address.sin_addr),
-               ntohs(client_address.sin_port));
+    event_loop_rearm(conn);
+}
 
-        pthread_t client_thread;
-        if (pthread_create(&client_thread, NULL, client_handler, client_socket_ptr) != 0) {
-            perror("Thread creation failed");
-            free(client_socket_ptr);
-            continue;
+/**
+ * @brief Raise the open file limit so the reactors can hold many idle connections.
+ */
+static void raise_fd_limit(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) < 0) {
+            perror("setrlimit");
         }
     }
 }
@@ -317,11 +447,25 @@ void accept_connections(int server_socket) {
 int main(void) {
     // Register the signal handler for SIGINT
     signal(SIGINT, handle_sigint);
+    // A client hanging up mid-transfer must not kill the whole server
+    signal(SIGPIPE, SIG_IGN);
 
-    load_configuration("server.conf", host, &port, usb_devices, &num_usb_devices);
+    load_configuration("server.conf", host, &port, usb_devices, &num_usb_devices, &server_config);
+    raise_fd_limit();
+
+    // Before any thread takes a buffer
+    buffer_pool_start();
+    if (server_config.io_uring && uring_start() < 0) {
+        fprintf(stderr, "io_uring is unavailable, using the sync backend\n");
+        server_config.io_uring = 0;
+    }
+    // Requests need the mount table to tell which devices are there
+    int mount_fd = mount_watch_open();
+    upload_sweep(usb_devices, num_usb_devices, 1);
+    resync_start(usb_devices, num_usb_devices);
 
     pthread_t usb_monitor_thread;
-    if (pthread_create(&usb_monitor_thread, NULL, usb_monitor, NULL) != 0) {
+    if (pthread_create(&usb_monitor_thread, NULL, usb_monitor, (void *)(intptr_t)mount_fd) != 0) {
         printf("Failed to create USB monitor thread\n");
         return -1;
     }
@@ -357,7 +501,30 @@ int main(void) {
 
     printf("Server started on port %d\n", port);
 
-    accept_connections(server_socket);
+    if (replication_start(usb_devices, num_usb_devices, server_config.device_queue_depth) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (durability_start(num_usb_devices) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    cache_start((size_t)server_config.cache_memory_mb * 1024 * 1024, (size_t)server_config.cache_max_file_kb * 1024);
+    meta_cache_start(server_config.stat_cache_entries);
+
+    if (metrics_start(num_usb_devices, server_config.metrics_port) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (replica_start(server_config.worker_threads) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (worker_pool_start(server_config.worker_threads, server_config.queue_depth) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    event_loop_run(server_socket, server_config.reactor_threads);
 
     close(server_socket);  
     return 0;
@@ -18,17 +18,211 @@
 #include <dirent.h>
 #include <errno.h>
 #include <libconfig.h>
-#include <sys/inotify.h>
+#include "protocol.h"
+#include "crc32c.h"
 
-#define BUFFER_SIZE 4096
 #define MAX_USB_DEVICES 16
 
+#define DEFAULT_WORKER_THREADS 16
+#define DEFAULT_QUEUE_DEPTH 1024
+#define DEFAULT_PUT_WINDOW 16
+#define DEFAULT_PUT_CHUNK_KB 64
+#define DEFAULT_DEVICE_QUEUE_DEPTH 64
+#define DEFAULT_LOCK_TIMEOUT_MS 30000
+#define DEFAULT_COPY_THREADS 4
+#define DEFAULT_CACHE_MEMORY_MB 64
+#define DEFAULT_CACHE_MAX_FILE_KB 1024
+#define DEFAULT_STAT_CACHE_ENTRIES 65536
+#define DEFAULT_METRICS_PORT 0
+#define DEFAULT_BUFFER_POOL_MB 256
+#define DEFAULT_DIRECT_MIN_MB 16
+#define DEFAULT_UPLOAD_EXPIRY_HOURS 24
+#define UPLOAD_SWEEP_INTERVAL 600       // seconds between sweeps for expired multipart uploads
+#define DIRECT_IO_ALIGN 4096            // offsets, lengths and buffers of O_DIRECT writes
+#define BUFFER_BLOCK_MIN (64 * 1024)    // smallest block of the buffer arena
+#define BUFFER_BLOCK_MAX (1024 * 1024)  // larger buffers are mapped one by one
+#define CONNECTION_BUFFER_SIZE (16 * 1024)
+#define REPLY_MAX_PARTS 4
+#define MANIFEST_FILE ".fs_manifest"
+#define UPLOAD_DIR ".fs_uploads"
+#define CHECKSUM_DIR ".fs_checksums"   // sidecar digests on filesystems without extended attributes
+
+/**
+ * @brief How uploads are written to a device
+ */
+typedef enum WritePolicy {
+    WRITE_CACHED,           // through the page cache, flushed whenever the kernel likes
+    WRITE_BEHIND,           // through the page cache, pushed out and dropped as the upload goes
+    WRITE_DIRECT            // large uploads preallocated and written with O_DIRECT, others as WRITE_BEHIND
+} WritePolicy;
+
 typedef struct USBDevice {
     char label[256];
     char mount_point[256];
     char storage_folder[256];
+    WritePolicy write_policy;
+    uint64_t direct_min_size; // smaller uploads are not written with O_DIRECT
+    int removable;            // only served while a block device is mounted on mount_point
 } USBDevice;
 
+/**
+ * @brief How far write-behind got on one upload file
+ */
+typedef struct WriteBehind {
+    uint64_t started;       // writeback was started on everything before this offset
+    uint64_t dropped;       // and the pages before this one are off the page cache
+} WriteBehind;
+
+/**
+ * @brief Where a request spent its time
+ */
+typedef enum MetricsPhase {
+    METRICS_PARSE,          // decoding the request frame
+    METRICS_LOCK,           // waiting for path locks
+    METRICS_DEVICE,         // everything else the handler does, mostly device I/O
+    METRICS_NETWORK,        // sending the reply and receiving bulk request data
+    METRICS_TOTAL,
+    METRICS_PHASES
+} MetricsPhase;
+
+typedef enum DurabilityMode {
+    DURABILITY_NONE,        // leave flushing to the kernel
+    DURABILITY_FDATASYNC,   // fdatasync every uploaded file before it replaces the old one
+    DURABILITY_GROUP        // one syncfs per device covers every upload that is waiting
+} DurabilityMode;
+
+typedef struct ServerConfig {
+    int reactor_threads;    // epoll reactor threads, 0 means one per online CPU
+    int worker_threads;     // threads running the handle_*_command functions
+    int queue_depth;        // max ready connections waiting for a worker
+    int put_window;         // receive buffers in flight per PUT
+    size_t put_chunk_size;  // bytes in each of them, BUFFER_BLOCK_MIN to BUFFER_BLOCK_MAX
+    int device_queue_depth; // chunks queued per device writer before the receiver blocks
+    int lock_timeout_ms;    // how long a request waits for a path lock, negative waits forever
+    int cross_process_locks; // also take fcntl locks on the device files
+    int copy_threads;       // files copied at once per destination device during a sync
+    int hedged_reads;       // open a second replica when the first is slower than its p95
+    DurabilityMode durability; // when uploaded data must be on the device
+    int upload_expiry_hours; // multipart uploads idle this long are removed, 0 keeps them forever
+    int cache_memory_mb;    // RAM for the GET content cache, 0 turns it off
+    int cache_max_file_kb;  // larger files are never cached
+    int stat_cache_entries; // stat results kept for INFO and STAT, 0 turns it off
+    int metrics_port;       // local port serving metrics to Prometheus, 0 turns it off
+    int resync_bandwidth_mb; // MB/s a device resync may copy, 0 for no limit
+    int resync_iops;        // copy steps per second a device resync may issue, 0 for no limit
+    int resync_idle_priority; // run resync I/O in the idle I/O scheduling class
+    int resync_latency_target_ms; // pause resync while client p99 is above this, 0 never pauses
+    int io_uring;           // io_backend = "uring": uploads and copies go through per-thread rings
+    int put_splice;         // PUT bodies go from the socket to the device files through pipes
+    int buffer_pool_mb;     // address space of the I/O buffer arena, 0 maps every buffer on its own
+    int buffer_hugepages;   // back the arena with huge pages
+} ServerConfig;
+
+extern ServerConfig server_config;
+
+/**
+ * @brief A client connection, owned by at most one worker at a time
+ */
+typedef struct Connection {
+    int sock;
+    int epoll_fd;           // reactor that re-arms the socket between requests
+    int broken;             // the byte stream is out of step with the framing, close it
+    uint32_t request_id;    // request being handled, echoed in its reply
+    int checksum;           // the request's body or reply ends with a CRC32C trailer
+    const uint8_t *args;    // opcode specific arguments after the path
+    size_t args_len;
+    uint64_t body_remaining; // bulk request bytes still on the socket
+    size_t start;           // first unread byte in buffer
+    size_t end;             // one past the last buffered byte
+    char buffer[CONNECTION_BUFFER_SIZE];
+} Connection;
+
+/**
+ * @brief A receive buffer shared by every device writer of one upload
+ */
+typedef struct ReplicaBuffer {
+    char *data;
+    size_t len;
+    uint64_t offset;        // position of the chunk in the upload
+    int refcount;           // device writers still holding the buffer
+} ReplicaBuffer;
+
+typedef struct Uring Uring;
+
+/**
+ * @brief One PUT being fanned out to all devices through a ring of buffers
+ */
+typedef struct PutStream {
+    ReplicaBuffer *ring;
+    char *memory;           // the ring's region the chunks are carved from, with io_uring
+    int window;
+    int next;
+    int fds[MAX_USB_DEVICES];
+    int errors[MAX_USB_DEVICES];
+    int num_devices;
+    Uring *uring;           // the receiving thread's ring when io_backend is uring, else NULL
+    uint64_t base[MAX_USB_DEVICES]; // file offset each device file started at
+    uint64_t submitted;     // bytes handed to the devices so far
+    int spliced;            // chunks wait in the devices' pipes, the ring buffers hold no data
+    int (*pipes)[MAX_USB_DEVICES][2]; // per ring slot, the pipe of each device
+    int buffered[MAX_USB_DEVICES]; // the device file rejected splice, its pipe is read and written instead
+    int direct[MAX_USB_DEVICES]; // the device file is open with O_DIRECT
+    WriteBehind behind[MAX_USB_DEVICES];
+    pthread_mutex_t mutex;
+    pthread_cond_t released;
+} PutStream;
+
+typedef enum {
+    PATH_LOCK_NONE,
+    PATH_LOCK_READ,
+    PATH_LOCK_WRITE
+} PathLockMode;
+
+typedef struct PathLock PathLock;
+
+/**
+ * @brief Lock a logical path in the in-process lock table
+ * 
+ * @param path 
+ * @param mode 
+ * @param timeout_ms how long to wait, negative waits forever
+ * @return PathLock* the held lock, or NULL with errno set to ETIMEDOUT
+ */
+PathLock *path_lock_acquire(const char *path, PathLockMode mode, int timeout_ms);
+
+/**
+ * @brief Lock two different logical paths, always in the same order so opposite requests cannot deadlock
+ * 
+ * @param first 
+ * @param first_mode 
+ * @param second 
+ * @param second_mode 
+ * @param timeout_ms how long to wait for each lock, negative waits forever
+ * @param first_lock receives the lock on first
+ * @param second_lock receives the lock on second
+ * @return int 0 with both held, -1 with neither held and errno set to ETIMEDOUT
+ */
+int path_lock_acquire_pair(const char *first, PathLockMode first_mode, const char *second, PathLockMode second_mode,
+                           int timeout_ms, PathLock **first_lock, PathLock **second_lock);
+
+/**
+ * @brief Release a lock taken with path_lock_acquire
+ * 
+ * @param lock 
+ * @param mode the mode it was acquired in
+ */
+void path_lock_release(PathLock *lock, PathLockMode mode);
+
+/**
+ * @brief Normalise a logical path so "a//b/", "/a/b" and "./a/b" compare equal
+ * 
+ * @param path 
+ * @param out 
+ * @param size 
+ */
+void normalize_path(const char *path, char *out, size_t size);
+
+// fcntl locks on device files, no-ops unless cross_process_locks is set
 int lock_file_read(int fd);
 int lock_file_write(int fd);
 int unlock_file(int fd);
@@ -36,57 +230,709 @@ int unlock_file(int fd);
 /**
  * @brief Handle a GET command from the client
  * 
- * @param client_sock 
+ * @param conn 
  * @param file_path 
  * @param usb_devices 
  * @param num_usb_devices
  * @return int 
  */
-void handle_get_command(int client_sock, const char *file_path, USBDevice* usb_devices, const int num_usb_devices);
+void handle_get_command(Connection *conn, const char *file_path, USBDevice* usb_devices, const int num_usb_devices);
+
+/**
+ * @brief Handle a GET_RANGE command, sending part of a file after its size
+ * 
+ * @param conn 
+ * @param file_path 
+ * @param usb_devices 
+ * @param num_usb_devices 
+ */
+void handle_get_range_command(Connection *conn, const char *file_path, USBDevice* usb_devices, const int num_usb_devices);
 
 /**
  * @brief Handle a PUT command from the client
  * 
- * @param client_sock 
+ * @param conn 
  * @param file_path 
  * @param usb_devices 
  * @param num_usb_devices
  * @return int 
  */
-void handle_info_command(int client_sock, const char *file_path, USBDevice* usb_devices, const int num_usb_devices);
+void handle_info_command(Connection *conn, const char *file_path, USBDevice* usb_devices, const int num_usb_devices);
+
+/**
+ * @brief Handle a STAT command, a batched INFO answering many paths in one binary reply
+ * 
+ * @param conn 
+ * @param base_path directory the requested paths are relative to, empty for the storage folder
+ * @param usb_devices 
+ * @param num_usb_devices 
+ */
+void handle_stat_command(Connection *conn, const char *base_path, USBDevice* usb_devices, const int num_usb_devices);
+
+/**
+ * @brief Handle an LS command, streaming a directory listing a bounded number of entries at a time
+ * 
+ * @param conn 
+ * @param dir_path 
+ * @param usb_devices 
+ * @param num_usb_devices 
+ */
+void handle_ls_command(Connection *conn, const char *dir_path, USBDevice* usb_devices, const int num_usb_devices);
 
 /**
  * @brief Handle a PUT command from the client
  * 
- * @param client_sock 
+ * @param conn 
  * @param file_path 
  * @param usb_devices 
  * @param num_usb_devices
  * @return int 
  */
-void handle_md_command(int client_sock, const char *new_folder, USBDevice* usb_devices, const int num_usb_devices);
+void handle_md_command(Connection *conn, const char *new_folder, USBDevice* usb_devices, const int num_usb_devices);
 
 /**
  * @brief Handle a PUT command from the client
  * 
- * @param client_sock 
+ * @param conn 
  * @param file_path 
  * @param usb_devices 
  * @param num_usb_devices
  * @return int 
  */
-void handle_put_command(int client_sock, const char *file_path, USBDevice* usb_devices, const int num_usb_devices);
+void handle_put_command(Connection *conn, const char *file_path, USBDevice* usb_devices, const int num_usb_devices);
 
 /**
  * @brief Handle a RM command from the client
  * 
- * @param client_sock 
+ * @param conn 
  * @param path 
  * @param usb_devices 
  * @param num_usb_devices
  * @return int 
  */
-void handle_rm_command(int client_sock, const char *path, USBDevice* usb_devices, const int num_usb_devices);
+void handle_rm_command(Connection *conn, const char *path, USBDevice* usb_devices, const int num_usb_devices);
+
+/**
+ * @brief Handle a COPY command, copying a file or directory in place on every device
+ * 
+ * @param conn 
+ * @param src 
+ * @param usb_devices 
+ * @param num_usb_devices 
+ */
+void handle_copy_command(Connection *conn, const char *src, USBDevice* usb_devices, const int num_usb_devices);
+
+/**
+ * @brief Handle a MOVE command, renaming a file or directory on every device
+ * 
+ * @param conn 
+ * @param src 
+ * @param usb_devices 
+ * @param num_usb_devices 
+ */
+void handle_move_command(Connection *conn, const char *src, USBDevice* usb_devices, const int num_usb_devices);
+
+/**
+ * @brief Handle a STATS command, replying with the server's metrics as text
+ * 
+ * @param conn 
+ * @param path ignored
+ * @param usb_devices 
+ * @param num_usb_devices 
+ */
+void handle_stats_command(Connection *conn, const char *path, USBDevice* usb_devices, const int num_usb_devices);
+
+/**
+ * @brief Handle an UPLOAD_BEGIN command, staging a multipart upload on every device
+ * 
+ * @param conn 
+ * @param file_path 
+ * @param usb_devices 
+ * @param num_usb_devices 
+ */
+void handle_upload_begin_command(Connection *conn, const char *file_path, USBDevice* usb_devices, const int num_usb_devices);
+
+/**
+ * @brief Handle an UPLOAD_CHUNK command, writing one chunk of a multipart upload
+ * 
+ * @param conn 
+ * @param file_path 
+ * @param usb_devices 
+ * @param num_usb_devices 
+ */
+void handle_upload_chunk_command(Connection *conn, const char *file_path, USBDevice* usb_devices, const int num_usb_devices);
+
+/**
+ * @brief Handle an UPLOAD_STATUS command, reporting the chunks received so far
+ * 
+ * @param conn 
+ * @param file_path 
+ * @param usb_devices 
+ * @param num_usb_devices 
+ */
+void handle_upload_status_command(Connection *conn, const char *file_path, USBDevice* usb_devices, const int num_usb_devices);
+
+/**
+ * @brief Handle an UPLOAD_COMMIT command, moving a complete upload into place
+ * 
+ * @param conn 
+ * @param file_path 
+ * @param usb_devices 
+ * @param num_usb_devices 
+ */
+void handle_upload_commit_command(Connection *conn, const char *file_path, USBDevice* usb_devices, const int num_usb_devices);
+
+/**
+ * @brief Remove multipart uploads that have been idle for upload_expiry_hours
+ * 
+ * @param usb_devices 
+ * @param num_usb_devices 
+ * @param startup also remove whatever PUT, COPY and resync left staged when the server last stopped
+ */
+void upload_sweep(USBDevice *usb_devices, int num_usb_devices, int startup);
+
+/**
+ * @brief Run the requests a ready client has sent, then re-arm or close it
+ * 
+ * @param conn 
+ */
+void handle_client(Connection *conn);
+
+/**
+ * @brief Allocate the state for a newly accepted client socket
+ * 
+ * @param sock 
+ * @param epoll_fd 
+ * @return Connection* or NULL on allocation failure
+ */
+Connection *connection_create(int sock, int epoll_fd);
+
+/**
+ * @brief Close the client socket and free the connection
+ * 
+ * @param conn 
+ */
+void connection_close(Connection *conn);
+
+/**
+ * @brief Read whatever the socket has ready into the connection buffer without blocking
+ * 
+ * @param conn 
+ * @return ssize_t bytes read, 0 on orderly shutdown, -1 on error
+ */
+ssize_t connection_fill(Connection *conn);
+
+/**
+ * @brief Take the next complete request frame out of the connection buffer
+ * 
+ * @param conn 
+ * @param header 
+ * @param path 
+ * @param path_size 
+ * @return FrameStatus FRAME_INCOMPLETE until the whole request is buffered
+ */
+FrameStatus connection_next_request(Connection *conn, FrameHeader *header, char *path, size_t path_size);
+
+/**
+ * @brief Receive from the client, handing out buffered bytes before reading the socket
+ * 
+ * @param conn 
+ * @param buf 
+ * @param len 
+ * @param flags 
+ * @return ssize_t bytes received, 0 on orderly shutdown, -1 on error
+ */
+ssize_t connection_recv(Connection *conn, void *buf, size_t len, int flags);
+
+/**
+ * @brief Receive bulk request data, never reading past the end of the current frame
+ * 
+ * @param conn 
+ * @param buf 
+ * @param len 
+ * @return ssize_t bytes received, 0 once the body is used up or the client hung up
+ */
+ssize_t connection_recv_body(Connection *conn, void *buf, size_t len);
+
+/**
+ * @brief Read and drop whatever bulk data of the current request is left
+ * 
+ * @param conn 
+ * @return int 0 on success, -1 if the client hung up
+ */
+int connection_discard_body(Connection *conn);
+
+/**
+ * @brief Receive the CRC32C trailer that ends a checksummed request body
+ * 
+ * @param conn 
+ * @param crc what the data before it hashed to
+ * @return int 0 if the trailer matches, -1 if it does not or never arrived
+ */
+int connection_check_trailer(Connection *conn, uint32_t crc);
+
+/**
+ * @brief Send the header of a reply whose payload the caller streams afterwards
+ * 
+ * @param conn 
+ * @param opcode 
+ * @param length 
+ * @return int 0 on success, -1 on failure
+ */
+int connection_send_header(Connection *conn, uint8_t opcode, uint64_t length);
+
+/**
+ * @brief Send the header of a reply and the start of its payload
+ * 
+ * @param conn 
+ * @param opcode 
+ * @param length full payload length, the caller streams what follows head
+ * @param head 
+ * @param head_len 
+ * @return int 0 on success, -1 on failure
+ */
+int connection_send_reply_head(Connection *conn, uint8_t opcode, uint64_t length, const void *head, size_t head_len);
+
+/**
+ * @brief Send a complete reply frame whose payload is gathered from several buffers
+ * 
+ * @param conn 
+ * @param opcode 
+ * @param parts 
+ * @param num_parts at most REPLY_MAX_PARTS
+ * @return int 0 on success, -1 on failure
+ */
+int connection_send_reply_parts(Connection *conn, uint8_t opcode, const struct iovec *parts, int num_parts);
+
+/**
+ * @brief Send a complete reply frame to the current request
+ * 
+ * @param conn 
+ * @param opcode 
+ * @param payload 
+ * @param length 
+ * @return int 0 on success, -1 on failure
+ */
+int connection_send_reply(Connection *conn, uint8_t opcode, const void *payload, size_t length);
+
+/**
+ * @brief Send an OP_ERROR reply carrying a message
+ * 
+ * @param conn 
+ * @param message 
+ * @return int 0 on success, -1 on failure
+ */
+int connection_send_error(Connection *conn, const char *message);
+
+/**
+ * @brief Hold back partial packets of a streamed reply until its trailer is sent
+ * 
+ * @param conn 
+ */
+void connection_cork(Connection *conn);
+
+/**
+ * @brief Send the CRC32C trailer that ends a checksummed reply, and whatever connection_cork held back
+ * 
+ * @param conn 
+ * @param crc 
+ * @return int 0 on success, -1 on failure
+ */
+int connection_send_trailer(Connection *conn, uint32_t crc);
+
+/**
+ * @brief Start the worker pool that runs client commands
+ * 
+ * @param num_threads 
+ * @param queue_depth 
+ * @return int 0 on success, -1 on failure
+ */
+int worker_pool_start(int num_threads, int queue_depth);
+
+/**
+ * @brief Queue a ready client for a worker, blocks while the queue is full
+ * 
+ * @param conn 
+ */
+void worker_pool_submit(Connection *conn);
+
+/**
+ * @brief Ready connections waiting for a worker
+ * 
+ * @return int 
+ */
+int worker_pool_queued(void);
+
+/**
+ * @brief Run the epoll reactors on the listening socket, does not return on success
+ * 
+ * @param server_socket 
+ * @param num_reactors 
+ * @return int -1 on failure
+ */
+int event_loop_run(int server_socket, int num_reactors);
+
+/**
+ * @brief Hand a session connection back to its reactor to wait for the next command
+ * 
+ * @param conn 
+ */
+void event_loop_rearm(Connection *conn);
+
+/**
+ * @brief Start one writer thread per configured USB device
+ * 
+ * @param usb_devices 
+ * @param num_devices 
+ * @param queue_depth 
+ * @return int 0 on success, -1 on failure
+ */
+int replication_start(const USBDevice *usb_devices, int num_devices, int queue_depth);
+
+/**
+ * @brief Upload chunks queued for one device's writer
+ * 
+ * @param device 
+ * @return int 
+ */
+int replication_queue_depth(int device);
+
+/**
+ * @brief Start a replicated upload to the given device files, -1 entries are skipped
+ * 
+ * @param fds 
+ * @param num_devices 
+ * @param window 
+ * @param spliced the chunks go through pipes, so the ring gets no buffers
+ * @return PutStream* or NULL on allocation failure
+ */
+PutStream *put_stream_open(const int *fds, int num_devices, int window, int spliced);
+
+/**
+ * @brief Take the next ring buffer, waiting until every device has released it
+ * 
+ * @param stream 
+ * @return ReplicaBuffer* 
+ */
+ReplicaBuffer *put_stream_acquire(PutStream *stream);
+
+/**
+ * @brief Hand a filled buffer to every device writer
+ * 
+ * @param stream 
+ * @param buffer 
+ * @param len 
+ */
+void put_stream_submit(PutStream *stream, ReplicaBuffer *buffer, size_t len);
+
+/**
+ * @brief Wait for every queued write of the upload to finish and free the stream
+ * 
+ * @param stream 
+ * @param errors receives the errno of each device's first failed write, may be NULL
+ * @return int 0 if every device wrote all data, -1 otherwise
+ */
+int put_stream_close(PutStream *stream, int *errors);
+
+/**
+ * @brief Receive the next length bytes of request body into every open device file
+ * 
+ * @param conn 
+ * @param fds the device files, -1 for devices to skip
+ * @param num_devices 
+ * @param length 
+ * @param crc receives the CRC32C of the data
+ * @return int 0 if all of it arrived and every open device wrote it, 1 if so but it was spliced without
+ *             being hashed, which a request with a checksum trailer never is, -1 otherwise
+ */
+int put_stream_receive(Connection *conn, const int *fds, int num_devices, uint64_t length, uint32_t *crc);
+
+/**
+ * @brief A file opened for a GET on one replica
+ */
+typedef struct ReplicaRead {
+    int fd;
+    int device;
+} ReplicaRead;
+
+/**
+ * @brief Start the threads that run hedged replica opens
+ * 
+ * @param num_threads 
+ * @return int 0 on success, -1 on failure
+ */
+int replica_start(int num_threads);
+
+/**
+ * @brief Open a file on the replica expected to serve it fastest
+ * 
+ * @param usb_devices 
+ * @param num_usb_devices 
+ * @param file_path 
+ * @param read 
+ * @return int 0 on success, -1 with errno set
+ */
+int replica_open(USBDevice *usb_devices, int num_usb_devices, const char *file_path, ReplicaRead *read);
+
+/**
+ * @brief Close a file opened with replica_open
+ * 
+ * @param read 
+ */
+void replica_close(ReplicaRead *read);
+
+/**
+ * @brief Whether a device is serving requests or resting after repeated failures
+ * 
+ * @param device 
+ * @return int 1 if it is healthy and not being rebuilt
+ */
+int replica_healthy(int device);
+
+/**
+ * @brief GETs currently reading from a device
+ * 
+ * @param device 
+ * @return int 
+ */
+int replica_outstanding(int device);
+
+/**
+ * @brief The contents of a small file kept in memory for GETs
+ */
+typedef struct CacheEntry {
+    char *key;              // normalised logical path
+    char *data;
+    uint64_t size;
+    uint32_t crc;           // CRC32C of the data
+    size_t charge;          // bytes counted against the cache budget
+    uint64_t hash;
+    int refs;               // GETs still sending the data
+    int segment;            // LRU segment holding it, or none once dropped
+    struct CacheEntry *hash_next;
+    struct CacheEntry *prev;
+    struct CacheEntry *next;
+} CacheEntry;
+
+/**
+ * @brief Size the GET content cache, a budget of 0 turns it off
+ * 
+ * @param budget_bytes 
+ * @param max_file_bytes files larger than this are always read from the devices
+ */
+void cache_start(size_t budget_bytes, size_t max_file_bytes);
+
+/**
+ * @brief Whether a file of this size may be kept in memory
+ * 
+ * @param size 
+ * @return int 1 if it may
+ */
+int cache_admits(uint64_t size);
+
+/**
+ * @brief Find the cached contents of a logical path
+ * 
+ * @param path 
+ * @return CacheEntry* a reference to drop with cache_release, or NULL on a miss
+ */
+CacheEntry *cache_lookup(const char *path);
+
+/**
+ * @brief Current invalidation generation, taken before a file is read for cache_fill
+ * 
+ * @return uint64_t 
+ */
+uint64_t cache_generation(void);
+
+/**
+ * @brief Read a whole file into memory and add it to the cache
+ * 
+ * @param path 
+ * @param fd open file on one replica
+ * @param size its size
+ * @param since generation taken before the file was opened, a later invalidation keeps it out of the cache
+ * @return CacheEntry* a reference to drop with cache_release, or NULL if the file could not be read
+ */
+CacheEntry *cache_fill(const char *path, int fd, uint64_t size, uint64_t since);
+
+/**
+ * @brief Drop a reference taken by cache_lookup or cache_fill
+ * 
+ * @param entry 
+ */
+void cache_release(CacheEntry *entry);
+
+/**
+ * @brief Forget the cached contents and metadata of a logical path, call with its write lock held
+ * 
+ * @param path the root of the storage folder forgets everything
+ * @param subtree also forget everything below the path, for removed or resynced directories
+ */
+void cache_invalidate(const char *path, int subtree);
+
+/**
+ * @brief Size the stat cache, 0 entries turns it off
+ * 
+ * @param entries 
+ */
+void meta_cache_start(int entries);
+
+/**
+ * @brief Stat a logical path on the first device that has it, through the cache
+ * 
+ * @param usb_devices 
+ * @param num_usb_devices 
+ * @param path 
+ * @param st 
+ * @return int 0 on success, -1 with errno set
+ */
+int meta_cache_stat(USBDevice *usb_devices, int num_usb_devices, const char *path, struct stat *st);
+
+/**
+ * @brief Forget the stat results of a logical path and its parent
+ * 
+ * @param path the root of the storage folder forgets everything
+ * @param subtree also forget everything below the path
+ */
+void meta_cache_invalidate(const char *path, int subtree);
+
+/**
+ * @brief Name of a user, its uid as text if it has none
+ * 
+ * @param uid 
+ * @param out 
+ * @param size 
+ */
+void meta_cache_user(uid_t uid, char *out, size_t size);
+
+/**
+ * @brief Name of a group, its gid as text if it has none
+ * 
+ * @param gid 
+ * @param out 
+ * @param size 
+ */
+void meta_cache_group(gid_t gid, char *out, size_t size);
+
+typedef struct CopyPool CopyPool;
+typedef void (*CopyDone)(void *arg, int result);
+typedef struct Throttle Throttle;
+
+/**
+ * @brief Start a pool of threads copying files for one destination device
+ * 
+ * @param device index of the destination device, whose copy_threads limit the pool shares
+ * @param throttle paces the copies, NULL for full speed
+ * @return CopyPool* or NULL on failure
+ */
+CopyPool *copy_pool_start(int device, Throttle *throttle);
+
+/**
+ * @brief Queue a file copy, blocks while the pool is busy
+ * 
+ * @param pool 
+ * @param src 
+ * @param dst 
+ * @param done called on the copy thread with copy_file's result, may be NULL
+ * @param arg 
+ * @return int 0 on success, -1 on failure
+ */
+int copy_pool_submit(CopyPool *pool, const char *src, const char *dst, CopyDone done, void *arg);
+
+/**
+ * @brief Wait for the queued copies and free the pool
+ * 
+ * @param pool 
+ * @return int number of copies that failed
+ */
+int copy_pool_finish(CopyPool *pool);
+
+/**
+ * @brief Bring one device in line with another, copying only what differs
+ * 
+ * @param src_root 
+ * @param src_manifest manifest file kept on the source device
+ * @param dst_root 
+ * @param dst_manifest manifest file kept on the destination device
+ * @param staging_dir where copies are made before they are renamed into place
+ * @param device index of the destination device
+ * @param throttle paces the copies, may be NULL
+ * @return int 1 on success, 0 on failure
+ */
+int resync_device(const char *src_root, const char *src_manifest, const char *dst_root, const char *dst_manifest,
+                  const char *staging_dir, int device, Throttle *throttle);
+
+/**
+ * @brief Set up the per-device resync throttles from the configuration
+ * 
+ * @param usb_devices 
+ * @param num_usb_devices 
+ */
+void resync_start(USBDevice *usb_devices, int num_usb_devices);
+
+/**
+ * @brief Rebuild a device from another on a background thread
+ * 
+ * @param idx 
+ */
+void resync_schedule(int idx);
+
+/**
+ * @brief Whether a device is being rebuilt and kept out of reads
+ * 
+ * @param idx 
+ * @return int 
+ */
+int resync_active(int idx);
+
+/**
+ * @brief Wait until a resync may issue more I/O, charging it to the throttle
+ * 
+ * @param throttle NULL returns at once
+ * @param bytes 
+ */
+void throttle_wait(Throttle *throttle, uint64_t bytes);
+
+/**
+ * @brief Give the calling thread the throttle's I/O priority
+ * 
+ * @param throttle NULL leaves the thread alone
+ */
+void throttle_attach(Throttle *throttle);
+
+/**
+ * @brief Start the threads that flush uploaded files to their devices
+ * 
+ * @param num_devices 
+ * @return int 0 on success, -1 on failure
+ */
+int durability_start(int num_devices);
+
+/**
+ * @brief Make the data written to each device file durable, as the durability setting asks
+ * 
+ * @param fds the device files, -1 for devices to skip
+ * @param num_devices 
+ * @return int 0 on success, -1 if any device failed to flush
+ */
+int durability_sync(const int *fds, int num_devices);
+
+/**
+ * @brief Make the renames that put files in place durable, as the durability setting asks
+ * 
+ * @param paths where each device's file now is, empty for devices to skip
+ * @param num_devices 
+ * @return int 0 on success, -1 if any device failed to flush
+ */
+int durability_sync_parents(char (*paths)[4096], int num_devices);
+
+/**
+ * @brief A random 64-bit id for staging files and uploads
+ * 
+ * @return uint64_t 
+ */
+uint64_t random_id(void);
 
 /**
  * @brief Remove a file from the filesystem
@@ -113,13 +959,332 @@ int delete_directory(const char *path);
  */
 int copy_file(const char *src, const char *dst);
 
+/**
+ * @brief Copy a file, no faster than a throttle allows
+ * 
+ * @param src 
+ * @param dst 
+ * @param throttle NULL copies at full speed
+ * @return int 
+ */
+int copy_file_throttled(const char *src, const char *dst, Throttle *throttle);
+
+/**
+ * @brief Stream part of a file to a socket without copying it through user space
+ * 
+ * @param sock 
+ * @param fd 
+ * @param offset 
+ * @param count 
+ * @return off_t bytes sent, or -1 on error
+ */
+off_t send_file_range(int sock, int fd, off_t offset, off_t count);
+
+/**
+ * @brief Stream part of a file to a socket through user space, hashing it on the way
+ * 
+ * @param sock 
+ * @param fd 
+ * @param offset 
+ * @param count 
+ * @param crc extended with the CRC32C of what was sent
+ * @return off_t bytes sent, or -1 on error
+ */
+off_t send_file_range_hashed(int sock, int fd, off_t offset, off_t count, uint32_t *crc);
+
 /**
  * @brief Copy a directory from one location to another
  * 
  * @param src 
  * @param dst 
+ * @param device index of the device dst is on
+ * @return int 
+ */
+int copy_directory(const char *src, const char *dst, int device);
+
+/**
+ * @brief Set up the metrics, and serve them over HTTP on a local port when one is given
+ * 
+ * @param num_devices 
+ * @param port 0 for no listener
+ * @return int 0 on success, -1 if the listener could not be started
+ */
+int metrics_start(int num_devices, int port);
+
+/**
+ * @brief Nanoseconds on the monotonic clock, for timing phases
+ * 
+ * @return uint64_t 
+ */
+uint64_t metrics_now(void);
+
+/**
+ * @brief Start timing a request whose frame took parse_started until now to decode
+ * 
+ * @param parse_started 
+ */
+void metrics_request_begin(uint64_t parse_started);
+
+/**
+ * @brief Charge time to a phase of the request the calling thread is running
+ * 
+ * @param phase METRICS_LOCK or METRICS_NETWORK
+ * @param ns 
+ */
+void metrics_phase_add(MetricsPhase phase, uint64_t ns);
+
+/**
+ * @brief Record the phases of the request the calling thread has finished
+ * 
+ * @param opcode 
+ */
+void metrics_request_end(uint8_t opcode);
+
+/**
+ * @brief Count bytes read from or written to a device
+ * 
+ * @param device 
+ * @param write 1 for a write, 0 for a read
+ * @param bytes 
+ */
+void metrics_device_io(int device, int write, uint64_t bytes);
+
+/**
+ * @brief Count a client connection opening or closing
+ * 
+ * @param delta 1 on accept, -1 on close
+ */
+void metrics_connection(int delta);
+
+/**
+ * @brief Requests finished so far and how many took longer than a threshold, both cumulative
+ * 
+ * @param threshold_ns 
+ * @param total receives the number of requests
+ * @return uint64_t 
+ */
+uint64_t metrics_requests_over(uint64_t threshold_ns, uint64_t *total);
+
+/**
+ * @brief Render every metric in the Prometheus text format
+ * 
+ * @param length receives the text length
+ * @return char* the text, for the caller to free, or NULL if it could not be built
+ */
+char *metrics_format(size_t *length);
+
+/**
+ * @brief Open /proc/self/mountinfo and load the current block device mounts
+ * 
+ * @return int the descriptor to poll for POLLPRI, -1 on failure
+ */
+int mount_watch_open(void);
+
+/**
+ * @brief Reload the mount table after poll reported a change
+ * 
+ * @param fd from mount_watch_open
+ * @param on_mount called for every block device mount that was not there before, may be NULL
+ * @param on_unmount called for every block device mount that is gone, may be NULL
+ * @return int number of mounts added or removed, -1 on failure
+ */
+int mount_watch_refresh(int fd, void (*on_mount)(const char *device, const char *mount_point),
+                        void (*on_unmount)(const char *device, const char *mount_point));
+
+/**
+ * @brief Whether a block device is mounted on a mount point, from the mount table
+ * 
+ * @param mount_point 
+ * @return int 1 if it is mounted
+ */
+int mount_watch_is_mounted(const char *mount_point);
+
+/**
+ * @brief Whether a device may be read and written: mounted, or not removable
+ * 
+ * @param usb_device 
  * @return int 
  */
-int copy_directory(const char *src, const char *dst);
+int device_mounted(const USBDevice *usb_device);
+
+struct io_uring_cqe;
+
+/**
+ * @brief Check that io_uring rings can be created
+ * 
+ * @return int 0 if they can, -1 otherwise
+ */
+int uring_start(void);
+
+/**
+ * @brief The calling thread's ring, created on first use
+ * 
+ * @return Uring* NULL when io_backend is not uring or no ring could be made
+ */
+Uring *uring_thread(void);
+
+/**
+ * @brief The ring's registered buffer region, buffer index 0 for fixed I/O
+ * 
+ * @param ring 
+ * @param size receives its length
+ * @return char* 
+ */
+char *uring_buffers(Uring *ring, size_t *size);
+
+/**
+ * @brief Point registered file slots at descriptors, -1 empties a slot
+ * 
+ * @param ring 
+ * @param first 
+ * @param fds 
+ * @param count 
+ * @return int 0 on success, -1 on failure
+ */
+int uring_set_files(Uring *ring, int first, const int *fds, int count);
+
+/**
+ * @brief Queue a fixed-buffer read or write on a registered file slot
+ * 
+ * @param ring 
+ * @param write 
+ * @param slot 
+ * @param data inside the ring's buffer region
+ * @param len 
+ * @param offset 
+ * @param user_data 
+ * @param link start the next queued operation only if this one succeeds in full
+ */
+void uring_queue_fixed(Uring *ring, int write, int slot, void *data, unsigned len, uint64_t offset, uint64_t user_data, int link);
+
+/**
+ * @brief Submit what is queued and wait for completions in one system call
+ * 
+ * @param ring 
+ * @param wait_for 
+ * @return int 0 on success, -1 on failure
+ */
+int uring_submit(Uring *ring, unsigned wait_for);
+
+/**
+ * @brief Take the next completion
+ * 
+ * @param ring 
+ * @param wait 
+ * @param cqe 
+ * @return int 1 if one was taken, 0 if none was ready, -1 on failure
+ */
+int uring_complete(Uring *ring, int wait, struct io_uring_cqe *cqe);
+
+/**
+ * @brief Copy a file through the ring with linked read and write pairs
+ * 
+ * @param ring 
+ * @param src_fd 
+ * @param dst_fd 
+ * @param size 
+ * @param throttle may be NULL
+ * @return int 0 on success, -1 on failure
+ */
+int uring_copy_fd(Uring *ring, int src_fd, int dst_fd, uint64_t size, Throttle *throttle);
+
+/**
+ * @brief Reserve the buffer arena
+ *
+ * @return int 0 on success, -1 if every buffer will be mapped on its own
+ */
+int buffer_pool_start(void);
+
+/**
+ * @brief Take a page aligned I/O buffer of at least size bytes
+ *
+ * @param size
+ * @return void* NULL on failure
+ */
+void *buffer_acquire(size_t size);
+
+/**
+ * @brief Give back a buffer from buffer_acquire
+ *
+ * @param block may be NULL
+ * @param size as passed to buffer_acquire
+ */
+void buffer_release(void *block, size_t size);
+
+/**
+ * @brief Allocate the blocks of a large upload's file up front under the "direct" policy
+ *
+ * @param device
+ * @param fd
+ * @param size bytes the upload will write from offset 0
+ */
+void write_policy_preallocate(const USBDevice *device, int fd, uint64_t size);
+
+/**
+ * @brief Switch a device file to O_DIRECT for a large upload under the "direct" policy
+ *
+ * @param device
+ * @param fd
+ * @param size of the whole upload
+ */
+void write_policy_open(const USBDevice *device, int fd, uint64_t size);
+
+/**
+ * @brief Push a buffered upload out to the device as it goes and drop what has been written from the page cache
+ *
+ * @param device
+ * @param fd
+ * @param state where this file's write-behind is at
+ * @param end file offset the upload has been written up to
+ */
+void write_behind(const USBDevice *device, int fd, WriteBehind *state, uint64_t end);
+
+/**
+ * @brief Start writeback of the rest of an upload and drop whatever of it is already on the device
+ *
+ * @param device
+ * @param fd
+ * @param state where this file's write-behind is at
+ * @param end file offset the upload was written up to
+ */
+void write_behind_finish(const USBDevice *device, int fd, WriteBehind *state, uint64_t end);
+
+/**
+ * @brief Look up the digest stored for a device file
+ *
+ * @param device
+ * @param file_path below the storage folder
+ * @param fd the file on that device
+ * @param crc receives the CRC32C of the whole file
+ * @return int 0 if a digest matching the file is stored, -1 otherwise
+ */
+int checksum_load(const USBDevice *device, const char *file_path, int fd, uint32_t *crc);
+
+/**
+ * @brief Store the digest of a device file, so GETs send it without reading the file twice
+ *
+ * @param device
+ * @param file_path below the storage folder, where the file is now
+ * @param fd the file on that device, fully written
+ * @param crc the CRC32C of the whole file
+ */
+void checksum_store(const USBDevice *device, const char *file_path, int fd, uint32_t crc);
+
+/**
+ * @brief Drop the sidecars of a removed file or directory
+ *
+ * @param device
+ * @param file_path below the storage folder
+ */
+void checksum_remove(const USBDevice *device, const char *file_path);
+
+/**
+ * @brief Move the sidecars of a renamed file or directory along with it
+ *
+ * @param device
+ * @param from below the storage folder
+ * @param to
+ */
+void checksum_rename(const USBDevice *device, const char *from, const char *to);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,26 @@
+#include "server.h"
+
+/**
+ * @brief Handle a STATS command from the client
+ * 
+ * The reply is the same text the metrics port serves to Prometheus.
+ * 
+ * @param conn 
+ * @param path ignored
+ * @param usb_devices 
+ * @param num_usb_devices 
+ */
+void handle_stats_command(Connection *conn, const char *path, USBDevice* usb_devices, const int num_usb_devices) {
+    (void)path;
+    (void)usb_devices;
+    (void)num_usb_devices;
+
+    size_t length;
+    char *text = metrics_format(&length);
+    if (text == NULL) {
+        connection_send_error(conn, "Error: Out of memory");
+        return;
+    }
+    connection_send_reply(conn, OP_OK, text, length);
+    free(text);
+}
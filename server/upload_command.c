@@ -0,0 +1,628 @@
+#include <dirent.h>
+#include <inttypes.h>
+#include <time.h>
+#include "server.h"
+
+#define UPLOAD_META_HEADER 4096   // text header, the chunk map follows at this offset
+#define CHUNK_HASHED 2            // chunk map value once the chunk's CRC32C is in the table after the map
+
+/**
+ * @brief A multipart upload staged on every device until it is committed
+ *
+ * Each device holds <mount_point>/.fs_uploads/<id>.part, preallocated to the
+ * final size, and <id>.meta with the target path, one byte per chunk that
+ * is set once the chunk is on that device and a u32 CRC32C per chunk.
+ */
+typedef struct Upload {
+    uint64_t id;
+    char path[FRAME_MAX_PATH + 1];
+    uint64_t size;
+    uint32_t chunk_size;
+    uint32_t num_chunks;
+    uint8_t *chunks;        // 1 once the chunk is on every device that stages the upload, CHUNK_HASHED with its CRC32C known
+    uint32_t *crcs;
+    int refs;               // requests using the upload
+    time_t last_used;       // when a request last used it, for expiry
+    int committing;         // no new requests may use it
+    struct Upload *next;
+} Upload;
+
+static Upload *uploads = NULL;
+static pthread_mutex_t uploads_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t uploads_idle = PTHREAD_COND_INITIALIZER;
+
+/**
+ * @brief Build the path of an upload's staging or meta file on one device.
+ *
+ * @param device
+ * @param id
+ * @param suffix ".part" or ".meta"
+ * @param out
+ * @param size
+ */
+static void staging_path(const USBDevice *device, uint64_t id, const char *suffix, char *out, size_t size) {
+    snprintf(out, size, "%s/%s/%016" PRIx64 "%s", device->mount_point, UPLOAD_DIR, id, suffix);
+}
+
+static uint32_t chunk_count(uint64_t size, uint32_t chunk_size) {
+    return size == 0 ? 1 : (uint32_t)((size + chunk_size - 1) / chunk_size);
+}
+
+/**
+ * @brief Read an upload back from the first device that has its meta file.
+ *
+ * @param id
+ * @param usb_devices
+ * @param num_usb_devices
+ * @return Upload* or NULL
+ */
+static Upload *load_upload(uint64_t id, USBDevice *usb_devices, int num_usb_devices) {
+    for (int i = 0; i < num_usb_devices; i++) {
+        char meta_path[4096];
+        staging_path(&usb_devices[i], id, ".meta", meta_path, sizeof(meta_path));
+        int fd = open(meta_path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+
+        char header[UPLOAD_META_HEADER + 1];
+        ssize_t n = pread(fd, header, UPLOAD_META_HEADER, 0);
+        Upload *upload = calloc(1, sizeof(Upload));
+        int path_offset = 0;
+        if (n <= 0 || upload == NULL) {
+            free(upload);
+            close(fd);
+            continue;
+        }
+        header[n] = '\0';
+        if (sscanf(header, "FSUPLOAD 1\n%" SCNu64 " %" SCNu32 "\n%n", &upload->size, &upload->chunk_size, &path_offset) != 2 ||
+            path_offset == 0 || upload->chunk_size < UPLOAD_MIN_CHUNK_SIZE || upload->chunk_size > UPLOAD_MAX_CHUNK_SIZE) {
+            free(upload);
+            close(fd);
+            continue;
+        }
+        snprintf(upload->path, sizeof(upload->path), "%.*s", (int)strcspn(header + path_offset, "\n"), header + path_offset);
+        upload->id = id;
+        upload->num_chunks = chunk_count(upload->size, upload->chunk_size);
+        upload->chunks = calloc(upload->num_chunks, 1);
+        upload->crcs = calloc(upload->num_chunks, sizeof(uint32_t));
+        if (upload->chunks == NULL || upload->crcs == NULL ||
+            pread(fd, upload->chunks, upload->num_chunks, UPLOAD_META_HEADER) != (ssize_t)upload->num_chunks) {
+            free(upload->chunks);
+            free(upload->crcs);
+            free(upload);
+            close(fd);
+            continue;
+        }
+        // Uploads staged before chunks were hashed have no table
+        size_t table_size = (size_t)upload->num_chunks * sizeof(uint32_t);
+        uint8_t *table = malloc(table_size);
+        int hashed = table != NULL && pread(fd, table, table_size, UPLOAD_META_HEADER + upload->num_chunks) == (ssize_t)table_size;
+        for (uint32_t i = 0; i < upload->num_chunks; i++) {
+            if (hashed) {
+                upload->crcs[i] = frame_get_u32(table + (size_t)i * sizeof(uint32_t));
+            } else if (upload->chunks[i] == CHUNK_HASHED) {
+                upload->chunks[i] = 1;
+            }
+        }
+        free(table);
+        close(fd);
+        return upload;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Find an upload and take a reference to it.
+ *
+ * Uploads begun before a restart are read back from the devices.
+ *
+ * @param id
+ * @param path must match the path the upload was begun with
+ * @param usb_devices
+ * @param num_usb_devices
+ * @return Upload* or NULL if there is no such upload or it is being committed
+ */
+static Upload *upload_get(uint64_t id, const char *path, USBDevice *usb_devices, int num_usb_devices) {
+    pthread_mutex_lock(&uploads_mutex);
+    Upload *upload = uploads;
+    while (upload != NULL && upload->id != id) {
+        upload = upload->next;
+    }
+    if (upload == NULL) {
+        upload = load_upload(id, usb_devices, num_usb_devices);
+        if (upload != NULL) {
+            upload->next = uploads;
+            uploads = upload;
+        }
+    }
+    if (upload != NULL && (upload->committing || strcmp(upload->path, path) != 0)) {
+        upload = NULL;
+    }
+    if (upload != NULL) {
+        upload->refs++;
+        upload->last_used = time(NULL);
+    }
+    pthread_mutex_unlock(&uploads_mutex);
+    return upload;
+}
+
+static void upload_put(Upload *upload) {
+    pthread_mutex_lock(&uploads_mutex);
+    if (--upload->refs == 0) {
+        pthread_cond_broadcast(&uploads_idle);
+    }
+    pthread_mutex_unlock(&uploads_mutex);
+}
+
+/**
+ * @brief Handle an UPLOAD_BEGIN command, staging an empty file on every device
+ *
+ * @param conn
+ * @param file_path
+ * @param usb_devices
+ * @param num_usb_devices
+ */
+void handle_upload_begin_command(Connection *conn, const char *file_path, USBDevice *usb_devices, int num_usb_devices) {
+    if (conn->args_len != UPLOAD_BEGIN_ARGS_SIZE) {
+        connection_send_error(conn, "Error: Malformed upload");
+        return;
+    }
+    uint64_t size = frame_get_u64(conn->args);
+    uint32_t chunk_size = frame_get_u32(conn->args + 8);
+    if (chunk_size < UPLOAD_MIN_CHUNK_SIZE || chunk_size > UPLOAD_MAX_CHUNK_SIZE ||
+        size / chunk_size >= UPLOAD_MAX_CHUNKS) {
+        connection_send_error(conn, "Error: Unsupported chunk size");
+        return;
+    }
+
+    Upload *upload = calloc(1, sizeof(Upload));
+    if (upload == NULL) {
+        connection_send_error(conn, strerror(errno));
+        return;
+    }
+    // Random ids cannot be guessed by other clients and survive restarts
+    upload->id = random_id();
+    snprintf(upload->path, sizeof(upload->path), "%s", file_path);
+    upload->size = size;
+    upload->chunk_size = chunk_size;
+    upload->num_chunks = chunk_count(size, chunk_size);
+    upload->chunks = calloc(upload->num_chunks, 1);
+    upload->crcs = calloc(upload->num_chunks, sizeof(uint32_t));
+    if (upload->chunks == NULL || upload->crcs == NULL) {
+        connection_send_error(conn, strerror(errno));
+        free(upload->chunks);
+        free(upload->crcs);
+        free(upload);
+        return;
+    }
+
+    char header[UPLOAD_META_HEADER];
+    int header_len = snprintf(header, sizeof(header), "FSUPLOAD 1\n%" PRIu64 " %" PRIu32 "\n%s\n", size, chunk_size, file_path);
+    int staged = 0, error = 0;
+    for (int i = 0; i < num_usb_devices; i++) {
+        if (!device_mounted(&usb_devices[i])) {
+            continue;
+        }
+        char dir[4096], part_path[4096], meta_path[4096];
+        snprintf(dir, sizeof(dir), "%s/%s", usb_devices[i].mount_point, UPLOAD_DIR);
+        mkdir(dir, 0755);
+        staging_path(&usb_devices[i], upload->id, ".part", part_path, sizeof(part_path));
+        staging_path(&usb_devices[i], upload->id, ".meta", meta_path, sizeof(meta_path));
+
+        int part_fd = open(part_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        int meta_fd = open(meta_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        // The chunk map and CRC table start out as zeros past the header
+        if (part_fd < 0 || meta_fd < 0 || ftruncate(part_fd, size) < 0 ||
+            pwrite(meta_fd, header, header_len, 0) != header_len ||
+            ftruncate(meta_fd, UPLOAD_META_HEADER + (off_t)upload->num_chunks * (1 + sizeof(uint32_t))) < 0) {
+            error = errno;
+            perror("upload staging");
+            unlink(part_path);
+            unlink(meta_path);
+        } else {
+            write_policy_preallocate(&usb_devices[i], part_fd, size);
+            staged++;
+        }
+        if (part_fd >= 0) {
+            close(part_fd);
+        }
+        if (meta_fd >= 0) {
+            close(meta_fd);
+        }
+    }
+    if (staged == 0) {
+        connection_send_error(conn, strerror(error ? error : ENODEV));
+        free(upload->chunks);
+        free(upload->crcs);
+        free(upload);
+        return;
+    }
+
+    upload->last_used = time(NULL);
+    pthread_mutex_lock(&uploads_mutex);
+    upload->next = uploads;
+    uploads = upload;
+    pthread_mutex_unlock(&uploads_mutex);
+
+    uint8_t reply[8];
+    frame_put_u64(reply, upload->id);
+    connection_send_reply(conn, OP_OK, reply, sizeof(reply));
+}
+
+/**
+ * @brief Handle an UPLOAD_CHUNK command, writing one chunk into place on every device
+ *
+ * Chunks may arrive in any order and over several connections at once.
+ *
+ * @param conn
+ * @param file_path
+ * @param usb_devices
+ * @param num_usb_devices
+ */
+void handle_upload_chunk_command(Connection *conn, const char *file_path, USBDevice *usb_devices, int num_usb_devices) {
+    uint64_t id = frame_get_u64(conn->args);
+    uint32_t index = frame_get_u32(conn->args + 8);
+
+    Upload *upload = upload_get(id, file_path, usb_devices, num_usb_devices);
+    uint64_t offset = upload != NULL ? (uint64_t)index * upload->chunk_size : 0;
+    uint64_t length = conn->body_remaining - (conn->checksum ? CHECKSUM_TRAILER_SIZE : 0);
+    const char *error = NULL;
+    if (upload == NULL) {
+        error = "Error: No such upload";
+    } else if (index >= upload->num_chunks || (conn->checksum && conn->body_remaining < CHECKSUM_TRAILER_SIZE) ||
+               length != (upload->size - offset < upload->chunk_size ? upload->size - offset : upload->chunk_size)) {
+        error = "Error: Bad chunk";
+    }
+    if (error != NULL) {
+        if (upload != NULL) {
+            upload_put(upload);
+        }
+        if (connection_discard_body(conn) == 0) {
+            connection_send_error(conn, error);
+        }
+        return;
+    }
+
+    int fds[num_usb_devices];
+    for (int i = 0; i < num_usb_devices; i++) {
+        char part_path[4096];
+        staging_path(&usb_devices[i], id, ".part", part_path, sizeof(part_path));
+        fds[i] = open(part_path, O_WRONLY | O_CLOEXEC);
+        if (fds[i] != -1 && lseek(fds[i], offset, SEEK_SET) < 0) {
+            close(fds[i]);
+            fds[i] = -1;
+        }
+        if (fds[i] != -1) {
+            write_policy_open(&usb_devices[i], fds[i], upload->size);
+        }
+    }
+
+    uint32_t crc = 0;
+    int result = put_stream_receive(conn, fds, num_usb_devices, length, &crc);
+    const char *failure = NULL;
+    if (result < 0) {
+        failure = "Error: Upload incomplete";
+        if (conn->checksum && !conn->broken) {
+            connection_discard_body(conn);
+        }
+    } else if (conn->checksum && connection_check_trailer(conn, crc) < 0) {
+        // The chunk stays missing and is sent again
+        failure = "Error: Checksum mismatch";
+    }
+
+    // The CRC goes in before the chunk is marked, so a marked chunk never has a stale one
+    uint8_t state = result == 0 ? CHUNK_HASHED : 1;
+    uint8_t crc_bytes[sizeof(uint32_t)];
+    frame_put_u32(crc_bytes, crc);
+    for (int i = 0; i < num_usb_devices; i++) {
+        if (fds[i] == -1) {
+            continue;
+        }
+        close(fds[i]);
+        if (failure == NULL) {
+            // Record the chunk on every device so any of them can resume the upload
+            char meta_path[4096];
+            staging_path(&usb_devices[i], id, ".meta", meta_path, sizeof(meta_path));
+            int meta_fd = open(meta_path, O_WRONLY | O_CLOEXEC);
+            off_t crc_offset = UPLOAD_META_HEADER + upload->num_chunks + (off_t)index * sizeof(uint32_t);
+            if (meta_fd < 0 || (state == CHUNK_HASHED && pwrite(meta_fd, crc_bytes, sizeof(crc_bytes), crc_offset) != sizeof(crc_bytes)) ||
+                pwrite(meta_fd, &state, 1, UPLOAD_META_HEADER + index) != 1) {
+                perror("upload meta");
+            }
+            if (meta_fd >= 0) {
+                close(meta_fd);
+            }
+        }
+    }
+    if (failure == NULL) {
+        pthread_mutex_lock(&uploads_mutex);
+        upload->chunks[index] = state;
+        upload->crcs[index] = crc;
+        pthread_mutex_unlock(&uploads_mutex);
+    }
+    upload_put(upload);
+
+    // A client that hung up mid-chunk gets no reply
+    if (conn->broken) {
+        return;
+    }
+    if (failure == NULL) {
+        connection_send_reply(conn, OP_OK, NULL, 0);
+    } else {
+        connection_send_error(conn, failure);
+    }
+}
+
+/**
+ * @brief Handle an UPLOAD_STATUS command, reporting which chunks have arrived
+ *
+ * @param conn
+ * @param file_path
+ * @param usb_devices
+ * @param num_usb_devices
+ */
+void handle_upload_status_command(Connection *conn, const char *file_path, USBDevice *usb_devices, int num_usb_devices) {
+    if (conn->args_len != UPLOAD_ID_ARGS_SIZE) {
+        connection_send_error(conn, "Error: Malformed upload");
+        return;
+    }
+    Upload *upload = upload_get(frame_get_u64(conn->args), file_path, usb_devices, num_usb_devices);
+    if (upload == NULL) {
+        connection_send_error(conn, "Error: No such upload");
+        return;
+    }
+
+    size_t reply_len = 12 + upload->num_chunks;
+    uint8_t *reply = malloc(reply_len);
+    if (reply == NULL) {
+        connection_send_error(conn, strerror(errno));
+        upload_put(upload);
+        return;
+    }
+    frame_put_u64(reply, upload->size);
+    frame_put_u32(reply + 8, upload->chunk_size);
+    pthread_mutex_lock(&uploads_mutex);
+    memcpy(reply + 12, upload->chunks, upload->num_chunks);
+    pthread_mutex_unlock(&uploads_mutex);
+    upload_put(upload);
+
+    connection_send_reply(conn, OP_OK, reply, reply_len);
+    free(reply);
+}
+
+/**
+ * @brief Handle an UPLOAD_COMMIT command, renaming the assembled file into place on every device
+ *
+ * @param conn
+ * @param file_path
+ * @param usb_devices
+ * @param num_usb_devices
+ */
+void handle_upload_commit_command(Connection *conn, const char *file_path, USBDevice *usb_devices, int num_usb_devices) {
+    if (conn->args_len != UPLOAD_ID_ARGS_SIZE) {
+        connection_send_error(conn, "Error: Malformed upload");
+        return;
+    }
+    uint64_t id = frame_get_u64(conn->args);
+    Upload *upload = upload_get(id, file_path, usb_devices, num_usb_devices);
+    if (upload == NULL) {
+        connection_send_error(conn, "Error: No such upload");
+        return;
+    }
+
+    // Stop new chunks and wait for the ones in flight
+    pthread_mutex_lock(&uploads_mutex);
+    int complete = !upload->committing;
+    for (uint32_t i = 0; complete && i < upload->num_chunks; i++) {
+        complete = upload->chunks[i];
+    }
+    if (complete) {
+        upload->committing = 1;
+        while (upload->refs > 1) {
+            pthread_cond_wait(&uploads_idle, &uploads_mutex);
+        }
+    }
+    pthread_mutex_unlock(&uploads_mutex);
+    if (!complete) {
+        upload_put(upload);
+        connection_send_error(conn, "Error: Upload incomplete");
+        return;
+    }
+
+    // The assembled file has to be durable before it replaces the old one
+    int fds[num_usb_devices];
+    for (int i = 0; i < num_usb_devices; i++) {
+        char part_path[4096];
+        staging_path(&usb_devices[i], id, ".part", part_path, sizeof(part_path));
+        fds[i] = open(part_path, O_RDONLY | O_CLOEXEC);
+    }
+    int flushed = durability_sync(fds, num_usb_devices);
+
+    // The digest of the whole file follows from those of its chunks
+    int hashed = 1;
+    uint32_t crc = 0;
+    for (uint32_t i = 0; hashed && i < upload->num_chunks; i++) {
+        uint64_t offset = (uint64_t)i * upload->chunk_size;
+        uint64_t length = upload->size - offset < upload->chunk_size ? upload->size - offset : upload->chunk_size;
+        hashed = upload->chunks[i] == CHUNK_HASHED;
+        crc = i == 0 ? upload->crcs[i] : crc32c_combine(crc, upload->crcs[i], length);
+    }
+
+    const char *failure = flushed < 0 ? "Error: Failed to flush upload" : NULL;
+    PathLock *path_lock = NULL;
+    if (failure == NULL && (path_lock = path_lock_acquire(file_path, PATH_LOCK_WRITE, server_config.lock_timeout_ms)) == NULL) {
+        failure = "Error: File is busy";
+    }
+    if (failure != NULL) {
+        for (int i = 0; i < num_usb_devices; i++) {
+            if (fds[i] != -1) {
+                close(fds[i]);
+            }
+        }
+        // The upload stays staged, the client may commit again
+        pthread_mutex_lock(&uploads_mutex);
+        upload->committing = 0;
+        pthread_mutex_unlock(&uploads_mutex);
+        upload_put(upload);
+        connection_send_error(conn, failure);
+        return;
+    }
+
+    int renamed = 0, error = 0;
+    char placed[num_usb_devices][4096];
+    for (int i = 0; i < num_usb_devices; i++) {
+        char part_path[4096], meta_path[4096];
+        char *full_path = placed[i];
+        staging_path(&usb_devices[i], id, ".part", part_path, sizeof(part_path));
+        staging_path(&usb_devices[i], id, ".meta", meta_path, sizeof(meta_path));
+        snprintf(full_path, sizeof(placed[i]), "%s%s%s", usb_devices[i].mount_point, usb_devices[i].storage_folder, file_path);
+
+        // A device that never staged the upload has nothing to rename, and one
+        // missing the directory is skipped, as a PUT skips it
+        if (rename(part_path, full_path) == 0) {
+            renamed++;
+            if (hashed && fds[i] != -1) {
+                checksum_store(&usb_devices[i], file_path, fds[i], crc);
+            }
+        } else {
+            if (errno != ENOENT) {
+                error = errno;
+                perror("upload rename");
+            }
+            unlink(part_path);
+            full_path[0] = '\0';
+        }
+        unlink(meta_path);
+        if (fds[i] != -1) {
+            close(fds[i]);
+        }
+    }
+    if (renamed > 0) {
+        cache_invalidate(file_path, 0);
+        if (durability_sync_parents(placed, num_usb_devices) < 0 && error == 0) {
+            error = EIO;
+        }
+    }
+    path_lock_release(path_lock, PATH_LOCK_WRITE);
+
+    pthread_mutex_lock(&uploads_mutex);
+    Upload **link = &uploads;
+    while (*link != upload) {
+        link = &(*link)->next;
+    }
+    *link = upload->next;
+    pthread_mutex_unlock(&uploads_mutex);
+    free(upload->chunks);
+    free(upload->crcs);
+    free(upload);
+
+    if (renamed > 0 && error == 0) {
+        connection_send_reply(conn, OP_OK, NULL, 0);
+    } else {
+        connection_send_error(conn, strerror(error ? error : ENOENT));
+    }
+}
+
+/**
+ * @brief Remove an upload's staging and meta files from every device
+ *
+ * @param id
+ * @param usb_devices
+ * @param num_usb_devices
+ */
+static void remove_staged(uint64_t id, USBDevice *usb_devices, int num_usb_devices) {
+    for (int i = 0; i < num_usb_devices; i++) {
+        char part_path[4096], meta_path[4096];
+        staging_path(&usb_devices[i], id, ".part", part_path, sizeof(part_path));
+        staging_path(&usb_devices[i], id, ".meta", meta_path, sizeof(meta_path));
+        unlink(part_path);
+        unlink(meta_path);
+    }
+}
+
+/**
+ * @brief Remove multipart uploads that have been idle for upload_expiry_hours
+ *
+ * Uploads in memory expire by their last request, those only on the devices,
+ * begun before a restart, by when their meta file last changed. Each of them
+ * holds a file preallocated to the full upload size on every device, so a
+ * client that gives up would otherwise fill the devices for good. The sweep
+ * holds the upload list throughout, so an upload cannot be read back from a
+ * device while its files are being removed.
+ *
+ * @param usb_devices
+ * @param num_usb_devices
+ * @param startup also remove whatever PUT, COPY and resync left staged when the server last stopped
+ */
+void upload_sweep(USBDevice *usb_devices, int num_usb_devices, int startup) {
+    time_t now = time(NULL);
+    time_t expiry = (time_t)server_config.upload_expiry_hours * 3600;
+    pthread_mutex_lock(&uploads_mutex);
+
+    for (Upload **link = &uploads; expiry > 0 && *link != NULL; ) {
+        Upload *upload = *link;
+        if (upload->refs > 0 || upload->committing || now - upload->last_used < expiry) {
+            link = &upload->next;
+            continue;
+        }
+        printf("Multipart upload %016" PRIx64 " of %s expired\n", upload->id, upload->path);
+        *link = upload->next;
+        remove_staged(upload->id, usb_devices, num_usb_devices);
+        free(upload->chunks);
+        free(upload->crcs);
+        free(upload);
+    }
+
+    for (int i = 0; i < num_usb_devices; i++) {
+        char dir_path[3072];
+        snprintf(dir_path, sizeof(dir_path), "%s/%s", usb_devices[i].mount_point, UPLOAD_DIR);
+        DIR *dir = device_mounted(&usb_devices[i]) ? opendir(dir_path) : NULL;
+        if (dir == NULL) {
+            continue;
+        }
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            char path[4096];
+            snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+            // Only this process stages anything there, and it has just started
+            struct stat st;
+            if (startup && (strncmp(entry->d_name, "put-", 4) == 0 || strncmp(entry->d_name, "copy-", 5) == 0 ||
+                            strncmp(entry->d_name, "resync-", 7) == 0)) {
+                if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+                    delete_directory(path);
+                } else {
+                    unlink(path);
+                }
+                continue;
+            }
+
+            uint64_t id;
+            int end = 0;
+            if (startup && sscanf(entry->d_name, "%16" SCNx64 ".part%n", &id, &end) == 1 && end == 21 && entry->d_name[end] == '\0') {
+                // A staging file whose meta file is gone belongs to no upload
+                char meta_path[4096];
+                staging_path(&usb_devices[i], id, ".meta", meta_path, sizeof(meta_path));
+                if (access(meta_path, F_OK) < 0 && errno == ENOENT) {
+                    unlink(path);
+                }
+                continue;
+            }
+            if (expiry == 0 || sscanf(entry->d_name, "%16" SCNx64 ".meta%n", &id, &end) != 1 ||
+                end != 21 || entry->d_name[end] != '\0' || lstat(path, &st) < 0 || now - st.st_mtime < expiry) {
+                continue;
+            }
+            Upload *upload = uploads;
+            while (upload != NULL && upload->id != id) {
+                upload = upload->next;
+            }
+            if (upload == NULL) {
+                printf("Multipart upload %016" PRIx64 " on %s expired\n", id, usb_devices[i].mount_point);
+                remove_staged(id, &usb_devices[i], 1);
+            }
+        }
+        closedir(dir);
+    }
+
+    pthread_mutex_unlock(&uploads_mutex);
+}
@@ -0,0 +1,430 @@
+#define _GNU_SOURCE
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include "server.h"
+
+#define URING_ENTRIES 256
+#define URING_FILE_SLOTS (MAX_USB_DEVICES + 2)
+#define URING_COPY_SLOTS 8          // read/write pairs in flight per copy
+
+/**
+ * @brief An io_uring instance owned by one thread, driven with the raw system calls
+ *
+ * Every ring has one registered buffer region, so fixed reads and writes skip
+ * pinning pages per request, and a table of registered file slots that
+ * callers fill for the files they are working on.
+ */
+struct Uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned sq_tail;               // local tail, published on submit
+    unsigned to_submit;
+    _Atomic unsigned *sq_head;
+    _Atomic unsigned *sq_ktail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    _Atomic unsigned *cq_head;
+    _Atomic unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    char *buffers;                  // registered as buffer index 0
+    size_t buffers_size;
+};
+
+static pthread_key_t uring_key;
+static pthread_once_t uring_key_once = PTHREAD_ONCE_INIT;
+static __thread Uring *thread_ring = NULL;
+static __thread int thread_ring_failed = 0;
+
+static int uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * @brief Unmap and close a ring.
+ *
+ * @param arg the ring
+ */
+static void uring_free(void *arg) {
+    Uring *ring = arg;
+    if (ring == NULL) {
+        return;
+    }
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    buffer_release(ring->buffers, ring->buffers_size);
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    free(ring);
+}
+
+static void make_uring_key(void) {
+    pthread_key_create(&uring_key, uring_free);
+}
+
+/**
+ * @brief Create a ring with its registered buffer region and empty file slots.
+ *
+ * @param buffers_size
+ * @return Uring* NULL with errno set on failure
+ */
+static Uring *uring_create(size_t buffers_size) {
+    Uring *ring = calloc(1, sizeof(Uring));
+    if (ring == NULL) {
+        return NULL;
+    }
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    ring->fd = uring_setup(URING_ENTRIES, &params);
+    if (ring->fd < 0 && errno == EINVAL) {
+        // Kernels before 6.0 know neither flag
+        memset(&params, 0, sizeof(params));
+        ring->fd = uring_setup(URING_ENTRIES, &params);
+    }
+    if (ring->fd < 0) {
+        free(ring);
+        return NULL;
+    }
+
+    ring->sq_entries = params.sq_entries;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        uring_free(ring);
+        return NULL;
+    }
+    ring->cq_ring = ring->sq_ring;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            uring_free(ring);
+            return NULL;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        uring_free(ring);
+        return NULL;
+    }
+
+    char *sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_head = (_Atomic unsigned *)(sq + params.sq_off.head);
+    ring->sq_ktail = (_Atomic unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (_Atomic unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (_Atomic unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->sq_tail = atomic_load_explicit(ring->sq_ktail, memory_order_relaxed);
+
+    // One region registered up front, so fixed I/O never pins pages per request
+    ring->buffers_size = buffers_size;
+    ring->buffers = buffer_acquire(buffers_size);
+    if (ring->buffers == NULL) {
+        uring_free(ring);
+        return NULL;
+    }
+    struct iovec region = { .iov_base = ring->buffers, .iov_len = buffers_size };
+    int empty[URING_FILE_SLOTS];
+    for (int i = 0; i < URING_FILE_SLOTS; i++) {
+        empty[i] = -1;
+    }
+    if (uring_register(ring->fd, IORING_REGISTER_BUFFERS, &region, 1) < 0 ||
+        uring_register(ring->fd, IORING_REGISTER_FILES, empty, URING_FILE_SLOTS) < 0) {
+        int saved_errno = errno;
+        uring_free(ring);
+        errno = saved_errno;
+        return NULL;
+    }
+    return ring;
+}
+
+/**
+ * @brief Check at startup that io_uring can be used, so a bad kernel or seccomp policy is reported once
+ *
+ * @return int 0 if rings can be created, -1 otherwise
+ */
+int uring_start(void) {
+    Uring *ring = uring_create(BUFFER_BLOCK_MIN);
+    if (ring == NULL) {
+        perror("io_uring");
+        return -1;
+    }
+    uring_free(ring);
+    return 0;
+}
+
+/**
+ * @brief The calling thread's ring, created on first use
+ *
+ * Its buffer region holds one upload window of put_chunk_kb chunks.
+ *
+ * @return Uring* NULL when the backend is off or the ring could not be made
+ */
+Uring *uring_thread(void) {
+    if (!server_config.io_uring || thread_ring_failed) {
+        return NULL;
+    }
+    if (thread_ring != NULL) {
+        return thread_ring;
+    }
+    pthread_once(&uring_key_once, make_uring_key);
+    thread_ring = uring_create((size_t)server_config.put_window * server_config.put_chunk_size);
+    if (thread_ring == NULL) {
+        perror("io_uring");
+        thread_ring_failed = 1;
+        return NULL;
+    }
+    pthread_setspecific(uring_key, thread_ring);
+    return thread_ring;
+}
+
+/**
+ * @brief The ring's registered buffer region
+ *
+ * @param ring
+ * @param size receives its length
+ * @return char* buffer index 0 for fixed reads and writes
+ */
+char *uring_buffers(Uring *ring, size_t *size) {
+    *size = ring->buffers_size;
+    return ring->buffers;
+}
+
+/**
+ * @brief Point registered file slots at descriptors, -1 empties a slot
+ *
+ * A slot holds its own reference to the file, so slots must be emptied
+ * before the caller's descriptors are closed for the file to be released.
+ *
+ * @param ring
+ * @param first
+ * @param fds
+ * @param count
+ * @return int 0 on success, -1 on failure
+ */
+int uring_set_files(Uring *ring, int first, const int *fds, int count) {
+    struct io_uring_files_update update = { .offset = (unsigned)first, .fds = (uint64_t)(uintptr_t)fds };
+    return uring_register(ring->fd, IORING_REGISTER_FILES_UPDATE, &update, count) < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Take a free submission entry, submitting what is queued when the ring is full
+ *
+ * @param ring
+ * @return struct io_uring_sqe* zeroed, never NULL
+ */
+static struct io_uring_sqe *get_sqe(Uring *ring) {
+    while (ring->sq_tail - atomic_load_explicit(ring->sq_head, memory_order_acquire) >= ring->sq_entries) {
+        uring_submit(ring, 0);
+    }
+    unsigned index = ring->sq_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->sq_tail++;
+    ring->to_submit++;
+    return sqe;
+}
+
+/**
+ * @brief Queue a read or write of part of the registered region
+ *
+ * @param ring
+ * @param write
+ * @param slot registered file slot
+ * @param data inside the ring's buffer region
+ * @param len
+ * @param offset file offset
+ * @param user_data returned in the completion
+ * @param link the next queued operation only starts once this one succeeded in full
+ */
+void uring_queue_fixed(Uring *ring, int write, int slot, void *data, unsigned len, uint64_t offset, uint64_t user_data, int link) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+    sqe->flags = IOSQE_FIXED_FILE | (link ? IOSQE_IO_LINK : 0);
+    sqe->fd = slot;
+    sqe->addr = (uint64_t)(uintptr_t)data;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->buf_index = 0;
+    sqe->user_data = user_data;
+}
+
+/**
+ * @brief Submit everything queued and optionally wait for completions, in one system call
+ *
+ * @param ring
+ * @param wait_for completions to wait for, 0 to only submit
+ * @return int 0 on success, -1 with errno set
+ */
+int uring_submit(Uring *ring, unsigned wait_for) {
+    atomic_store_explicit(ring->sq_ktail, ring->sq_tail, memory_order_release);
+    while (ring->to_submit > 0 || wait_for > 0) {
+        int submitted = uring_enter(ring->fd, ring->to_submit, wait_for, wait_for > 0 ? IORING_ENTER_GETEVENTS : 0);
+        if (submitted < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EBUSY || errno == EAGAIN) {
+                // The completion queue is full, the caller has to reap first
+                return 0;
+            }
+            return -1;
+        }
+        if (submitted == 0 && wait_for == 0) {
+            return 0;
+        }
+        ring->to_submit -= (unsigned)submitted;
+        wait_for = 0;
+    }
+    return 0;
+}
+
+/**
+ * @brief Take the next completion
+ *
+ * @param ring
+ * @param wait block until one arrives, submitting anything still queued
+ * @param cqe receives the completion
+ * @return int 1 if one was taken, 0 if none was ready, -1 on failure
+ */
+int uring_complete(Uring *ring, int wait, struct io_uring_cqe *cqe) {
+    while (1) {
+        unsigned head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+        if (head != atomic_load_explicit(ring->cq_tail, memory_order_acquire)) {
+            *cqe = ring->cqes[head & *ring->cq_mask];
+            atomic_store_explicit(ring->cq_head, head + 1, memory_order_release);
+            return 1;
+        }
+        if (!wait) {
+            return 0;
+        }
+        if (uring_submit(ring, 1) < 0) {
+            return -1;
+        }
+    }
+}
+
+/**
+ * @brief Copy a file through the ring's buffers, keeping several linked read/write pairs in flight
+ *
+ * Each pair reads one slice of the region and, linked to it, writes the same
+ * slice at the same offset, so the pairs may finish in any order. A short
+ * read breaks its link; the pair's data is then written synchronously.
+ *
+ * @param ring
+ * @param src_fd
+ * @param dst_fd
+ * @param size bytes to copy
+ * @param throttle charged per pair, may be NULL
+ * @return int 0 on success, -1 on failure
+ */
+int uring_copy_fd(Uring *ring, int src_fd, int dst_fd, uint64_t size, Throttle *throttle) {
+    int fds[2] = { src_fd, dst_fd };
+    if (uring_set_files(ring, 0, fds, 2) < 0) {
+        return -1;
+    }
+    size_t slice = ring->buffers_size / URING_COPY_SLOTS;
+    uint64_t slot_offset[URING_COPY_SLOTS];
+    unsigned slot_len[URING_COPY_SLOTS];
+    int slot_pending[URING_COPY_SLOTS] = { 0 };
+    int in_flight = 0, result = 0;
+    uint64_t next = 0;
+
+    while (result == 0 && (next < size || in_flight > 0)) {
+        for (int s = 0; s < URING_COPY_SLOTS && next < size && result == 0; s++) {
+            if (slot_pending[s]) {
+                continue;
+            }
+            slot_offset[s] = next;
+            slot_len[s] = size - next < slice ? (unsigned)(size - next) : (unsigned)slice;
+            throttle_wait(throttle, slot_len[s]);
+            char *data = ring->buffers + s * slice;
+            uring_queue_fixed(ring, 0, 0, data, slot_len[s], next, (uint64_t)s << 1, 1);
+            uring_queue_fixed(ring, 1, 1, data, slot_len[s], next, (uint64_t)s << 1 | 1, 0);
+            slot_pending[s] = 2;
+            in_flight++;
+            next += slot_len[s];
+        }
+
+        struct io_uring_cqe cqe;
+        if (uring_complete(ring, 1, &cqe) < 0) {
+            result = -1;
+            break;
+        }
+        int s = (int)(cqe.user_data >> 1);
+        int is_write = (int)(cqe.user_data & 1);
+        if (!is_write && cqe.res >= 0 && (unsigned)cqe.res < slot_len[s]) {
+            // Short read, the linked write is cancelled: finish the slice here
+            char *data = ring->buffers + s * slice;
+            if (pwrite(dst_fd, data, cqe.res, slot_offset[s]) != cqe.res) {
+                result = -1;
+            }
+            if (slot_offset[s] + cqe.res < size) {
+                size = slot_offset[s] + cqe.res;    // the source ended early
+            }
+        } else if (cqe.res < 0 && cqe.res != -ECANCELED) {
+            errno = -cqe.res;
+            result = -1;
+        } else if (is_write && cqe.res >= 0 && (unsigned)cqe.res < slot_len[s]) {
+            errno = EIO;
+            result = -1;
+        }
+        if (--slot_pending[s] == 0) {
+            in_flight--;
+        }
+    }
+
+    // Nothing may still write into the region once the caller reuses it
+    while (in_flight > 0) {
+        struct io_uring_cqe cqe;
+        if (uring_complete(ring, 1, &cqe) < 0) {
+            break;
+        }
+        int s = (int)(cqe.user_data >> 1);
+        if (--slot_pending[s] == 0) {
+            in_flight--;
+        }
+    }
+    int empty[2] = { -1, -1 };
+    uring_set_files(ring, 0, empty, 2);
+    return result;
+}
@@ -1,5 +1,13 @@
+#define _GNU_SOURCE
+#include <sys/ioctl.h>
+#include <sys/random.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
 #include "server.h"
 
+#define SPLICE_CHUNK (1 << 20)
+#define COPY_BUFFER_SIZE (1 << 20)
+
 /**
  * @brief Remove a file from the filesystem
  * 
@@ -80,13 +88,105 @@ int delete_directory(const char *path) {
 }
 
 /**
- * @brief Copy a file from one location to another
+ * @brief Copy file content with the cheapest mechanism the filesystems allow
+ *
+ * A reflink shares the source's extents, copy_file_range copies inside the
+ * kernel (server side on some filesystems) and the buffered loop, on the
+ * thread's io_uring when there is one, is left for pairs of filesystems that
+ * support neither. With a throttle the data moves
+ * in COPY_BUFFER_SIZE steps, each paid for before it is issued.
+ *
+ * @param src_fd
+ * @param dst_fd
+ * @param throttle may be NULL
+ * @return int 0 on success, -1 on failure
+ */
+static int copy_fd(int src_fd, int dst_fd, Throttle *throttle) {
+    throttle_wait(throttle, 0);
+    if (ioctl(dst_fd, FICLONE, src_fd) == 0) {
+        return 0;
+    }
+
+    struct stat st;
+    if (fstat(src_fd, &st) < 0) {
+        return -1;
+    }
+
+    off_t copied = 0;
+    while (copied < st.st_size) {
+        size_t step = st.st_size - copied;
+        if (throttle != NULL && step > COPY_BUFFER_SIZE) {
+            step = COPY_BUFFER_SIZE;
+        }
+        throttle_wait(throttle, step);
+        ssize_t n = copy_file_range(src_fd, NULL, dst_fd, NULL, step, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (copied == 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+                break;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            return 0; // The source shrank under us
+        }
+        copied += n;
+    }
+    if (copied > 0 || st.st_size == 0) {
+        return 0;
+    }
+
+    Uring *ring = uring_thread();
+    if (ring != NULL) {
+        return uring_copy_fd(ring, src_fd, dst_fd, st.st_size, throttle);
+    }
+
+    char *buf = buffer_acquire(COPY_BUFFER_SIZE);
+    if (buf == NULL) {
+        return -1;
+    }
+    posix_fadvise(src_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    ssize_t bytes_read;
+    int result = 0;
+    while (result == 0 && (bytes_read = read(src_fd, buf, COPY_BUFFER_SIZE)) != 0) {
+        if (bytes_read < 0) {
+            if (errno != EINTR) {
+                result = -1;
+            }
+            continue;
+        }
+        throttle_wait(throttle, bytes_read);
+        char *ptr = buf;
+        while (bytes_read > 0) {
+            ssize_t bytes_written = write(dst_fd, ptr, bytes_read);
+            if (bytes_written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                result = -1;
+                break;
+            }
+            bytes_read -= bytes_written;
+            ptr += bytes_written;
+        }
+    }
+
+    buffer_release(buf, COPY_BUFFER_SIZE);
+    return result;
+}
+
+/**
+ * @brief Copy a file from one location to another, no faster than a throttle allows
  * 
  * @param src 
  * @param dst 
+ * @param throttle NULL copies at full speed
  * @return int 
  */
-int copy_file(const char *src, const char *dst) {
+int copy_file_throttled(const char *src, const char *dst, Throttle *throttle) {
     int src_fd = open(src, O_RDONLY);
     if (src_fd < 0) {
         perror("open src");
@@ -115,46 +215,38 @@ int copy_file(const char *src, const char *dst) {
         return -1;
     }
 
-    char buf[4096];
-    ssize_t bytes_read, bytes_written;
-
-    while ((bytes_read = read(src_fd, buf, sizeof(buf))) > 0) {
-        char *ptr = buf;
-        do {
-            bytes_written = write(dst_fd, ptr, bytes_read);
-            if (bytes_written >= 0) {
-                bytes_read -= bytes_written;
-                ptr += bytes_written;
-            } else {
-                perror("write");
-                unlock_file(src_fd);
-                unlock_file(dst_fd);
-                close(src_fd);
-                close(dst_fd);
-                return -1;
-            }
-        } while (bytes_read > 0);
-    }
-
-    if (bytes_read < 0) {
-        perror("read");
+    int result = copy_fd(src_fd, dst_fd, throttle);
+    if (result < 0) {
+        perror("copy");
     }
 
     unlock_file(src_fd);
     unlock_file(dst_fd);
     close(src_fd);
     close(dst_fd);
-    return 0;
+    return result;
 }
 
 /**
- * @brief Copy a directory from one location to another
+ * @brief Copy a file from one location to another
  * 
  * @param src 
  * @param dst 
  * @return int 
  */
-int copy_directory(const char *src, const char *dst) {
+int copy_file(const char *src, const char *dst) {
+    return copy_file_throttled(src, dst, NULL);
+}
+
+/**
+ * @brief Walk a directory tree, creating directories and queueing file copies.
+ * 
+ * @param src 
+ * @param dst 
+ * @param pool 
+ * @return int 1 if the whole tree was walked, 0 otherwise
+ */
+static int copy_tree(const char *src, const char *dst, CopyPool *pool) {
     DIR *dir = opendir(src);
     if (!dir) {
         perror("opendir");
@@ -167,6 +259,7 @@ int copy_directory(const char *src, const char *dst) {
         return 0;
     }
 
+    int success = 1;
     struct dirent *entry;
     while ((entry = readdir(dir)) != NULL) {
         if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
@@ -184,16 +277,209 @@ int copy_directory(const char *src, const char *dst) {
         }
 
         if (S_ISDIR(st.st_mode)) {
-            if (copy_directory(src_path, dst_path) < 0) {
-                perror("copy_directory");
+            if (!copy_tree(src_path, dst_path, pool)) {
+                success = 0;
             }
         } else if (S_ISREG(st.st_mode)) {
-            if (copy_file(src_path, dst_path) < 0) {
-                perror("copy_file");
+            if (copy_pool_submit(pool, src_path, dst_path, NULL, NULL) < 0) {
+                perror("copy_pool_submit");
+                success = 0;
             }
         }
     }
 
     closedir(dir);
-    return 1;
-}
\ No newline at end of file
+    return success;
+}
+
+/**
+ * @brief Copy a directory from one location to another
+ * 
+ * The walk runs on the calling thread while the files are copied by a copy
+ * pool, within the copy_threads limit of the destination device.
+ * 
+ * @param src 
+ * @param dst 
+ * @param device index of the device dst is on
+ * @return int 1 on success, 0 if anything could not be copied
+ */
+int copy_directory(const char *src, const char *dst, int device) {
+    CopyPool *pool = copy_pool_start(device, NULL);
+    if (pool == NULL) {
+        return 0;
+    }
+
+    int success = copy_tree(src, dst, pool);
+    if (copy_pool_finish(pool) > 0) {
+        success = 0;
+    }
+    return success;
+}
+
+/**
+ * @brief Stream part of a file to a socket through a pipe with splice(2)
+ * 
+ * @param sock 
+ * @param fd 
+ * @param offset 
+ * @param count 
+ * @return off_t bytes sent, or -1 with errno set
+ */
+static off_t splice_file_range(int sock, int fd, off_t offset, off_t count) {
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) < 0) {
+        return -1;
+    }
+
+    off_t sent = 0;
+    while (sent < count) {
+        size_t want = (count - sent) < SPLICE_CHUNK ? (size_t)(count - sent) : SPLICE_CHUNK;
+        ssize_t in_pipe = splice(fd, &offset, pipe_fds[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in_pipe <= 0) {
+            if (in_pipe < 0 && sent == 0) {
+                sent = -1;
+            }
+            break;
+        }
+        while (in_pipe > 0) {
+            ssize_t out = splice(pipe_fds[0], NULL, sock, NULL, in_pipe, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out <= 0) {
+                close(pipe_fds[0]);
+                close(pipe_fds[1]);
+                return -1;
+            }
+            in_pipe -= out;
+            sent += out;
+        }
+    }
+
+    int saved_errno = errno;
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    errno = saved_errno;
+    return sent;
+}
+
+/**
+ * @brief Stream part of a file to a socket with pread(2) and send(2)
+ * 
+ * @param sock 
+ * @param fd 
+ * @param offset 
+ * @param count 
+ * @param crc extended with what was sent, may be NULL
+ * @return off_t bytes sent, or -1 with errno set
+ */
+static off_t read_file_range_to_socket(int sock, int fd, off_t offset, off_t count, uint32_t *crc) {
+    char *buf = buffer_acquire(BUFFER_BLOCK_MIN);
+    if (buf == NULL) {
+        return -1;
+    }
+    off_t sent = 0;
+
+    while (sent < count) {
+        size_t want = (count - sent) < BUFFER_BLOCK_MIN ? (size_t)(count - sent) : BUFFER_BLOCK_MIN;
+        ssize_t bytes_read = pread(fd, buf, want, offset + sent);
+        if (bytes_read <= 0) {
+            if (bytes_read < 0) {
+                sent = -1;
+            }
+            break;
+        }
+        if (crc != NULL) {
+            *crc = crc32c_update(*crc, buf, bytes_read);
+        }
+        ssize_t done = 0;
+        while (done < bytes_read) {
+            ssize_t out = send(sock, buf + done, bytes_read - done, 0);
+            if (out < 0) {
+                buffer_release(buf, BUFFER_BLOCK_MIN);
+                return -1;
+            }
+            done += out;
+        }
+        sent += bytes_read;
+    }
+    buffer_release(buf, BUFFER_BLOCK_MIN);
+    return sent;
+}
+
+/**
+ * @brief Stream part of a file to a socket without copying it through user space
+ * 
+ * Uses sendfile(2), falls back to splice(2) through a pipe when the source
+ * filesystem does not support sendfile, and to a pread/send loop as a last resort.
+ * 
+ * @param sock 
+ * @param fd 
+ * @param offset 
+ * @param count 
+ * @return off_t bytes sent, or -1 on error
+ */
+off_t send_file_range(int sock, int fd, off_t offset, off_t count) {
+    off_t sent = 0;
+
+    while (sent < count) {
+        size_t want = (count - sent) < SPLICE_CHUNK ? (size_t)(count - sent) : SPLICE_CHUNK;
+        ssize_t out = sendfile(sock, fd, &offset, want);
+        if (out > 0) {
+            sent += out;
+            continue;
+        }
+        if (out == 0) {
+            // The file shrank underneath us
+            return sent;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP) {
+            perror("sendfile");
+            return -1;
+        }
+
+        off_t rest = splice_file_range(sock, fd, offset, count - sent);
+        if (rest < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            rest = read_file_range_to_socket(sock, fd, offset, count - sent, NULL);
+        }
+        if (rest < 0) {
+            perror("send_file_range");
+            return -1;
+        }
+        return sent + rest;
+    }
+    return sent;
+}
+
+/**
+ * @brief Stream part of a file to a socket through user space, hashing it on the way
+ * 
+ * @param sock 
+ * @param fd 
+ * @param offset 
+ * @param count 
+ * @param crc extended with the CRC32C of what was sent
+ * @return off_t bytes sent, or -1 on error
+ */
+off_t send_file_range_hashed(int sock, int fd, off_t offset, off_t count, uint32_t *crc) {
+    off_t sent = read_file_range_to_socket(sock, fd, offset, count, crc);
+    if (sent < 0) {
+        perror("send_file_range_hashed");
+    }
+    return sent;
+}
+
+/**
+ * @brief A random 64-bit id for staging files and uploads
+ * 
+ * @return uint64_t 
+ */
+uint64_t random_id(void) {
+    static uint64_t counter = 0;
+    uint64_t id;
+    if (getrandom(&id, sizeof(id), 0) != sizeof(id)) {
+        // Unique within this process at least
+        id = ((uint64_t)time(NULL) << 32) ^ __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED);
+    }
+    return id;
+}
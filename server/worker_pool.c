@@ -0,0 +1,89 @@
+#include "server.h"
+
+static Connection **queue;
+static int queue_capacity;
+static int queue_head = 0;
+static int queue_count = 0;
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_not_full = PTHREAD_COND_INITIALIZER;
+
+/**
+ * @brief Worker thread, takes ready connections off the queue and runs their commands.
+ *
+ * @param arg
+ * @return void*
+ */
+static void *worker_thread(void *arg) {
+    (void)arg;
+
+    while (1) {
+        pthread_mutex_lock(&queue_mutex);
+        while (queue_count == 0) {
+            pthread_cond_wait(&queue_not_empty, &queue_mutex);
+        }
+        Connection *conn = queue[queue_head];
+        queue_head = (queue_head + 1) % queue_capacity;
+        queue_count--;
+        pthread_cond_signal(&queue_not_full);
+        pthread_mutex_unlock(&queue_mutex);
+
+        handle_client(conn);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Start the worker pool that runs client commands
+ *
+ * @param num_threads
+ * @param queue_depth
+ * @return int 0 on success, -1 on failure
+ */
+int worker_pool_start(int num_threads, int queue_depth) {
+    queue_capacity = queue_depth;
+    queue = malloc(sizeof(Connection *) * queue_capacity);
+    if (queue == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    for (int i = 0; i < num_threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, worker_thread, NULL) != 0) {
+            perror("Worker thread creation failed");
+            return -1;
+        }
+        pthread_detach(thread);
+    }
+    return 0;
+}
+
+/**
+ * @brief Ready connections waiting for a worker
+ *
+ * @return int
+ */
+int worker_pool_queued(void) {
+    pthread_mutex_lock(&queue_mutex);
+    int queued = queue_count;
+    pthread_mutex_unlock(&queue_mutex);
+    return queued;
+}
+
+/**
+ * @brief Queue a ready client for a worker, blocks while the queue is full
+ *
+ * @param conn
+ */
+void worker_pool_submit(Connection *conn) {
+    pthread_mutex_lock(&queue_mutex);
+    while (queue_count == queue_capacity) {
+        pthread_cond_wait(&queue_not_full, &queue_mutex);
+    }
+    queue[(queue_head + queue_count) % queue_capacity] = conn;
+    queue_count++;
+    pthread_cond_signal(&queue_not_empty);
+    pthread_mutex_unlock(&queue_mutex);
+}
@@ -0,0 +1,107 @@
+#define _GNU_SOURCE
+#include "server.h"
+
+#define WRITE_BEHIND_SIZE (8 * 1024 * 1024) // writeback is started per this much of an upload
+
+/**
+ * @brief Whether an upload is large enough for the device's direct writes
+ *
+ * @param device
+ * @param size
+ * @return int
+ */
+static int use_direct(const USBDevice *device, uint64_t size) {
+    return device->write_policy == WRITE_DIRECT && size >= device->direct_min_size;
+}
+
+/**
+ * @brief Allocate the blocks of a large upload's file up front under the "direct" policy
+ *
+ * FAT and exFAT then lay the file out in one run instead of growing it a
+ * cluster at a time between other uploads. The file size is left alone, so
+ * nothing is zeroed and a short upload is no longer than what arrived.
+ *
+ * @param device
+ * @param fd
+ * @param size bytes the upload will write from offset 0
+ */
+void write_policy_preallocate(const USBDevice *device, int fd, uint64_t size) {
+    if (!use_direct(device, size)) {
+        return;
+    }
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size) < 0 && errno != EOPNOTSUPP && errno != ENOSYS) {
+        perror("fallocate");
+    }
+}
+
+/**
+ * @brief Switch a device file to O_DIRECT for a large upload under the "direct" policy
+ *
+ * A filesystem without direct I/O leaves the file as it was, and the upload
+ * then gets the write-behind of the other policies instead.
+ *
+ * @param device
+ * @param fd
+ * @param size of the whole upload
+ */
+void write_policy_open(const USBDevice *device, int fd, uint64_t size) {
+    if (!use_direct(device, size)) {
+        return;
+    }
+    int flags = fcntl(fd, F_GETFL);
+    if (flags >= 0 && fcntl(fd, F_SETFL, flags | O_DIRECT) < 0 && errno != EINVAL) {
+        perror("fcntl O_DIRECT");
+    }
+}
+
+/**
+ * @brief Push a buffered upload out to the device as it goes and drop what has been written from the page cache
+ *
+ * Every WRITE_BEHIND_SIZE of data starts writeback of what came since the
+ * last time, then waits for the step before that and drops its pages. An
+ * upload thus never holds more than two steps of dirty pages, rather than
+ * piling them up until the kernel throttles every writer at once, and its
+ * data does not push out the files clients read.
+ *
+ * @param device
+ * @param fd
+ * @param state where this file's write-behind is at
+ * @param end file offset the upload has been written up to
+ */
+void write_behind(const USBDevice *device, int fd, WriteBehind *state, uint64_t end) {
+    if (device->write_policy == WRITE_CACHED || end < state->started + WRITE_BEHIND_SIZE) {
+        return;
+    }
+    if (sync_file_range(fd, state->started, end - state->started, SYNC_FILE_RANGE_WRITE) < 0) {
+        perror("sync_file_range");
+        return;
+    }
+    if (state->started > state->dropped) {
+        sync_file_range(fd, state->dropped, state->started - state->dropped,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(fd, state->dropped, state->started - state->dropped, POSIX_FADV_DONTNEED);
+        state->dropped = state->started;
+    }
+    state->started = end;
+}
+
+/**
+ * @brief Start writeback of the rest of an upload and drop whatever of it is already on the device
+ *
+ * Nothing is waited for, so the last steps of the upload stay in the page
+ * cache until the kernel has written them and needs the memory.
+ *
+ * @param device
+ * @param fd
+ * @param state where this file's write-behind is at
+ * @param end file offset the upload was written up to
+ */
+void write_behind_finish(const USBDevice *device, int fd, WriteBehind *state, uint64_t end) {
+    if (device->write_policy == WRITE_CACHED || end <= state->dropped) {
+        return;
+    }
+    if (end > state->started) {
+        sync_file_range(fd, state->started, end - state->started, SYNC_FILE_RANGE_WRITE);
+    }
+    posix_fadvise(fd, state->dropped, end - state->dropped, POSIX_FADV_DONTNEED);
+}